@@ -0,0 +1,556 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ai.h"
+
+/* The bitboards follow the usual layout for this game: the field (x, y)
+ * is the bit x * (height + 1) + y and the bit above each column is always
+ * empty, so that shifting a line past the top of a column never carries it
+ * into the next one.
+ *
+ * The search keeps two bitboards per position: the discs of the side
+ * to move and all the discs on the board. Making a move swaps the sides,
+ * so positions are copied instead of being undone.
+ *
+ * With several threads, every thread runs its own iterative deepening
+ * on the root, the helpers starting at staggered depths. They share
+ * the transposition table, so the work of one thread mostly cuts off
+ * the search of the others. Each thread orders its moves using its own
+ * history of cutoffs, which makes the threads explore different parts
+ * of the tree.
+ */
+
+enum {
+	BOUND_EXACT,
+	BOUND_LOWER,
+	BOUND_UPPER,
+};
+
+/* Entries are read and written by many threads without locks. The key is
+ * stored xored with the data, so an entry torn by concurrent writes fails
+ * the key check and is treated as empty.
+ */
+struct ai_entry {
+	uint64_t check;
+	// score, depth, bound and move packed into 16, 8, 8 and 8 bits
+	uint64_t data;
+};
+
+struct position {
+	// discs of the side to move
+	uint64_t current;
+	// all discs on the board
+	uint64_t mask;
+	uint64_t hash;
+	int moves;
+};
+
+struct ai_thread {
+	struct ai *ai;
+	pthread_t thread;
+	int id;
+	struct position root;
+	unsigned long nodes;
+	int aborted;
+	int root_move;
+	// cutoffs caused by the moves to each field
+	unsigned long history[64];
+	// result of the deepest completed iteration
+	int column;
+	int score;
+	int depth;
+};
+
+// the search checks the clock once per this many nodes
+#define CLOCK_INTERVAL 1024
+
+#define SCORE_INF (AI_SCORE_WIN + 1)
+
+static uint64_t splitmix(uint64_t *state)
+{
+	uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+	z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return z ^ (z >> 31);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int popcount(uint64_t b)
+{
+	return __builtin_popcountll(b);
+}
+
+static uint64_t shift(uint64_t b, int d)
+{
+	if (d >= 64 || d <= -64) {
+		return 0;
+	}
+	return d >= 0 ? b >> d : b << -d;
+}
+
+int ai_supported(const struct game_rules *rules)
+{
+	return game_rules_check(rules) == 0
+		&& rules->width <= AI_MAX_WIDTH
+		&& rules->width * (rules->height + 1) <= 64;
+}
+
+int ai_init(struct ai *ai, const struct game_rules *rules,
+		size_t table_size, size_t nthreads)
+{
+	int i, j;
+	int h1 = rules->height + 1;
+	uint64_t seed = 0;
+	if (!ai_supported(rules) || nthreads == 0
+			|| table_size == 0 || (table_size & (table_size - 1)))
+	{
+		return -1;
+	}
+	ai->table = calloc(table_size, sizeof(*ai->table));
+	ai->threads = calloc(nthreads, sizeof(*ai->threads));
+	if (!ai->table || !ai->threads) {
+		free(ai->table);
+		free(ai->threads);
+		return -1;
+	}
+	ai->table_size = table_size;
+	ai->nthreads = nthreads;
+	for (i = 0; i < nthreads; ++i) {
+		ai->threads[i].ai = ai;
+		ai->threads[i].id = i;
+	}
+	ai->width = rules->width;
+	ai->height = rules->height;
+	ai->line_length = rules->line_length;
+	ai->cells = rules->width * rules->height;
+	ai->bottom = 0;
+	ai->board = 0;
+	for (i = 0; i < ai->width; ++i) {
+		ai->columns[i] = ((UINT64_C(1) << ai->height) - 1) << (i * h1);
+		ai->bottom |= UINT64_C(1) << (i * h1);
+		ai->board |= ai->columns[i];
+	}
+	ai->shifts[0] = 1;
+	ai->shifts[1] = h1;
+	ai->shifts[2] = h1 - 1;
+	ai->shifts[3] = h1 + 1;
+	for (i = 0; i < ai->width; ++i) {
+		ai->order[i] = ai->width / 2 + (1 - 2 * (i % 2)) * (i + 1) / 2;
+	}
+	for (i = 0; i < 64; ++i) {
+		for (j = 0; j < 2; ++j) {
+			ai->zobrist[i][j] = splitmix(&seed);
+		}
+	}
+	return 0;
+}
+
+void ai_clear(struct ai *ai)
+{
+	memset(ai->table, 0, ai->table_size * sizeof(*ai->table));
+}
+
+void ai_finalize(struct ai *ai)
+{
+	free(ai->table);
+	free(ai->threads);
+}
+
+/* Returns the empty fields that would complete a line of discs.
+ */
+static uint64_t threats(struct ai *ai, uint64_t discs)
+{
+	uint64_t res = 0;
+	uint64_t w;
+	int d, j, k;
+	for (d = 0; d < 4; ++d) {
+		// k is the position of the empty field within the line
+		for (k = 0; k < ai->line_length; ++k) {
+			w = ai->board;
+			for (j = 0; j < ai->line_length && w; ++j) {
+				if (j != k) {
+					w &= shift(discs, (j - k) * ai->shifts[d]);
+				}
+			}
+			res |= w;
+		}
+	}
+	return res;
+}
+
+static int has_line(struct ai *ai, uint64_t discs)
+{
+	uint64_t m;
+	int d, k;
+	for (d = 0; d < 4; ++d) {
+		m = discs;
+		for (k = 1; k < ai->line_length && m; ++k) {
+			m &= shift(discs, k * ai->shifts[d]);
+		}
+		if (m) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static uint64_t move_bit(struct ai *ai, struct position *pos, int col)
+{
+	return (pos->mask + (ai->bottom & ai->columns[col])) & ai->columns[col];
+}
+
+static void play(struct ai *ai, struct position *pos, uint64_t bit)
+{
+	int idx = __builtin_ctzll(bit);
+	pos->hash ^= ai->zobrist[idx][pos->moves & 1];
+	pos->current ^= pos->mask;
+	pos->mask |= bit;
+	++pos->moves;
+}
+
+static int column_of(struct ai *ai, uint64_t bit)
+{
+	return __builtin_ctzll(bit) / (ai->height + 1);
+}
+
+static int is_decided(int score)
+{
+	return score > AI_SCORE_DECIDED || score < -AI_SCORE_DECIDED;
+}
+
+static int tt_score_in(int score, int ply)
+{
+	if (score > AI_SCORE_DECIDED) {
+		return score + ply;
+	} else if (score < -AI_SCORE_DECIDED) {
+		return score - ply;
+	}
+	return score;
+}
+
+static int tt_score_out(int score, int ply)
+{
+	if (score > AI_SCORE_DECIDED) {
+		return score - ply;
+	} else if (score < -AI_SCORE_DECIDED) {
+		return score + ply;
+	}
+	return score;
+}
+
+static int tt_load(struct ai *ai, uint64_t hash, int *score, int *depth,
+		int *bound, int *move)
+{
+	struct ai_entry *entry = &ai->table[hash & (ai->table_size - 1)];
+	uint64_t check = __atomic_load_n(&entry->check, __ATOMIC_RELAXED);
+	uint64_t data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+	if ((check ^ data) != hash) {
+		return -1;
+	}
+	*score = (int16_t)(data & 0xffff);
+	*depth = (data >> 16) & 0xff;
+	*bound = (data >> 24) & 0xff;
+	*move = (int8_t)((data >> 32) & 0xff);
+	return 0;
+}
+
+static void tt_store(struct ai *ai, uint64_t hash, int score, int depth,
+		int bound, int move)
+{
+	struct ai_entry *entry = &ai->table[hash & (ai->table_size - 1)];
+	uint64_t data = (uint64_t)(uint16_t)score
+		| (uint64_t)depth << 16
+		| (uint64_t)bound << 24
+		| (uint64_t)(uint8_t)move << 32;
+	__atomic_store_n(&entry->check, hash ^ data, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+}
+
+static int evaluate(struct ai *ai, struct position *pos, uint64_t mine, uint64_t theirs)
+{
+	uint64_t empty = ai->board & ~pos->mask;
+	uint64_t center = ai->columns[ai->width / 2];
+	return 4 * (popcount(mine & empty) - popcount(theirs & empty))
+		+ popcount(pos->current & center)
+		- popcount((pos->current ^ pos->mask) & center);
+}
+
+static int out_of_time(struct ai *ai)
+{
+	if (__atomic_load_n(&ai->done, __ATOMIC_RELAXED)) {
+		return 1;
+	}
+	if (ai->stop && __atomic_load_n(ai->stop, __ATOMIC_RELAXED)) {
+		return 1;
+	}
+	return now_ms() >= ai->deadline;
+}
+
+/* Fills moves with the columns to try, best first. Returns their number.
+ */
+static int order_moves(struct ai_thread *t, struct position *pos, uint64_t possible,
+		int tt_move, int *moves)
+{
+	struct ai *ai = t->ai;
+	unsigned long keys[AI_MAX_WIDTH];
+	unsigned long key;
+	int i, j, n = 0;
+	int col;
+	uint64_t bit;
+	for (i = 0; i < ai->width; ++i) {
+		col = ai->order[i];
+		bit = possible & ai->columns[col];
+		if (!bit) {
+			continue;
+		}
+		if (col == tt_move) {
+			key = ~0UL;
+		} else {
+			// threats created by the move first, then the history
+			key = (unsigned long)popcount(threats(ai, pos->current | bit)
+					& ai->board & ~(pos->mask | bit)) << 24;
+			key += t->history[__builtin_ctzll(bit)] < (1 << 24)
+				? t->history[__builtin_ctzll(bit)]
+				: (1 << 24) - 1;
+		}
+		// insertion sort keeps the center-first order among equal keys
+		for (j = n; j > 0 && keys[j-1] < key; --j) {
+			keys[j] = keys[j-1];
+			moves[j] = moves[j-1];
+		}
+		keys[j] = key;
+		moves[j] = col;
+		++n;
+	}
+	return n;
+}
+
+static int negamax(struct ai_thread *t, struct position *pos, int depth, int ply,
+		int alpha, int beta)
+{
+	struct ai *ai = t->ai;
+	uint64_t possible, mine, theirs, forced, bit;
+	struct position child;
+	int moves[AI_MAX_WIDTH];
+	int i, n, score, best, best_move, bound;
+	int tt_score, tt_depth, tt_bound;
+	int tt_move = -1;
+	int alpha0 = alpha;
+	++t->nodes;
+	if (t->nodes % CLOCK_INTERVAL == 0 && out_of_time(ai)) {
+		t->aborted = 1;
+	}
+	if (t->aborted) {
+		return 0;
+	}
+	if (pos->moves == ai->cells) {
+		return 0;
+	}
+	possible = (pos->mask + ai->bottom) & ai->board;
+	mine = threats(ai, pos->current);
+	if (possible & mine) {
+		if (ply == 0) {
+			t->root_move = column_of(ai, possible & mine & -(possible & mine));
+		}
+		return AI_SCORE_WIN - ply - 1;
+	}
+	theirs = threats(ai, pos->current ^ pos->mask);
+	forced = possible & theirs;
+	if (forced) {
+		if (forced & (forced - 1)) {
+			return -(AI_SCORE_WIN - ply - 2);
+		}
+		possible = forced;
+	}
+	possible &= ~(theirs >> 1);
+	if (!possible) {
+		return -(AI_SCORE_WIN - ply - 2);
+	}
+	if (depth == 0) {
+		return evaluate(ai, pos, mine, theirs);
+	}
+
+	if (tt_load(ai, pos->hash, &tt_score, &tt_depth, &tt_bound, &tt_move) == 0) {
+		tt_score = tt_score_out(tt_score, ply);
+		if (tt_depth >= depth && ply > 0) {
+			if (tt_bound == BOUND_EXACT
+					|| (tt_bound == BOUND_LOWER && tt_score >= beta)
+					|| (tt_bound == BOUND_UPPER && tt_score <= alpha))
+			{
+				return tt_score;
+			}
+		}
+	}
+
+	n = order_moves(t, pos, possible, tt_move, moves);
+	best = -SCORE_INF;
+	best_move = -1;
+	for (i = 0; i < n; ++i) {
+		child = *pos;
+		bit = move_bit(ai, pos, moves[i]);
+		play(ai, &child, bit);
+		score = -negamax(t, &child, depth - 1, ply + 1, -beta, -alpha);
+		if (t->aborted) {
+			return 0;
+		}
+		if (score > best) {
+			best = score;
+			best_move = moves[i];
+		}
+		if (score > alpha) {
+			alpha = score;
+		}
+		if (alpha >= beta) {
+			t->history[__builtin_ctzll(bit)] += depth * depth;
+			break;
+		}
+	}
+
+	if (best <= alpha0) {
+		bound = BOUND_UPPER;
+	} else if (best >= beta) {
+		bound = BOUND_LOWER;
+	} else {
+		bound = BOUND_EXACT;
+	}
+	tt_store(ai, pos->hash, tt_score_in(best, ply), depth, bound, best_move);
+	if (ply == 0) {
+		t->root_move = best_move;
+	}
+	return best;
+}
+
+static int setup(struct ai *ai, const unsigned char *history, int moves,
+		struct position *pos)
+{
+	int i;
+	uint64_t bit;
+	pos->current = 0;
+	pos->mask = 0;
+	pos->hash = 0;
+	pos->moves = 0;
+	if (moves >= ai->cells) {
+		return -1;
+	}
+	for (i = 0; i < moves; ++i) {
+		if (history[i] >= ai->width) {
+			return -1;
+		}
+		bit = move_bit(ai, pos, history[i]);
+		if (!bit) {
+			return -1;
+		}
+		play(ai, pos, bit);
+		// the side that has just moved is now the opponent
+		if (has_line(ai, pos->current ^ pos->mask)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Runs the iterative deepening on one thread. Helpers start one ply deeper
+ * every other thread, so that they don't all repeat the same iterations.
+ */
+static void *deepen(void *arg)
+{
+	struct ai_thread *t = arg;
+	struct ai *ai = t->ai;
+	int max_depth = ai->cells - t->root.moves;
+	int depth, score;
+	if (ai->max_depth > 0 && ai->max_depth < max_depth) {
+		max_depth = ai->max_depth;
+	}
+	for (depth = 1 + t->id % 2; depth <= max_depth; ++depth) {
+		t->root_move = t->column;
+		score = negamax(t, &t->root, depth, 0, -SCORE_INF, SCORE_INF);
+		if (t->aborted) {
+			break;
+		}
+		t->column = t->root_move;
+		t->score = score;
+		t->depth = depth;
+		if (is_decided(score)) {
+			break;
+		}
+	}
+	// whichever thread finishes first ends the search
+	__atomic_store_n(&ai->done, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+int ai_search(struct ai *ai, const unsigned char *history, int moves,
+		const struct ai_limits *limits, struct ai_result *res)
+{
+	struct position root;
+	struct ai_thread *t, *best;
+	uint64_t possible;
+	size_t i, started;
+	int fallback = 0;
+	if (setup(ai, history, moves, &root) < 0) {
+		return -1;
+	}
+	ai->done = 0;
+	ai->stop = limits->stop;
+	ai->max_depth = limits->depth;
+	ai->deadline = now_ms() + limits->time_ms;
+
+	// fall back to any legal move in case the first iteration
+	// does not complete
+	possible = (root.mask + ai->bottom) & ai->board;
+	for (i = 0; i < ai->width; ++i) {
+		if (possible & ai->columns[ai->order[i]]) {
+			fallback = ai->order[i];
+			break;
+		}
+	}
+	for (i = 0; i < ai->nthreads; ++i) {
+		t = &ai->threads[i];
+		t->root = root;
+		t->nodes = 0;
+		t->aborted = 0;
+		t->column = fallback;
+		t->score = 0;
+		t->depth = 0;
+		memset(t->history, 0, sizeof(t->history));
+	}
+
+	for (started = 1; started < ai->nthreads; ++started) {
+		t = &ai->threads[started];
+		if (pthread_create(&t->thread, NULL, deepen, t) != 0) {
+			break;
+		}
+	}
+	deepen(&ai->threads[0]);
+	for (i = 1; i < started; ++i) {
+		pthread_join(ai->threads[i].thread, NULL);
+	}
+	if (started < ai->nthreads) {
+		return -1;
+	}
+
+	// a decided score is exact, otherwise the deepest iteration wins
+	best = &ai->threads[0];
+	res->nodes = 0;
+	for (i = 0; i < ai->nthreads; ++i) {
+		t = &ai->threads[i];
+		if (!is_decided(best->score)
+				&& (is_decided(t->score) || t->depth > best->depth))
+		{
+			best = t;
+		}
+		res->nodes += t->nodes;
+	}
+	res->column = best->column;
+	res->score = best->score;
+	res->depth = best->depth;
+	return 0;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+/* This module implements the bot's search engine: a negamax alpha-beta
+ * search with iterative deepening and a Zobrist-keyed transposition table.
+ *
+ * The search may run on several threads (Lazy SMP): all threads search
+ * the same root with their own move ordering and share the transposition
+ * table, which is accessed without locks.
+ *
+ * Positions are kept in bitboards with one bit per field plus a sentinel
+ * bit on top of each column, so the engine only supports the boards
+ * for which width * (height + 1) <= 64.
+ */
+
+// Scores of the positions that are won by force. A score of
+// AI_SCORE_WIN - n means that the side to move wins with its nth move
+// from the searched position (counting plies of both players),
+// AI_SCORE_WIN is never reached. Losses are scored symmetrically.
+#define AI_SCORE_WIN 10000
+#define AI_SCORE_DECIDED (AI_SCORE_WIN - 100)
+
+#define AI_MAX_WIDTH 32
+
+struct ai_entry;
+struct ai_thread;
+
+struct ai_limits {
+	// time limit in milliseconds
+	int time_ms;
+	// maximum depth of the search, 0 means no limit
+	int depth;
+	// the search stops early when *stop becomes nonzero, may be NULL
+	const int *stop;
+};
+
+struct ai {
+	// these should be treated as private
+	int width;
+	int height;
+	int line_length;
+	// number of fields on the board
+	int cells;
+	// one bit at the bottom of every column
+	uint64_t bottom;
+	// all fields of the board, without the sentinels
+	uint64_t board;
+	uint64_t columns[AI_MAX_WIDTH];
+	// bitboard shifts along the four directions of a line
+	int shifts[4];
+	// columns ordered from the center outwards
+	int order[AI_MAX_WIDTH];
+	uint64_t zobrist[64][2];
+
+	struct ai_entry *table;
+	size_t table_size;
+
+	// state of each search thread, the first one is the calling thread
+	struct ai_thread *threads;
+	size_t nthreads;
+
+	// state of the running search
+	uint64_t deadline;
+	int max_depth;
+	const int *stop;
+	// set when the helper threads should stop
+	int done;
+};
+
+struct ai_result {
+	// column that should be played next
+	int column;
+	// score from the point of view of the side to move
+	int score;
+	// depth of the last completed iteration
+	int depth;
+	// number of visited positions
+	unsigned long nodes;
+};
+
+/* Returns 1 if the engine can play with the given rules and 0 otherwise.
+ */
+int ai_supported(const struct game_rules *rules);
+
+/* Initializes the engine for the given rules with a transposition table
+ * of table_size entries, which must be a power of two. Each search will
+ * run on nthreads threads (including the caller).
+ * Returns 0 on success and -1 on failure.
+ */
+int ai_init(struct ai *ai, const struct game_rules *rules,
+		size_t table_size, size_t nthreads);
+
+/* Empties the transposition table.
+ */
+void ai_clear(struct ai *ai);
+
+/* Releases all resources associated with the engine.
+ */
+void ai_finalize(struct ai *ai);
+
+/* Searches the position reached by playing the given columns from
+ * the empty board. The search deepens iteratively until the position
+ * is solved or one of the limits is reached. The result is taken from
+ * the deepest completed iteration of all threads.
+ *
+ * Returns 0 on success and -1 if the moves are invalid, the game
+ * is already over or the helper threads can't be started.
+ */
+int ai_search(struct ai *ai, const unsigned char *history, int moves,
+		const struct ai_limits *limits, struct ai_result *res);
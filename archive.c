@@ -0,0 +1,710 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+
+// segments are merged this many at a time
+#define MERGE_WIDTH 4
+// a failed write or merge is retried after this long, doubled after every
+// failure in a row up to the maximum
+#define RETRY_MS 1000
+#define RETRY_MAX_MS 60000
+
+struct archive_segment {
+	void *data;
+	size_t size;
+	char *path;
+	const struct archive_header *header;
+	const char *records;
+	const struct archive_time *times;
+	// two per game
+	const struct archive_ref *refs;
+};
+
+struct archive_memtable {
+	uint64_t first;
+	int count;
+	char *data;
+	size_t len;
+	size_t cap;
+	size_t offsets[ARCHIVE_SEGMENT_GAMES];
+};
+
+static uint64_t name_key(const char *name, size_t len)
+{
+	// FNV-1a, the keys are stored so they must not depend on the process
+	uint64_t h = UINT64_C(0xcbf29ce484222325);
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		h ^= (unsigned char)name[i];
+		h *= UINT64_C(0x100000001b3);
+	}
+	return h;
+}
+
+static int plays(const struct journal_game *game, const char *name, size_t len)
+{
+	return (game->red_len == len && memcmp(game->red, name, len) == 0)
+		|| (game->blue_len == len && memcmp(game->blue, name, len) == 0);
+}
+
+static int compare_refs(const void *p, const void *q)
+{
+	const struct archive_ref *a = p, *b = q;
+	if (a->key != b->key) {
+		return a->key < b->key ? -1 : 1;
+	}
+	return a->game < b->game ? -1 : a->game > b->game;
+}
+
+static uint64_t segment_end(const struct archive_segment *seg)
+{
+	return seg->header->first + seg->header->count;
+}
+
+static void segment_free(struct archive_segment *seg, int remove)
+{
+	munmap(seg->data, seg->size);
+	if (remove) {
+		unlink(seg->path);
+	}
+	free(seg->path);
+	free(seg);
+}
+
+static struct archive_segment *segment_map(const char *path)
+{
+	struct archive_segment *seg;
+	const struct archive_header *h;
+	struct stat st;
+	void *data;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*h)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+	h = data;
+	if (memcmp(h->magic, ARCHIVE_MAGIC, 8) != 0
+			|| h->records_size > st.st_size
+			|| st.st_size != sizeof(*h) + h->records_size
+				+ h->count * (sizeof(struct archive_time)
+					+ 2 * sizeof(struct archive_ref)))
+	{
+		munmap(data, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	seg = malloc(sizeof(*seg));
+	if (!seg || !(seg->path = strdup(path))) {
+		free(seg);
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	seg->data = data;
+	seg->size = st.st_size;
+	seg->header = h;
+	seg->records = (const char *)(h + 1);
+	seg->times = (const struct archive_time *)(seg->records + h->records_size);
+	seg->refs = (const struct archive_ref *)(seg->times + h->count);
+	return seg;
+}
+
+static char *segment_path(const char *dir, uint64_t first, uint64_t count,
+		const char *suffix)
+{
+	size_t len = strlen(dir) + 64;
+	char *path = malloc(len);
+	if (path) {
+		snprintf(path, len, "%s/%020llu-%llu%s", dir,
+				(unsigned long long)first, (unsigned long long)count, suffix);
+	}
+	return path;
+}
+
+/* Starts writing a segment to a temporary file, the caller writes
+ * the records and the indexes and calls segment_commit.
+ */
+static FILE *segment_create(const char *dir, uint64_t first, uint64_t count,
+		uint64_t records_size, char **tmp)
+{
+	struct archive_header h;
+	FILE *file;
+	*tmp = segment_path(dir, first, count, ".tmp");
+	if (!*tmp) {
+		return NULL;
+	}
+	file = fopen(*tmp, "wb");
+	if (!file) {
+		free(*tmp);
+		return NULL;
+	}
+	memcpy(h.magic, ARCHIVE_MAGIC, 8);
+	h.first = first;
+	h.count = count;
+	h.records_size = records_size;
+	fwrite(&h, sizeof(h), 1, file);
+	return file;
+}
+
+/* Makes the segment durable and gives it its final name, then maps it.
+ */
+static struct archive_segment *segment_commit(const char *dir, FILE *file,
+		char *tmp, uint64_t first, uint64_t count)
+{
+	struct archive_segment *seg = NULL;
+	char *path = segment_path(dir, first, count, ".seg");
+	int failed = ferror(file) || fflush(file) != 0 || fsync(fileno(file)) < 0;
+	int fd;
+	if (fclose(file) != 0 || failed || !path || rename(tmp, path) < 0) {
+		unlink(tmp);
+		goto out;
+	}
+	// the rename is durable once the directory is synced
+	fd = open(dir, O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	seg = segment_map(path);
+out:
+	free(tmp);
+	free(path);
+	return seg;
+}
+
+static struct archive_segment *write_memtable(const char *dir,
+		const struct archive_memtable *m)
+{
+	struct archive_time *times;
+	struct archive_ref *refs;
+	struct archive_segment *seg = NULL;
+	struct journal_game game;
+	FILE *file;
+	char *tmp;
+	int i;
+	times = malloc(m->count * sizeof(*times));
+	refs = malloc(2 * m->count * sizeof(*refs));
+	if (!times || !refs) {
+		goto out;
+	}
+	for (i = 0; i < m->count; ++i) {
+		journal_parse(m->data + m->offsets[i], m->len - m->offsets[i], &game);
+		times[i].finished = game.finished;
+		times[i].offset = m->offsets[i];
+		refs[2 * i].key = name_key(game.red, game.red_len);
+		refs[2 * i].game = i;
+		refs[2 * i + 1].key = name_key(game.blue, game.blue_len);
+		refs[2 * i + 1].game = i;
+	}
+	qsort(refs, 2 * m->count, sizeof(*refs), compare_refs);
+	file = segment_create(dir, m->first, m->count, m->len, &tmp);
+	if (!file) {
+		goto out;
+	}
+	fwrite(m->data, 1, m->len, file);
+	fwrite(times, sizeof(*times), m->count, file);
+	fwrite(refs, sizeof(*refs), 2 * m->count, file);
+	seg = segment_commit(dir, file, tmp, m->first, m->count);
+out:
+	free(times);
+	free(refs);
+	return seg;
+}
+
+/* Merges consecutive segments into one. The player indexes are merged
+ * as they are written, since each of them is already sorted.
+ */
+static struct archive_segment *merge_segments(const char *dir,
+		struct archive_segment **segs, int n)
+{
+	uint64_t count = 0, records_size = 0, games[MERGE_WIDTH];
+	uint64_t offsets[MERGE_WIDTH], pos[MERGE_WIDTH];
+	uint64_t first = segs[0]->header->first, i;
+	struct archive_time time;
+	struct archive_ref ref;
+	FILE *file;
+	char *tmp;
+	int k, best;
+	for (k = 0; k < n; ++k) {
+		games[k] = count;
+		offsets[k] = records_size;
+		pos[k] = 0;
+		count += segs[k]->header->count;
+		records_size += segs[k]->header->records_size;
+	}
+	file = segment_create(dir, first, count, records_size, &tmp);
+	if (!file) {
+		return NULL;
+	}
+	for (k = 0; k < n; ++k) {
+		fwrite(segs[k]->records, 1, segs[k]->header->records_size, file);
+	}
+	for (k = 0; k < n; ++k) {
+		for (i = 0; i < segs[k]->header->count; ++i) {
+			time = segs[k]->times[i];
+			time.offset += offsets[k];
+			fwrite(&time, sizeof(time), 1, file);
+		}
+	}
+	for (i = 0; i < 2 * count; ++i) {
+		// among equal keys the older segment goes first, its games
+		// have lower numbers
+		best = -1;
+		for (k = 0; k < n; ++k) {
+			if (pos[k] < 2 * segs[k]->header->count && (best < 0
+					|| segs[k]->refs[pos[k]].key
+						< segs[best]->refs[pos[best]].key))
+			{
+				best = k;
+			}
+		}
+		ref = segs[best]->refs[pos[best]++];
+		ref.game += games[best];
+		fwrite(&ref, sizeof(ref), 1, file);
+	}
+	return segment_commit(dir, file, tmp, first, count);
+}
+
+/* Returns the index of the oldest of MERGE_WIDTH consecutive segments with
+ * the same number of games, or -1 if there are none.
+ */
+static int mergeable(struct archive *a)
+{
+	int i, run = 1;
+	for (i = a->nsegments - 2; i >= 0; --i) {
+		if (a->segments[i]->header->count
+				== a->segments[i + 1]->header->count)
+		{
+			if (++run == MERGE_WIDTH) {
+				return i;
+			}
+		} else {
+			run = 1;
+		}
+	}
+	return -1;
+}
+
+static int push_segment(struct archive *a, struct archive_segment *seg)
+{
+	struct archive_segment **segments;
+	if (a->nsegments == a->segments_cap) {
+		segments = realloc(a->segments,
+				(2 * a->segments_cap + 1) * sizeof(*segments));
+		if (!segments) {
+			return -1;
+		}
+		a->segments = segments;
+		a->segments_cap = 2 * a->segments_cap + 1;
+	}
+	a->segments[a->nsegments++] = seg;
+	return 0;
+}
+
+/* Logs the failure of the thread and waits, with the lock held, before
+ * the thread tries again. The wait ends early if the archive is closed.
+ */
+static void compact_failed(struct archive *a, const char *what, int *delay)
+{
+	struct timespec until;
+	int res = 0;
+	fprintf(stderr, "failed to %s, retrying in %d ms: %s\n", what, *delay,
+			strerror(errno));
+	a->failed = 1;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += *delay / 1000;
+	until.tv_nsec += (long)(*delay % 1000) * 1000000;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	// the new games wake the thread too, they don't end the wait
+	while (!a->stop && res != ETIMEDOUT) {
+		res = pthread_cond_timedwait(&a->cond, &a->lock, &until);
+	}
+	*delay = *delay > RETRY_MAX_MS / 2 ? RETRY_MAX_MS : 2 * *delay;
+}
+
+static void *compact(void *arg)
+{
+	struct archive *a = arg;
+	struct archive_segment *seg, *old[MERGE_WIDTH];
+	struct archive_memtable *m;
+	int i, at, delay = RETRY_MS;
+	pthread_mutex_lock(&a->lock);
+	while (!a->stop) {
+		at = mergeable(a);
+		if (a->nsealed == 0 && at < 0) {
+			pthread_cond_wait(&a->cond, &a->lock);
+			continue;
+		}
+		if (a->nsealed > 0) {
+			// the sealed games and the segments don't change, so they
+			// are read without the lock
+			m = a->sealed[0];
+			pthread_mutex_unlock(&a->lock);
+			seg = write_memtable(a->dir, m);
+			pthread_mutex_lock(&a->lock);
+			if (seg && push_segment(a, seg) < 0) {
+				// the segment is written again on the retry
+				segment_free(seg, 0);
+				seg = NULL;
+			}
+			if (!seg) {
+				compact_failed(a, "write an archive segment", &delay);
+				continue;
+			}
+			a->failed = 0;
+			delay = RETRY_MS;
+			memmove(a->sealed, a->sealed + 1, --a->nsealed * sizeof(*a->sealed));
+			free(m->data);
+			free(m);
+			continue;
+		}
+		memcpy(old, a->segments + at, sizeof(old));
+		pthread_mutex_unlock(&a->lock);
+		seg = merge_segments(a->dir, old, MERGE_WIDTH);
+		pthread_mutex_lock(&a->lock);
+		if (!seg) {
+			compact_failed(a, "merge the archive segments", &delay);
+			continue;
+		}
+		a->failed = 0;
+		delay = RETRY_MS;
+		// only this thread changes the segments, so they are still at
+		// the same place
+		a->segments[at] = seg;
+		memmove(a->segments + at + 1, a->segments + at + MERGE_WIDTH,
+				(a->nsegments - at - MERGE_WIDTH) * sizeof(*a->segments));
+		a->nsegments -= MERGE_WIDTH - 1;
+		pthread_mutex_unlock(&a->lock);
+		for (i = 0; i < MERGE_WIDTH; ++i) {
+			segment_free(old[i], 1);
+		}
+		pthread_mutex_lock(&a->lock);
+	}
+	pthread_mutex_unlock(&a->lock);
+	return NULL;
+}
+
+static int compare_segments(const void *p, const void *q)
+{
+	const struct archive_segment *a = *(const struct archive_segment **)p;
+	const struct archive_segment *b = *(const struct archive_segment **)q;
+	if (a->header->first != b->header->first) {
+		return a->header->first < b->header->first ? -1 : 1;
+	}
+	// the bigger one first, so that the ones it contains are dropped
+	return a->header->count > b->header->count ? -1
+		: a->header->count < b->header->count;
+}
+
+/* Maps the segments in the directory. Segments contained in others
+ * were merged before a crash and are removed, as are unfinished ones.
+ */
+static int load_segments(struct archive *a)
+{
+	struct archive_segment *seg;
+	struct dirent *entry;
+	size_t len;
+	char *path;
+	int i, kept;
+	DIR *dir = opendir(a->dir);
+	if (!dir) {
+		return -1;
+	}
+	while ((entry = readdir(dir))) {
+		len = strlen(entry->d_name);
+		if (len < 4) {
+			continue;
+		}
+		path = malloc(strlen(a->dir) + len + 2);
+		if (!path) {
+			closedir(dir);
+			return -1;
+		}
+		sprintf(path, "%s/%s", a->dir, entry->d_name);
+		if (strcmp(entry->d_name + len - 4, ".tmp") == 0) {
+			unlink(path);
+		} else if (strcmp(entry->d_name + len - 4, ".seg") == 0) {
+			seg = segment_map(path);
+			if (!seg || push_segment(a, seg) < 0) {
+				free(path);
+				closedir(dir);
+				return -1;
+			}
+		}
+		free(path);
+	}
+	closedir(dir);
+	qsort(a->segments, a->nsegments, sizeof(*a->segments), compare_segments);
+	kept = 0;
+	for (i = 0; i < a->nsegments; ++i) {
+		if (kept > 0 && segment_end(a->segments[i])
+				<= segment_end(a->segments[kept - 1]))
+		{
+			segment_free(a->segments[i], 1);
+		} else {
+			a->segments[kept++] = a->segments[i];
+		}
+	}
+	a->nsegments = kept;
+	return 0;
+}
+
+static int replay(const struct journal_game *game, void *ctx)
+{
+	return archive_add(ctx, game);
+}
+
+/* Removes the segments with games from the given number on, the games
+ * before it that they hold are added from the journal again.
+ */
+static void drop_segments(struct archive *a, uint64_t end)
+{
+	while (a->nsegments > 0
+			&& segment_end(a->segments[a->nsegments - 1]) > end)
+	{
+		segment_free(a->segments[--a->nsegments], 1);
+	}
+	a->next = a->nsegments > 0
+		? segment_end(a->segments[a->nsegments - 1]) : 0;
+}
+
+static void release(struct archive *a)
+{
+	int i;
+	for (i = 0; i < a->nsegments; ++i) {
+		segment_free(a->segments[i], 0);
+	}
+	for (i = 0; i < a->nsealed; ++i) {
+		free(a->sealed[i]->data);
+		free(a->sealed[i]);
+	}
+	if (a->active) {
+		free(a->active->data);
+		free(a->active);
+	}
+	free(a->segments);
+	free(a->sealed);
+	free(a->dir);
+	pthread_mutex_destroy(&a->lock);
+	pthread_cond_destroy(&a->cond);
+}
+
+int archive_open(struct archive *a, const char *dir, const char *journal)
+{
+	long count;
+	memset(a, 0, sizeof(*a));
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+	a->dir = strdup(dir);
+	if (!a->dir || load_segments(a) < 0) {
+		release(a);
+		return -1;
+	}
+	if (a->nsegments > 0) {
+		a->next = segment_end(a->segments[a->nsegments - 1]);
+	}
+	count = journal_replay(journal, a->next, replay, a);
+	if (count < 0) {
+		release(a);
+		return -1;
+	}
+	if (count < a->next) {
+		// the segments are written before the journal is, a crash may
+		// leave games in them that the journal doesn't have
+		drop_segments(a, count);
+		if (journal_replay(journal, a->next, replay, a) < 0) {
+			release(a);
+			return -1;
+		}
+	}
+	if (pthread_create(&a->thread, NULL, compact, a) != 0) {
+		release(a);
+		return -1;
+	}
+	return 0;
+}
+
+void archive_close(struct archive *a)
+{
+	pthread_mutex_lock(&a->lock);
+	a->stop = 1;
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+	pthread_join(a->thread, NULL);
+	release(a);
+}
+
+static int seal(struct archive *a)
+{
+	struct archive_memtable **sealed;
+	int res = 0;
+	pthread_mutex_lock(&a->lock);
+	if (a->nsealed == a->sealed_cap) {
+		sealed = realloc(a->sealed, (2 * a->sealed_cap + 1) * sizeof(*sealed));
+		if (!sealed) {
+			res = -1;
+			goto out;
+		}
+		a->sealed = sealed;
+		a->sealed_cap = 2 * a->sealed_cap + 1;
+	}
+	a->sealed[a->nsealed++] = a->active;
+	a->active = NULL;
+	pthread_cond_signal(&a->cond);
+out:
+	pthread_mutex_unlock(&a->lock);
+	return res;
+}
+
+int archive_failing(struct archive *a)
+{
+	int failed;
+	pthread_mutex_lock(&a->lock);
+	failed = a->failed;
+	pthread_mutex_unlock(&a->lock);
+	return failed;
+}
+
+int archive_add(struct archive *a, const struct journal_game *game)
+{
+	struct archive_memtable *m = a->active;
+	size_t len = journal_record_size(game), cap;
+	char *data;
+	if (a->behind) {
+		return -1;
+	}
+	if (m && m->count == ARCHIVE_SEGMENT_GAMES) {
+		// sealing it has failed, it's tried again
+		if (seal(a) < 0) {
+			goto fail;
+		}
+		m = NULL;
+	}
+	if (len == 0) {
+		goto fail;
+	}
+	if (!m) {
+		m = malloc(sizeof(*m));
+		if (!m) {
+			goto fail;
+		}
+		m->first = a->next;
+		m->count = 0;
+		m->data = NULL;
+		m->len = m->cap = 0;
+		a->active = m;
+	}
+	if (m->len + len > m->cap) {
+		cap = m->cap ? 2 * m->cap : 64 * ARCHIVE_SEGMENT_GAMES;
+		while (cap < m->len + len) {
+			cap *= 2;
+		}
+		data = realloc(m->data, cap);
+		if (!data) {
+			goto fail;
+		}
+		m->data = data;
+		m->cap = cap;
+	}
+	journal_encode(game, m->data + m->len);
+	m->offsets[m->count++] = m->len;
+	m->len += len;
+	a->next++;
+	if (m->count == ARCHIVE_SEGMENT_GAMES) {
+		// the game is in, if this fails the next game seals it
+		seal(a);
+	}
+	return 0;
+fail:
+	// the later games would get the wrong numbers, so they are left to
+	// the next open, which adds them from the journal
+	a->behind = 1;
+	return -1;
+}
+
+static int memtable_history(const struct archive_memtable *m,
+		const char *name, size_t len, int n, int *found,
+		int (*fn)(const struct journal_game *game, void *ctx), void *ctx)
+{
+	struct journal_game game;
+	int i;
+	for (i = m->count - 1; i >= 0 && *found < n; --i) {
+		journal_parse(m->data + m->offsets[i], m->len - m->offsets[i], &game);
+		if (plays(&game, name, len)) {
+			++*found;
+			if (fn(&game, ctx) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int segment_history(const struct archive_segment *seg,
+		const char *name, size_t len, int n, int *found,
+		int (*fn)(const struct journal_game *game, void *ctx), void *ctx)
+{
+	const struct archive_header *h = seg->header;
+	struct journal_game game;
+	uint64_t key = name_key(name, len), lo = 0, hi = 2 * h->count, mid, offset;
+	// find the end of the key's refs, the newest games come last
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (seg->refs[mid].key <= key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for (; lo > 0 && seg->refs[lo - 1].key == key && *found < n; --lo) {
+		offset = seg->times[seg->refs[lo - 1].game].offset;
+		journal_parse(seg->records + offset, h->records_size - offset, &game);
+		// keys of different names may collide
+		if (plays(&game, name, len)) {
+			++*found;
+			if (fn(&game, ctx) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int archive_history(struct archive *a, const char *name, int n,
+		int (*fn)(const struct journal_game *game, void *ctx), void *ctx)
+{
+	size_t len = strlen(name);
+	int i, found = 0, res = 0;
+	if (a->active) {
+		res = memtable_history(a->active, name, len, n, &found, fn, ctx);
+	}
+	pthread_mutex_lock(&a->lock);
+	for (i = a->nsealed - 1; i >= 0 && res == 0; --i) {
+		res = memtable_history(a->sealed[i], name, len, n, &found, fn, ctx);
+	}
+	for (i = a->nsegments - 1; i >= 0 && res == 0; --i) {
+		res = segment_history(a->segments[i], name, len, n, &found, fn, ctx);
+	}
+	pthread_mutex_unlock(&a->lock);
+	return res < 0 ? -1 : found;
+}
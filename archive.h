@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "journal.h"
+
+/* This module implements the archive: the games of the journal, indexed
+ * by player, so that the last games of a player are found without reading
+ * the others.
+ *
+ * The archive is a directory of immutable segment files. The newest games
+ * are kept in memory until there are ARCHIVE_SEGMENT_GAMES of them, then
+ * a background thread writes them to a new segment. Whenever four
+ * consecutive segments have the same number of games, the thread merges
+ * them into one, so there are at most three segments of every size.
+ * The games still in memory are recovered from the journal on startup.
+ * Segments are written before the journal is synced, so the ones that
+ * hold games the journal has lost in a crash are removed on startup.
+ * A write or a merge that fails is retried after a while, meanwhile
+ * the games wait in memory.
+ *
+ * A segment starts with a header and the records of its games, in the
+ * format of the journal and in the same order, followed by two indexes:
+ * - the time index: the time each game finished and the offset of its
+ *   record, in the order of the games,
+ * - the player index: the key of a player's name and the number of the game
+ *   within the segment, for both players of every game, sorted by the key
+ *   and then by the number.
+ * Segments are mapped read-only, so the records are read in place.
+ * Numbers are stored in the byte order of the machine.
+ */
+
+#define ARCHIVE_MAGIC "FOURARCH"
+#define ARCHIVE_SEGMENT_GAMES 4096
+
+struct archive_header {
+	char magic[8];
+	// number of the first game within the journal
+	uint64_t first;
+	uint64_t count;
+	// size of the records, the indexes follow them
+	uint64_t records_size;
+};
+
+struct archive_time {
+	// in milliseconds since the epoch
+	uint64_t finished;
+	// from the start of the records
+	uint64_t offset;
+};
+
+struct archive_ref {
+	// hash of the player's name
+	uint64_t key;
+	uint64_t game;
+};
+
+struct archive_segment;
+struct archive_memtable;
+
+struct archive {
+	// these should be treated as private
+	char *dir;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	// the rest is protected by the lock, except for active, which only
+	// the archive's user touches, and the segments' contents, which
+	// don't change
+	struct archive_segment **segments;
+	int nsegments;
+	int segments_cap;
+	// games waiting for the thread to write them, oldest first
+	struct archive_memtable **sealed;
+	int nsealed;
+	int sealed_cap;
+	// the newest games
+	struct archive_memtable *active;
+	// number of the next game within the journal
+	uint64_t next;
+	// set while the thread waits to retry a failed write or merge
+	int failed;
+	// set once a game couldn't be added, only the archive's user
+	// touches it
+	int behind;
+};
+
+/* Opens the archive in the given directory, which must exist, and adds
+ * the games of the journal that are not archived yet. Starts the thread
+ * that writes and merges the segments. Returns 0 on success and -1
+ * on failure.
+ */
+int archive_open(struct archive *a, const char *dir, const char *journal);
+
+/* Stops the thread and releases the archive. The games still in memory
+ * are dropped, they are added from the journal again on the next open.
+ */
+void archive_close(struct archive *a);
+
+/* Adds a finished game, which must be the next game of the journal.
+ * Returns 0 on success and -1 on failure. After a failure no more games
+ * are added until the archive is opened again, which adds the missing
+ * ones from the journal.
+ */
+int archive_add(struct archive *a, const struct journal_game *game);
+
+/* Returns 1 if the last write or merge of the thread has failed, the games
+ * wait in memory until a retry succeeds, and 0 otherwise.
+ */
+int archive_failing(struct archive *a);
+
+/* Calls fn for the last games of the player with the given name,
+ * newest first, until n games are found or fn returns -1. The game
+ * passed to fn is only valid during the call. Returns the number of games
+ * found, or -1 if fn has stopped.
+ */
+int archive_history(struct archive *a, const char *name, int n,
+		int (*fn)(const struct journal_game *game, void *ctx), void *ctx);
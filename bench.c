@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ai.h"
+
+/* Measures how the search engine scales with the number of threads.
+ * Every thread count searches the same suite of 7x6 positions for a fixed
+ * time each, starting with an empty transposition table.
+ */
+
+const char *POSITIONS[] = {
+	"",
+	"33",
+	"3341356",
+	"6502053",
+	"2453101231",
+	"6632144222",
+	"53114344053",
+	"43652260546",
+	"130530535046",
+	"3406230204656",
+	"356345052602360",
+	"20543062623550550",
+	"624513321256501350",
+	"1453406220202416626",
+};
+
+const int DEFAULT_THREADS = 4;
+const int DEFAULT_TIME = 500;
+const size_t TABLE_SIZE = 1 << 22;
+
+const char *USAGE = "bench [-t MAX_THREADS] [-m MS_PER_POSITION]";
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(int threads, int time_ms, double *nps)
+{
+	struct game_rules rules = {7, 6, 4, 0};
+	struct ai ai;
+	struct ai_limits limits;
+	struct ai_result res;
+	unsigned char history[64];
+	unsigned long nodes = 0;
+	double start, elapsed = 0;
+	size_t i, j, len;
+	if (ai_init(&ai, &rules, TABLE_SIZE, threads) < 0) {
+		return -1;
+	}
+	limits.time_ms = time_ms;
+	limits.depth = 0;
+	limits.stop = NULL;
+	for (i = 0; i < sizeof(POSITIONS) / sizeof(*POSITIONS); ++i) {
+		len = strlen(POSITIONS[i]);
+		for (j = 0; j < len; ++j) {
+			history[j] = POSITIONS[i][j] - '0';
+		}
+		ai_clear(&ai);
+		start = now();
+		if (ai_search(&ai, history, len, &limits, &res) < 0) {
+			ai_finalize(&ai);
+			return -1;
+		}
+		elapsed += now() - start;
+		nodes += res.nodes;
+	}
+	ai_finalize(&ai);
+	*nps = nodes / elapsed;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = DEFAULT_THREADS;
+	int time_ms = DEFAULT_TIME;
+	int threads, c;
+	double nps, base = 0;
+	while ((c = getopt(argc, argv, "t:m:")) != -1) {
+		switch (c) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'm':
+			time_ms = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s\n", USAGE);
+			return 1;
+		}
+	}
+	if (max_threads <= 0 || time_ms <= 0) {
+		fprintf(stderr, "%s\n", USAGE);
+		return 1;
+	}
+	printf("%8s %14s %8s\n", "threads", "nodes/sec", "speedup");
+	threads = 1;
+	while (threads <= max_threads) {
+		if (run(threads, time_ms, &nps) < 0) {
+			perror("search failed");
+			return 1;
+		}
+		if (threads == 1) {
+			base = nps;
+		}
+		printf("%8d %14.0f %8.2f\n", threads, nps, nps / base);
+		if (threads < max_threads && threads * 2 > max_threads) {
+			threads = max_threads;
+		} else {
+			threads *= 2;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "book.h"
+
+int book_open(struct book *b, const char *path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*b->header)) {
+		close(fd);
+		return -1;
+	}
+	b->size = st.st_size;
+	b->data = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0);
+	// the mapping stays valid after the file is closed
+	close(fd);
+	if (b->data == MAP_FAILED) {
+		return -1;
+	}
+	b->header = b->data;
+	b->entries = (const struct book_entry *)(b->header + 1);
+	if (memcmp(b->header->magic, BOOK_MAGIC, sizeof(b->header->magic)) != 0
+			|| (b->size - sizeof(*b->header)) / sizeof(*b->entries)
+				!= b->header->count)
+	{
+		munmap(b->data, b->size);
+		return -1;
+	}
+	return 0;
+}
+
+void book_close(struct book *b)
+{
+	munmap(b->data, b->size);
+}
+
+int book_matches(const struct book *b, const struct game_rules *rules)
+{
+	return b->header->width == rules->width
+		&& b->header->height == rules->height
+		&& b->header->line_length == rules->line_length;
+}
+
+int book_probe(const struct book *b, uint64_t key, int mirrored,
+		struct book_entry *entry)
+{
+	size_t lo = 0, hi = b->header->count, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (b->entries[mid].key < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == b->header->count || b->entries[lo].key != key) {
+		return -1;
+	}
+	*entry = b->entries[lo];
+	if (mirrored) {
+		entry->column = b->header->width - 1 - entry->column;
+	}
+	return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	uint64_t x = ((const struct book_entry *)a)->key;
+	uint64_t y = ((const struct book_entry *)b)->key;
+	return (x > y) - (x < y);
+}
+
+int book_write(const char *path, const struct game_rules *rules, int depth,
+		struct book_entry *entries, size_t count)
+{
+	struct book_header header = {{0}};
+	FILE *file;
+	qsort(entries, count, sizeof(*entries), compare_entries);
+	memcpy(header.magic, BOOK_MAGIC, sizeof(header.magic));
+	header.width = rules->width;
+	header.height = rules->height;
+	header.line_length = rules->line_length;
+	header.depth = depth;
+	header.count = count;
+	file = fopen(path, "wb");
+	if (!file) {
+		return -1;
+	}
+	if (fwrite(&header, sizeof(header), 1, file) != 1
+			|| fwrite(entries, sizeof(*entries), count, file) != count)
+	{
+		fclose(file);
+		return -1;
+	}
+	return fclose(file) == 0 ? 0 : -1;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+/* This module implements the opening book: a file with the best moves
+ * of all positions up to some depth, generated offline by bookgen.
+ *
+ * The file starts with a header followed by the entries sorted by the key
+ * of their position, so that they can be found with a binary search.
+ * The keys are the canonical hashes from game.h, a position and its mirror
+ * image share an entry whose column is given for the canonical one.
+ * It is mapped read-only, so all processes using the same book share
+ * its pages. Numbers are stored in the byte order of the machine.
+ */
+
+// The books keyed with the canonical hashes have their own magic, the older
+// ones would load and then miss on every probe, so they have to be generated
+// again.
+#define BOOK_MAGIC "FOURBOK2"
+
+struct book_header {
+	char magic[8];
+	uint32_t width;
+	uint32_t height;
+	uint32_t line_length;
+	// positions with at most this many discs are in the book
+	uint32_t depth;
+	uint64_t count;
+};
+
+struct book_entry {
+	// see game_canonical_hash
+	uint64_t key;
+	// score from the point of view of the side to move, see ai.h
+	int32_t score;
+	int32_t column;
+};
+
+struct book {
+	// these should be treated as private
+	void *data;
+	size_t size;
+	const struct book_header *header;
+	const struct book_entry *entries;
+};
+
+/* Maps the book from the given file. Returns 0 on success and -1 if
+ * the file can't be mapped or isn't a valid book.
+ */
+int book_open(struct book *b, const char *path);
+
+void book_close(struct book *b);
+
+/* Returns 1 if the book was generated for the given rules and 0 otherwise.
+ */
+int book_matches(const struct book *b, const struct game_rules *rules);
+
+/* Looks up the position with the given canonical hash and copies its entry
+ * to *entry, with the column flipped if the position is mirrored.
+ * Returns 0 on success and -1 if the position isn't in the book.
+ */
+int book_probe(const struct book *b, uint64_t key, int mirrored,
+		struct book_entry *entry);
+
+/* Sorts the entries and writes them to a new book file.
+ * Returns 0 on success and -1 on failure.
+ */
+int book_write(const char *path, const struct game_rules *rules, int depth,
+		struct book_entry *entries, size_t count);
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "book.h"
+
+/* Generates an opening book: searches every position with at most
+ * DEPTH discs that can be reached in a game and writes the best moves
+ * to a book file for the server.
+ */
+
+#define MAX_DEPTH 16
+
+struct position {
+	uint64_t key;
+	int mirrored;
+	int moves;
+	unsigned char history[MAX_DEPTH];
+};
+
+struct generator {
+	struct game_rules rules;
+	int depth;
+	// one board per ply, so that moves can be taken back by copying
+	struct game games[MAX_DEPTH + 1];
+	unsigned char history[MAX_DEPTH];
+	struct position *positions;
+	size_t count;
+	size_t capacity;
+};
+
+const int DEFAULT_WIDTH = 7;
+const int DEFAULT_HEIGHT = 6;
+const int DEFAULT_LINE_LENGTH = 4;
+const int DEFAULT_DEPTH = 4;
+const int DEFAULT_TIME = 1000;
+const int DEFAULT_THREADS = 1;
+const size_t TABLE_SIZE = 1 << 22;
+
+const char *USAGE = "bookgen [-w WIDTH] [-h HEIGHT] [-l LINE] [-d DEPTH]"
+	" [-m MS_PER_POSITION] [-s SEARCH_THREADS] FILE";
+
+static int add_position(struct generator *gen, const struct game *g)
+{
+	struct position *pos;
+	size_t capacity;
+	if (gen->count == gen->capacity) {
+		capacity = gen->capacity ? 2 * gen->capacity : 1024;
+		pos = realloc(gen->positions, capacity * sizeof(*pos));
+		if (!pos) {
+			return -1;
+		}
+		gen->positions = pos;
+		gen->capacity = capacity;
+	}
+	pos = &gen->positions[gen->count++];
+	pos->key = game_canonical_hash(g, &pos->mirrored);
+	pos->moves = g->moves;
+	memcpy(pos->history, gen->history, g->moves);
+	return 0;
+}
+
+/* Collects all unfinished positions reachable from the board at the given
+ * ply, transpositions and mirror images included. Duplicates are removed
+ * later.
+ */
+static int collect(struct generator *gen, int ply)
+{
+	struct game *g = &gen->games[ply];
+	struct game *next = &gen->games[ply + 1];
+	int x;
+	if (add_position(gen, g) < 0) {
+		return -1;
+	}
+	if (ply == gen->depth) {
+		return 0;
+	}
+	for (x = 0; x < g->width; ++x) {
+		game_copy(next, g);
+		if (game_drop(next, next->turn, x) < 0 || next->over) {
+			continue;
+		}
+		gen->history[ply] = x;
+		if (collect(gen, ply + 1) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int compare_positions(const void *a, const void *b)
+{
+	uint64_t x = ((const struct position *)a)->key;
+	uint64_t y = ((const struct position *)b)->key;
+	return (x > y) - (x < y);
+}
+
+static size_t unique_positions(struct generator *gen)
+{
+	size_t i, n = 0;
+	qsort(gen->positions, gen->count, sizeof(*gen->positions),
+			compare_positions);
+	for (i = 0; i < gen->count; ++i) {
+		if (n == 0 || gen->positions[i].key != gen->positions[n - 1].key) {
+			gen->positions[n++] = gen->positions[i];
+		}
+	}
+	return n;
+}
+
+static int generate(const struct game_rules *rules, int depth, int time_ms,
+		int threads, const char *path)
+{
+	struct generator gen;
+	struct book_entry *entries = NULL;
+	struct ai ai;
+	struct ai_limits limits;
+	struct ai_result res;
+	size_t i, count;
+	int status = -1;
+
+	gen.rules = *rules;
+	gen.depth = depth;
+	gen.positions = NULL;
+	gen.count = gen.capacity = 0;
+	for (i = 0; i <= depth; ++i) {
+		if (game_init(&gen.games[i], rules) < 0) {
+			while (i > 0) {
+				game_finalize(&gen.games[--i]);
+			}
+			return -1;
+		}
+	}
+	if (ai_init(&ai, rules, TABLE_SIZE, threads) < 0) {
+		goto out_games;
+	}
+	if (collect(&gen, 0) < 0) {
+		goto out;
+	}
+	count = unique_positions(&gen);
+	entries = malloc((count + 1) * sizeof(*entries));
+	if (!entries) {
+		goto out;
+	}
+
+	limits.time_ms = time_ms;
+	limits.depth = 0;
+	limits.stop = NULL;
+	for (i = 0; i < count; ++i) {
+		// the table is kept between positions, neighbours share a lot
+		if (ai_search(&ai, gen.positions[i].history, gen.positions[i].moves,
+					&limits, &res) < 0)
+		{
+			goto out;
+		}
+		entries[i].key = gen.positions[i].key;
+		entries[i].score = res.score;
+		// the entries hold the moves of the canonical positions
+		entries[i].column = gen.positions[i].mirrored
+			? rules->width - 1 - res.column : res.column;
+		fprintf(stderr, "\r%zu/%zu positions", i + 1, count);
+	}
+	fprintf(stderr, "\n");
+	status = book_write(path, rules, depth, entries, count);
+out:
+	ai_finalize(&ai);
+out_games:
+	for (i = 0; i <= depth; ++i) {
+		game_finalize(&gen.games[i]);
+	}
+	free(gen.positions);
+	free(entries);
+	return status;
+}
+
+int main(int argc, char **argv)
+{
+	struct game_rules rules;
+	int depth = DEFAULT_DEPTH;
+	int time_ms = DEFAULT_TIME;
+	int threads = DEFAULT_THREADS;
+	int c;
+	rules.width = DEFAULT_WIDTH;
+	rules.height = DEFAULT_HEIGHT;
+	rules.line_length = DEFAULT_LINE_LENGTH;
+	rules.undos = 0;
+	while ((c = getopt(argc, argv, "w:h:l:d:m:s:")) != -1) {
+		switch (c) {
+		case 'w':
+			rules.width = atoi(optarg);
+			break;
+		case 'h':
+			rules.height = atoi(optarg);
+			break;
+		case 'l':
+			rules.line_length = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'm':
+			time_ms = atoi(optarg);
+			break;
+		case 's':
+			threads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s\n", USAGE);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || depth < 0 || depth > MAX_DEPTH
+			|| time_ms <= 0 || threads <= 0)
+	{
+		fprintf(stderr, "%s\n", USAGE);
+		return 1;
+	}
+	if (game_rules_check(&rules) < 0 || !ai_supported(&rules)) {
+		fprintf(stderr, "the search engine doesn't support these rules\n");
+		return 1;
+	}
+	if (generate(&rules, depth, time_ms, threads, argv[optind]) < 0) {
+		perror("failed to generate the book");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+
+#include "cache.h"
+
+// Entries are kept in an array and linked by their indices, -1 ends a list.
+struct cache_entry {
+	uint64_t key;
+	struct cache_value value;
+	// the LRU list, most recently used first
+	int prev;
+	int next;
+	// the next entry in the same bucket
+	int chain;
+};
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct cache_entry *entries;
+	int capacity;
+	int used;
+	int *buckets;
+	int nbuckets;
+	int head;
+	int tail;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+static int shard_init(struct cache_shard *sh, int capacity)
+{
+	int i;
+	sh->entries = malloc(capacity * sizeof(*sh->entries));
+	// twice as many buckets as entries keeps the chains short
+	sh->nbuckets = 2 * capacity;
+	sh->buckets = malloc(sh->nbuckets * sizeof(*sh->buckets));
+	if (!sh->entries || !sh->buckets) {
+		free(sh->entries);
+		free(sh->buckets);
+		return -1;
+	}
+	for (i = 0; i < sh->nbuckets; ++i) {
+		sh->buckets[i] = -1;
+	}
+	sh->capacity = capacity;
+	sh->used = 0;
+	sh->head = sh->tail = -1;
+	sh->hits = sh->misses = 0;
+	pthread_mutex_init(&sh->lock, NULL);
+	return 0;
+}
+
+static void shard_finalize(struct cache_shard *sh)
+{
+	pthread_mutex_destroy(&sh->lock);
+	free(sh->entries);
+	free(sh->buckets);
+}
+
+int cache_init(struct cache *c, size_t capacity, size_t nshards)
+{
+	size_t i;
+	if (nshards == 0 || capacity < nshards) {
+		return -1;
+	}
+	c->shards = malloc(nshards * sizeof(*c->shards));
+	if (!c->shards) {
+		return -1;
+	}
+	for (i = 0; i < nshards; ++i) {
+		if (shard_init(&c->shards[i], capacity / nshards) < 0) {
+			while (i > 0) {
+				shard_finalize(&c->shards[--i]);
+			}
+			free(c->shards);
+			return -1;
+		}
+	}
+	c->nshards = nshards;
+	return 0;
+}
+
+void cache_finalize(struct cache *c)
+{
+	size_t i;
+	for (i = 0; i < c->nshards; ++i) {
+		shard_finalize(&c->shards[i]);
+	}
+	free(c->shards);
+}
+
+static struct cache_shard *shard_of(struct cache *c, uint64_t key)
+{
+	// the low bits pick the bucket, so the shard is picked by the high ones
+	return &c->shards[(key >> 32) % c->nshards];
+}
+
+static int *bucket_of(struct cache_shard *sh, uint64_t key)
+{
+	return &sh->buckets[key % sh->nbuckets];
+}
+
+static void unlink_entry(struct cache_shard *sh, int i)
+{
+	struct cache_entry *e = &sh->entries[i];
+	if (e->prev >= 0) {
+		sh->entries[e->prev].next = e->next;
+	} else {
+		sh->head = e->next;
+	}
+	if (e->next >= 0) {
+		sh->entries[e->next].prev = e->prev;
+	} else {
+		sh->tail = e->prev;
+	}
+}
+
+static void push_front(struct cache_shard *sh, int i)
+{
+	struct cache_entry *e = &sh->entries[i];
+	e->prev = -1;
+	e->next = sh->head;
+	if (sh->head >= 0) {
+		sh->entries[sh->head].prev = i;
+	} else {
+		sh->tail = i;
+	}
+	sh->head = i;
+}
+
+static int find(struct cache_shard *sh, uint64_t key)
+{
+	int i;
+	for (i = *bucket_of(sh, key); i >= 0; i = sh->entries[i].chain) {
+		if (sh->entries[i].key == key) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int cache_get(struct cache *c, uint64_t key, struct cache_value *value)
+{
+	struct cache_shard *sh = shard_of(c, key);
+	int i;
+	pthread_mutex_lock(&sh->lock);
+	i = find(sh, key);
+	if (i < 0) {
+		sh->misses++;
+		pthread_mutex_unlock(&sh->lock);
+		return -1;
+	}
+	sh->hits++;
+	*value = sh->entries[i].value;
+	unlink_entry(sh, i);
+	push_front(sh, i);
+	pthread_mutex_unlock(&sh->lock);
+	return 0;
+}
+
+void cache_put(struct cache *c, uint64_t key, const struct cache_value *value)
+{
+	struct cache_shard *sh = shard_of(c, key);
+	int i, *link;
+	pthread_mutex_lock(&sh->lock);
+	i = find(sh, key);
+	if (i >= 0) {
+		unlink_entry(sh, i);
+	} else {
+		if (sh->used < sh->capacity) {
+			i = sh->used++;
+		} else {
+			// evict the tail and remove it from its bucket
+			i = sh->tail;
+			unlink_entry(sh, i);
+			link = bucket_of(sh, sh->entries[i].key);
+			while (*link != i) {
+				link = &sh->entries[*link].chain;
+			}
+			*link = sh->entries[i].chain;
+		}
+		sh->entries[i].key = key;
+		link = bucket_of(sh, key);
+		sh->entries[i].chain = *link;
+		*link = i;
+	}
+	sh->entries[i].value = *value;
+	push_front(sh, i);
+	pthread_mutex_unlock(&sh->lock);
+}
+
+void cache_stats(struct cache *c, unsigned long *hits, unsigned long *misses)
+{
+	size_t i;
+	*hits = *misses = 0;
+	for (i = 0; i < c->nshards; ++i) {
+		pthread_mutex_lock(&c->shards[i].lock);
+		*hits += c->shards[i].hits;
+		*misses += c->shards[i].misses;
+		pthread_mutex_unlock(&c->shards[i].lock);
+	}
+}
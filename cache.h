@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* This module implements a bounded cache of analysed positions that
+ * evicts the least recently used ones. It may be used from several
+ * threads at once: the keys are spread over shards that are locked
+ * separately, each with its own LRU list and a fixed number of entries.
+ */
+
+struct cache_shard;
+
+struct cache_value {
+	int column;
+	int score;
+};
+
+struct cache {
+	// these should be treated as private
+	struct cache_shard *shards;
+	size_t nshards;
+};
+
+/* Initializes a cache holding up to capacity entries, spread over
+ * nshards shards. Returns 0 on success and -1 on failure.
+ */
+int cache_init(struct cache *c, size_t capacity, size_t nshards);
+
+void cache_finalize(struct cache *c);
+
+/* Copies the value stored under the key to *value and marks it as recently
+ * used. Returns 0 if the key was found and -1 otherwise.
+ */
+int cache_get(struct cache *c, uint64_t key, struct cache_value *value);
+
+/* Stores the value under the key, evicting the least recently used entry
+ * of its shard if the shard is full.
+ */
+void cache_put(struct cache *c, uint64_t key, const struct cache_value *value);
+
+/* Returns the number of lookups that found their key and that didn't.
+ */
+void cache_stats(struct cache *c, unsigned long *hits, unsigned long *misses);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
@@ -62,6 +63,8 @@ int main(int argc, char **argv)
 		}
 		return 1;
 	}
+	// a dropped connection shows up as the write failing with EPIPE
+	signal(SIGPIPE, SIG_IGN);
 	if ((res = client_init(&c, addr, name)) < 0) {
 		perror("failed to initialize the client");
 		free(name);
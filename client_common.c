@@ -10,6 +10,9 @@
 #include "client_render.h"
 
 #define BUF_SIZE 512
+// times the client tries to connect again after the connection drops
+// during a game, a second apart
+#define RECONNECT_ATTEMPTS 10
 
 int request(struct client *c, struct message *msg)
 {
@@ -27,25 +30,35 @@ int request(struct client *c, struct message *msg)
 	return RES_OK;
 }
 
-static int client_connect(struct client *c)
+static int client_open(struct client *c)
 {
 	struct epoll_event event = {0};
-	struct message msg;
-	int res;
 	c->conn = socket(AF_INET, SOCK_STREAM, 0);
 	if (c->conn < 0) {
 		return RES_ERR;
 	}
 	if (connect(c->conn, (struct sockaddr *)&c->addr, sizeof(c->addr)) < 0) {
 		close(c->conn);
+		c->conn = -1;
 		return RES_ERR;
 	}
 	event.events = EPOLLIN;
 	event.data.fd = c->conn;
 	if (epoll_ctl(c->epoll, EPOLL_CTL_ADD, c->conn, &event) < 0) {
 		close(c->conn);
+		c->conn = -1;
 		return RES_ERR;
 	}
+	return RES_OK;
+}
+
+static int client_connect(struct client *c)
+{
+	struct message msg;
+	int res;
+	if ((res = client_open(c)) < 0) {
+		return res;
+	}
 	msg.type = MSG_LOGIN;
 	msg.data.login.name = c->name;
 	if ((res = request(c, &msg)) < 0) {
@@ -71,6 +84,7 @@ int client_init(struct client *c, struct sockaddr_in addr, char *name)
 	}
 	c->addr = addr;
 	c->name = name;
+	c->token = NULL;
 	buffer_init(&c->input);
 	buffer_init(&c->output);
 	if ((res = client_connect(c)) < 0) {
@@ -86,18 +100,17 @@ int client_init(struct client *c, struct sockaddr_in addr, char *name)
 
 void finalize_state(struct client *c)
 {
-	int i;
 	switch (c->state) {
 	case STATE_LOGIN_ERR:
 		free(c->data.login_err);
 		break;
+	case STATE_START_ERR:
+		free(c->data.start_err);
+		break;
 	case STATE_GAME:
 	case STATE_GAME_QUIT:
 	case STATE_GAME_OVER:
 		free(c->data.game.b.other);
-		for (i = 0; i < c->data.game.b.width; ++i) {
-			free(c->data.game.b.board[i]);
-		}
 		free(c->data.game.b.board);
 		break;
 	default:
@@ -108,6 +121,7 @@ void finalize_state(struct client *c)
 void client_finalize(struct client *c)
 {
 	free(c->name);
+	free(c->token);
 	close(c->conn);
 	buffer_finalize(&c->input);
 	buffer_finalize(&c->output);
@@ -183,6 +197,41 @@ static int client_write(struct client *c)
 	return RES_OK;
 }
 
+/* Returns 1 if the connection has dropped during a game,
+ * which the server keeps for a while, and 0 otherwise.
+ */
+static int can_resume(struct client *c, int res)
+{
+	if (!c->token || (c->state != STATE_GAME && c->state != STATE_GAME_QUIT)) {
+		return 0;
+	}
+	return res == RES_DISCONNECT || (res == RES_ERR
+			&& (errno == ECONNRESET || errno == EPIPE));
+}
+
+/* Connects to the server again and asks it to resume the game.
+ * Whatever was in flight is lost, the server sends the whole state
+ * of the game.
+ */
+static int client_reconnect(struct client *c)
+{
+	struct message msg;
+	int i;
+	epoll_ctl(c->epoll, EPOLL_CTL_DEL, c->conn, NULL);
+	close(c->conn);
+	buffer_pop(&c->input, NULL, buffer_len(&c->input));
+	buffer_pop(&c->output, NULL, buffer_len(&c->output));
+	for (i = 0; client_open(c) < 0; ++i) {
+		if (i + 1 == RECONNECT_ATTEMPTS) {
+			return RES_DISCONNECT;
+		}
+		sleep(1);
+	}
+	msg.type = MSG_RESUME;
+	msg.data.resume.token = c->token;
+	return request(c, &msg);
+}
+
 static int client_redraw(struct client *c)
 {
 	int res;
@@ -228,14 +277,18 @@ int client_run(struct client *c)
 				}
 			} else if (events[i].data.fd == c->conn) {
 				if (events[i].events & EPOLLIN) {
-					if ((res = client_read(c)) < 0) {
-						return res;
-					}
+					res = client_read(c);
+				} else {
+					res = RES_OK;
 				}
-				if (events[i].events & EPOLLOUT) {
-					if ((res = client_write(c)) < 0) {
-						return res;
-					}
+				if (res == RES_OK && (events[i].events & EPOLLOUT)) {
+					res = client_write(c);
+				}
+				if (res < 0 && can_resume(c, res)) {
+					res = client_reconnect(c);
+				}
+				if (res < 0) {
+					return res;
 				}
 			}
 			if ((res = client_redraw(c)) < 0) {
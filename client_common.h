@@ -42,9 +42,13 @@ enum client_state {
 	STATE_LOBBY,
 
 	// Client is waiting for the game to start.
-	// next states: STATE_GAME or STATE_LOBBY
+	// next states: STATE_GAME, STATE_START_ERR or STATE_LOBBY
 	STATE_START_WAIT,
 
+	// The server refused to start the game, display the error message.
+	// next states: STATE_LOBBY
+	STATE_START_ERR,
+
 	// Client is in the game.
 	// next states: STATE_GAME_QUIT, STATE_GAME_OVER or STATE_HALTED
 	STATE_GAME,
@@ -65,6 +69,7 @@ enum client_state {
 
 enum {
 	LOBBY_START,
+	LOBBY_BOT,
 	LOBBY_QUIT,
 	LOBBY_LEN,
 };
@@ -80,9 +85,13 @@ struct game_base {
 	char *other;
 	// our side
 	enum side side;
-	enum side **board;
+	// fields of the board stored column by column,
+	// the field (x, y) is at board[x * height + y]
+	enum side *board;
 	int width;
 	int height;
+	// number of discs in a line needed to win
+	int line_length;
 	// currently selected column
 	int column;
 	// current turn
@@ -97,6 +106,8 @@ struct client {
 
 	struct sockaddr_in addr;
 	char *name;
+	// resumes the game if the connection drops, NULL before logging in
+	char *token;
 	int conn;
 	struct buffer input;
 	struct buffer output;
@@ -104,6 +115,7 @@ struct client {
 	enum client_state state;
 	union {
 		char *login_err;
+		char *start_err;
 
 		struct {
 			int index;
@@ -13,26 +13,18 @@ static int goto_lobby(struct client *c)
 	return RES_OK;
 }
 
-static enum side **create_board(int width, int height)
+// The board uses the same layout as struct game on the server:
+// a single allocation with the field (x, y) at board[x * height + y].
+static enum side *create_board(int width, int height)
 {
-	int i, j;
-	enum side **board;
-	board = malloc(width * sizeof(*board));
+	int i;
+	enum side *board;
+	board = malloc(width * height * sizeof(*board));
 	if (!board) {
 		return NULL;
 	}
-	for (i = 0; i < width; ++i) {
-		board[i] = malloc(height * sizeof(**board));
-		if (!board[i]) {
-			for (j = 0; j < i; ++j) {
-				free(board[j]);
-			}
-			free(board);
-			return NULL;
-		}
-		for (j = 0; j < height; ++j) {
-			board[i][j] = SIDE_NONE;
-		}
+	for (i = 0; i < width * height; ++i) {
+		board[i] = SIDE_NONE;
 	}
 	return board;
 }
@@ -48,6 +40,7 @@ static int goto_game(struct client *c, struct message *msg)
 	base->side = msg->data.start_ok.side;
 	base->width = msg->data.start_ok.width;
 	base->height = msg->data.start_ok.height;
+	base->line_length = msg->data.start_ok.line_length;
 	base->column = base->width / 2;
 	base->turn = SIDE_RED;
 	base->red_undos = msg->data.start_ok.red_undos;
@@ -60,6 +53,44 @@ static int goto_game(struct client *c, struct message *msg)
 	return RES_OK;
 }
 
+/* Replaces the state of the game with the one sent by the server
+ * after the connection has been restored.
+ */
+static int resume_game(struct client *c, struct message *msg)
+{
+	struct game_base *base = &c->data.game.b;
+	enum side *board;
+	int i, len = msg->data.resume_ok.width * msg->data.resume_ok.height;
+	if ((int)strlen(msg->data.resume_ok.board) != len) {
+		return RES_INVALID_MSG;
+	}
+	board = create_board(msg->data.resume_ok.width, msg->data.resume_ok.height);
+	if (!board) {
+		return RES_ERR;
+	}
+	for (i = 0; i < len; ++i) {
+		switch (msg->data.resume_ok.board[i]) {
+		case 'r':
+			board[i] = SIDE_RED;
+			break;
+		case 'b':
+			board[i] = SIDE_BLUE;
+			break;
+		}
+	}
+	free(base->board);
+	base->board = board;
+	base->width = msg->data.resume_ok.width;
+	base->height = msg->data.resume_ok.height;
+	if (base->column >= base->width) {
+		base->column = base->width / 2;
+	}
+	base->turn = msg->data.resume_ok.turn;
+	base->red_undos = msg->data.resume_ok.red_undos;
+	base->blue_undos = msg->data.resume_ok.blue_undos;
+	return RES_OK;
+}
+
 static void move_cursor(int delta, int *idx, int len)
 {
 	int new_idx = *idx + delta;
@@ -75,6 +106,10 @@ static int handle_login_wait(struct client *c, struct event *ev)
 		msg = ev->data.msg;
 		switch (msg->type) {
 		case MSG_LOGIN_OK:
+			c->token = strdup(msg->data.login_ok.token);
+			if (!c->token) {
+				return RES_ERR;
+			}
 			return goto_lobby(c);
 		case MSG_LOGIN_ERR:
 			c->state = STATE_LOGIN_ERR;
@@ -120,7 +155,9 @@ static int handle_lobby(struct client *c, struct event *ev)
 		case '\n':
 			switch (c->data.lobby.index) {
 			case LOBBY_START:
+			case LOBBY_BOT:
 				req.type = MSG_START;
+				req.data.start.bot = c->data.lobby.index == LOBBY_BOT;
 				if ((res = request(c, &req)) < 0) {
 					return res;
 				}
@@ -153,8 +190,12 @@ static int handle_start_wait(struct client *c, struct event *ev)
 		msg = ev->data.msg;
 		switch (msg->type) {
 		case MSG_START_ERR:
-			// should not happen anyway
-			return RES_INVALID_MSG;
+			c->state = STATE_START_ERR;
+			c->data.start_err = strdup(msg->data.err.text);
+			if (!c->data.start_err) {
+				return RES_ERR;
+			}
+			break;
 		case MSG_START_OK:
 			return goto_game(c, msg);
 		default:
@@ -164,6 +205,15 @@ static int handle_start_wait(struct client *c, struct event *ev)
 	return RES_OK;
 }
 
+static int handle_start_err(struct client *c, struct event *ev)
+{
+	if (ev->type == EVENT_INPUT && (ev->data.ch == KEY_ENTER || ev->data.ch == '\n')) {
+		finalize_state(c);
+		return goto_lobby(c);
+	}
+	return RES_OK;
+}
+
 static int handle_game(struct client *c, struct event *ev)
 {
 	enum side side;
@@ -204,9 +254,12 @@ static int handle_game(struct client *c, struct event *ev)
 		msg = ev->data.msg;
 		switch (msg->type) {
 		case MSG_NOTIFY_QUIT:
+		case MSG_RESUME_ERR:
 			finalize_state(c);
 			c->state = STATE_HALTED;
 			break;
+		case MSG_RESUME_OK:
+			return resume_game(c, msg);
 		case MSG_NOTIFY_OVER:
 			c->state = STATE_GAME_OVER;
 			c->data.game_over.winner = msg->data.notify_over.winner;
@@ -214,7 +267,8 @@ static int handle_game(struct client *c, struct event *ev)
 		case MSG_NOTIFY_DROP:
 			column = msg->data.notify_drop.column;
 			row = msg->data.notify_drop.row;
-			c->data.game.b.board[column][row] = msg->data.notify_drop.side;
+			c->data.game.b.board[column * c->data.game.b.height + row] =
+				msg->data.notify_drop.side;
 			c->data.game.b.turn = msg->data.notify_drop.side == SIDE_RED
 				? SIDE_BLUE
 				: SIDE_RED;
@@ -223,7 +277,7 @@ static int handle_game(struct client *c, struct event *ev)
 			column = msg->data.notify_undo.column;
 			row = msg->data.notify_undo.row;
 			side = msg->data.notify_undo.side;
-			c->data.game.b.board[column][row] = SIDE_NONE;
+			c->data.game.b.board[column * c->data.game.b.height + row] = SIDE_NONE;
 			c->data.game.b.turn = side;
 			if (side == SIDE_RED) {
 				--c->data.game.b.red_undos;
@@ -304,6 +358,8 @@ int handle(struct client *c, struct event *ev)
 		return handle_lobby(c, ev);
 	case STATE_START_WAIT:
 		return handle_start_wait(c, ev);
+	case STATE_START_ERR:
+		return handle_start_err(c, ev);
 	case STATE_GAME:
 		return handle_game(c, ev);
 	case STATE_GAME_QUIT:
@@ -3,7 +3,7 @@
 
 #include "client_render.h"
 
-const char *LOBBY[] = {"START", "QUIT"};
+const char *LOBBY[] = {"START", "PLAY WITH BOT", "QUIT"};
 
 const char *GAME_QUIT[] = {"YES", "NO"};
 
@@ -223,14 +223,14 @@ static void mvgrid(int starty, int startx, int height, int width)
 	}
 }
 
-static void mvboard(int starty, int startx, enum side **board, int height, int width)
+static void mvboard(int starty, int startx, enum side *board, int height, int width)
 {
 	int i, j;
 	int sym;
 	mvgrid(starty, startx, height, width);
 	for (i = 0; i < height; ++i) {
 		for (j = 0; j < width; ++j) {
-			switch (board[j][height - 1 - i]) {
+			switch (board[j * height + (height - 1 - i)]) {
 			case SIDE_RED:
 				sym = ' ' | COLOR_PAIR(RED_CELL_PAIR);
 				break;
@@ -251,7 +251,7 @@ static void mvboard(int starty, int startx, enum side **board, int height, int w
 
 const int HOOK_HEIGHT = 1;
 
-static void render_board(enum side **board, int height, int width,
+static void render_board(enum side *board, int height, int width,
 		int column, enum side side)
 {
 	int scr_height, scr_width;
@@ -319,8 +319,14 @@ static void render_players(struct client *c)
 	attroff(right_attr);
 }
 
+const int TITLE_OFFSET = 4;
+
 static void render_base_game(struct client *c)
 {
+	char buf[32];
+	sprintf(buf, "connect %d to win", c->data.game.b.line_length);
+	move(TITLE_OFFSET + 1, 0);
+	centered(buf, getmaxx(stdscr));
 	render_board(
 		c->data.game.b.board,
 		c->data.game.b.height,
@@ -330,8 +336,6 @@ static void render_base_game(struct client *c)
 	render_players(c);
 }
 
-const int TITLE_OFFSET = 4;
-
 static void render_title(char *msg)
 {
 	move(TITLE_OFFSET, 0);
@@ -374,6 +378,13 @@ static int render_start_wait(struct client *c)
 	return RES_OK;
 }
 
+static int render_start_err(struct client *c)
+{
+	char *choices[] = {"OK"};
+	render_dialog("Error", c->data.start_err, (const char **)choices, 1, 0);
+	return RES_OK;
+}
+
 static int render_game(struct client *c)
 {
 	char *msg;
@@ -433,6 +444,8 @@ int render(struct client *c)
 		return render_lobby(c);
 	case STATE_START_WAIT:
 		return render_start_wait(c);
+	case STATE_START_ERR:
+		return render_start_err(c);
 	case STATE_GAME:
 		return render_game(c);
 	case STATE_GAME_QUIT:
@@ -0,0 +1,66 @@
+// the CPU sets are a GNU extension
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include "cpu.h"
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the CPUs of the first thread pinned, from before it was pinned
+static cpu_set_t unpinned;
+static int saved;
+
+int cpu_pin(int cpu)
+{
+	cpu_set_t set;
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!saved) {
+		if (sched_getaffinity(0, sizeof(unpinned), &unpinned) < 0) {
+			return -1;
+		}
+		saved = 1;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
+int cpu_unpin(void)
+{
+	if (!saved) {
+		return 0;
+	}
+	return sched_setaffinity(0, sizeof(unpinned), &unpinned);
+}
+
+void cpu_spin_init(struct cpu_spin *sp, int spin)
+{
+	sp->spin = spin;
+	sp->last = 0;
+}
+
+int cpu_spin_timeout(struct cpu_spin *sp, int timeout)
+{
+	if (sp->spin > 0 && timeout != 0 && now_us() - sp->last < (uint64_t)sp->spin) {
+		return 0;
+	}
+	return timeout;
+}
+
+void cpu_spin_events(struct cpu_spin *sp, int nfds)
+{
+	if (sp->spin > 0 && nfds > 0) {
+		sp->last = now_us();
+	}
+}
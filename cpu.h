@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+/* This module controls how the server's loops use the CPUs: a loop may be
+ * pinned to a CPU, and may poll for a while after its last event before it
+ * goes to sleep in epoll_wait, which saves the wakeup when the next event
+ * comes soon.
+ *
+ * Memory is placed on the NUMA node of the CPU that first writes to it,
+ * so a pinned thread should allocate and fill its own tables.
+ */
+
+/* Pins the calling thread to the CPU. Returns 0 on success and -1
+ * on failure.
+ *
+ * The first call remembers the CPUs the thread could run on before, so it
+ * should be made before any other threads are pinned.
+ */
+int cpu_pin(int cpu);
+
+/* Lets the calling thread run on the CPUs it could run on before the first
+ * cpu_pin. Threads start on the CPUs of the thread creating them, so
+ * a pinned thread unpins itself while it starts threads that shouldn't
+ * share its CPU. Returns 0 on success and -1 on failure.
+ */
+int cpu_unpin(void);
+
+struct cpu_spin {
+	// microseconds to keep polling after the last event, 0 if the loop
+	// sleeps right away
+	int spin;
+	// when the last event came, in microseconds
+	uint64_t last;
+};
+
+void cpu_spin_init(struct cpu_spin *sp, int spin);
+
+/* Returns the timeout to pass to epoll_wait instead of timeout: 0 while
+ * the loop should still poll.
+ */
+int cpu_spin_timeout(struct cpu_spin *sp, int timeout);
+
+/* Notes what epoll_wait has returned.
+ */
+void cpu_spin_events(struct cpu_spin *sp, int nfds);
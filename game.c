@@ -1,94 +1,179 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "game.h"
 
-const int LINE_LENGTH = 4;
-const int UNDOS = 3;
+/* The win check runs after every move, so it is generated from a single
+ * template for a few common rule sets, letting the compiler work with
+ * constant board dimensions. Other rules use the generic version that reads
+ * them from the game.
+ */
+#define DEFINE_CONNECTED(name, W, H, N) \
+static int name(struct game *g, int x, int y) \
+{ \
+	static const int dx[4] = {1, 0, 1, 1}; \
+	static const int dy[4] = {0, 1, 1, -1}; \
+	const signed char *cells = g->cells; \
+	signed char disc = cells[x * (H) + y]; \
+	int d, len, cx, cy; \
+	for (d = 0; d < 4; ++d) { \
+		len = 1; \
+		cx = x + dx[d]; \
+		cy = y + dy[d]; \
+		while (cx < (W) && cy >= 0 && cy < (H) \
+				&& cells[cx * (H) + cy] == disc) { \
+			++len; \
+			cx += dx[d]; \
+			cy += dy[d]; \
+		} \
+		cx = x - dx[d]; \
+		cy = y - dy[d]; \
+		while (cx >= 0 && cy >= 0 && cy < (H) \
+				&& cells[cx * (H) + cy] == disc) { \
+			++len; \
+			cx -= dx[d]; \
+			cy -= dy[d]; \
+		} \
+		if (len >= (N)) { \
+			return 1; \
+		} \
+	} \
+	return 0; \
+}
+
+DEFINE_CONNECTED(is_connected_generic, g->width, g->height, g->line_length)
+DEFINE_CONNECTED(is_connected_7x6_4, 7, 6, 4)
+DEFINE_CONNECTED(is_connected_8x8_4, 8, 8, 4)
+DEFINE_CONNECTED(is_connected_9x7_4, 9, 7, 4)
+
+static const struct {
+	int width;
+	int height;
+	int line_length;
+	int (*fn)(struct game *, int, int);
+} KERNELS[] = {
+	{7, 6, 4, is_connected_7x6_4},
+	{8, 8, 4, is_connected_8x8_4},
+	{9, 7, 4, is_connected_9x7_4},
+};
 
-int game_init(struct game *g, int width, int height)
+static int (*pick_kernel(const struct game_rules *rules))(struct game *, int, int)
 {
-	int x, y;
-	g->fields = malloc(width * sizeof(*g->fields));
+	size_t i;
+	for (i = 0; i < sizeof(KERNELS) / sizeof(*KERNELS); ++i) {
+		if (KERNELS[i].width == rules->width
+				&& KERNELS[i].height == rules->height
+				&& KERNELS[i].line_length == rules->line_length)
+		{
+			return KERNELS[i].fn;
+		}
+	}
+	return is_connected_generic;
+}
+
+int game_rules_check(const struct game_rules *rules)
+{
+	if (rules->width <= 0 || rules->width > GAME_MAX_WIDTH
+			|| rules->height <= 0 || rules->height > GAME_MAX_HEIGHT
+			|| rules->line_length <= 0
+			|| rules->line_length > GAME_MAX_LINE_LENGTH
+			|| rules->undos < 0)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns the Zobrist key of a disc of the given side on the given field.
+ * The keys are computed with splitmix64 rather than drawn at random,
+ * so they need no table and hashes can be shared between processes.
+ */
+static uint64_t zobrist(int field, enum side side)
+{
+	uint64_t x = ((uint64_t)field << 1 | (side == SIDE_BLUE))
+		+ UINT64_C(0x9e3779b97f4a7c15);
+	x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return x ^ (x >> 31);
+}
+
+static void toggle_disc(struct game *g, int x, int y, enum side side)
+{
+	g->hash ^= zobrist(x * g->height + y, side);
+	g->mirror_hash ^= zobrist((g->width - 1 - x) * g->height + y, side);
+}
+
+static size_t block_size(int width, int height)
+{
+	// heights go first so that they are properly aligned
+	return width * sizeof(int)
+		+ width * height * sizeof(signed char)
+		+ width * height * sizeof(unsigned char);
+}
+
+int game_init(struct game *g, const struct game_rules *rules)
+{
+	int i;
+	char *block;
+	int width = rules->width;
+	int height = rules->height;
+	if (game_rules_check(rules) < 0) {
+		return -1;
+	}
+	block = malloc(block_size(width, height));
+	if (!block) {
+		return -1;
+	}
+	g->heights = (int *)block;
+	g->cells = (signed char *)(block + width * sizeof(*g->heights));
+	g->history = (unsigned char *)(g->cells + width * height);
 	g->width = width;
 	g->height = height;
+	g->line_length = rules->line_length;
+	g->is_connected = pick_kernel(rules);
+	g->moves = 0;
+	g->hash = 0;
+	g->mirror_hash = 0;
 	g->turn = SIDE_RED;
 	g->over = 0;
 	g->winner = SIDE_NONE;
-	g->red_undos = UNDOS;
-	g->blue_undos = UNDOS;
-	g->last_x = -1;
-	g->last_y = -1;
-	if (!g->fields) {
-		return -1;
+	g->red_undos = rules->undos;
+	g->blue_undos = rules->undos;
+	for (i = 0; i < width; ++i) {
+		g->heights[i] = 0;
 	}
-	for (x = 0; x < width; ++x) {
-		g->fields[x] = malloc(height * sizeof(**g->fields));
-		if (!g->fields[x]) {
-			while (x > 0) {
-				free(g->fields[x-1]);
-				--x;
-			}
-			free(g->fields);
-			return -1;
-		}
-		for (y = 0; y < height; ++y) {
-			g->fields[x][y] = SIDE_NONE;
-		}
+	for (i = 0; i < width * height; ++i) {
+		g->cells[i] = SIDE_NONE;
 	}
 	return 0;
 }
 
 void game_finalize(struct game *g)
 {
-	size_t i;
-	for (i = 0; i < g->width; ++i) {
-		free(g->fields[i]);
-	}
-	free(g->fields);
+	free(g->heights);
 }
 
-static int count_equal(struct game *g, int startx, int starty, int dx, int dy)
+void game_copy(struct game *dst, const struct game *src)
 {
-	int x, y;
-	int count = 0;
-	x = startx + dx;
-	y = starty + dy;
-	while (x >= 0 && x < g->width && y >= 0 && y < g->height) {
-		if (g->fields[x][y] != g->fields[startx][starty]) {
-			break;
-		}
-		++count;
-		x += dx;
-		y += dy;
-	}
-	return count;
-
-}
-
-static int is_line(struct game *g, int startx, int starty, int dx, int dy)
-{
-	int len = 1 + count_equal(g, startx, starty, -dx, -dy)
-		+ count_equal(g, startx, starty, dx, dy);
-	return len >= LINE_LENGTH;
+	memcpy(dst->heights, src->heights, block_size(src->width, src->height));
+	dst->moves = src->moves;
+	dst->hash = src->hash;
+	dst->mirror_hash = src->mirror_hash;
+	dst->turn = src->turn;
+	dst->over = src->over;
+	dst->winner = src->winner;
+	dst->red_undos = src->red_undos;
+	dst->blue_undos = src->blue_undos;
 }
 
-static int is_connected(struct game *g, int startx, int starty)
+enum side game_get(struct game *g, int x, int y)
 {
-	return is_line(g, startx, starty, 1, 0)
-		|| is_line(g, startx, starty, 0, 1)
-		|| is_line(g, startx, starty, 1, 1)
-		|| is_line(g, startx, starty, 1, -1);
+	return g->cells[x * g->height + y];
 }
 
 static int is_full(struct game *g)
 {
-	int i;
-	for (i = 0; i < g->width; ++i) {
-		if (g->fields[i][g->height - 1] == SIDE_NONE) {
-			return 0;
-		}
-	}
-	return 1;
+	return g->moves == g->width * g->height;
 }
 
 int game_drop(struct game *g, enum side side, int x)
@@ -97,31 +182,41 @@ int game_drop(struct game *g, enum side side, int x)
 	if (g->over || g->turn != side || x < 0 || x >= g->width) {
 		return -1;
 	}
-	for (y = 0; y < g->height; ++y) {
-		if (g->fields[x][y] == SIDE_NONE) {
-			break;
-		}
-	}
+	y = g->heights[x];
 	if (y >= g->height) {
 		return -1;
 	}
-	g->fields[x][y] = side;
+	g->cells[x * g->height + y] = side;
+	toggle_disc(g, x, y, side);
+	++g->heights[x];
+	g->history[g->moves++] = x;
 	g->turn = side == SIDE_RED ? SIDE_BLUE : SIDE_RED;
-	if (is_connected(g, x, y)) {
+	if (g->is_connected(g, x, y)) {
 		g->over = 1;
 		g->winner = side;
 	} else if (is_full(g)) {
 		g->over = 1;
 		g->winner = SIDE_NONE;
 	}
-	g->last_x = x;
-	g->last_y = y;
 	return y;
 }
 
+int game_wins(struct game *g, enum side side, int x)
+{
+	int y = g->heights[x], res;
+	if (y >= g->height) {
+		return 0;
+	}
+	g->cells[x * g->height + y] = side;
+	res = g->is_connected(g, x, y);
+	g->cells[x * g->height + y] = SIDE_NONE;
+	return res;
+}
+
 int game_undo(struct game *g, enum side side, int *x, int *y)
 {
-	if (g->over || g->turn == side || g->last_x < 0 || g->last_y < 0) {
+	int lx;
+	if (g->over || g->turn == side || g->moves == 0) {
 		return -1;
 	}
 	if ((side == SIDE_RED && g->red_undos == 0)
@@ -129,11 +224,12 @@ int game_undo(struct game *g, enum side side, int *x, int *y)
 	{
 		return -1;
 	}
-	g->fields[g->last_x][g->last_y] = SIDE_NONE;
-	*x = g->last_x;
-	*y = g->last_y;
-	g->last_x = -1;
-	g->last_y = -1;
+	lx = g->history[--g->moves];
+	--g->heights[lx];
+	toggle_disc(g, lx, g->heights[lx], side);
+	g->cells[lx * g->height + g->heights[lx]] = SIDE_NONE;
+	*x = lx;
+	*y = g->heights[lx];
 	if (side == SIDE_RED) {
 		--g->red_undos;
 	} else {
@@ -142,3 +238,42 @@ int game_undo(struct game *g, enum side side, int *x, int *y)
 	g->turn = side;
 	return 0;
 }
+
+int game_resign(struct game *g, enum side side)
+{
+	if (g->over) {
+		return -1;
+	}
+	g->over = 1;
+	g->winner = side == SIDE_RED ? SIDE_BLUE : SIDE_RED;
+	return 0;
+}
+
+int game_takeback(struct game *g)
+{
+	int x, y;
+	enum side side;
+	if (g->moves == 0) {
+		return -1;
+	}
+	x = g->history[--g->moves];
+	y = --g->heights[x];
+	side = g->cells[x * g->height + y];
+	toggle_disc(g, x, y, side);
+	g->cells[x * g->height + y] = SIDE_NONE;
+	g->turn = side;
+	g->over = 0;
+	g->winner = SIDE_NONE;
+	return 0;
+}
+
+uint64_t game_canonical_hash(const struct game *g, int *mirrored)
+{
+	*mirrored = g->mirror_hash < g->hash;
+	return *mirrored ? g->mirror_hash : g->hash;
+}
+
+const unsigned char *game_history(struct game *g)
+{
+	return g->history;
+}
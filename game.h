@@ -1,11 +1,47 @@
 #pragma once
 
+#include <stdint.h>
+
 #include "side.h"
 
+// Columns are recorded in the move history as single bytes, and the journal
+// keeps each of the dimensions in a byte.
+#define GAME_MAX_WIDTH 255
+#define GAME_MAX_HEIGHT 255
+#define GAME_MAX_LINE_LENGTH 255
+
+struct game_rules {
+	int width;
+	int height;
+	// number of discs in a line needed to win
+	int line_length;
+	// undos available to each player
+	int undos;
+};
+
 struct game {
-	enum side **fields;
+	// The board is kept in a single allocation. cells holds width columns
+	// of height fields each, the field (x, y) lives at cells[x * height + y].
+	// heights holds the number of discs in each column and points
+	// into the same allocation, right before the cells.
+	signed char *cells;
+	int *heights;
 	int width;
 	int height;
+	int line_length;
+	// checks whether the disc at (x, y) is a part of a line, picked
+	// by game_init depending on the rules
+	int (*is_connected)(struct game *g, int x, int y);
+	// number of discs on the board
+	int moves;
+	// columns of all moves played so far, in order. Also lives in the board's
+	// allocation and has room for every field, so moves never allocate.
+	unsigned char *history;
+	// Zobrist hashes of the position and of its mirror image, updated
+	// with every move and undo. They only depend on the discs on the
+	// board and are the same in every process.
+	uint64_t hash;
+	uint64_t mirror_hash;
 
 	enum side turn;
 	int over;
@@ -13,14 +49,62 @@ struct game {
 
 	int red_undos;
 	int blue_undos;
-	int last_x;
-	int last_y;
 };
 
-int game_init(struct game *g, int width, int height);
+/* Initializes the game. Returns 0 on success and -1 if the rules
+ * are invalid or if the allocation fails.
+ */
+int game_init(struct game *g, const struct game_rules *rules);
+
+/* Returns 0 if a game can be played with the given rules and -1 otherwise.
+ */
+int game_rules_check(const struct game_rules *rules);
 
 void game_finalize(struct game *g);
 
+/* Copies the state of src to dst without allocating. Both games must have
+ * been initialized with the same rules.
+ */
+void game_copy(struct game *dst, const struct game *src);
+
+/* Returns the contents of the field (x, y). Rows are counted from the bottom.
+ */
+enum side game_get(struct game *g, int x, int y);
+
 int game_drop(struct game *g, enum side side, int x);
 
+/* Returns 1 if a disc of the given side dropped into column x would
+ * complete a line and 0 otherwise, including when the column is full.
+ * The game is left unchanged.
+ */
+int game_wins(struct game *g, enum side side, int x);
+
+/* Takes back the last move, which must have been made by the given side.
+ * Since the moves alternate, repeated undos by both players walk back
+ * through the whole history, as long as their undo budgets last.
+ */
 int game_undo(struct game *g, enum side side, int *x, int *y);
+
+/* Ends the game with a loss for the given side, the board stays as it is.
+ * Returns -1 if the game is already over and 0 otherwise.
+ */
+int game_resign(struct game *g, enum side side);
+
+/* Returns a hash that is the same for the position and its mirror image,
+ * so that tables keyed with it need to hold only one of them. *mirrored
+ * is set to 1 if the position is the mirror image of the one the hash
+ * stands for, then its columns should be flipped (x -> width - 1 - x)
+ * when looking up moves, and to 0 otherwise.
+ */
+uint64_t game_canonical_hash(const struct game *g, int *mirrored);
+
+/* Takes back the last move regardless of the undo budgets, even if it
+ * ended the game. Meant for searches that walk the game tree.
+ * Returns -1 if there are no moves and 0 otherwise.
+ */
+int game_takeback(struct game *g);
+
+/* Returns the columns of all moves played so far. The array holds
+ * g->moves entries and stays valid until the next move or undo.
+ */
+const unsigned char *game_history(struct game *g);
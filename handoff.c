@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+// most descriptors the kernel takes in a single message
+#define MAX_BATCH 253
+
+static int make_address(const char *path, struct sockaddr_un *addr)
+{
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int handoff_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+	if (make_address(path, &addr) < 0) {
+		return -1;
+	}
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		return -1;
+	}
+	if (unlink(path) < 0 && errno != ENOENT) {
+		goto error;
+	}
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| listen(sock, 1) < 0)
+	{
+		goto error;
+	}
+	return sock;
+error:
+	close(sock);
+	return -1;
+}
+
+int handoff_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+	if (make_address(path, &addr) < 0) {
+		return -1;
+	}
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+int handoff_send(int sock, const char *data, size_t len)
+{
+	ssize_t n;
+	while (len > 0) {
+		// the new server may die, which must not kill the old one
+		n = send(sock, data, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int recv_all(int sock, char *data, size_t len)
+{
+	ssize_t n;
+	while (len > 0) {
+		n = recv(sock, data, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			if (n == 0) {
+				errno = ECONNRESET;
+			}
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int handoff_send_fds(int sock, const int *fds, int nfds)
+{
+	union {
+		char buf[CMSG_SPACE(MAX_BATCH * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char header[8 + 4], byte = 0;
+	uint32_t count = nfds;
+	int batch;
+	memcpy(header, HANDOFF_MAGIC, 8);
+	memcpy(header + 8, &count, 4);
+	if (handoff_send(sock, header, sizeof(header)) < 0) {
+		return -1;
+	}
+	while (nfds > 0) {
+		batch = nfds < MAX_BATCH ? nfds : MAX_BATCH;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, batch * sizeof(int));
+		if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1) {
+			return -1;
+		}
+		fds += batch;
+		nfds -= batch;
+	}
+	return 0;
+}
+
+/* Closes the descriptors passed with a message that is rejected, in every
+ * control message of it that has arrived.
+ */
+static void close_passed(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	size_t i, n;
+	int fd;
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; ++i) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			close(fd);
+		}
+	}
+}
+
+int handoff_recv_fds(int sock, int **fds, int *nfds)
+{
+	union {
+		char buf[CMSG_SPACE(MAX_BATCH * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char header[8 + 4], byte;
+	uint32_t count;
+	int received = 0, batch;
+	*fds = NULL;
+	if (recv_all(sock, header, sizeof(header)) < 0) {
+		return -1;
+	}
+	memcpy(&count, header + 8, 4);
+	if (memcmp(header, HANDOFF_MAGIC, 8) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	// + 1 so that the allocation is never empty
+	*fds = malloc((count + 1) * sizeof(int));
+	if (!*fds) {
+		return -1;
+	}
+	while (received < count) {
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if (recvmsg(sock, &msg, 0) != 1) {
+			goto error;
+		}
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+				|| cmsg->cmsg_type != SCM_RIGHTS
+				|| (msg.msg_flags & MSG_CTRUNC)
+				|| CMSG_NXTHDR(&msg, cmsg))
+		{
+			close_passed(&msg);
+			errno = EINVAL;
+			goto error;
+		}
+		batch = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (batch > count - received) {
+			close_passed(&msg);
+			errno = EINVAL;
+			goto error;
+		}
+		memcpy(*fds + received, CMSG_DATA(cmsg), batch * sizeof(int));
+		received += batch;
+	}
+	*nfds = count;
+	return 0;
+error:
+	while (received > 0) {
+		close((*fds)[--received]);
+	}
+	free(*fds);
+	*fds = NULL;
+	return -1;
+}
+
+int handoff_recv(int sock, char **data, size_t *len)
+{
+	size_t cap = 65536;
+	ssize_t n;
+	char *tmp;
+	*len = 0;
+	*data = malloc(cap);
+	if (!*data) {
+		return -1;
+	}
+	while (1) {
+		if (*len == cap) {
+			tmp = realloc(*data, cap * 2);
+			if (!tmp) {
+				goto error;
+			}
+			*data = tmp;
+			cap *= 2;
+		}
+		n = recv(sock, *data + *len, cap - *len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			goto error;
+		}
+		if (n == 0) {
+			return 0;
+		}
+		*len += n;
+	}
+error:
+	free(*data);
+	*data = NULL;
+	return -1;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+
+/* This module hands the sockets of a running server over to a new process,
+ * so that the server can be upgraded without dropping its connections.
+ *
+ * The old server listens on a Unix socket. The new one connects to it and
+ * the old one sends the magic "FOURHAND" and the number of file descriptors
+ * as a 32-bit number, then the descriptors themselves with SCM_RIGHTS,
+ * in batches attached to a single byte each. Whatever is sent after them
+ * is up to the server, it is read until the old server closes
+ * the connection.
+ */
+
+#define HANDOFF_MAGIC "FOURHAND"
+
+/* Creates the socket on which the server waits for its successor,
+ * replacing a stale socket at path. Returns the socket or -1 on failure.
+ */
+int handoff_listen(const char *path);
+
+/* Connects to the server waiting at path. Returns the connection or -1
+ * on failure, errno is ENOENT or ECONNREFUSED if no server is waiting.
+ */
+int handoff_connect(const char *path);
+
+/* Sends the file descriptors, they stay open in this process as well.
+ * Returns 0 on success and -1 on failure.
+ */
+int handoff_send_fds(int sock, const int *fds, int nfds);
+
+/* Receives the file descriptors sent by handoff_send_fds into an array
+ * allocated with malloc. Returns 0 on success and -1 on failure.
+ */
+int handoff_recv_fds(int sock, int **fds, int *nfds);
+
+/* Sends len bytes of data. Returns 0 on success and -1 on failure.
+ */
+int handoff_send(int sock, const char *data, size_t len);
+
+/* Reads the rest of the data until the connection is closed into memory
+ * allocated with malloc. Returns 0 on success and -1 on failure.
+ */
+int handoff_recv(int sock, char **data, size_t *len);
@@ -14,6 +14,11 @@ static unsigned long hash(unsigned char *data, size_t len)
 	for (i = 0; i < len; ++i) {
 		hash = (hash * 33) ^ data[i];
 	}
+	// the index is taken modulo a power of two, so the high bits are mixed
+	// into the low ones, keys that differ only at the end would cluster
+	hash ^= hash >> 17;
+	hash *= 2654435761UL;
+	hash ^= hash >> 15;
 	return hash;
 }
 
@@ -204,3 +209,17 @@ int hashmap_contains(struct hashmap *h, void *key)
 	void *tmp;
 	return hashmap_get(h, key, &tmp) == 0;
 }
+
+int hashmap_foreach(struct hashmap *h, int (*fn)(void *key, void *value, void *ctx),
+		void *ctx)
+{
+	size_t i;
+	for (i = 0; i < h->nbuckets; ++i) {
+		if (h->buckets[i].taken
+				&& fn(h->buckets[i].key, h->buckets[i].value, ctx) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -61,3 +61,10 @@ int hashmap_get(struct hashmap *h, void *key, void **valueptr);
 /* Returns 1 if hashmap contains the key and 0 if it doesn't.
  */
 int hashmap_contains(struct hashmap *h, void *key);
+
+/* Calls fn for every entry of the hashmap, in no particular order, until fn
+ * returns -1. The hashmap must not be modified by fn. Returns 0 on success
+ * and -1 if fn has stopped.
+ */
+int hashmap_foreach(struct hashmap *h, int (*fn)(void *key, void *value, void *ctx),
+		void *ctx);
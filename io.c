@@ -0,0 +1,539 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "io.h"
+#include "buffer.h"
+
+// number of items each ring holds
+#define IO_RING_SIZE 4096
+#define IO_MAX_EVENTS 64
+#define IO_MAX_READ 4096
+#define IO_MAX_WRITE 4096
+
+struct io_conn {
+	int sock;
+	uint64_t id;
+	// set while the output is above the high watermark, the socket
+	// is not read from until it drains to the low one
+	int paused;
+	// the value of paused the loop was last told about
+	int told_paused;
+	// set once the connection has ended, and once the loop was told
+	int ended;
+	int told_ended;
+	// set while the connection is on the ready list, and the neighbours
+	int ready;
+	struct io_conn *ready_prev;
+	struct io_conn *ready_next;
+	struct buffer input;
+	struct buffer output;
+};
+
+static struct io_conn *conn_new(int sock, uint64_t id)
+{
+	struct io_conn *c = malloc(sizeof(*c));
+	if (!c) {
+		return NULL;
+	}
+	c->sock = sock;
+	c->id = id;
+	c->paused = c->told_paused = 0;
+	c->ended = c->told_ended = 0;
+	c->ready = 0;
+	c->ready_prev = c->ready_next = NULL;
+	buffer_init(&c->input);
+	buffer_init(&c->output);
+	return c;
+}
+
+static void conn_free(void *arg)
+{
+	struct io_conn *c = arg;
+	close(c->sock);
+	buffer_finalize(&c->input);
+	buffer_finalize(&c->output);
+	free(c);
+}
+
+/* Watches the socket for reading unless the connection is paused or has
+ * messages left, and for writing while there is some output.
+ */
+static int conn_poll(struct io_thread *io, struct io_conn *c)
+{
+	struct epoll_event event = {0};
+	if (c->ended) {
+		return 0;
+	}
+	if (!c->paused && !c->ready) {
+		event.events |= EPOLLIN;
+	}
+	if (buffer_len(&c->output) > 0) {
+		event.events |= EPOLLOUT;
+	}
+	event.data.fd = c->sock;
+	return epoll_ctl(io->epoll, EPOLL_CTL_MOD, c->sock, &event);
+}
+
+static void ready_remove(struct io_thread *io, struct io_conn *c)
+{
+	if (!c->ready) {
+		return;
+	}
+	if (c->ready_prev) {
+		c->ready_prev->ready_next = c->ready_next;
+	} else {
+		io->ready_head = c->ready_next;
+	}
+	if (c->ready_next) {
+		c->ready_next->ready_prev = c->ready_prev;
+	} else {
+		io->ready_tail = c->ready_prev;
+	}
+	c->ready_prev = c->ready_next = NULL;
+	c->ready = 0;
+}
+
+static void ready_append(struct io_thread *io, struct io_conn *c)
+{
+	c->ready = 1;
+	c->ready_prev = io->ready_tail;
+	c->ready_next = NULL;
+	if (io->ready_tail) {
+		io->ready_tail->ready_next = c;
+	} else {
+		io->ready_head = c;
+	}
+	io->ready_tail = c;
+}
+
+/* Puts the connection on the ready list, if it isn't on it, so that
+ * the loop is told about the change at its next turn.
+ */
+static void conn_changed(struct io_thread *io, struct io_conn *c)
+{
+	if (!c->ready) {
+		ready_append(io, c);
+	}
+}
+
+/* Stops serving the connection, the socket stays open until the loop
+ * closes it.
+ */
+static void conn_end(struct io_thread *io, struct io_conn *c)
+{
+	if (c->ended) {
+		return;
+	}
+	c->ended = 1;
+	epoll_ctl(io->epoll, EPOLL_CTL_DEL, c->sock, NULL);
+	conn_changed(io, c);
+}
+
+/* Notes that the output of a connection went from before to after bytes,
+ * the loop reads the totals with io_output.
+ */
+static void output_changed(struct io_thread *io, size_t before, size_t after)
+{
+	size_t buffered = __atomic_load_n(&io->buffered, __ATOMIC_RELAXED);
+	__atomic_store_n(&io->buffered, buffered + after - before, __ATOMIC_RELAXED);
+	if (after > __atomic_load_n(&io->buffered_max, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&io->buffered_max, after, __ATOMIC_RELAXED);
+	}
+}
+
+/* Pushes an item for the loop, the caller has made sure there is room.
+ */
+static void post(struct io_thread *io, struct io_conn *c, enum io_type type,
+		struct message *msg)
+{
+	struct io_item item;
+	item.type = type;
+	item.sock = c->sock;
+	item.id = c->id;
+	item.len = buffer_len(&c->output);
+	if (msg) {
+		item.msg = *msg;
+	} else {
+		item.msg.type = MSG_INVALID;
+	}
+	ring_push(&io->out, &item);
+	io->posted = 1;
+}
+
+/* Passes at most io->cfg.budget of the connection's messages to the loop,
+ * after the changes of its output, and then its end. Returns 0 on success
+ * and -1 if the ring to the loop is full, the connection then waits for
+ * the next turn.
+ */
+static int conn_serve(struct io_thread *io, struct io_conn *c)
+{
+	struct message msg;
+	int i, n, handled;
+	int was_ready = c->ready, full = 0;
+	ready_remove(io, c);
+	if (c->paused != c->told_paused) {
+		if (ring_full(&io->out)) {
+			full = 1;
+			goto out;
+		}
+		post(io, c, c->paused ? IO_PAUSED : IO_RESUMED, NULL);
+		c->told_paused = c->paused;
+	}
+	for (handled = 0; handled < io->cfg.budget; ++handled) {
+		if (ring_full(&io->out)) {
+			full = 1;
+			goto out;
+		}
+		if ((n = parse_message(&c->input, &msg)) == 0) {
+			break;
+		}
+		// the other threads print too, keep the line together
+		flockfile(stdout);
+		if (n < 0) {
+			n = -n;
+			printf("invalid message: ");
+			msg.type = MSG_INVALID;
+		} else {
+			printf("message: ");
+		}
+		for (i = 0; i < n; ++i) {
+			printf("%c", buffer_get(&c->input, i));
+		}
+		funlockfile(stdout);
+		post(io, c, IO_MESSAGE, &msg);
+		buffer_pop(&c->input, NULL, n);
+	}
+	if (handled == io->cfg.budget) {
+		// there may be more, the next turn finds out
+		ready_append(io, c);
+	} else if (c->ended && !c->told_ended) {
+		if (ring_full(&io->out)) {
+			full = 1;
+			goto out;
+		}
+		post(io, c, IO_CLOSED, NULL);
+		c->told_ended = 1;
+	}
+out:
+	if (full) {
+		ready_append(io, c);
+	}
+	if (c->ready != was_ready) {
+		conn_poll(io, c);
+	}
+	return full ? -1 : 0;
+}
+
+static void conn_read(struct io_thread *io, struct io_conn *c)
+{
+	char buf[IO_MAX_READ];
+	int n = read(c->sock, buf, sizeof(buf));
+	// the loop learns about the errors as the end of the connection
+	if (n <= 0 || buffer_push(&c->input, buf, n) < 0) {
+		conn_end(io, c);
+		return;
+	}
+	if (!c->ready) {
+		ready_append(io, c);
+		conn_poll(io, c);
+	}
+}
+
+static void conn_write(struct io_thread *io, struct io_conn *c)
+{
+	char buf[IO_MAX_WRITE];
+	size_t len = buffer_len(&c->output);
+	int n;
+	if (len > sizeof(buf)) {
+		len = sizeof(buf);
+	}
+	buffer_peek(&c->output, buf, len);
+	n = write(c->sock, buf, len);
+	if (n < 0) {
+		conn_end(io, c);
+		return;
+	}
+	buffer_pop(&c->output, NULL, n);
+	output_changed(io, buffer_len(&c->output) + n, buffer_len(&c->output));
+	if (c->paused && buffer_len(&c->output) <= io->cfg.low_water) {
+		c->paused = 0;
+		conn_changed(io, c);
+		conn_poll(io, c);
+	} else if (buffer_len(&c->output) == 0) {
+		conn_poll(io, c);
+	}
+}
+
+static void conn_send(struct io_thread *io, struct io_conn *c,
+		struct message *msg)
+{
+	size_t len = buffer_len(&c->output);
+	int res = format_message(msg, &c->output);
+	close_message(msg);
+	if (res < 0) {
+		conn_end(io, c);
+		return;
+	}
+	output_changed(io, len, buffer_len(&c->output));
+	// the loop logs the pause once it's told
+	if (!c->paused && buffer_len(&c->output) > io->cfg.high_water) {
+		c->paused = 1;
+		conn_changed(io, c);
+		conn_poll(io, c);
+	} else if (len == 0) {
+		conn_poll(io, c);
+	}
+}
+
+/* Handles the items from the loop, at most a ring of them so that
+ * the loop soon learns about the paused connections.
+ */
+static void io_commands(struct io_thread *io)
+{
+	struct io_item item;
+	struct io_conn *c;
+	struct epoll_event event = {0};
+	int n;
+	for (n = 0; n < IO_RING_SIZE && ring_pop(&io->in, &item) == 0; ++n) {
+		if (item.type == IO_ADOPT) {
+			c = conn_new(item.sock, item.id);
+			if (!c || hashmap_insert(&io->conns,
+						(void *)(intptr_t)item.sock, c) < 0)
+			{
+				// the socket is closed with IO_CLOSE
+				free(c);
+				continue;
+			}
+			event.events = EPOLLIN;
+			event.data.fd = item.sock;
+			if (epoll_ctl(io->epoll, EPOLL_CTL_ADD, item.sock, &event) < 0) {
+				conn_end(io, c);
+			}
+			continue;
+		}
+		if (hashmap_get(&io->conns, (void *)(intptr_t)item.sock,
+					(void **)&c) < 0 || c->id != item.id)
+		{
+			c = NULL;
+		}
+		if (item.type == IO_SEND) {
+			if (c && !c->ended) {
+				conn_send(io, c, &item.msg);
+			} else {
+				close_message(&item.msg);
+			}
+		} else if (item.type == IO_CLOSE) {
+			if (c) {
+				ready_remove(io, c);
+				output_changed(io, buffer_len(&c->output), 0);
+				hashmap_remove(&io->conns, (void *)(intptr_t)item.sock);
+			} else if (!hashmap_contains(&io->conns,
+						(void *)(intptr_t)item.sock))
+			{
+				// it was never adopted
+				close(item.sock);
+			}
+		}
+	}
+}
+
+/* Gives a turn to every connection that was on the ready list when it
+ * started, until the ring to the loop is full.
+ */
+static void io_serve(struct io_thread *io)
+{
+	struct io_conn *c, *last = io->ready_tail;
+	int done = last == NULL;
+	while (!done) {
+		c = io->ready_head;
+		done = c == last;
+		if (conn_serve(io, c) < 0) {
+			// the loop wakes us up once it makes room, unless it already has
+			__atomic_store_n(&io->blocked, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (!ring_full(&io->out)) {
+				__atomic_store_n(&io->blocked, 0, __ATOMIC_RELAXED);
+			}
+			return;
+		}
+	}
+}
+
+static void *io_run(void *arg)
+{
+	struct io_thread *io = arg;
+	struct epoll_event events[IO_MAX_EVENTS];
+	struct io_conn *c;
+	uint64_t value = 1;
+	int nfds, i;
+	// the memory the thread allocates from here on is local to the CPU
+	if (io->cfg.cpu >= 0 && cpu_pin(io->cfg.cpu) < 0) {
+		perror("failed to pin an I/O thread");
+	}
+	while (!__atomic_load_n(&io->stop, __ATOMIC_ACQUIRE)) {
+		// the commands left from the last round go on right away
+		nfds = epoll_wait(io->epoll, events, IO_MAX_EVENTS,
+				!ring_empty(&io->in) || (io->ready_head
+					&& !__atomic_load_n(&io->blocked, __ATOMIC_RELAXED))
+				? 0 : cpu_spin_timeout(&io->spin, -1));
+		if (nfds < 0 && errno != EINTR) {
+			perror("I/O thread");
+			break;
+		}
+		cpu_spin_events(&io->spin, nfds);
+		for (i = 0; i < nfds; ++i) {
+			if (events[i].data.fd == io->wake) {
+				if (read(io->wake, &value, sizeof(value)) < 0) {
+					errno = 0;
+				}
+				continue;
+			}
+			if (hashmap_get(&io->conns, (void *)(intptr_t)events[i].data.fd,
+						(void **)&c) < 0)
+			{
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				conn_read(io, c);
+			}
+			if (events[i].events & EPOLLOUT && !c->ended) {
+				conn_write(io, c);
+			}
+		}
+		io_commands(io);
+		io_serve(io);
+		if (io->posted) {
+			io->posted = 0;
+			value = 1;
+			if (write(io->notify, &value, sizeof(value)) < 0) {
+				errno = 0;
+			}
+		}
+	}
+	return NULL;
+}
+
+int io_start(struct io_thread *io, int notify, const struct io_config *cfg)
+{
+	struct epoll_event event = {0};
+	io->notify = notify;
+	io->cfg = *cfg;
+	cpu_spin_init(&io->spin, cfg->spin);
+	io->blocked = io->pushed = io->posted = io->stop = 0;
+	io->buffered = io->buffered_max = 0;
+	io->ready_head = io->ready_tail = NULL;
+	io->epoll = epoll_create1(0);
+	if (io->epoll < 0) {
+		return -1;
+	}
+	io->wake = eventfd(0, EFD_NONBLOCK);
+	if (io->wake < 0) {
+		goto error_epoll;
+	}
+	event.events = EPOLLIN;
+	event.data.fd = io->wake;
+	if (epoll_ctl(io->epoll, EPOLL_CTL_ADD, io->wake, &event) < 0) {
+		goto error_wake;
+	}
+	// the pages of a ring are first written by its producer, so they end up
+	// on the producer's node
+	if (ring_init(&io->in, IO_RING_SIZE, sizeof(struct io_item)) < 0) {
+		goto error_wake;
+	}
+	if (ring_init(&io->out, IO_RING_SIZE, sizeof(struct io_item)) < 0) {
+		goto error_in;
+	}
+	hashmap_init(&io->conns, &hashmap_ptr_equals, &hashmap_ptr_hash,
+			NULL, &conn_free);
+	if (pthread_create(&io->thread, NULL, io_run, io) != 0) {
+		hashmap_finalize(&io->conns);
+		ring_finalize(&io->out);
+		goto error_in;
+	}
+	return 0;
+error_in:
+	ring_finalize(&io->in);
+error_wake:
+	close(io->wake);
+error_epoll:
+	close(io->epoll);
+	return -1;
+}
+
+void io_stop(struct io_thread *io)
+{
+	struct io_item item;
+	uint64_t value = 1;
+	__atomic_store_n(&io->stop, 1, __ATOMIC_RELEASE);
+	if (write(io->wake, &value, sizeof(value)) < 0) {
+		errno = 0;
+	}
+	pthread_join(io->thread, NULL);
+	// the sockets that were still being adopted or closed
+	while (!ring_empty(&io->in)) {
+		io_commands(io);
+	}
+	while (ring_pop(&io->out, &item) == 0) {
+		close_message(&item.msg);
+	}
+	hashmap_finalize(&io->conns);
+	ring_finalize(&io->in);
+	ring_finalize(&io->out);
+	close(io->wake);
+	close(io->epoll);
+}
+
+void io_send(struct io_thread *io, const struct io_item *item)
+{
+	while (ring_push(&io->in, item) < 0) {
+		// the thread makes room once it's awake
+		io->pushed = 1;
+		io_flush(io);
+		sched_yield();
+	}
+	io->pushed = 1;
+}
+
+void io_flush(struct io_thread *io)
+{
+	uint64_t value = 1;
+	if (!io->pushed) {
+		return;
+	}
+	io->pushed = 0;
+	if (write(io->wake, &value, sizeof(value)) < 0) {
+		errno = 0;
+	}
+}
+
+void io_output(struct io_thread *io, size_t *buffered, size_t *max)
+{
+	size_t thread_max = __atomic_load_n(&io->buffered_max, __ATOMIC_RELAXED);
+	*buffered += __atomic_load_n(&io->buffered, __ATOMIC_RELAXED);
+	if (thread_max > *max) {
+		*max = thread_max;
+	}
+}
+
+int io_receive(struct io_thread *io, struct io_item *item)
+{
+	uint64_t value = 1;
+	if (ring_pop(&io->out, item) == 0) {
+		return 0;
+	}
+	// the ring is empty, so a thread waiting for room may go on
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&io->blocked, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&io->blocked, 0, __ATOMIC_RELAXED);
+		if (write(io->wake, &value, sizeof(value)) < 0) {
+			errno = 0;
+		}
+	}
+	return -1;
+}
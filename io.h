@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "hashmap.h"
+#include "protocol.h"
+#include "ring.h"
+#include "cpu.h"
+
+/* This module implements the I/O threads of the staged server. Each thread
+ * owns the sockets of some of the clients: it reads and parses their
+ * messages and formats and writes the messages for them, while the server's
+ * loop, the logic thread, handles the messages and owns the games, the names
+ * and the queue. A thread and the loop talk through a pair of rings of
+ * decoded messages and wake each other with eventfds.
+ *
+ * The sockets are closed by the threads, and only when the loop says so,
+ * so a socket isn't reused while the loop still knows it.
+ */
+
+enum io_type {
+	// from the loop: start serving the socket
+	IO_ADOPT,
+	// from the loop: send the message
+	IO_SEND,
+	// from the loop: forget the connection and close the socket
+	IO_CLOSE,
+	// to the loop: a message from the client, MSG_INVALID if it couldn't
+	// be parsed
+	IO_MESSAGE,
+	// to the loop: the client's output went above the high watermark,
+	// and it drained to the low one
+	IO_PAUSED,
+	IO_RESUMED,
+	// to the loop: the connection has ended, answered with IO_CLOSE
+	IO_CLOSED,
+};
+
+struct io_item {
+	enum io_type type;
+	int sock;
+	// tells the connection apart from the earlier ones with the same socket
+	uint64_t id;
+	// to the loop: the bytes in the client's output when the item was pushed
+	size_t len;
+	// owned by whoever pops the item
+	struct message msg;
+};
+
+struct io_conn;
+
+struct io_config {
+	// most messages of a connection parsed at a time
+	int budget;
+	// reading from a connection stops while its output is above high_water
+	// bytes, until it drains to low_water
+	size_t high_water;
+	size_t low_water;
+	// the CPU the thread is pinned to, -1 if it isn't pinned
+	int cpu;
+	// microseconds the thread polls after an event, see cpu.h
+	int spin;
+};
+
+struct io_thread {
+	// these should be treated as private
+	pthread_t thread;
+	int epoll;
+	// eventfd waking the thread for the items from the loop
+	int wake;
+	// eventfd of the loop, written once items for it are pushed
+	int notify;
+	// items from the loop and to it
+	struct ring in;
+	struct ring out;
+	// set by the thread while out is full, the loop wakes it up once
+	// there is room again
+	int blocked;
+	// set once the loop has pushed items since the last io_flush
+	int pushed;
+	// set once the thread has pushed items since it last woke the loop
+	int posted;
+	// the connections by socket, maps int to struct io_conn
+	struct hashmap conns;
+	// the connections with messages left after their turn, served in turns
+	struct io_conn *ready_head;
+	struct io_conn *ready_tail;
+	struct io_config cfg;
+	struct cpu_spin spin;
+	// bytes in the output of all the connections and the most the output
+	// of one has held, written by the thread and read by the loop
+	size_t buffered;
+	size_t buffered_max;
+	int stop;
+};
+
+/* Starts a thread that wakes the loop with the eventfd notify.
+ * Returns 0 on success and -1 on failure.
+ */
+int io_start(struct io_thread *io, int notify, const struct io_config *cfg);
+
+/* Stops the thread and closes the sockets it still has.
+ */
+void io_stop(struct io_thread *io);
+
+/* Pushes the item for the thread, waiting while the ring is full. The thread
+ * owns the message from then on. Called by the loop.
+ */
+void io_send(struct io_thread *io, const struct io_item *item);
+
+/* Wakes the thread up if something was pushed for it since the last call.
+ * Called by the loop.
+ */
+void io_flush(struct io_thread *io);
+
+/* Adds the bytes in the output of the thread's connections to *buffered
+ * and raises *max to the most the output of one of them has held.
+ * Called by the loop.
+ */
+void io_output(struct io_thread *io, size_t *buffered, size_t *max);
+
+/* Pops the next item from the thread. Returns 0 on success and -1 if there
+ * are none. Called by the loop.
+ */
+int io_receive(struct io_thread *io, struct io_item *item);
@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "journal.h"
+
+// the length of a record without the names and the moves
+#define RECORD_FIXED (4 + 8 + 8 + 4 + 2 + 2 + 2)
+#define MAX_NAME 0xffff
+#define MAX_MOVES 0xffff
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void *writer(void *arg)
+{
+	struct journal *j = arg;
+	struct journal_chunk chunk;
+	int failed;
+	pthread_mutex_lock(&j->lock);
+	while (1) {
+		while (!j->stop && j->pending.len == 0) {
+			pthread_cond_wait(&j->cond, &j->lock);
+		}
+		if (j->pending.len == 0) {
+			break;
+		}
+		// take everything appended so far, the loop keeps appending
+		// to the other chunk while this one is written
+		chunk = j->pending;
+		j->pending = j->writing;
+		j->writing = chunk;
+		pthread_mutex_unlock(&j->lock);
+
+		failed = write_all(j->fd, j->writing.data, j->writing.len) < 0
+			|| fdatasync(j->fd) < 0;
+
+		pthread_mutex_lock(&j->lock);
+		if (failed) {
+			j->failed = 1;
+		}
+		j->writing.len = 0;
+	}
+	pthread_mutex_unlock(&j->lock);
+	return NULL;
+}
+
+/* Maps the journal and checks its magic. An empty file is mapped as NULL.
+ * Returns 0 on success and -1 on failure.
+ */
+static int map_journal(int fd, const char **data, size_t *size)
+{
+	struct stat st;
+	void *addr;
+	if (fstat(fd, &st) < 0) {
+		return -1;
+	}
+	*size = st.st_size;
+	*data = NULL;
+	if (*size == 0) {
+		return 0;
+	}
+	addr = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		return -1;
+	}
+	*data = addr;
+	if (*size < 8 || memcmp(*data, JOURNAL_MAGIC, 8) != 0) {
+		munmap(addr, *size);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int journal_open(struct journal *j, const char *path)
+{
+	struct journal_game game;
+	const char *data;
+	size_t size, end, len;
+	j->fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644);
+	if (j->fd < 0) {
+		return -1;
+	}
+	if (map_journal(j->fd, &data, &size) < 0) {
+		goto error;
+	}
+	if (size == 0) {
+		if (write_all(j->fd, JOURNAL_MAGIC, 8) < 0 || fdatasync(j->fd) < 0) {
+			goto error;
+		}
+	} else {
+		// cut off the record the last run didn't finish writing
+		end = 8;
+		while ((len = journal_parse(data + end, size - end, &game)) > 0) {
+			end += len;
+		}
+		munmap((void *)data, size);
+		if (end < size && ftruncate(j->fd, end) < 0) {
+			goto error;
+		}
+	}
+	memset(&j->pending, 0, sizeof(j->pending));
+	memset(&j->writing, 0, sizeof(j->writing));
+	j->stop = 0;
+	j->failed = 0;
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->cond, NULL);
+	if (pthread_create(&j->thread, NULL, writer, j) != 0) {
+		pthread_mutex_destroy(&j->lock);
+		pthread_cond_destroy(&j->cond);
+		goto error;
+	}
+	return 0;
+error:
+	close(j->fd);
+	return -1;
+}
+
+int journal_close(struct journal *j)
+{
+	int res;
+	pthread_mutex_lock(&j->lock);
+	j->stop = 1;
+	pthread_cond_signal(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+	pthread_join(j->thread, NULL);
+	res = j->failed ? -1 : 0;
+	if (close(j->fd) < 0) {
+		res = -1;
+	}
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->cond);
+	free(j->pending.data);
+	free(j->writing.data);
+	return res;
+}
+
+static int chunk_reserve(struct journal_chunk *c, size_t len)
+{
+	char *data;
+	size_t cap = c->cap ? c->cap : 4096;
+	while (cap < c->len + len) {
+		cap *= 2;
+	}
+	if (cap != c->cap) {
+		data = realloc(c->data, cap);
+		if (!data) {
+			return -1;
+		}
+		c->data = data;
+		c->cap = cap;
+	}
+	return 0;
+}
+
+size_t journal_record_size(const struct journal_game *game)
+{
+	if (game->red_len > MAX_NAME || game->blue_len > MAX_NAME
+			|| game->moves > MAX_MOVES)
+	{
+		return 0;
+	}
+	return RECORD_FIXED + game->red_len + game->blue_len + game->moves;
+}
+
+static char *put(char *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+	return dst + len;
+}
+
+void journal_encode(const struct journal_game *game, char *dst)
+{
+	uint32_t len = journal_record_size(game) - 4;
+	uint16_t red_len = game->red_len, blue_len = game->blue_len;
+	uint16_t moves = game->moves;
+	unsigned char dims[4];
+	dims[0] = game->width;
+	dims[1] = game->height;
+	dims[2] = game->line_length;
+	dims[3] = (signed char)game->winner;
+	dst = put(dst, &len, 4);
+	dst = put(dst, &game->started, 8);
+	dst = put(dst, &game->finished, 8);
+	dst = put(dst, dims, 4);
+	dst = put(dst, &moves, 2);
+	dst = put(dst, &red_len, 2);
+	dst = put(dst, game->red, red_len);
+	dst = put(dst, &blue_len, 2);
+	dst = put(dst, game->blue, blue_len);
+	put(dst, game->history, moves);
+}
+
+size_t journal_parse(const char *data, size_t len, struct journal_game *game)
+{
+	uint32_t record_len;
+	uint16_t n;
+	size_t pos = 4 + 8 + 8 + 4;
+	if (len < RECORD_FIXED) {
+		return 0;
+	}
+	memcpy(&record_len, data, 4);
+	if (record_len < RECORD_FIXED - 4 || record_len > len - 4) {
+		return 0;
+	}
+	memcpy(&game->started, data + 4, 8);
+	memcpy(&game->finished, data + 12, 8);
+	game->width = (unsigned char)data[20];
+	game->height = (unsigned char)data[21];
+	game->line_length = (unsigned char)data[22];
+	game->winner = (signed char)data[23];
+	memcpy(&n, data + pos, 2);
+	game->moves = n;
+	pos += 2;
+	memcpy(&n, data + pos, 2);
+	game->red_len = n;
+	game->red = data + pos + 2;
+	pos += 2 + n;
+	if (pos + 2 > record_len + 4) {
+		return 0;
+	}
+	memcpy(&n, data + pos, 2);
+	game->blue_len = n;
+	game->blue = data + pos + 2;
+	pos += 2 + n;
+	game->history = (const unsigned char *)data + pos;
+	if (pos + game->moves != record_len + 4) {
+		return 0;
+	}
+	return pos + game->moves;
+}
+
+long journal_replay(const char *path, unsigned long first,
+		int (*fn)(const struct journal_game *game, void *ctx), void *ctx)
+{
+	struct journal_game game;
+	const char *data;
+	size_t size, pos = 8, len;
+	long count = 0;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (map_journal(fd, &data, &size) < 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	while (pos < size && (len = journal_parse(data + pos, size - pos, &game)) > 0) {
+		if (count >= first && fn(&game, ctx) < 0) {
+			count = -1;
+			break;
+		}
+		pos += len;
+		count++;
+	}
+	if (data) {
+		munmap((void *)data, size);
+	}
+	return count;
+}
+
+int journal_append(struct journal *j, const struct journal_game *game)
+{
+	struct journal_chunk *c = &j->pending;
+	size_t len = journal_record_size(game);
+	if (len == 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&j->lock);
+	if (j->failed || chunk_reserve(c, len) < 0) {
+		pthread_mutex_unlock(&j->lock);
+		return -1;
+	}
+	journal_encode(game, c->data + c->len);
+	c->len += len;
+	pthread_cond_signal(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+	return 0;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* This module implements the journal: a file to which every finished game
+ * is appended. Appending only copies the game to memory, a writer thread
+ * writes everything appended since its last write at once and makes it
+ * durable with a single fdatasync, so a burst of games costs one sync.
+ *
+ * The file starts with the magic "FOURJRNL" followed by the records.
+ * Each record starts with its length as a 32-bit number, not counting
+ * the length itself, followed by:
+ * - the start and the end of the game in milliseconds since the epoch,
+ *   as 64-bit numbers,
+ * - the width, the height and the line length as bytes,
+ * - the winner as a signed byte (see side.h),
+ * - the number of moves as a 16-bit number,
+ * - the names of the red and the blue player, each as a 16-bit length
+ *   followed by the characters,
+ * - the columns of the moves as bytes.
+ * Numbers are stored in the byte order of the machine. A record cut short
+ * by a crash is cut off when the journal is opened again.
+ */
+
+#define JOURNAL_MAGIC "FOURJRNL"
+
+struct journal_game {
+	uint64_t started;
+	uint64_t finished;
+	int width;
+	int height;
+	int line_length;
+	int winner;
+	// names of the players, they need not be terminated
+	const char *red;
+	const char *blue;
+	int red_len;
+	int blue_len;
+	int moves;
+	const unsigned char *history;
+};
+
+struct journal_chunk {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+struct journal {
+	// these should be treated as private
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// records appended but not yet taken by the writer
+	struct journal_chunk pending;
+	// records being written
+	struct journal_chunk writing;
+	int stop;
+	int failed;
+};
+
+/* Opens the journal for appending, creating the file if it doesn't exist,
+ * and starts the writer. Returns 0 on success and -1 on failure.
+ */
+int journal_open(struct journal *j, const char *path);
+
+/* Writes the remaining records, stops the writer and closes the file.
+ * Returns 0 if all records were made durable and -1 otherwise.
+ */
+int journal_close(struct journal *j);
+
+/* Queues the game to be written, doesn't wait for the disk.
+ * Returns 0 on success and -1 if it can't be queued or an earlier write
+ * has failed.
+ */
+int journal_append(struct journal *j, const struct journal_game *game);
+
+/* Returns the length of the record of the game, or 0 if the game
+ * can't be stored.
+ */
+size_t journal_record_size(const struct journal_game *game);
+
+/* Writes the record of the game to dst, which must have room for
+ * journal_record_size bytes.
+ */
+void journal_encode(const struct journal_game *game, char *dst);
+
+/* Parses the record at the start of data, which holds len bytes.
+ * The names and the history of *game point into data.
+ * Returns the length of the record, or 0 if it's cut short or malformed.
+ */
+size_t journal_parse(const char *data, size_t len, struct journal_game *game);
+
+/* Calls fn for every record of the journal at the given path, starting
+ * with the record number first (counted from 0). fn returns 0 to go on
+ * and -1 to stop. Returns the number of records in the journal, or -1
+ * if it can't be read or fn has stopped.
+ */
+long journal_replay(const char *path, unsigned long first,
+		int (*fn)(const struct journal_game *game, void *ctx), void *ctx);
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+
+#include "limiter.h"
+
+// Entries are kept in an array and linked by their indices, -1 ends a list.
+struct limiter_entry {
+	uint64_t key;
+	struct token_bucket bucket;
+	// the LRU list, most recently used first
+	int prev;
+	int next;
+	// the next entry in the same bucket
+	int chain;
+};
+
+void token_bucket_init(struct token_bucket *b, int burst, uint64_t now)
+{
+	b->tokens = (uint64_t)burst * 1000;
+	b->filled = now;
+}
+
+int token_bucket_take(struct token_bucket *b, int rate, int burst,
+		uint64_t now)
+{
+	uint64_t max = (uint64_t)burst * 1000;
+	if (now > b->filled) {
+		// a token a second is a thousandth of it a millisecond
+		b->tokens += (now - b->filled) * rate;
+		if (b->tokens > max) {
+			b->tokens = max;
+		}
+		b->filled = now;
+	}
+	if (b->tokens < 1000) {
+		return -1;
+	}
+	b->tokens -= 1000;
+	return 0;
+}
+
+int limiter_init(struct limiter *l, int capacity, int rate, int burst)
+{
+	int i;
+	l->entries = malloc(capacity * sizeof(*l->entries));
+	// at least twice as many buckets as entries keeps the chains short
+	l->bits = 1;
+	while ((1 << l->bits) < 2 * capacity) {
+		l->bits++;
+	}
+	l->nbuckets = 1 << l->bits;
+	l->buckets = malloc(l->nbuckets * sizeof(*l->buckets));
+	if (!l->entries || !l->buckets) {
+		free(l->entries);
+		free(l->buckets);
+		return -1;
+	}
+	for (i = 0; i < l->nbuckets; ++i) {
+		l->buckets[i] = -1;
+	}
+	l->capacity = capacity;
+	l->used = 0;
+	l->head = l->tail = -1;
+	l->rate = rate;
+	l->burst = burst;
+	return 0;
+}
+
+void limiter_finalize(struct limiter *l)
+{
+	free(l->entries);
+	free(l->buckets);
+}
+
+static int *bucket_of(struct limiter *l, uint64_t key)
+{
+	// The multiplication moves every bit of the key into the high bits
+	// of the product, the low bits of the product only depend on the low
+	// bits of the key.
+	return &l->buckets[(key * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - l->bits)];
+}
+
+static void unlink_entry(struct limiter *l, int i)
+{
+	struct limiter_entry *e = &l->entries[i];
+	if (e->prev >= 0) {
+		l->entries[e->prev].next = e->next;
+	} else {
+		l->head = e->next;
+	}
+	if (e->next >= 0) {
+		l->entries[e->next].prev = e->prev;
+	} else {
+		l->tail = e->prev;
+	}
+}
+
+static void push_front(struct limiter *l, int i)
+{
+	struct limiter_entry *e = &l->entries[i];
+	e->prev = -1;
+	e->next = l->head;
+	if (l->head >= 0) {
+		l->entries[l->head].prev = i;
+	} else {
+		l->tail = i;
+	}
+	l->head = i;
+}
+
+static int find(struct limiter *l, uint64_t key)
+{
+	int i;
+	for (i = *bucket_of(l, key); i >= 0; i = l->entries[i].chain) {
+		if (l->entries[i].key == key) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int limiter_take(struct limiter *l, uint64_t key, uint64_t now)
+{
+	int i, *link;
+	i = find(l, key);
+	if (i >= 0) {
+		unlink_entry(l, i);
+	} else {
+		if (l->used < l->capacity) {
+			i = l->used++;
+		} else {
+			// evict the tail and remove it from its bucket
+			i = l->tail;
+			unlink_entry(l, i);
+			link = bucket_of(l, l->entries[i].key);
+			while (*link != i) {
+				link = &l->entries[*link].chain;
+			}
+			*link = l->entries[i].chain;
+		}
+		l->entries[i].key = key;
+		token_bucket_init(&l->entries[i].bucket, l->burst, now);
+		link = bucket_of(l, key);
+		l->entries[i].chain = *link;
+		*link = i;
+	}
+	push_front(l, i);
+	return token_bucket_take(&l->entries[i].bucket, l->rate, l->burst, now);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+/* This module implements token buckets that limit how often something
+ * may happen: a bucket holds up to burst tokens and gains rate tokens
+ * a second, every event takes one and the events finding it empty are
+ * refused. A limiter keeps a bucket for each of a bounded number of keys,
+ * such as the addresses of the clients, and forgets the least recently
+ * used key when it's full. A forgotten key starts over with a full bucket.
+ */
+
+struct token_bucket {
+	// these should be treated as private
+	// in thousandths of a token, so that it fills up every millisecond
+	uint64_t tokens;
+	// when the bucket was last filled up, in milliseconds
+	uint64_t filled;
+};
+
+/* Initializes a full bucket, times are in milliseconds from any fixed point.
+ */
+void token_bucket_init(struct token_bucket *b, int burst, uint64_t now);
+
+/* Takes a token from the bucket, after adding the ones gained since it was
+ * last filled up. Returns 0 if there was one and -1 if the bucket is empty.
+ */
+int token_bucket_take(struct token_bucket *b, int rate, int burst,
+		uint64_t now);
+
+struct limiter_entry;
+
+struct limiter {
+	// these should be treated as private
+	struct limiter_entry *entries;
+	int capacity;
+	int used;
+	int *buckets;
+	// the number of buckets is a power of two, 1 << bits
+	int nbuckets;
+	int bits;
+	// the LRU list
+	int head;
+	int tail;
+	int rate;
+	int burst;
+};
+
+/* Initializes a limiter allowing rate events a second for each of up to
+ * capacity keys, with bursts of up to burst events. Returns 0 on success
+ * and -1 on failure.
+ */
+int limiter_init(struct limiter *l, int capacity, int rate, int burst);
+
+void limiter_finalize(struct limiter *l);
+
+/* Takes a token from the bucket of the key, see token_bucket_take.
+ */
+int limiter_take(struct limiter *l, uint64_t key, uint64_t now);
@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "buffer.h"
+#include "protocol.h"
+#include "game.h"
+
+/* Plays games between pairs of connections to a running server as fast
+ * as it answers and prints the moves per second along with the latency
+ * of the moves: the time from sending MSG_DROP until the opponent reads
+ * MSG_NOTIFY_DROP. Every pair has its own thread and plays one game after
+ * another, the moves are the same as in selfplay's random policy.
+ *
+ * The server should run without the message rate limit (-r 0), otherwise
+ * it starts refusing the messages after the first moves.
+ */
+
+// latencies are counted in microseconds up to this, longer ones in the last bucket
+#define MAX_LATENCY 100000
+#define READ_SIZE 4096
+
+struct conn {
+	int sock;
+	struct buffer input;
+	enum side side;
+};
+
+struct pair_run {
+	pthread_t thread;
+	int index;
+	struct conn conns[2];
+	uint64_t rng;
+	unsigned long moves;
+	unsigned long games;
+	// number of moves by latency in microseconds
+	unsigned long *latencies;
+	int failed;
+};
+
+const int DEFAULT_PORT = 8051;
+const int DEFAULT_PAIRS = 1;
+const int DEFAULT_DURATION = 10;
+
+const char *USAGE = "loadgen [-n PAIRS] [-d SECONDS] HOST[:PORT]|PATH";
+
+// the server's TCP address, or its Unix domain one if server_family is AF_UNIX
+static struct sockaddr_in server_addr;
+static struct sockaddr_un server_local;
+static socklen_t server_local_len;
+static int server_family;
+static double deadline;
+// the server pairs whoever starts next, so the pairs start one at a time
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * UINT64_C(0x2545f4914f6cdd1d);
+}
+
+static int random_column(struct pair_run *p, struct game *g)
+{
+	int x, i;
+	x = xorshift(&p->rng) % g->width;
+	for (i = 0; i < g->width; ++i) {
+		if (g->heights[(x + i) % g->width] < g->height) {
+			return (x + i) % g->width;
+		}
+	}
+	return -1;
+}
+
+static int conn_open(struct conn *c)
+{
+	int one = 1;
+	buffer_init(&c->input);
+	c->sock = socket(server_family, SOCK_STREAM, 0);
+	if (c->sock < 0) {
+		return -1;
+	}
+	if (server_family == AF_UNIX) {
+		if (connect(c->sock, (struct sockaddr *)&server_local, server_local_len) < 0) {
+			close(c->sock);
+			return -1;
+		}
+		return 0;
+	}
+	if (connect(c->sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+		close(c->sock);
+		return -1;
+	}
+	// the messages are small and every one of them waits for an answer
+	setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 0;
+}
+
+static void conn_close(struct conn *c)
+{
+	close(c->sock);
+	buffer_finalize(&c->input);
+}
+
+static int conn_send(struct conn *c, struct message *msg)
+{
+	struct buffer out;
+	char buf[READ_SIZE];
+	size_t len;
+	int n;
+	buffer_init(&out);
+	if (format_message(msg, &out) < 0) {
+		buffer_finalize(&out);
+		return -1;
+	}
+	while ((len = buffer_len(&out)) > 0) {
+		len = len < sizeof(buf) ? len : sizeof(buf);
+		buffer_peek(&out, buf, len);
+		if ((n = write(c->sock, buf, len)) < 0) {
+			buffer_finalize(&out);
+			return -1;
+		}
+		buffer_pop(&out, NULL, n);
+	}
+	buffer_finalize(&out);
+	return 0;
+}
+
+/* Reads the next message, which must be of the given type. Returns 0
+ * on success and -1 on failure, the message then doesn't need closing.
+ */
+static int conn_expect(struct conn *c, enum message_type type, struct message *msg)
+{
+	char buf[READ_SIZE];
+	int n;
+	while ((n = parse_message(&c->input, msg)) == 0) {
+		if ((n = read(c->sock, buf, sizeof(buf))) <= 0) {
+			return -1;
+		}
+		if (buffer_push(&c->input, buf, n) < 0) {
+			return -1;
+		}
+	}
+	buffer_pop(&c->input, NULL, n < 0 ? -n : n);
+	if (n < 0 || msg->type != type) {
+		if (n > 0 && (msg->type == MSG_LOGIN_ERR || msg->type == MSG_START_ERR
+				|| msg->type == MSG_DROP_ERR))
+		{
+			fprintf(stderr, "server refused: %s\n", msg->data.err.text);
+		}
+		close_message(msg);
+		return -1;
+	}
+	return 0;
+}
+
+static int conn_login(struct conn *c, int pair, int index)
+{
+	struct message msg;
+	char name[64];
+	snprintf(name, sizeof(name), "lg%d_%d_%c", (int)getpid(), pair, 'a' + index);
+	msg.type = MSG_LOGIN;
+	msg.data.login.name = name;
+	if (conn_send(c, &msg) < 0 || conn_expect(c, MSG_LOGIN_OK, &msg) < 0) {
+		return -1;
+	}
+	close_message(&msg);
+	return 0;
+}
+
+/* Starts a game for both connections of the pair and initializes the
+ * game with the rules the server has sent.
+ */
+static int pair_start(struct pair_run *p, struct game *g)
+{
+	struct message msg;
+	struct game_rules rules;
+	int i, res = 0;
+	pthread_mutex_lock(&start_lock);
+	msg.type = MSG_START;
+	msg.data.start.bot = 0;
+	for (i = 0; i < 2 && res == 0; ++i) {
+		res = conn_send(&p->conns[i], &msg);
+	}
+	for (i = 0; i < 2 && res == 0; ++i) {
+		if ((res = conn_expect(&p->conns[i], MSG_START_OK, &msg)) == 0) {
+			p->conns[i].side = msg.data.start_ok.side;
+			rules.width = msg.data.start_ok.width;
+			rules.height = msg.data.start_ok.height;
+			rules.line_length = msg.data.start_ok.line_length;
+			rules.undos = msg.data.start_ok.red_undos;
+			close_message(&msg);
+		}
+	}
+	pthread_mutex_unlock(&start_lock);
+	if (res < 0) {
+		return -1;
+	}
+	return game_init(g, &rules);
+}
+
+/* Plays one move of the side to move and records its latency.
+ */
+static int pair_move(struct pair_run *p, struct game *g)
+{
+	struct conn *mover, *other;
+	struct message msg;
+	double sent;
+	uint64_t latency;
+	int i;
+	mover = &p->conns[p->conns[0].side == g->turn ? 0 : 1];
+	other = &p->conns[p->conns[0].side == g->turn ? 1 : 0];
+	msg.type = MSG_DROP;
+	msg.data.drop.column = random_column(p, g);
+	game_drop(g, g->turn, msg.data.drop.column);
+	sent = now();
+	if (conn_send(mover, &msg) < 0 || conn_expect(other, MSG_NOTIFY_DROP, &msg) < 0) {
+		return -1;
+	}
+	latency = (now() - sent) * 1e6;
+	p->latencies[latency < MAX_LATENCY ? latency : MAX_LATENCY]++;
+	p->moves++;
+	if (conn_expect(mover, MSG_DROP_OK, &msg) < 0
+			|| conn_expect(mover, MSG_NOTIFY_DROP, &msg) < 0)
+	{
+		return -1;
+	}
+	if (g->over) {
+		for (i = 0; i < 2; ++i) {
+			if (conn_expect(&p->conns[i], MSG_NOTIFY_OVER, &msg) < 0) {
+				return -1;
+			}
+		}
+		p->games++;
+	}
+	return 0;
+}
+
+static void *pair_play(void *arg)
+{
+	struct pair_run *p = arg;
+	struct game g;
+	int i, opened;
+	for (opened = 0; opened < 2 && !p->failed; ++opened) {
+		if (conn_open(&p->conns[opened]) < 0) {
+			p->failed = 1;
+			break;
+		}
+		p->failed = conn_login(&p->conns[opened], p->index, opened) < 0;
+	}
+	while (!p->failed && now() < deadline) {
+		if (pair_start(p, &g) < 0) {
+			p->failed = 1;
+			break;
+		}
+		while (!g.over && now() < deadline) {
+			if (pair_move(p, &g) < 0) {
+				p->failed = 1;
+				break;
+			}
+		}
+		game_finalize(&g);
+	}
+	// quitting an unfinished game is left to the server's disconnect handling
+	for (i = 0; i < opened; ++i) {
+		conn_close(&p->conns[i]);
+	}
+	return NULL;
+}
+
+static unsigned long percentile(unsigned long *latencies, unsigned long total, double q)
+{
+	unsigned long seen = 0;
+	int i;
+	for (i = 0; i < MAX_LATENCY; ++i) {
+		seen += latencies[i];
+		if (seen >= q * total) {
+			break;
+		}
+	}
+	return i;
+}
+
+static int run(int npairs, int duration)
+{
+	struct pair_run *pairs;
+	unsigned long *latencies, moves = 0, games = 0, max = 0;
+	double start, elapsed;
+	int i, j, started, failed = 0;
+	pairs = calloc(npairs, sizeof(*pairs));
+	latencies = calloc(MAX_LATENCY + 1, sizeof(*latencies));
+	if (!pairs || !latencies) {
+		free(pairs);
+		free(latencies);
+		return -1;
+	}
+	for (i = 0; i < npairs; ++i) {
+		pairs[i].index = i;
+		pairs[i].rng = (time(NULL) + i + 1) * UINT64_C(0x9e3779b97f4a7c15) | 1;
+		pairs[i].latencies = calloc(MAX_LATENCY + 1, sizeof(*latencies));
+		if (!pairs[i].latencies) {
+			while (i > 0) {
+				free(pairs[--i].latencies);
+			}
+			free(pairs);
+			free(latencies);
+			return -1;
+		}
+	}
+	start = now();
+	deadline = start + duration;
+	for (started = 0; started < npairs; ++started) {
+		if (pthread_create(&pairs[started].thread, NULL,
+					pair_play, &pairs[started]) != 0)
+		{
+			break;
+		}
+	}
+	for (i = 0; i < started; ++i) {
+		pthread_join(pairs[i].thread, NULL);
+		moves += pairs[i].moves;
+		games += pairs[i].games;
+		failed += pairs[i].failed;
+		for (j = 0; j <= MAX_LATENCY; ++j) {
+			latencies[j] += pairs[i].latencies[j];
+		}
+	}
+	elapsed = now() - start;
+	for (i = 0; i < npairs; ++i) {
+		free(pairs[i].latencies);
+	}
+	free(pairs);
+	if (moves > 0) {
+		max = MAX_LATENCY;
+		while (latencies[max] == 0) {
+			--max;
+		}
+		printf("pairs:       %d\n", started);
+		printf("games:       %lu\n", games);
+		printf("moves:       %lu\n", moves);
+		printf("moves/sec:   %.0f\n", moves / elapsed);
+		printf("latency p50: %lu us\n", percentile(latencies, moves, 0.5));
+		printf("latency p90: %lu us\n", percentile(latencies, moves, 0.9));
+		printf("latency p99: %lu us\n", percentile(latencies, moves, 0.99));
+		printf("latency max: %lu%s us\n", max, max == MAX_LATENCY ? "+" : "");
+	}
+	free(latencies);
+	if (failed > 0) {
+		fprintf(stderr, "%d of %d pairs failed\n", failed, started);
+	}
+	return started == npairs && failed == 0 && moves > 0 ? 0 : -1;
+}
+
+/* Parses the path of the server's Unix domain listener, which starts
+ * with '@' if it's in the abstract namespace.
+ */
+static int parse_local(const char *arg)
+{
+	if (strlen(arg) >= sizeof(server_local.sun_path)) {
+		return -1;
+	}
+	memset(&server_local, 0, sizeof(server_local));
+	server_local.sun_family = AF_UNIX;
+	strcpy(server_local.sun_path, arg);
+	server_local_len = offsetof(struct sockaddr_un, sun_path) + strlen(arg);
+	if (arg[0] == '@') {
+		server_local.sun_path[0] = '\0';
+	} else {
+		server_local_len++;
+	}
+	server_family = AF_UNIX;
+	return 0;
+}
+
+static int parse_addr(const char *arg, struct sockaddr_in *addr)
+{
+	char host[64], *colon, *endptr;
+	long port = DEFAULT_PORT;
+	if (strlen(arg) >= sizeof(host)) {
+		return -1;
+	}
+	strcpy(host, arg);
+	colon = strchr(host, ':');
+	if (colon) {
+		*colon = '\0';
+		port = strtol(colon + 1, &endptr, 10);
+		if (colon[1] == '\0' || *endptr != '\0' || port <= 0 || port > 65535) {
+			return -1;
+		}
+	}
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	server_family = AF_INET;
+	return inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	int npairs = DEFAULT_PAIRS;
+	int duration = DEFAULT_DURATION;
+	int c;
+	while ((c = getopt(argc, argv, "n:d:")) != -1) {
+		switch (c) {
+		case 'n':
+			npairs = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s\n", USAGE);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc || npairs <= 0 || duration <= 0) {
+		fprintf(stderr, "%s\n", USAGE);
+		return 1;
+	}
+	// a path has a slash in it or starts with '@'
+	if ((argv[optind][0] == '@' || strchr(argv[optind], '/')
+				? parse_local(argv[optind])
+				: parse_addr(argv[optind], &server_addr)) < 0)
+	{
+		fprintf(stderr, "%s\n", USAGE);
+		return 1;
+	}
+	// a dropped connection shows up as the write failing with EPIPE
+	signal(SIGPIPE, SIG_IGN);
+	if (run(npairs, duration) < 0) {
+		perror("load test failed");
+		return 1;
+	}
+	return 0;
+}
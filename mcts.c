@@ -0,0 +1,371 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "mcts.h"
+
+/* The tree is shared by all threads and guarded by a single lock, which is
+ * only held while walking down and updating the statistics. The random
+ * games, where nearly all the time goes, are played outside of it.
+ *
+ * While a thread plays from a leaf, the nodes on its path count the
+ * pending games as losses (virtual loss), so that the other threads are
+ * steered to different branches in the meantime.
+ */
+
+// number of random games played at once from every leaf
+#define BATCH 8
+#define VIRTUAL_LOSS BATCH
+#define EXPLORATION 1.0
+
+struct mcts_node {
+	// column played to reach this node and the side that played it
+	int column;
+	enum side side;
+	// visits include the virtual losses of the games in progress
+	int visits;
+	// won games of the side that played the move, draws count as halves
+	double wins;
+	int expanded;
+	struct mcts_node *children;
+	int nchildren;
+};
+
+struct mcts_thread {
+	struct mcts *m;
+	pthread_t thread;
+	// the position of the leaf being visited
+	struct game leaf;
+	struct game batch[BATCH];
+	struct mcts_node **path;
+	uint64_t rng;
+	unsigned long playouts;
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * UINT64_C(0x2545f4914f6cdd1d);
+}
+
+static void thread_finalize(struct mcts_thread *t)
+{
+	int i;
+	game_finalize(&t->leaf);
+	for (i = 0; i < BATCH; ++i) {
+		game_finalize(&t->batch[i]);
+	}
+	free(t->path);
+}
+
+static int thread_init(struct mcts_thread *t, struct mcts *m, int id)
+{
+	int i;
+	t->m = m;
+	t->rng = UINT64_C(0x9e3779b97f4a7c15) * (id + 1);
+	t->path = malloc((m->rules.width * m->rules.height + 2) * sizeof(*t->path));
+	if (!t->path) {
+		return -1;
+	}
+	if (game_init(&t->leaf, &m->rules) < 0) {
+		free(t->path);
+		return -1;
+	}
+	for (i = 0; i < BATCH; ++i) {
+		if (game_init(&t->batch[i], &m->rules) < 0) {
+			while (i > 0) {
+				game_finalize(&t->batch[--i]);
+			}
+			game_finalize(&t->leaf);
+			free(t->path);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int mcts_init(struct mcts *m, const struct game_rules *rules,
+		size_t nthreads, size_t max_nodes)
+{
+	size_t i;
+	if (game_rules_check(rules) < 0 || nthreads == 0 || max_nodes == 0) {
+		return -1;
+	}
+	m->rules = *rules;
+	m->nodes = malloc(max_nodes * sizeof(*m->nodes));
+	m->threads = malloc(nthreads * sizeof(*m->threads));
+	if (!m->nodes || !m->threads) {
+		goto error;
+	}
+	m->max_nodes = max_nodes;
+	m->nthreads = nthreads;
+	if (game_init(&m->start, rules) < 0) {
+		goto error;
+	}
+	if (game_init(&m->root, rules) < 0) {
+		game_finalize(&m->start);
+		goto error;
+	}
+	for (i = 0; i < nthreads; ++i) {
+		if (thread_init(&m->threads[i], m, i) < 0) {
+			while (i > 0) {
+				thread_finalize(&m->threads[--i]);
+			}
+			game_finalize(&m->start);
+			game_finalize(&m->root);
+			goto error;
+		}
+	}
+	pthread_mutex_init(&m->lock, NULL);
+	return 0;
+error:
+	free(m->nodes);
+	free(m->threads);
+	return -1;
+}
+
+void mcts_finalize(struct mcts *m)
+{
+	size_t i;
+	for (i = 0; i < m->nthreads; ++i) {
+		thread_finalize(&m->threads[i]);
+	}
+	game_finalize(&m->start);
+	game_finalize(&m->root);
+	pthread_mutex_destroy(&m->lock);
+	free(m->nodes);
+	free(m->threads);
+}
+
+static int out_of_time(struct mcts *m)
+{
+	if (m->stop && __atomic_load_n(m->stop, __ATOMIC_RELAXED)) {
+		return 1;
+	}
+	return now_ms() >= __atomic_load_n(&m->deadline, __ATOMIC_RELAXED);
+}
+
+static void node_init(struct mcts_node *node, int column, enum side side)
+{
+	node->column = column;
+	node->side = side;
+	node->visits = 0;
+	node->wins = 0;
+	node->expanded = 0;
+	node->children = NULL;
+	node->nchildren = 0;
+}
+
+/* Adds the children of a leaf. Fails if the node pool is exhausted,
+ * in which case the node stays a leaf.
+ */
+static int expand(struct mcts *m, struct mcts_node *node, struct game *g)
+{
+	int x, n = 0;
+	for (x = 0; x < g->width; ++x) {
+		n += g->heights[x] < g->height;
+	}
+	if (m->used_nodes + n > m->max_nodes) {
+		return -1;
+	}
+	node->children = &m->nodes[m->used_nodes];
+	m->used_nodes += n;
+	for (x = 0; x < g->width; ++x) {
+		if (g->heights[x] < g->height) {
+			node_init(&node->children[node->nchildren++], x, g->turn);
+		}
+	}
+	node->expanded = 1;
+	return 0;
+}
+
+static struct mcts_node *select_child(struct mcts_node *node)
+{
+	struct mcts_node *child, *best = NULL;
+	double score, best_score = -1;
+	double log_visits = log(node->visits);
+	int i;
+	for (i = 0; i < node->nchildren; ++i) {
+		child = &node->children[i];
+		if (child->visits == 0) {
+			return child;
+		}
+		score = child->wins / child->visits
+			+ EXPLORATION * sqrt(log_visits / child->visits);
+		if (score > best_score) {
+			best_score = score;
+			best = child;
+		}
+	}
+	return best;
+}
+
+static int random_column(struct mcts_thread *t, struct game *g)
+{
+	int x, i;
+	x = xorshift(&t->rng) % g->width;
+	if (g->heights[x] < g->height) {
+		return x;
+	}
+	// the board is filling up, take the next column that isn't full
+	for (i = 1; i < g->width; ++i) {
+		if (g->heights[(x + i) % g->width] < g->height) {
+			return (x + i) % g->width;
+		}
+	}
+	return -1;
+}
+
+/* Plays BATCH random games from the leaf position in lockstep, one move
+ * of every unfinished game per round. Counts the winners in wins,
+ * which is indexed by SIDE_BLUE and SIDE_RED, draws count as halves.
+ */
+static void playout(struct mcts_thread *t, double *wins)
+{
+	struct game *g;
+	int i, active;
+	wins[SIDE_BLUE] = wins[SIDE_RED] = 0;
+	for (i = 0; i < BATCH; ++i) {
+		game_copy(&t->batch[i], &t->leaf);
+	}
+	do {
+		active = 0;
+		for (i = 0; i < BATCH; ++i) {
+			g = &t->batch[i];
+			if (!g->over) {
+				game_drop(g, g->turn, random_column(t, g));
+				active += !g->over;
+			}
+		}
+	} while (active > 0);
+	for (i = 0; i < BATCH; ++i) {
+		if (t->batch[i].winner == SIDE_NONE) {
+			wins[SIDE_BLUE] += 0.5;
+			wins[SIDE_RED] += 0.5;
+		} else {
+			wins[t->batch[i].winner] += 1;
+		}
+	}
+	t->playouts += BATCH;
+}
+
+static void iterate(struct mcts_thread *t)
+{
+	struct mcts *m = t->m;
+	struct mcts_node *node = &m->nodes[0];
+	double wins[2];
+	int i, len = 0;
+
+	pthread_mutex_lock(&m->lock);
+	game_copy(&t->leaf, &m->root);
+	node->visits += VIRTUAL_LOSS;
+	t->path[len++] = node;
+	while (node->expanded && !t->leaf.over) {
+		node = select_child(node);
+		game_drop(&t->leaf, t->leaf.turn, node->column);
+		node->visits += VIRTUAL_LOSS;
+		t->path[len++] = node;
+	}
+	if (!t->leaf.over && expand(m, node, &t->leaf) == 0) {
+		node = select_child(node);
+		game_drop(&t->leaf, t->leaf.turn, node->column);
+		node->visits += VIRTUAL_LOSS;
+		t->path[len++] = node;
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	playout(t, wins);
+
+	pthread_mutex_lock(&m->lock);
+	for (i = 0; i < len; ++i) {
+		node = t->path[i];
+		node->visits += BATCH - VIRTUAL_LOSS;
+		node->wins += wins[node->side];
+	}
+	pthread_mutex_unlock(&m->lock);
+}
+
+static void *grow(void *arg)
+{
+	struct mcts_thread *t = arg;
+	while (!out_of_time(t->m)) {
+		iterate(t);
+	}
+	return NULL;
+}
+
+int mcts_search(struct mcts *m, const unsigned char *history, int moves,
+		const struct mcts_limits *limits, struct mcts_result *res)
+{
+	struct mcts_node *root, *child, *best;
+	uint64_t start = now_ms();
+	size_t i, started;
+	int j, status = 0;
+
+	game_copy(&m->root, &m->start);
+	for (j = 0; j < moves; ++j) {
+		if (game_drop(&m->root, m->root.turn, history[j]) < 0) {
+			return -1;
+		}
+	}
+	if (m->root.over) {
+		return -1;
+	}
+
+	m->stop = limits->stop;
+	m->deadline = start + limits->time_ms;
+	m->used_nodes = 1;
+	root = &m->nodes[0];
+	node_init(root, -1, m->root.turn == SIDE_RED ? SIDE_BLUE : SIDE_RED);
+	for (i = 0; i < m->nthreads; ++i) {
+		m->threads[i].playouts = 0;
+	}
+
+	for (started = 1; started < m->nthreads; ++started) {
+		if (pthread_create(&m->threads[started].thread, NULL,
+					grow, &m->threads[started]) != 0)
+		{
+			status = -1;
+			// let the threads that did start finish quickly
+			__atomic_store_n(&m->deadline, 0, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	// make sure that the root has children even if the time is up already
+	iterate(&m->threads[0]);
+	grow(&m->threads[0]);
+	for (i = 1; i < started; ++i) {
+		pthread_join(m->threads[i].thread, NULL);
+	}
+
+	best = NULL;
+	for (i = 0; i < root->nchildren; ++i) {
+		child = &root->children[i];
+		if (!best || child->visits > best->visits) {
+			best = child;
+		}
+	}
+	if (!best) {
+		return -1;
+	}
+	res->column = best->column;
+	res->value = best->visits > 0 ? best->wins / best->visits : 0.5;
+	res->playouts = 0;
+	for (i = 0; i < m->nthreads; ++i) {
+		res->playouts += m->threads[i].playouts;
+	}
+	res->time_ms = now_ms() - start;
+	return status;
+}
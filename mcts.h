@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "game.h"
+
+/* This module implements the second bot engine, a Monte Carlo tree search
+ * (UCT). Unlike the alpha-beta search in ai.c it works with any rules,
+ * so it is used for the boards that don't fit in bitboards.
+ *
+ * Several threads grow the same tree, using virtual loss to spread out
+ * over different branches. Every time a thread reaches a leaf it plays
+ * a batch of random games from there at once, using the rules from game.c.
+ */
+
+struct mcts_node;
+struct mcts_thread;
+
+struct mcts_limits {
+	// time limit in milliseconds
+	int time_ms;
+	// the search stops early when *stop becomes nonzero, may be NULL
+	const int *stop;
+};
+
+struct mcts {
+	// these should be treated as private
+	struct game_rules rules;
+	// the tree is kept in a preallocated pool of nodes
+	struct mcts_node *nodes;
+	size_t max_nodes;
+	size_t used_nodes;
+	pthread_mutex_t lock;
+
+	struct mcts_thread *threads;
+	size_t nthreads;
+
+	// the empty board and the searched position
+	struct game start;
+	struct game root;
+	// accessed atomically, the search may end it early while the threads
+	// read it
+	uint64_t deadline;
+	const int *stop;
+};
+
+struct mcts_result {
+	// column that should be played next
+	int column;
+	// estimated chance that the side to move wins, draws count as halves
+	double value;
+	// number of random games played
+	unsigned long playouts;
+	// time spent on the search, in milliseconds
+	unsigned long time_ms;
+};
+
+/* Initializes the engine for the given rules. Searches will run
+ * on nthreads threads (including the caller) and use at most
+ * max_nodes nodes of the tree. Returns 0 on success and -1 on failure.
+ */
+int mcts_init(struct mcts *m, const struct game_rules *rules,
+		size_t nthreads, size_t max_nodes);
+
+/* Releases all resources associated with the engine.
+ */
+void mcts_finalize(struct mcts *m);
+
+/* Searches the position reached by playing the given columns from
+ * the empty board until one of the limits is reached.
+ *
+ * Returns 0 on success and -1 if the moves are invalid, the game
+ * is already over or the helper threads can't be started.
+ */
+int mcts_search(struct mcts *m, const unsigned char *history, int moves,
+		const struct mcts_limits *limits, struct mcts_result *res);
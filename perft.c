@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "game.h"
+
+/* Counts all move sequences of a given length and the games that end
+ * before it, using the rules from game.c. It doubles as the benchmark
+ * of the move and win detection code, so it is timed with 1, 2, 4, ...
+ * threads.
+ *
+ * The tree is split into tasks, one per node near the root. Each thread
+ * has a deque of tasks: it takes the newest task from its own deque and
+ * steals the oldest one from the others when it runs out. A task close
+ * to the root pushes its children as new tasks, the deeper ones are
+ * counted on the spot.
+ *
+ * Optionally each thread keeps a transposition table with the counts of
+ * the subtrees it has seen, keyed by the Zobrist hash of the position
+ * and the remaining depth.
+ */
+
+#define MAX_DEPTH 64
+// tasks with more plies left than this are split into their children
+#define SPLIT_DEPTH 6
+
+struct counts {
+	// sequences of the full length
+	unsigned long leaves;
+	// games ended within the length, by winner
+	unsigned long wins[2];
+	unsigned long draws;
+};
+
+struct task {
+	int moves;
+	unsigned char history[MAX_DEPTH];
+};
+
+struct deque {
+	pthread_mutex_t lock;
+	struct task *tasks;
+	size_t top;
+	size_t bottom;
+	size_t capacity;
+};
+
+struct entry {
+	uint64_t key;
+	struct counts counts;
+};
+
+struct perft;
+
+struct worker {
+	struct perft *perft;
+	pthread_t thread;
+	int id;
+	struct deque deque;
+	struct game start;
+	struct game game;
+	struct entry *table;
+	unsigned long nodes;
+	struct counts counts;
+};
+
+struct perft {
+	struct game_rules rules;
+	int depth;
+	size_t table_size;
+	struct worker *workers;
+	int nworkers;
+	// tasks pushed but not finished yet
+	long pending;
+};
+
+const int DEFAULT_WIDTH = 7;
+const int DEFAULT_HEIGHT = 6;
+const int DEFAULT_LINE_LENGTH = 4;
+const int DEFAULT_DEPTH = 9;
+const int DEFAULT_THREADS = 4;
+
+const char *USAGE = "perft [-w WIDTH] [-h HEIGHT] [-l LINE] [-d DEPTH]"
+	" [-j MAX_THREADS] [-x TABLE_SIZE]";
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int push(struct deque *d, const struct task *task)
+{
+	struct task *tasks;
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom == d->capacity) {
+		// move the live tasks to the front before growing
+		memmove(d->tasks, d->tasks + d->top,
+				(d->bottom - d->top) * sizeof(*d->tasks));
+		d->bottom -= d->top;
+		d->top = 0;
+		if (d->bottom == d->capacity) {
+			tasks = realloc(d->tasks, 2 * d->capacity * sizeof(*tasks));
+			if (!tasks) {
+				pthread_mutex_unlock(&d->lock);
+				return -1;
+			}
+			d->tasks = tasks;
+			d->capacity *= 2;
+		}
+	}
+	d->tasks[d->bottom++] = *task;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+// the owner takes the newest task
+static int pop(struct deque *d, struct task *task)
+{
+	int res = -1;
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom > d->top) {
+		*task = d->tasks[--d->bottom];
+		res = 0;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return res;
+}
+
+// thieves take the oldest task, which has the biggest subtree
+static int steal(struct deque *d, struct task *task)
+{
+	int res = -1;
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom > d->top) {
+		*task = d->tasks[d->top++];
+		res = 0;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return res;
+}
+
+static void add_counts(struct counts *dst, const struct counts *src)
+{
+	dst->leaves += src->leaves;
+	dst->wins[0] += src->wins[0];
+	dst->wins[1] += src->wins[1];
+	dst->draws += src->draws;
+}
+
+static void count(struct worker *w, int depth, struct counts *res)
+{
+	struct game *g = &w->game;
+	struct counts sub;
+	struct entry *e = NULL;
+	uint64_t key;
+	int x;
+	w->nodes++;
+	if (g->over) {
+		if (g->winner == SIDE_NONE) {
+			res->draws++;
+		} else {
+			res->wins[g->winner]++;
+		}
+		return;
+	}
+	if (depth == 0) {
+		res->leaves++;
+		return;
+	}
+	if (w->table && depth >= 2) {
+		// the same board always has the same subtree
+		key = g->hash ^ (depth * UINT64_C(0x9e3779b97f4a7c15));
+		e = &w->table[key & (w->perft->table_size - 1)];
+		if (e->key == key) {
+			add_counts(res, &e->counts);
+			return;
+		}
+	}
+	memset(&sub, 0, sizeof(sub));
+	for (x = 0; x < g->width; ++x) {
+		if (game_drop(g, g->turn, x) >= 0) {
+			count(w, depth - 1, &sub);
+			game_takeback(g);
+		}
+	}
+	if (e) {
+		e->key = key;
+		e->counts = sub;
+	}
+	add_counts(res, &sub);
+}
+
+static int run_task(struct worker *w, const struct task *task)
+{
+	struct perft *p = w->perft;
+	struct game *g = &w->game;
+	struct task child;
+	int i, x;
+	game_copy(g, &w->start);
+	for (i = 0; i < task->moves; ++i) {
+		game_drop(g, g->turn, task->history[i]);
+	}
+	if (g->over || p->depth - task->moves <= SPLIT_DEPTH) {
+		count(w, p->depth - task->moves, &w->counts);
+		return 0;
+	}
+	w->nodes++;
+	child = *task;
+	child.moves++;
+	for (x = 0; x < g->width; ++x) {
+		if (g->heights[x] < g->height) {
+			child.history[task->moves] = x;
+			__atomic_add_fetch(&p->pending, 1, __ATOMIC_SEQ_CST);
+			if (push(&w->deque, &child) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int next_task(struct worker *w, struct task *task)
+{
+	struct perft *p = w->perft;
+	int i;
+	if (pop(&w->deque, task) == 0) {
+		return 0;
+	}
+	for (i = 1; i < p->nworkers; ++i) {
+		if (steal(&p->workers[(w->id + i) % p->nworkers].deque, task) == 0) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void *work(void *arg)
+{
+	struct worker *w = arg;
+	struct perft *p = w->perft;
+	struct task task;
+	while (__atomic_load_n(&p->pending, __ATOMIC_SEQ_CST) > 0) {
+		if (next_task(w, &task) < 0) {
+			sched_yield();
+			continue;
+		}
+		// children are counted as pending before their parent finishes
+		if (run_task(w, &task) < 0) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		__atomic_sub_fetch(&p->pending, 1, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+static void worker_finalize(struct worker *w)
+{
+	pthread_mutex_destroy(&w->deque.lock);
+	free(w->deque.tasks);
+	game_finalize(&w->start);
+	game_finalize(&w->game);
+	free(w->table);
+}
+
+static int worker_init(struct worker *w, struct perft *p, int id)
+{
+	memset(w, 0, sizeof(*w));
+	w->perft = p;
+	w->id = id;
+	w->deque.capacity = 64;
+	w->deque.tasks = malloc(w->deque.capacity * sizeof(*w->deque.tasks));
+	if (!w->deque.tasks) {
+		return -1;
+	}
+	if (p->table_size > 0) {
+		w->table = calloc(p->table_size, sizeof(*w->table));
+		if (!w->table) {
+			free(w->deque.tasks);
+			return -1;
+		}
+	}
+	if (game_init(&w->start, &p->rules) < 0) {
+		free(w->deque.tasks);
+		free(w->table);
+		return -1;
+	}
+	if (game_init(&w->game, &p->rules) < 0) {
+		game_finalize(&w->start);
+		free(w->deque.tasks);
+		free(w->table);
+		return -1;
+	}
+	pthread_mutex_init(&w->deque.lock, NULL);
+	return 0;
+}
+
+static int run(struct perft *p, int threads, struct counts *total,
+		unsigned long *nodes, double *elapsed)
+{
+	struct task root = {0};
+	double start;
+	int i, started, status = 0;
+	p->workers = malloc(threads * sizeof(*p->workers));
+	if (!p->workers) {
+		return -1;
+	}
+	for (i = 0; i < threads; ++i) {
+		if (worker_init(&p->workers[i], p, i) < 0) {
+			while (i > 0) {
+				worker_finalize(&p->workers[--i]);
+			}
+			free(p->workers);
+			return -1;
+		}
+	}
+	p->nworkers = threads;
+	p->pending = 1;
+	push(&p->workers[0].deque, &root);
+
+	start = now();
+	for (started = 1; started < threads; ++started) {
+		if (pthread_create(&p->workers[started].thread, NULL,
+					work, &p->workers[started]) != 0)
+		{
+			status = -1;
+			break;
+		}
+	}
+	work(&p->workers[0]);
+	for (i = 1; i < started; ++i) {
+		pthread_join(p->workers[i].thread, NULL);
+	}
+	*elapsed = now() - start;
+
+	memset(total, 0, sizeof(*total));
+	*nodes = 0;
+	for (i = 0; i < threads; ++i) {
+		add_counts(total, &p->workers[i].counts);
+		*nodes += p->workers[i].nodes;
+		worker_finalize(&p->workers[i]);
+	}
+	free(p->workers);
+	return status;
+}
+
+int main(int argc, char **argv)
+{
+	struct perft p;
+	struct counts counts;
+	unsigned long nodes;
+	double elapsed, base = 0;
+	int max_threads = DEFAULT_THREADS;
+	int threads, c;
+	long table_size = 0;
+	p.rules.width = DEFAULT_WIDTH;
+	p.rules.height = DEFAULT_HEIGHT;
+	p.rules.line_length = DEFAULT_LINE_LENGTH;
+	p.rules.undos = 0;
+	p.depth = DEFAULT_DEPTH;
+	while ((c = getopt(argc, argv, "w:h:l:d:j:x:")) != -1) {
+		switch (c) {
+		case 'w':
+			p.rules.width = atoi(optarg);
+			break;
+		case 'h':
+			p.rules.height = atoi(optarg);
+			break;
+		case 'l':
+			p.rules.line_length = atoi(optarg);
+			break;
+		case 'd':
+			p.depth = atoi(optarg);
+			break;
+		case 'j':
+			max_threads = atoi(optarg);
+			break;
+		case 'x':
+			table_size = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s\n", USAGE);
+			return 1;
+		}
+	}
+	if (optind != argc || game_rules_check(&p.rules) < 0
+			|| p.depth < 0 || p.depth > MAX_DEPTH || max_threads <= 0
+			|| table_size < 0)
+	{
+		fprintf(stderr, "%s\n", USAGE);
+		return 1;
+	}
+	if ((table_size & (table_size - 1)) != 0) {
+		fprintf(stderr, "TABLE_SIZE must be a power of two\n");
+		return 1;
+	}
+	p.table_size = table_size;
+
+	threads = 1;
+	while (threads <= max_threads) {
+		if (run(&p, threads, &counts, &nodes, &elapsed) < 0) {
+			perror("perft failed");
+			return 1;
+		}
+		if (threads == 1) {
+			base = nodes / elapsed;
+			printf("sequences of %d moves: %lu\n", p.depth, counts.leaves);
+			printf("games won by the first player: %lu\n", counts.wins[SIDE_RED]);
+			printf("games won by the second player: %lu\n", counts.wins[SIDE_BLUE]);
+			printf("drawn games: %lu\n", counts.draws);
+			printf("%8s %14s %14s %8s\n", "threads", "nodes", "nodes/sec", "speedup");
+		}
+		printf("%8d %14lu %14.0f %8.2f\n", threads, nodes, nodes / elapsed,
+				nodes / elapsed / base);
+		if (threads < max_threads && threads * 2 > max_threads) {
+			threads = max_threads;
+		} else {
+			threads *= 2;
+		}
+	}
+	return 0;
+}
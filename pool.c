@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "pool.h"
+
+struct worker_arg {
+	struct pool *pool;
+	void *ctx;
+};
+
+static void *worker(void *arg)
+{
+	struct pool *p = ((struct worker_arg *)arg)->pool;
+	void *ctx = ((struct worker_arg *)arg)->ctx;
+	struct pool_job *job;
+	uint64_t one = 1;
+	free(arg);
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->todo_head && !p->stop) {
+			pthread_cond_wait(&p->cond, &p->lock);
+		}
+		if (p->stop) {
+			break;
+		}
+		job = p->todo_head;
+		p->todo_head = job->next;
+		if (!p->todo_head) {
+			p->todo_tail = NULL;
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		job->run(job, ctx);
+
+		pthread_mutex_lock(&p->lock);
+		job->next = NULL;
+		if (p->done_tail) {
+			p->done_tail->next = job;
+		} else {
+			p->done_head = job;
+		}
+		p->done_tail = job;
+		if (write(p->event, &one, sizeof(one)) < 0) {
+			// the counter can't overflow in practice
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void stop_workers(struct pool *p, size_t n)
+{
+	size_t i;
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	for (i = 0; i < n; ++i) {
+		pthread_join(p->threads[i], NULL);
+	}
+}
+
+int pool_init(struct pool *p, size_t nthreads, void **ctxs)
+{
+	struct worker_arg *arg;
+	size_t i;
+	p->threads = malloc(nthreads * sizeof(*p->threads));
+	if (!p->threads) {
+		return -1;
+	}
+	p->event = eventfd(0, EFD_NONBLOCK);
+	if (p->event < 0) {
+		free(p->threads);
+		return -1;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->nthreads = nthreads;
+	p->ctxs = ctxs;
+	p->todo_head = p->todo_tail = NULL;
+	p->done_head = p->done_tail = NULL;
+	p->stop = 0;
+	for (i = 0; i < nthreads; ++i) {
+		arg = malloc(sizeof(*arg));
+		if (!arg) {
+			goto error;
+		}
+		arg->pool = p;
+		arg->ctx = ctxs ? ctxs[i] : NULL;
+		if (pthread_create(&p->threads[i], NULL, worker, arg) != 0) {
+			free(arg);
+			goto error;
+		}
+	}
+	return 0;
+error:
+	stop_workers(p, i);
+	close(p->event);
+	free(p->threads);
+	return -1;
+}
+
+void pool_finalize(struct pool *p)
+{
+	stop_workers(p, p->nthreads);
+	close(p->event);
+	free(p->threads);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+}
+
+void pool_submit(struct pool *p, struct pool_job *job,
+		void (*run)(struct pool_job *job, void *ctx))
+{
+	job->run = run;
+	job->next = NULL;
+	pthread_mutex_lock(&p->lock);
+	if (p->todo_tail) {
+		p->todo_tail->next = job;
+	} else {
+		p->todo_head = job;
+	}
+	p->todo_tail = job;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+struct pool_job *pool_collect(struct pool *p)
+{
+	struct pool_job *jobs;
+	uint64_t count;
+	// reset the counter first, so that jobs finishing in the meantime
+	// will make the eventfd readable again
+	if (read(p->event, &count, sizeof(count)) < 0) {
+		// nothing has finished yet
+	}
+	pthread_mutex_lock(&p->lock);
+	jobs = p->done_head;
+	p->done_head = p->done_tail = NULL;
+	pthread_mutex_unlock(&p->lock);
+	return jobs;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* This module implements a pool of worker threads for the jobs
+ * that should not run on the event loop. Finished jobs are handed back
+ * to the loop through an eventfd, which should be watched for reading.
+ *
+ * Jobs are meant to be embedded as the first member of a bigger struct
+ * that holds their input and output.
+ */
+
+struct pool_job {
+	// next finished job, see pool_collect
+	struct pool_job *next;
+	// private
+	void (*run)(struct pool_job *job, void *ctx);
+};
+
+struct pool {
+	// these should be treated as private
+	pthread_t *threads;
+	size_t nthreads;
+	void **ctxs;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pool_job *todo_head;
+	struct pool_job *todo_tail;
+	struct pool_job *done_head;
+	struct pool_job *done_tail;
+	int stop;
+
+	// eventfd that becomes readable when some jobs have finished
+	int event;
+};
+
+/* Starts nthreads workers. The ith worker passes ctxs[i] to the jobs it runs,
+ * so the workers may keep their own state (ctxs may be NULL).
+ * Returns 0 on success and -1 on failure.
+ */
+int pool_init(struct pool *p, size_t nthreads, void **ctxs);
+
+/* Stops the workers and releases all resources associated with the pool.
+ * Jobs that are still queued or finished but not collected are dropped
+ * without being freed.
+ */
+void pool_finalize(struct pool *p);
+
+/* Queues the job, run will be called on one of the workers.
+ */
+void pool_submit(struct pool *p, struct pool_job *job,
+		void (*run)(struct pool_job *job, void *ctx));
+
+/* Returns the jobs that have finished since the last call as a list
+ * linked through their next fields, or NULL if there are none.
+ */
+struct pool_job *pool_collect(struct pool *p);
@@ -299,15 +299,48 @@ void close_message(struct message *msg)
 {
 	switch (msg->type) {
 	case MSG_LOGIN_ERR:
+	case MSG_RESUME_ERR:
 	case MSG_START_ERR:
 	case MSG_DROP_ERR:
 	case MSG_UNDO_ERR:
 	case MSG_QUIT_ERR:
+	case MSG_ANALYZE_ERR:
+	case MSG_HISTORY_ERR:
+	case MSG_RANK_ERR:
+	case MSG_LEADERBOARD_ERR:
 		free(msg->data.err.text);
 		break;
+	case MSG_ANALYZE:
+		free(msg->data.analyze.moves);
+		break;
+	case MSG_HISTORY:
+		free(msg->data.history.name);
+		break;
+	case MSG_HISTORY_GAME:
+		free(msg->data.history_game.red);
+		free(msg->data.history_game.blue);
+		free(msg->data.history_game.moves);
+		break;
+	case MSG_RANK:
+		free(msg->data.rank.name);
+		break;
+	case MSG_LEADERBOARD_ENTRY:
+		free(msg->data.leaderboard_entry.name);
+		break;
 	case MSG_LOGIN:
 		free(msg->data.login.name);
 		break;
+	case MSG_LOGIN_OK:
+		free(msg->data.login_ok.token);
+		break;
+	case MSG_RESUME:
+		free(msg->data.resume.token);
+		break;
+	case MSG_RESUME_OK:
+		free(msg->data.resume_ok.name);
+		free(msg->data.resume_ok.other);
+		free(msg->data.resume_ok.board);
+		break;
 	case MSG_START_OK:
 		free(msg->data.start_ok.other);
 		break;
@@ -316,6 +349,98 @@ void close_message(struct message *msg)
 	}
 }
 
+/* Helpers of copy_message, they set *failed if they run out of memory.
+ */
+static void copy_string(char **dst, const char *src, int *failed)
+{
+	*dst = NULL;
+	if (src && !(*dst = strdup(src))) {
+		*failed = 1;
+	}
+}
+
+static void copy_moves(int **dst, const int *src, int nmoves, int *failed)
+{
+	*dst = NULL;
+	if (nmoves > 0 && !(*dst = malloc(nmoves * sizeof(**dst)))) {
+		*failed = 1;
+	} else if (nmoves > 0) {
+		memcpy(*dst, src, nmoves * sizeof(**dst));
+	}
+}
+
+int copy_message(const struct message *src, struct message *dst)
+{
+	int failed = 0;
+	*dst = *src;
+	switch (src->type) {
+	case MSG_LOGIN_ERR:
+	case MSG_RESUME_ERR:
+	case MSG_START_ERR:
+	case MSG_DROP_ERR:
+	case MSG_UNDO_ERR:
+	case MSG_QUIT_ERR:
+	case MSG_ANALYZE_ERR:
+	case MSG_HISTORY_ERR:
+	case MSG_RANK_ERR:
+	case MSG_LEADERBOARD_ERR:
+		copy_string(&dst->data.err.text, src->data.err.text, &failed);
+		break;
+	case MSG_ANALYZE:
+		copy_moves(&dst->data.analyze.moves, src->data.analyze.moves,
+				src->data.analyze.nmoves, &failed);
+		break;
+	case MSG_HISTORY:
+		copy_string(&dst->data.history.name, src->data.history.name, &failed);
+		break;
+	case MSG_HISTORY_GAME:
+		copy_string(&dst->data.history_game.red,
+				src->data.history_game.red, &failed);
+		copy_string(&dst->data.history_game.blue,
+				src->data.history_game.blue, &failed);
+		copy_moves(&dst->data.history_game.moves,
+				src->data.history_game.moves,
+				src->data.history_game.nmoves, &failed);
+		break;
+	case MSG_RANK:
+		copy_string(&dst->data.rank.name, src->data.rank.name, &failed);
+		break;
+	case MSG_LEADERBOARD_ENTRY:
+		copy_string(&dst->data.leaderboard_entry.name,
+				src->data.leaderboard_entry.name, &failed);
+		break;
+	case MSG_LOGIN:
+		copy_string(&dst->data.login.name, src->data.login.name, &failed);
+		break;
+	case MSG_LOGIN_OK:
+		copy_string(&dst->data.login_ok.token, src->data.login_ok.token,
+				&failed);
+		break;
+	case MSG_RESUME:
+		copy_string(&dst->data.resume.token, src->data.resume.token, &failed);
+		break;
+	case MSG_RESUME_OK:
+		copy_string(&dst->data.resume_ok.name, src->data.resume_ok.name,
+				&failed);
+		copy_string(&dst->data.resume_ok.other, src->data.resume_ok.other,
+				&failed);
+		copy_string(&dst->data.resume_ok.board, src->data.resume_ok.board,
+				&failed);
+		break;
+	case MSG_START_OK:
+		copy_string(&dst->data.start_ok.other, src->data.start_ok.other,
+				&failed);
+		break;
+	default:
+		break;
+	}
+	if (failed) {
+		close_message(dst);
+		return -1;
+	}
+	return 0;
+}
+
 static size_t message_length(struct buffer *buf)
 {
 	int i;
@@ -351,11 +476,57 @@ static int match(struct raw_message *raw, char *name, size_t nargs, ...)
 	return ok;
 }
 
+/* Like match, but accepts any number of integer arguments.
+ */
+static int match_integers(struct raw_message *raw, char *name)
+{
+	size_t i;
+	if (raw->len < 1
+		|| raw->fields[0].type != FIELD_SYMBOL
+		|| strcmp(raw->fields[0].data.symbol, name) != 0)
+	{
+		return 0;
+	}
+	for (i = 1; i < raw->len; ++i) {
+		if (raw->fields[i].type != FIELD_INTEGER) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Matches a finished game: the names of both players and the winner
+ * followed by any number of moves.
+ */
+static int match_game(struct raw_message *raw, char *name)
+{
+	size_t i;
+	if (raw->len < 4
+		|| raw->fields[0].type != FIELD_SYMBOL
+		|| strcmp(raw->fields[0].data.symbol, name) != 0
+		|| raw->fields[1].type != FIELD_STRING
+		|| raw->fields[2].type != FIELD_STRING)
+	{
+		return 0;
+	}
+	for (i = 3; i < raw->len; ++i) {
+		if (raw->fields[i].type != FIELD_INTEGER) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
 static int take_integer(struct raw_message *raw, size_t idx)
 {
 	return raw->fields[idx].data.integer;
 }
 
+static char *take_symbol(struct raw_message *raw, size_t idx)
+{
+	return raw->fields[idx].data.symbol;
+}
+
 static char *take_string(struct raw_message *raw, size_t idx)
 {
 	char *val = raw->fields[idx].data.string;
@@ -388,20 +559,63 @@ static int decode_err(struct raw_message *raw, char *name,
 
 static int decode_message(struct raw_message *raw, struct message *msg)
 {
+	size_t i;
 	if (decode_nullary(raw, "invalid", MSG_INVALID, msg)) {}
 	else if (match(raw, "login", 1, FIELD_STRING)) {
 		msg->type = MSG_LOGIN;
 		msg->data.login.name = take_string(raw, 1);
 	}
-	else if (decode_nullary(raw, "login_ok", MSG_LOGIN_OK, msg)) {}
+	else if (match(raw, "login_ok", 1, FIELD_STRING)) {
+		msg->type = MSG_LOGIN_OK;
+		msg->data.login_ok.token = take_string(raw, 1);
+	}
 	else if (decode_err(raw, "login_err", MSG_LOGIN_ERR, msg)) {}
-	else if (decode_nullary(raw, "start", MSG_START, msg)) {}
-	else if (match(raw, "start_ok", 6,
+	else if (match(raw, "resume", 1, FIELD_STRING)) {
+		msg->type = MSG_RESUME;
+		msg->data.resume.token = take_string(raw, 1);
+	}
+	else if (match(raw, "resume_ok", 10,
+				FIELD_STRING,
+				FIELD_STRING,
+				FIELD_INTEGER,
+				FIELD_INTEGER,
+				FIELD_INTEGER,
+				FIELD_INTEGER,
+				FIELD_INTEGER,
+				FIELD_INTEGER,
+				FIELD_INTEGER,
+				FIELD_STRING))
+	{
+		msg->type = MSG_RESUME_OK;
+		msg->data.resume_ok.name = take_string(raw, 1);
+		msg->data.resume_ok.other = take_string(raw, 2);
+		msg->data.resume_ok.side = take_integer(raw, 3);
+		msg->data.resume_ok.width = take_integer(raw, 4);
+		msg->data.resume_ok.height = take_integer(raw, 5);
+		msg->data.resume_ok.line_length = take_integer(raw, 6);
+		msg->data.resume_ok.red_undos = take_integer(raw, 7);
+		msg->data.resume_ok.blue_undos = take_integer(raw, 8);
+		msg->data.resume_ok.turn = take_integer(raw, 9);
+		msg->data.resume_ok.board = take_string(raw, 10);
+	}
+	else if (decode_err(raw, "resume_err", MSG_RESUME_ERR, msg)) {}
+	else if (match(raw, "start", 0)) {
+		msg->type = MSG_START;
+		msg->data.start.bot = 0;
+	}
+	else if (match(raw, "start", 1, FIELD_SYMBOL)
+			&& strcmp(take_symbol(raw, 1), "bot") == 0)
+	{
+		msg->type = MSG_START;
+		msg->data.start.bot = 1;
+	}
+	else if (match(raw, "start_ok", 7,
 				FIELD_STRING,
 				FIELD_INTEGER,
 				FIELD_INTEGER,
 				FIELD_INTEGER,
 				FIELD_INTEGER,
+				FIELD_INTEGER,
 				FIELD_INTEGER))
 	{
 		msg->type = MSG_START_OK;
@@ -409,8 +623,9 @@ static int decode_message(struct raw_message *raw, struct message *msg)
 		msg->data.start_ok.side = take_integer(raw, 2);
 		msg->data.start_ok.width = take_integer(raw, 3);
 		msg->data.start_ok.height = take_integer(raw, 4);
-		msg->data.start_ok.red_undos = take_integer(raw, 5);
-		msg->data.start_ok.blue_undos = take_integer(raw, 6);
+		msg->data.start_ok.line_length = take_integer(raw, 5);
+		msg->data.start_ok.red_undos = take_integer(raw, 6);
+		msg->data.start_ok.blue_undos = take_integer(raw, 7);
 	}
 	else if (decode_err(raw, "start_err", MSG_START_ERR, msg)) {}
 	else if (match(raw, "drop", 1, FIELD_INTEGER)) {
@@ -450,6 +665,79 @@ static int decode_message(struct raw_message *raw, struct message *msg)
 		msg->data.notify_over.winner = take_integer(raw, 1);
 	}
 	else if (decode_nullary(raw, "notify_quit", MSG_NOTIFY_QUIT, msg)) {}
+	else if (match_integers(raw, "analyze")) {
+		msg->type = MSG_ANALYZE;
+		msg->data.analyze.nmoves = raw->len - 1;
+		// + 1 so that the allocation is never empty
+		msg->data.analyze.moves = malloc(raw->len * sizeof(int));
+		if (!msg->data.analyze.moves) {
+			return -1;
+		}
+		for (i = 1; i < raw->len; ++i) {
+			msg->data.analyze.moves[i - 1] = take_integer(raw, i);
+		}
+	}
+	else if (match(raw, "analyze_ok", 2, FIELD_INTEGER, FIELD_INTEGER)) {
+		msg->type = MSG_ANALYZE_OK;
+		msg->data.analyze_ok.column = take_integer(raw, 1);
+		msg->data.analyze_ok.score = take_integer(raw, 2);
+	}
+	else if (decode_err(raw, "analyze_err", MSG_ANALYZE_ERR, msg)) {}
+	else if (match(raw, "history", 2, FIELD_STRING, FIELD_INTEGER)) {
+		msg->type = MSG_HISTORY;
+		msg->data.history.name = take_string(raw, 1);
+		msg->data.history.count = take_integer(raw, 2);
+	}
+	else if (match_game(raw, "history_game")) {
+		msg->type = MSG_HISTORY_GAME;
+		msg->data.history_game.winner = take_integer(raw, 3);
+		msg->data.history_game.nmoves = raw->len - 4;
+		// + 1 so that the allocation is never empty
+		msg->data.history_game.moves = malloc((raw->len - 3) * sizeof(int));
+		if (!msg->data.history_game.moves) {
+			return -1;
+		}
+		for (i = 4; i < raw->len; ++i) {
+			msg->data.history_game.moves[i - 4] = take_integer(raw, i);
+		}
+		msg->data.history_game.red = take_string(raw, 1);
+		msg->data.history_game.blue = take_string(raw, 2);
+	}
+	else if (match(raw, "history_ok", 1, FIELD_INTEGER)) {
+		msg->type = MSG_HISTORY_OK;
+		msg->data.history_ok.count = take_integer(raw, 1);
+	}
+	else if (decode_err(raw, "history_err", MSG_HISTORY_ERR, msg)) {}
+	else if (match(raw, "rank", 1, FIELD_STRING)) {
+		msg->type = MSG_RANK;
+		msg->data.rank.name = take_string(raw, 1);
+	}
+	else if (match(raw, "rank_ok", 3, FIELD_INTEGER, FIELD_INTEGER,
+				FIELD_INTEGER))
+	{
+		msg->type = MSG_RANK_OK;
+		msg->data.rank_ok.rating = take_integer(raw, 1);
+		msg->data.rank_ok.rank = take_integer(raw, 2);
+		msg->data.rank_ok.players = take_integer(raw, 3);
+	}
+	else if (decode_err(raw, "rank_err", MSG_RANK_ERR, msg)) {}
+	else if (match(raw, "leaderboard", 1, FIELD_INTEGER)) {
+		msg->type = MSG_LEADERBOARD;
+		msg->data.leaderboard.count = take_integer(raw, 1);
+	}
+	else if (match(raw, "leaderboard_entry", 3, FIELD_INTEGER, FIELD_STRING,
+				FIELD_INTEGER))
+	{
+		msg->type = MSG_LEADERBOARD_ENTRY;
+		msg->data.leaderboard_entry.rank = take_integer(raw, 1);
+		msg->data.leaderboard_entry.name = take_string(raw, 2);
+		msg->data.leaderboard_entry.rating = take_integer(raw, 3);
+	}
+	else if (match(raw, "leaderboard_ok", 1, FIELD_INTEGER)) {
+		msg->type = MSG_LEADERBOARD_OK;
+		msg->data.leaderboard_ok.count = take_integer(raw, 1);
+	}
+	else if (decode_err(raw, "leaderboard_err", MSG_LEADERBOARD_ERR, msg)) {}
 	else {
 		return -1;
 	}
@@ -532,6 +820,7 @@ static int encode_err(char *name, struct message *msg, struct raw_message *raw)
 
 static int encode_message(struct message *msg, struct raw_message *raw)
 {
+	int i;
 	switch (msg->type) {
 	case MSG_INVALID:
 		return encode_nullary("invalid", raw);
@@ -543,13 +832,51 @@ static int encode_message(struct message *msg, struct raw_message *raw)
 		set_string(raw, 1, msg->data.login.name);
 		break;
 	case MSG_LOGIN_OK:
-		return encode_nullary("login_ok", raw);
+		if (init_raw_message(raw, 2) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "login_ok");
+		set_string(raw, 1, msg->data.login_ok.token);
+		break;
 	case MSG_LOGIN_ERR:
 		return encode_err("login_err", msg, raw);
+	case MSG_RESUME:
+		if (init_raw_message(raw, 2) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "resume");
+		set_string(raw, 1, msg->data.resume.token);
+		break;
+	case MSG_RESUME_OK:
+		if (init_raw_message(raw, 11) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "resume_ok");
+		set_string(raw, 1, msg->data.resume_ok.name);
+		set_string(raw, 2, msg->data.resume_ok.other);
+		set_integer(raw, 3, msg->data.resume_ok.side);
+		set_integer(raw, 4, msg->data.resume_ok.width);
+		set_integer(raw, 5, msg->data.resume_ok.height);
+		set_integer(raw, 6, msg->data.resume_ok.line_length);
+		set_integer(raw, 7, msg->data.resume_ok.red_undos);
+		set_integer(raw, 8, msg->data.resume_ok.blue_undos);
+		set_integer(raw, 9, msg->data.resume_ok.turn);
+		set_string(raw, 10, msg->data.resume_ok.board);
+		break;
+	case MSG_RESUME_ERR:
+		return encode_err("resume_err", msg, raw);
 	case MSG_START:
-		return encode_nullary("start", raw);
+		if (!msg->data.start.bot) {
+			return encode_nullary("start", raw);
+		}
+		if (init_raw_message(raw, 2) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "start");
+		set_symbol(raw, 1, "bot");
+		break;
 	case MSG_START_OK:
-		if (init_raw_message(raw, 7) < 0) {
+		if (init_raw_message(raw, 8) < 0) {
 			return -1;
 		}
 		set_symbol(raw, 0, "start_ok");
@@ -557,8 +884,9 @@ static int encode_message(struct message *msg, struct raw_message *raw)
 		set_integer(raw, 2, msg->data.start_ok.side);
 		set_integer(raw, 3, msg->data.start_ok.width);
 		set_integer(raw, 4, msg->data.start_ok.height);
-		set_integer(raw, 5, msg->data.start_ok.red_undos);
-		set_integer(raw, 6, msg->data.start_ok.blue_undos);
+		set_integer(raw, 5, msg->data.start_ok.line_length);
+		set_integer(raw, 6, msg->data.start_ok.red_undos);
+		set_integer(raw, 7, msg->data.start_ok.blue_undos);
 		break;
 	case MSG_START_ERR:
 		return encode_err("start_err", msg, raw);
@@ -612,6 +940,97 @@ static int encode_message(struct message *msg, struct raw_message *raw)
 		break;
 	case MSG_NOTIFY_QUIT:
 		return encode_nullary("notify_quit", raw);
+	case MSG_ANALYZE:
+		if (init_raw_message(raw, 1 + msg->data.analyze.nmoves) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "analyze");
+		for (i = 0; i < msg->data.analyze.nmoves; ++i) {
+			set_integer(raw, 1 + i, msg->data.analyze.moves[i]);
+		}
+		break;
+	case MSG_ANALYZE_OK:
+		if (init_raw_message(raw, 3) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "analyze_ok");
+		set_integer(raw, 1, msg->data.analyze_ok.column);
+		set_integer(raw, 2, msg->data.analyze_ok.score);
+		break;
+	case MSG_ANALYZE_ERR:
+		return encode_err("analyze_err", msg, raw);
+	case MSG_HISTORY:
+		if (init_raw_message(raw, 3) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "history");
+		set_string(raw, 1, msg->data.history.name);
+		set_integer(raw, 2, msg->data.history.count);
+		break;
+	case MSG_HISTORY_GAME:
+		if (init_raw_message(raw, 4 + msg->data.history_game.nmoves) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "history_game");
+		set_string(raw, 1, msg->data.history_game.red);
+		set_string(raw, 2, msg->data.history_game.blue);
+		set_integer(raw, 3, msg->data.history_game.winner);
+		for (i = 0; i < msg->data.history_game.nmoves; ++i) {
+			set_integer(raw, 4 + i, msg->data.history_game.moves[i]);
+		}
+		break;
+	case MSG_HISTORY_OK:
+		if (init_raw_message(raw, 2) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "history_ok");
+		set_integer(raw, 1, msg->data.history_ok.count);
+		break;
+	case MSG_HISTORY_ERR:
+		return encode_err("history_err", msg, raw);
+	case MSG_RANK:
+		if (init_raw_message(raw, 2) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "rank");
+		set_string(raw, 1, msg->data.rank.name);
+		break;
+	case MSG_RANK_OK:
+		if (init_raw_message(raw, 4) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "rank_ok");
+		set_integer(raw, 1, msg->data.rank_ok.rating);
+		set_integer(raw, 2, msg->data.rank_ok.rank);
+		set_integer(raw, 3, msg->data.rank_ok.players);
+		break;
+	case MSG_RANK_ERR:
+		return encode_err("rank_err", msg, raw);
+	case MSG_LEADERBOARD:
+		if (init_raw_message(raw, 2) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "leaderboard");
+		set_integer(raw, 1, msg->data.leaderboard.count);
+		break;
+	case MSG_LEADERBOARD_ENTRY:
+		if (init_raw_message(raw, 4) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "leaderboard_entry");
+		set_integer(raw, 1, msg->data.leaderboard_entry.rank);
+		set_string(raw, 2, msg->data.leaderboard_entry.name);
+		set_integer(raw, 3, msg->data.leaderboard_entry.rating);
+		break;
+	case MSG_LEADERBOARD_OK:
+		if (init_raw_message(raw, 2) < 0) {
+			return -1;
+		}
+		set_symbol(raw, 0, "leaderboard_ok");
+		set_integer(raw, 1, msg->data.leaderboard_ok.count);
+		break;
+	case MSG_LEADERBOARD_ERR:
+		return encode_err("leaderboard_err", msg, raw);
 	default:
 		return -1;
 	}
@@ -16,9 +16,18 @@ enum message_type {
 	MSG_LOGIN_OK,
 	MSG_LOGIN_ERR,
 
+	// MSG_RESUME is sent instead of MSG_LOGIN by a client whose connection
+	// has dropped during a game, with the token it got in MSG_LOGIN_OK.
+	// The server will respond with MSG_RESUME_OK, the client is then
+	// logged in and back in the game, or with MSG_RESUME_ERR.
+	MSG_RESUME,
+	MSG_RESUME_OK,
+	MSG_RESUME_ERR,
+
 	// MSG_START when sent to the server will attempt to connect a client
 	// to a new game. The server will respond with MSG_START_OK when
 	// the game starts or with START_ERR if game can't be started.
+	// With the bot option the game is played against the server.
 	MSG_START,
 	MSG_START_OK,
 	MSG_START_ERR,
@@ -51,6 +60,37 @@ enum message_type {
 	MSG_NOTIFY_OVER,
 	// MSG_NOTIFY_QUIT is sent to the client when opponent quits the game.
 	MSG_NOTIFY_QUIT,
+
+	// MSG_ANALYZE asks the server to evaluate the position reached
+	// by playing the given columns from the empty board. The server
+	// will respond with MSG_ANALYZE_OK or MSG_ANALYZE_ERR. A client
+	// may have only one analysis running at a time.
+	MSG_ANALYZE,
+	MSG_ANALYZE_OK,
+	MSG_ANALYZE_ERR,
+
+	// MSG_HISTORY asks for the last finished games of the named player.
+	// The server will respond with MSG_HISTORY_GAME for each of them,
+	// newest first, followed by MSG_HISTORY_OK, or with MSG_HISTORY_ERR.
+	MSG_HISTORY,
+	MSG_HISTORY_GAME,
+	MSG_HISTORY_OK,
+	MSG_HISTORY_ERR,
+
+	// MSG_RANK asks for the rating of the named player and their place
+	// on the leaderboard. The server will respond with MSG_RANK_OK
+	// or MSG_RANK_ERR.
+	MSG_RANK,
+	MSG_RANK_OK,
+	MSG_RANK_ERR,
+
+	// MSG_LEADERBOARD asks for the best rated players. The server will
+	// respond with MSG_LEADERBOARD_ENTRY for each of them, best first,
+	// followed by MSG_LEADERBOARD_OK, or with MSG_LEADERBOARD_ERR.
+	MSG_LEADERBOARD,
+	MSG_LEADERBOARD_ENTRY,
+	MSG_LEADERBOARD_OK,
+	MSG_LEADERBOARD_ERR,
 };
 
 struct message {
@@ -63,6 +103,38 @@ struct message {
 		struct {
 			char *name;
 		} login;
+		struct {
+			// resumes the game if the connection drops
+			char *token;
+		} login_ok;
+
+		struct {
+			char *token;
+		} resume;
+		struct {
+			// our name and the opponent's
+			char *name;
+			char *other;
+			// our side
+			enum side side;
+			int width;
+			int height;
+			int line_length;
+			// undos left to each player
+			int red_undos;
+			int blue_undos;
+			// side to move
+			enum side turn;
+			// The fields of the board column by column, the field (x, y)
+			// is at board[x * height + y]: 'r' for a red disc, 'b' for
+			// a blue one and '.' for an empty field.
+			char *board;
+		} resume_ok;
+
+		struct {
+			// nonzero if the game should be played against the bot
+			int bot;
+		} start;
 
 		struct {
 			// opponent's name
@@ -72,6 +144,8 @@ struct message {
 			// size of the board
 			int width;
 			int height;
+			// number of discs in a line needed to win
+			int line_length;
 			// initial undos for each player
 			int red_undos;
 			int blue_undos;
@@ -96,6 +170,61 @@ struct message {
 		struct {
 			enum side winner;
 		} notify_over;
+
+		struct {
+			int *moves;
+			int nmoves;
+		} analyze;
+		struct {
+			// best move for the side to move
+			int column;
+			// Evaluation from the point of view of the side to move,
+			// positive scores are good. Scores above 9900 mean a won
+			// position, 10000 - score is the number of plies until
+			// the win. Losses are scored symmetrically.
+			int score;
+		} analyze_ok;
+
+		struct {
+			char *name;
+			// maximum number of games to send
+			int count;
+		} history;
+		struct {
+			char *red;
+			char *blue;
+			enum side winner;
+			int *moves;
+			int nmoves;
+		} history_game;
+		struct {
+			// number of games sent
+			int count;
+		} history_ok;
+
+		struct {
+			char *name;
+		} rank;
+		struct {
+			int rating;
+			// place on the leaderboard, counted from 1
+			int rank;
+			// number of rated players
+			int players;
+		} rank_ok;
+		struct {
+			// maximum number of players to send
+			int count;
+		} leaderboard;
+		struct {
+			int rank;
+			char *name;
+			int rating;
+		} leaderboard_entry;
+		struct {
+			// number of players sent
+			int count;
+		} leaderboard_ok;
 	} data;
 };
 
@@ -103,6 +232,11 @@ struct message {
  */
 void close_message(struct message *msg);
 
+/* Copies the message to dst along with the memory it points to, so that
+ * the copy may be closed separately. Returns 0 on success and -1 on failure.
+ */
+int copy_message(const struct message *src, struct message *dst);
+
 /* Reads the next message in the buffer. This function will not mutate
  * the buffer.
  *
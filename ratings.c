@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "ratings.h"
+
+#define INITIAL_RATING 1500.0
+// the most a rating changes after a game
+#define K_FACTOR 32.0
+
+struct rating {
+	char *name;
+	double elo;
+	// the treap, ordered by elo from the best and then by name
+	struct rating *left;
+	struct rating *right;
+	uint64_t priority;
+	int size;
+};
+
+static void rating_free(void *p)
+{
+	struct rating *rt = p;
+	free(rt->name);
+	free(rt);
+}
+
+void ratings_init(struct ratings *r)
+{
+	struct timespec ts;
+	// the names are owned by the ratings
+	hashmap_init(&r->players, &hashmap_string_equals, &hashmap_string_hash,
+			NULL, &rating_free);
+	r->root = NULL;
+	// xorshift must not start from 0
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->rng = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec)
+		* UINT64_C(0x9e3779b97f4a7c15) | 1;
+}
+
+void ratings_finalize(struct ratings *r)
+{
+	hashmap_finalize(&r->players);
+}
+
+static int size(const struct rating *t)
+{
+	return t ? t->size : 0;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * UINT64_C(0x2545f4914f6cdd1d);
+}
+
+static void update(struct rating *t)
+{
+	t->size = 1 + size(t->left) + size(t->right);
+}
+
+/* Returns a negative number if a goes before b on the leaderboard.
+ */
+static int compare(const struct rating *a, const struct rating *b)
+{
+	if (a->elo != b->elo) {
+		return a->elo > b->elo ? -1 : 1;
+	}
+	return strcmp(a->name, b->name);
+}
+
+/* Splits the treap into the nodes that go before node and the rest.
+ */
+static void split(struct rating *t, const struct rating *node,
+		struct rating **before, struct rating **after)
+{
+	if (!t) {
+		*before = *after = NULL;
+	} else if (compare(t, node) < 0) {
+		split(t->right, node, &t->right, after);
+		update(t);
+		*before = t;
+	} else {
+		split(t->left, node, before, &t->left);
+		update(t);
+		*after = t;
+	}
+}
+
+static struct rating *merge(struct rating *a, struct rating *b)
+{
+	if (!a || !b) {
+		return a ? a : b;
+	}
+	if (a->priority > b->priority) {
+		a->right = merge(a->right, b);
+		update(a);
+		return a;
+	}
+	b->left = merge(a, b->left);
+	update(b);
+	return b;
+}
+
+static struct rating *insert(struct rating *t, struct rating *node)
+{
+	struct rating *before, *after;
+	split(t, node, &before, &after);
+	node->left = node->right = NULL;
+	node->size = 1;
+	return merge(merge(before, node), after);
+}
+
+static struct rating *erase(struct rating *t, const struct rating *node)
+{
+	int c;
+	if (t == node) {
+		return merge(t->left, t->right);
+	}
+	c = compare(node, t);
+	if (c < 0) {
+		t->left = erase(t->left, node);
+	} else {
+		t->right = erase(t->right, node);
+	}
+	update(t);
+	return t;
+}
+
+static struct rating *find(struct ratings *r, const char *name)
+{
+	struct rating *rt;
+	if (hashmap_get(&r->players, (void *)name, (void **)&rt) == 0) {
+		return rt;
+	}
+	rt = malloc(sizeof(*rt));
+	if (!rt) {
+		return NULL;
+	}
+	rt->name = malloc(strlen(name) + 1);
+	if (!rt->name) {
+		free(rt);
+		return NULL;
+	}
+	strcpy(rt->name, name);
+	rt->elo = INITIAL_RATING;
+	// drawn rather than hashed from the name, which the player chooses
+	rt->priority = xorshift(&r->rng);
+	if (hashmap_insert(&r->players, rt->name, rt) < 0) {
+		rating_free(rt);
+		return NULL;
+	}
+	r->root = insert(r->root, rt);
+	return rt;
+}
+
+int ratings_update(struct ratings *r, const char *red, const char *blue,
+		enum side winner)
+{
+	struct rating *a = find(r, red), *b = find(r, blue);
+	double expected, score, delta;
+	if (!a || !b || a == b) {
+		return -1;
+	}
+	expected = 1.0 / (1.0 + pow(10.0, (b->elo - a->elo) / 400.0));
+	score = winner == SIDE_RED ? 1.0 : winner == SIDE_BLUE ? 0.0 : 0.5;
+	delta = K_FACTOR * (score - expected);
+	// both players move, so they are taken out and put back
+	r->root = erase(r->root, a);
+	r->root = erase(r->root, b);
+	a->elo += delta;
+	b->elo -= delta;
+	r->root = insert(r->root, a);
+	r->root = insert(r->root, b);
+	return 0;
+}
+
+int ratings_rank(struct ratings *r, const char *name, int *rating, int *rank)
+{
+	struct rating *rt, *t = r->root;
+	int c, before = 0;
+	if (hashmap_get(&r->players, (void *)name, (void **)&rt) < 0) {
+		return -1;
+	}
+	while (t != rt) {
+		c = compare(rt, t);
+		if (c < 0) {
+			t = t->left;
+		} else {
+			before += size(t->left) + 1;
+			t = t->right;
+		}
+	}
+	*rating = (int)lround(rt->elo);
+	*rank = before + size(t->left) + 1;
+	return 0;
+}
+
+size_t ratings_count(struct ratings *r)
+{
+	return size(r->root);
+}
+
+struct top {
+	int n;
+	int found;
+	int (*fn)(const char *name, int rating, int rank, void *ctx);
+	void *ctx;
+};
+
+static int walk(const struct rating *t, struct top *top)
+{
+	if (!t || top->found == top->n) {
+		return 0;
+	}
+	if (walk(t->left, top) < 0) {
+		return -1;
+	}
+	if (top->found == top->n) {
+		return 0;
+	}
+	top->found++;
+	if (top->fn(t->name, (int)lround(t->elo), top->found, top->ctx) < 0) {
+		return -1;
+	}
+	return walk(t->right, top);
+}
+
+int ratings_top(struct ratings *r, int n,
+		int (*fn)(const char *name, int rating, int rank, void *ctx),
+		void *ctx)
+{
+	struct top top;
+	top.n = n;
+	top.found = 0;
+	top.fn = fn;
+	top.ctx = ctx;
+	if (walk(r->root, &top) < 0) {
+		return -1;
+	}
+	return top.found;
+}
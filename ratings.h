@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashmap.h"
+#include "side.h"
+
+/* This module keeps the Elo ratings of the players and the leaderboard.
+ * The leaderboard is a treap ordered by rating, each node knows the size
+ * of its subtree, so a rating is updated and a player's rank is found
+ * in O(log n), and the best k players are listed in O(k + log n).
+ */
+
+struct rating;
+
+struct ratings {
+	// these should be treated as private
+	// maps the name to struct rating
+	struct hashmap players;
+	struct rating *root;
+	// draws the priorities of the treap
+	uint64_t rng;
+};
+
+void ratings_init(struct ratings *r);
+
+void ratings_finalize(struct ratings *r);
+
+/* Updates the ratings of both players after a game won by winner,
+ * or drawn if it's SIDE_NONE. Players are added on their first game.
+ * Returns 0 on success and -1 on failure.
+ */
+int ratings_update(struct ratings *r, const char *red, const char *blue,
+		enum side winner);
+
+/* Finds the rating of the player and their rank, counted from 1.
+ * Returns 0 on success and -1 if the player hasn't played yet.
+ */
+int ratings_rank(struct ratings *r, const char *name, int *rating, int *rank);
+
+/* Returns the number of rated players.
+ */
+size_t ratings_count(struct ratings *r);
+
+/* Calls fn for the n best players, best first, until fn returns -1.
+ * Returns the number of players passed to fn, or -1 if fn has stopped.
+ */
+int ratings_top(struct ratings *r, int n,
+		int (*fn)(const char *name, int rating, int rank, void *ctx),
+		void *ctx);
@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+int ring_init(struct ring *r, size_t capacity, size_t item_size)
+{
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+		return -1;
+	}
+	r->items = malloc(capacity * item_size);
+	if (!r->items) {
+		return -1;
+	}
+	r->item_size = item_size;
+	r->mask = capacity - 1;
+	r->head = r->tail_seen = 0;
+	r->tail = r->head_seen = 0;
+	return 0;
+}
+
+void ring_finalize(struct ring *r)
+{
+	free(r->items);
+}
+
+int ring_full(struct ring *r)
+{
+	if (r->tail - r->head_seen <= r->mask) {
+		return 0;
+	}
+	// the consumer has popped since we last looked
+	r->head_seen = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	return r->tail - r->head_seen > r->mask;
+}
+
+int ring_push(struct ring *r, const void *item)
+{
+	if (ring_full(r)) {
+		return -1;
+	}
+	memcpy(r->items + (r->tail & r->mask) * r->item_size, item, r->item_size);
+	// the item must be written before the consumer sees it
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int ring_empty(struct ring *r)
+{
+	if (r->head != r->tail_seen) {
+		return 0;
+	}
+	// the producer may have pushed since we last looked
+	r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	return r->head == r->tail_seen;
+}
+
+int ring_pop(struct ring *r, void *item)
+{
+	if (ring_empty(r)) {
+		return -1;
+	}
+	memcpy(item, r->items + (r->head & r->mask) * r->item_size, r->item_size);
+	// the slot may be reused once the item is copied out
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* This module implements a bounded lock-free queue of fixed-size items
+ * between a single producer thread and a single consumer thread. Each side
+ * writes only its own index and keeps a copy of the other's, so the shared
+ * cache lines only move when the copy runs out.
+ */
+
+// size of a cache line, the indices of the two sides are kept this far apart
+#define RING_LINE 64
+
+struct ring {
+	// these should be treated as private
+	char *items;
+	size_t item_size;
+	// the capacity minus one, the capacity is a power of two
+	uint64_t mask;
+	char pad0[RING_LINE];
+	// the next item to pop, written by the consumer
+	uint64_t head;
+	// the consumer's copy of tail
+	uint64_t tail_seen;
+	char pad1[RING_LINE];
+	// the next free slot, written by the producer
+	uint64_t tail;
+	// the producer's copy of head
+	uint64_t head_seen;
+	char pad2[RING_LINE];
+};
+
+/* Initializes an empty ring holding up to capacity items of item_size
+ * bytes, capacity must be a power of two. Returns 0 on success and -1
+ * on failure.
+ */
+int ring_init(struct ring *r, size_t capacity, size_t item_size);
+
+void ring_finalize(struct ring *r);
+
+/* Copies the item to the end of the ring, called by the producer.
+ * Returns 0 on success and -1 if the ring is full.
+ */
+int ring_push(struct ring *r, const void *item);
+
+/* Returns 1 if the ring is full and 0 otherwise, called by the producer.
+ * A ring that isn't full stays so until the producer pushes.
+ */
+int ring_full(struct ring *r);
+
+/* Returns 1 if the ring is empty and 0 otherwise, called by the consumer.
+ */
+int ring_empty(struct ring *r);
+
+/* Moves the first item of the ring to item, called by the consumer.
+ * Returns 0 on success and -1 if the ring is empty.
+ */
+int ring_pop(struct ring *r, void *item);
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "game.h"
+
+/* Plays complete games with the rules from game.c as fast as possible
+ * and prints how often each side wins. Every thread plays its own stream
+ * of games with its own random generator.
+ *
+ * The games may also be written to a file, which starts with a header
+ * (the magic "FOURGAME", then width, height and line length as 32-bit
+ * numbers) followed by one record per game: the number of moves as
+ * a 32-bit number, the winner as a signed byte (see side.h) and the
+ * columns of the moves as bytes. Numbers are in the byte order of the
+ * machine and the games of different threads are interleaved.
+ */
+
+#define GAME_MAGIC "FOURGAME"
+// games are written in chunks of at least this many bytes
+#define CHUNK_SIZE (1 << 16)
+
+enum policy {
+	// every move is picked at random
+	POLICY_RANDOM,
+	// wins when it can, blocks the opponent's wins, random otherwise
+	POLICY_GREEDY,
+};
+
+struct stats {
+	unsigned long games;
+	unsigned long moves;
+	unsigned long wins[2];
+	unsigned long draws;
+};
+
+struct output {
+	FILE *file;
+	pthread_mutex_t lock;
+	int failed;
+};
+
+struct player {
+	pthread_t thread;
+	struct game_rules rules;
+	enum policy policy;
+	unsigned long games;
+	uint64_t rng;
+	struct output *output;
+	struct stats stats;
+	unsigned char *chunk;
+	size_t chunk_len;
+};
+
+const int DEFAULT_WIDTH = 7;
+const int DEFAULT_HEIGHT = 6;
+const int DEFAULT_LINE_LENGTH = 4;
+const int DEFAULT_THREADS = 1;
+const unsigned long DEFAULT_GAMES = 1000000;
+
+const char *USAGE = "selfplay [-w WIDTH] [-h HEIGHT] [-l LINE] [-j THREADS]"
+	" [-n GAMES] [-p random|greedy] [-r SEED] [-o FILE]";
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * UINT64_C(0x2545f4914f6cdd1d);
+}
+
+static int random_column(struct player *p, struct game *g)
+{
+	int x, i;
+	x = xorshift(&p->rng) % g->width;
+	// take the next column that isn't full
+	for (i = 0; i < g->width; ++i) {
+		if (g->heights[(x + i) % g->width] < g->height) {
+			return (x + i) % g->width;
+		}
+	}
+	return -1;
+}
+
+static int pick_column(struct player *p, struct game *g)
+{
+	enum side other = g->turn == SIDE_RED ? SIDE_BLUE : SIDE_RED;
+	int x;
+	if (p->policy == POLICY_GREEDY) {
+		for (x = 0; x < g->width; ++x) {
+			if (game_wins(g, g->turn, x)) {
+				return x;
+			}
+		}
+		for (x = 0; x < g->width; ++x) {
+			if (game_wins(g, other, x)) {
+				return x;
+			}
+		}
+	}
+	return random_column(p, g);
+}
+
+static int flush_chunk(struct player *p)
+{
+	struct output *out = p->output;
+	pthread_mutex_lock(&out->lock);
+	if (fwrite(p->chunk, 1, p->chunk_len, out->file) != p->chunk_len) {
+		out->failed = 1;
+	}
+	pthread_mutex_unlock(&out->lock);
+	p->chunk_len = 0;
+	return out->failed ? -1 : 0;
+}
+
+static int record_game(struct player *p, struct game *g)
+{
+	uint32_t moves = g->moves;
+	signed char winner = g->winner;
+	memcpy(p->chunk + p->chunk_len, &moves, sizeof(moves));
+	p->chunk_len += sizeof(moves);
+	p->chunk[p->chunk_len++] = winner;
+	memcpy(p->chunk + p->chunk_len, game_history(g), moves);
+	p->chunk_len += moves;
+	if (p->chunk_len >= CHUNK_SIZE) {
+		return flush_chunk(p);
+	}
+	return 0;
+}
+
+static void *play(void *arg)
+{
+	struct player *p = arg;
+	struct game start, g;
+	unsigned long i;
+	if (game_init(&start, &p->rules) < 0) {
+		return NULL;
+	}
+	if (game_init(&g, &p->rules) < 0) {
+		game_finalize(&start);
+		return NULL;
+	}
+	for (i = 0; i < p->games; ++i) {
+		game_copy(&g, &start);
+		while (!g.over) {
+			game_drop(&g, g.turn, pick_column(p, &g));
+		}
+		p->stats.games++;
+		p->stats.moves += g.moves;
+		if (g.winner == SIDE_NONE) {
+			p->stats.draws++;
+		} else {
+			p->stats.wins[g.winner]++;
+		}
+		if (p->output && record_game(p, &g) < 0) {
+			break;
+		}
+	}
+	if (p->output && p->chunk_len > 0) {
+		flush_chunk(p);
+	}
+	game_finalize(&g);
+	game_finalize(&start);
+	return NULL;
+}
+
+static int write_header(FILE *file, const struct game_rules *rules)
+{
+	uint32_t dims[3];
+	dims[0] = rules->width;
+	dims[1] = rules->height;
+	dims[2] = rules->line_length;
+	if (fwrite(GAME_MAGIC, 1, 8, file) != 8
+			|| fwrite(dims, sizeof(dims), 1, file) != 1)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+static int run(const struct game_rules *rules, int threads, unsigned long games,
+		enum policy policy, uint64_t seed, struct output *out)
+{
+	struct player *players;
+	struct stats total = {0};
+	double start, elapsed;
+	int i, started;
+	players = calloc(threads, sizeof(*players));
+	if (!players) {
+		return -1;
+	}
+	for (i = 0; i < threads; ++i) {
+		players[i].rules = *rules;
+		players[i].policy = policy;
+		players[i].games = games / threads + (i < games % threads);
+		// xorshift needs a nonzero state
+		players[i].rng = (seed + i + 1) * UINT64_C(0x9e3779b97f4a7c15) | 1;
+		players[i].output = out;
+		if (out) {
+			// room for one more game of any length
+			players[i].chunk = malloc(CHUNK_SIZE + sizeof(uint32_t) + 1
+					+ rules->width * rules->height);
+			if (!players[i].chunk) {
+				while (i > 0) {
+					free(players[--i].chunk);
+				}
+				free(players);
+				return -1;
+			}
+		}
+	}
+	start = now();
+	for (started = 0; started < threads; ++started) {
+		if (pthread_create(&players[started].thread, NULL,
+					play, &players[started]) != 0)
+		{
+			break;
+		}
+	}
+	for (i = 0; i < started; ++i) {
+		pthread_join(players[i].thread, NULL);
+		total.games += players[i].stats.games;
+		total.moves += players[i].stats.moves;
+		total.wins[SIDE_RED] += players[i].stats.wins[SIDE_RED];
+		total.wins[SIDE_BLUE] += players[i].stats.wins[SIDE_BLUE];
+		total.draws += players[i].stats.draws;
+		free(players[i].chunk);
+	}
+	elapsed = now() - start;
+	for (i = started; i < threads; ++i) {
+		free(players[i].chunk);
+	}
+	free(players);
+	if (started == 0 || total.games == 0) {
+		return -1;
+	}
+	printf("games:         %lu\n", total.games);
+	printf("first player:  %.2f%%\n", 100.0 * total.wins[SIDE_RED] / total.games);
+	printf("second player: %.2f%%\n", 100.0 * total.wins[SIDE_BLUE] / total.games);
+	printf("draws:         %.2f%%\n", 100.0 * total.draws / total.games);
+	printf("average moves: %.2f\n", (double)total.moves / total.games);
+	printf("games/sec:     %.0f\n", total.games / elapsed);
+	printf("moves/sec:     %.0f\n", total.moves / elapsed);
+	return started == threads && total.games == games ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct game_rules rules;
+	struct output out;
+	const char *path = NULL;
+	enum policy policy = POLICY_RANDOM;
+	int threads = DEFAULT_THREADS;
+	unsigned long games = DEFAULT_GAMES;
+	uint64_t seed = time(NULL);
+	int c, res;
+	rules.width = DEFAULT_WIDTH;
+	rules.height = DEFAULT_HEIGHT;
+	rules.line_length = DEFAULT_LINE_LENGTH;
+	rules.undos = 0;
+	while ((c = getopt(argc, argv, "w:h:l:j:n:p:r:o:")) != -1) {
+		switch (c) {
+		case 'w':
+			rules.width = atoi(optarg);
+			break;
+		case 'h':
+			rules.height = atoi(optarg);
+			break;
+		case 'l':
+			rules.line_length = atoi(optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'n':
+			games = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			if (strcmp(optarg, "random") == 0) {
+				policy = POLICY_RANDOM;
+			} else if (strcmp(optarg, "greedy") == 0) {
+				policy = POLICY_GREEDY;
+			} else {
+				fprintf(stderr, "%s\n", USAGE);
+				return 1;
+			}
+			break;
+		case 'r':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			path = optarg;
+			break;
+		default:
+			fprintf(stderr, "%s\n", USAGE);
+			return 1;
+		}
+	}
+	if (optind != argc || threads <= 0 || games == 0
+			|| game_rules_check(&rules) < 0)
+	{
+		fprintf(stderr, "%s\n", USAGE);
+		return 1;
+	}
+	if (path) {
+		out.file = fopen(path, "wb");
+		if (!out.file || write_header(out.file, &rules) < 0) {
+			perror("failed to open the output");
+			return 1;
+		}
+		pthread_mutex_init(&out.lock, NULL);
+		out.failed = 0;
+	}
+	res = run(&rules, threads, games, policy, seed, path ? &out : NULL);
+	if (path) {
+		if (fclose(out.file) != 0 || out.failed) {
+			res = -1;
+		}
+		pthread_mutex_destroy(&out.lock);
+	}
+	if (res < 0) {
+		perror("self-play failed");
+		return 1;
+	}
+	return 0;
+}
@@ -1,56 +1,422 @@
+// accept4 and SO_BUSY_POLL are GNU extensions
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
+#include "ai.h"
+#include "mcts.h"
+#include "book.h"
+#include "tablebase.h"
+#include "cache.h"
+#include "journal.h"
+#include "archive.h"
+#include "ratings.h"
+#include "snapshot.h"
+#include "handoff.h"
+#include "pool.h"
+#include "timer.h"
+#include "limiter.h"
+#include "io.h"
+#include "cpu.h"
 #include "hashmap.h"
 #include "buffer.h"
 #include "protocol.h"
 #include "side.h"
 #include "game.h"
 
-#define MAX_READ 64
-#define MAX_WRITE 64
+#define MAX_READ 4096
+#define MAX_WRITE 4096
+
+// number of entries in the transposition table of each bot thread
+#define BOT_TABLE_SIZE (1 << 20)
+// number of tree nodes of each bot thread using Monte Carlo search
+#define BOT_TREE_SIZE (1 << 19)
+// most CPUs the threads may be pinned to
+#define MAX_CPUS 1024
+// most connections accepted from a listener in a round of events
+#define ACCEPT_BATCH 64
+// milliseconds the listeners rest after accept has run out of resources
+#define ACCEPT_PAUSE 100
+// number of addresses whose logins are limited at a time
+#define LIMITED_PEERS 65536
+// number of shards of the analysis cache
+#define CACHE_SHARDS 16
+// most games sent in answer to a history request
+#define MAX_HISTORY 100
+// most players sent in answer to a leaderboard request
+#define MAX_LEADERBOARD 100
+// longest a step of a snapshot may keep the loop busy, in microseconds
+#define SNAPSHOT_STEP_US 500
+// hexadecimal digits of a resume token
+#define TOKEN_LEN 32
+
+enum engine_type {
+	// alpha-beta if the rules allow it, Monte Carlo search otherwise
+	ENGINE_AUTO,
+	ENGINE_ALPHABETA,
+	ENGINE_MCTS,
+	// only used in results, the move was found in the opening book
+	// or in the tablebase
+	ENGINE_BOOK,
+	ENGINE_TABLEBASE,
+};
+
+/* What happens to the messages for a client whose output is above
+ * the high watermark.
+ */
+enum output_policy {
+	// they are left out
+	OUTPUT_DROP,
+	// the client is disconnected
+	OUTPUT_DISCONNECT,
+	// the moves and undos of their game are left out, the state of the game
+	// is sent instead once the output drains, the others are sent as usual
+	OUTPUT_COALESCE,
+};
+
+/* What happens to a message of a client who is over their rate.
+ */
+enum limit_action {
+	// it's answered with an error
+	LIMIT_ERROR,
+	// the client is disconnected
+	LIMIT_DISCONNECT,
+};
+
+struct engine {
+	enum engine_type type;
+	// the tables probed before searching, may be NULL
+	const struct book *book;
+	const struct tablebase *tablebase;
+	union {
+		struct ai ai;
+		struct mcts mcts;
+	} data;
+};
+
+struct bot_job;
+
+/* Links the live pairs into a circular list, the server holds the head
+ * and the cursor of the snapshot being taken.
+ */
+struct pair_link {
+	struct pair_link *prev;
+	struct pair_link *next;
+};
 
 struct pair {
+	// must be the first member, the list is walked by the snapshots
+	struct pair_link link;
+	// the seat of the bot is NULL, and so is the seat of a player who
+	// hasn't come back since the restart
 	struct client *red;
 	struct client *blue;
 	struct game game;
+	// side played by the bot, SIDE_NONE in games between clients
+	enum side bot;
+	// the search for the bot's next move, NULL if the bot is not thinking
+	struct bot_job *job;
+	// when the game started, in milliseconds since the epoch
+	uint64_t started;
+	// names of the players whose seats are kept for them, NULL for
+	// the seats that are taken and for the bot's
+	char *red_name;
+	char *blue_name;
+	// tokens with which the dropped players resume the game, NULL unless
+	// the seat is kept for a player whose connection has dropped, and
+	// the timers at which their seats expire
+	char *red_token;
+	char *blue_token;
+	struct timer red_grace;
+	struct timer blue_grace;
+	// expires when the player to move has run out of time, armed only
+	// while it's a player's turn and the moves are timed
+	struct timer clock;
+	// the server's seats that are kept, maps the name to the pair,
+	// and the kept seats of the dropped players, maps the token to the pair
+	struct hashmap *seats;
+	struct hashmap *tokens;
+};
+
+/* A search for the bot's move, or for the analysis requested by a client.
+ * The job works on its own copy of the game, so the pair or the client
+ * may disappear while the search runs.
+ */
+struct bot_job {
+	struct pool_job base;
+	// NULL once the pair or the client is gone
+	struct pair *pair;
+	struct client *client;
+	// the analysis cache to fill, NULL for the bot's moves
+	struct cache *cache;
+	// when the analysis was requested, in microseconds
+	uint64_t started;
+	// set when the result is no longer needed, makes the search stop early
+	int cancelled;
+	int time_ms;
+	int moves;
+	unsigned char *history;
+	// canonical hash of the position, see game_canonical_hash
+	uint64_t key;
+	int mirrored;
+	int width;
+	int status;
+	enum engine_type engine;
+	union {
+		struct ai_result ai;
+		struct mcts_result mcts;
+		struct book_entry book;
+		struct tablebase_result tablebase;
+	} result;
 };
 
+const char *BOT_NAME = "bot";
+
 struct client {
 	int sock;
 	// NULL if client is not logged in
 	char *name;
+	// sent with MSG_LOGIN_OK, NULL if client is not logged in
+	char *token;
 	// NULL if no pair
 	struct pair *pair;
+	// the running analysis, NULL if there is none
+	struct bot_job *analysis;
+	// when the client last sent or got a message, in milliseconds,
+	// see now_ms, and the timer that disconnects them once they are idle
+	uint64_t active;
+	struct timer idle;
+	// set while the output is above the high watermark, the client's
+	// messages are not read until it drains to the low one
+	int paused;
+	// set when the moves of the client's game were left out of the output
+	int stale;
+	// set once the client is being disconnected for reading too slowly
+	int closing;
+	// set while the client is on the ready list, see client_serve,
+	// and the neighbours on the list
+	int ready;
+	struct client *ready_prev;
+	struct client *ready_next;
+	// tokens for the messages of the client
+	struct token_bucket messages;
+	// the I/O thread serving the socket, NULL if the loop serves it,
+	// and the number telling the connection apart from the earlier ones
+	// with the same socket
+	struct io_thread *io;
+	uint64_t id;
 	struct buffer input;
 	struct buffer output;
 };
 
-struct pair *pair_new(struct client *red, struct client *blue, int width, int height)
+static uint64_t wall_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_ms(void)
+{
+	return now_us() / 1000;
+}
+
+struct pair *pair_new(struct client *red, struct client *blue,
+		const struct game_rules *rules)
 {
 	struct pair *pair = malloc(sizeof(*pair));
 	if (!pair) {
 		return NULL;
 	}
+	if (game_init(&pair->game, rules) < 0) {
+		free(pair);
+		return NULL;
+	}
 	pair->red = red;
 	pair->blue = blue;
-	game_init(&pair->game, width, height);
-	red->pair = pair;
-	blue->pair = pair;
+	pair->bot = !red ? SIDE_RED : !blue ? SIDE_BLUE : SIDE_NONE;
+	pair->job = NULL;
+	pair->started = wall_ms();
+	pair->red_name = NULL;
+	pair->blue_name = NULL;
+	pair->red_token = NULL;
+	pair->blue_token = NULL;
+	timer_init(&pair->red_grace);
+	timer_init(&pair->blue_grace);
+	timer_init(&pair->clock);
+	pair->seats = NULL;
+	pair->tokens = NULL;
+	pair->link.prev = pair->link.next = &pair->link;
+	if (red) {
+		red->pair = pair;
+	}
+	if (blue) {
+		blue->pair = pair;
+	}
 	return pair;
 }
 
+void link_insert(struct pair_link *after, struct pair_link *link)
+{
+	link->prev = after;
+	link->next = after->next;
+	after->next->prev = link;
+	after->next = link;
+}
+
+void link_remove(struct pair_link *link)
+{
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	link->prev = link->next = link;
+}
+
+/* Returns the name of the player on the given side, whether they are
+ * in the game or their seat is kept for them.
+ */
+const char *pair_name(struct pair *pair, enum side side)
+{
+	struct client *cli = side == SIDE_RED ? pair->red : pair->blue;
+	const char *name = side == SIDE_RED ? pair->red_name : pair->blue_name;
+	return cli ? cli->name : name ? name : BOT_NAME;
+}
+
+/* Returns the token with which the player on the given side resumes,
+ * which is empty for the bot.
+ */
+static const char *pair_token(struct pair *pair, enum side side)
+{
+	struct client *cli = side == SIDE_RED ? pair->red : pair->blue;
+	const char *token = side == SIDE_RED ? pair->red_token : pair->blue_token;
+	return cli ? cli->token : token ? token : "";
+}
+
+/* Stops keeping the seat, the name is freed.
+ */
+void seat_release(struct pair *pair, char **name)
+{
+	struct pair *owner;
+	if (!*name) {
+		return;
+	}
+	if (hashmap_get(pair->seats, *name, (void **)&owner) == 0 && owner == pair) {
+		hashmap_remove(pair->seats, *name);
+	}
+	free(*name);
+	*name = NULL;
+}
+
+/* Stops keeping the seat of the dropped player on the given side,
+ * the token is freed and the seat no longer expires.
+ */
+void token_release(struct pair *pair, enum side side)
+{
+	char **token = side == SIDE_RED ? &pair->red_token : &pair->blue_token;
+	if (!*token) {
+		return;
+	}
+	hashmap_remove(pair->tokens, *token);
+	free(*token);
+	*token = NULL;
+	timer_cancel(side == SIDE_RED ? &pair->red_grace : &pair->blue_grace);
+}
+
+/* Returns the token of the dropped player with the given name,
+ * or NULL if their seat is not kept with a token.
+ */
+const char *seat_token(struct pair *pair, const char *name)
+{
+	if (pair->red_name && strcmp(pair->red_name, name) == 0) {
+		return pair->red_token;
+	}
+	return pair->blue_token;
+}
+
+/* Seats the client in the pair where their seat is kept.
+ */
+void seat_take(struct pair *pair, struct client *cli)
+{
+	if (pair->red_name && strcmp(pair->red_name, cli->name) == 0) {
+		seat_release(pair, &pair->red_name);
+		token_release(pair, SIDE_RED);
+		pair->red = cli;
+	} else {
+		seat_release(pair, &pair->blue_name);
+		token_release(pair, SIDE_BLUE);
+		pair->blue = cli;
+	}
+	cli->pair = pair;
+}
+
+void pair_log(struct pair *pair)
+{
+	const unsigned char *history = game_history(&pair->game);
+	int i;
+	printf("game %s vs %s:",
+			pair_name(pair, SIDE_RED), pair_name(pair, SIDE_BLUE));
+	for (i = 0; i < pair->game.moves; ++i) {
+		printf(" %d", history[i]);
+	}
+	printf("\n");
+}
+
+void bot_cancel(struct pair *pair)
+{
+	if (pair->job) {
+		__atomic_store_n(&pair->job->cancelled, 1, __ATOMIC_RELAXED);
+		pair->job->pair = NULL;
+		pair->job = NULL;
+	}
+}
+
+void analysis_cancel(struct client *cli)
+{
+	if (cli->analysis) {
+		__atomic_store_n(&cli->analysis->cancelled, 1, __ATOMIC_RELAXED);
+		cli->analysis->client = NULL;
+		cli->analysis = NULL;
+	}
+}
+
 void pair_free(struct pair *pair)
 {
-	pair->red->pair = NULL;
-	pair->blue->pair = NULL;
+	if (pair->red) {
+		pair->red->pair = NULL;
+	}
+	if (pair->blue) {
+		pair->blue->pair = NULL;
+	}
+	seat_release(pair, &pair->red_name);
+	seat_release(pair, &pair->blue_name);
+	token_release(pair, SIDE_RED);
+	token_release(pair, SIDE_BLUE);
+	timer_cancel(&pair->clock);
+	link_remove(&pair->link);
+	bot_cancel(pair);
 	game_finalize(&pair->game);
 	free(pair);
 }
@@ -63,7 +429,18 @@ struct client *client_new(int sock)
 	}
 	cli->sock = sock;
 	cli->name = NULL;
+	cli->token = NULL;
 	cli->pair = NULL;
+	cli->analysis = NULL;
+	cli->active = now_ms();
+	timer_init(&cli->idle);
+	cli->paused = 0;
+	cli->stale = 0;
+	cli->closing = 0;
+	cli->ready = 0;
+	cli->ready_prev = cli->ready_next = NULL;
+	cli->io = NULL;
+	cli->id = 0;
 	buffer_init(&cli->input);
 	buffer_init(&cli->output);
 	return cli;
@@ -71,11 +448,17 @@ struct client *client_new(int sock)
 
 void client_free(struct client *cli)
 {
-	close(cli->sock);
+	// the I/O threads close their sockets when they are told to
+	if (!cli->io) {
+		close(cli->sock);
+	}
 	free(cli->name);
+	free(cli->token);
 	if (cli->pair) {
 		pair_free(cli->pair);
 	}
+	analysis_cancel(cli);
+	timer_cancel(&cli->idle);
 	buffer_finalize(&cli->input);
 	buffer_finalize(&cli->output);
 	free(cli);
@@ -102,19 +485,220 @@ enum side client_side(struct client *cli)
 struct server {
 	int epoll;
 	int listener;
+	// the Unix domain listener for the clients on the same host, -1 if
+	// there is none
+	int local;
+	// the path it's bound to, NULL if there is none or if it's
+	// in the abstract namespace
+	char *local_path;
+	// expires when the listeners, left out of the events after accept has
+	// run out of descriptors or memory, should be watched again
+	struct timer accept_timer;
 	// clients by file descrptior, maps int to struct client
 	struct hashmap clients_by_fd;
 	// clients by name, maps string to int
 	struct hashmap fds_by_name;
+	// logged in clients by token, maps string to int, the tokens are owned
+	// by the clients
+	struct hashmap fds_by_token;
 	// fd of the client waiting for a game. -1 if empty.
 	int waiting_client;
+	// the player who was waiting when the snapshot was taken, they go
+	// back to waiting when they log in. NULL if there is none.
+	char *waiting_name;
+	// head of the list of live pairs
+	struct pair_link pairs;
+	// seats kept for the players of the restored games and for the dropped
+	// players, maps the name to struct pair, the names are owned by the pairs
+	struct hashmap seats;
+	// seats kept for the dropped players, maps the token to struct pair,
+	// the tokens are owned by the pairs
+	struct hashmap tokens;
+	// the tokens are read from here
+	int random;
+
+	// the idle clients, the kept seats, the move clocks and the queue
+	// expire here, the times are in milliseconds, see now_ms
+	struct timer_wheel timers;
+	// the seats of the dropped players are kept this long, 0 if they
+	// are not kept
+	int grace;
+	// the clients outside of the games and the queue are disconnected
+	// after this long without a message, 0 if they are not
+	int idle;
+	// time for a move, 0 if the moves are not timed
+	int move_time;
+	// time the waiting client waits for an opponent, 0 if it's unlimited
+	int queue_time;
+	// expires when the waiting client has waited for queue_time
+	struct timer queue_timer;
+
+	// reading from a client stops while their output is above high_water
+	// bytes and goes on once it drains to low_water bytes
+	size_t high_water;
+	size_t low_water;
+	enum output_policy policy;
+	// bytes in the output of all clients, the most the output of a client
+	// has held, the paused clients and the messages left out of the output
+	size_t buffered;
+	size_t buffered_max;
+	unsigned long paused;
+	unsigned long dropped;
+	// the client whose messages are being handled, NULL if there is none
+	struct client *reading;
+	// most messages of a client handled at a time
+	int budget;
+	// the clients with messages left after their turn, served in turns
+	// before waiting for the next events
+	struct client *ready_head;
+	struct client *ready_tail;
+
+	// the messages of a client are limited to message_rate a second,
+	// in bursts of message_burst, 0 if they are not limited
+	int message_rate;
+	int message_burst;
+	// the logins from an address, with the resumes, 0 if not limited
+	int login_rate;
+	struct limiter logins;
+	enum limit_action limit_action;
+	unsigned long limited;
+
+	// the threads serving the sockets of the clients, see io.h, the loop
+	// serves them itself if there are none
+	struct io_thread *io;
+	int nio;
+	// eventfd written by the I/O threads
+	int io_event;
+	// the number of the last accepted connection
+	uint64_t last_id;
 
-	// size of a game board
-	int game_width;
-	int game_height;
+	// the CPU the loop is pinned to, -1 if it isn't
+	int cpu;
+	// polling after the events instead of sleeping right away, see cpu.h
+	struct cpu_spin spin;
+	// SO_BUSY_POLL of the clients' sockets in microseconds, 0 if it's not set
+	int busy_poll;
+
+	// rules of the started games
+	struct game_rules rules;
+
+	// workers searching for the bots' moves, each with its own engine.
+	// nbots is 0 if the bots are not available.
+	struct pool bots;
+	struct engine *engines;
+	size_t nbots;
+	int bot_time;
+	// tables shared by the bots, NULL if there are none
+	struct book *book;
+	struct tablebase *tablebase;
+
+	// results of the analyses, shared with the workers
+	struct cache cache;
+	unsigned long analyses;
+	// latency of the answered analyses, in microseconds
+	uint64_t analysis_time;
+	uint64_t analysis_max_time;
+
+	// finished games are appended here, NULL if there is no journal
+	struct journal *journal;
+	// the games of the journal indexed by player, NULL if there is none
+	struct archive *archive;
+	// set while the archive can't write its games, see archive_failing
+	int archive_failing;
+	// ratings of the players from their games against each other
+	struct ratings ratings;
+
+	// the live games are written here periodically, NULL if they aren't
+	struct snapshot *snapshot;
+	// timerfd of the snapshots
+	int snapshot_timer;
+	// while a snapshot is taken, the cursor is linked into the list
+	// of pairs right after the last game added to it
+	struct pair_link snapshot_cursor;
+	int snapshotting;
+	unsigned long snapshot_games;
+	uint64_t snapshot_started;
+
+	// the socket on which a new server takes over, -1 if there is none
+	int handoff;
+	const char *handoff_path;
+	// the connection to the new server after the handoff, closed last
+	// to tell the new server that this one is done, -1 before
+	int successor;
+	// what was received from the old server until it's taken over,
+	// NULL if the server has started afresh
+	int *takeover_fds;
+	int takeover_nfds;
+	// number of the listeners before the clients' sockets
+	int takeover_listeners;
+	char *takeover_data;
+	size_t takeover_len;
+};
+
+struct server_config {
+	int port;
+	// path of the Unix domain listener, starting with '@' for the abstract
+	// namespace, may be NULL
+	const char *local;
+	// length of the queue of connections waiting to be accepted
+	int backlog;
+	struct game_rules rules;
+	// number of bot moves searched at the same time
+	int bot_threads;
+	// number of threads working on a single search
+	int search_threads;
+	// time limit for a bot's move, in milliseconds
+	int bot_time;
+	enum engine_type engine;
+	// paths of the opening book and the tablebase, may be NULL
+	const char *book;
+	const char *tablebase;
+	// number of analyses kept in the cache
+	int cache_size;
+	// path of the journal of finished games, may be NULL
+	const char *journal;
+	// directory of the archive, may be NULL, needs the journal
+	const char *archive;
+	// path of the snapshot of the live games, may be NULL
+	const char *snapshot;
+	// seconds between snapshots
+	int snapshot_interval;
+	// seconds the seat of a dropped player is kept, 0 if it isn't
+	int grace;
+	// seconds after which the idle clients are disconnected, 0 if they aren't
+	int idle;
+	// seconds for a move, 0 if the moves are not timed
+	int move_time;
+	// seconds a client waits for an opponent, 0 if it's unlimited
+	int queue_time;
+	// most messages of a client handled at a time
+	int budget;
+	// messages a second of a client and logins a second from an address,
+	// 0 if they are not limited, and the bursts allowed above them
+	int message_rate;
+	int message_burst;
+	int login_rate;
+	int login_burst;
+	enum limit_action limit_action;
+	// number of I/O threads, 0 if the loop serves the sockets itself
+	int io_threads;
+	// the CPUs of the loop and of the I/O threads, in turn, the threads
+	// are not pinned if there are none
+	int cpus[MAX_CPUS];
+	int ncpus;
+	// microseconds a loop polls after an event before it sleeps
+	int spin;
+	// SO_BUSY_POLL of the clients' sockets in microseconds, 0 if it's not set
+	int busy_poll;
+	// watermarks of the output of a client, in bytes
+	int high_water;
+	int low_water;
+	enum output_policy policy;
+	// path of the socket on which a new server takes over, may be NULL
+	const char *handoff;
 };
 
-int make_listener(int port)
+int make_listener(int port, int backlog)
 {
 	int sock;
 	struct sockaddr_in addr;
@@ -132,7 +716,7 @@ int make_listener(int port)
 	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 		goto error;
 	}
-	if (listen(sock, 5) < 0) {
+	if (listen(sock, backlog) < 0) {
 		goto error;
 	}
 	return sock;
@@ -141,372 +725,2819 @@ error:
 	return -1;
 }
 
-int server_init(struct server *s, int port, int game_width, int game_height)
+/* Removes the socket at the path if nobody listens on it anymore, such as
+ * one left by a server that has died. Anything else at the path is left
+ * alone and the bind fails on it. Returns -1 if a server is listening
+ * there and 0 otherwise.
+ */
+static int local_unlink_stale(const char *path, const struct sockaddr_un *addr,
+		socklen_t len)
 {
-	struct epoll_event event = {0};
-	s->epoll = epoll_create1(0);
-	if (s->epoll < 0) {
-		return -1;
+	struct stat st;
+	int sock, res;
+	if (lstat(path, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+		return 0;
 	}
-	s->listener = make_listener(port);
-	if (s->listener < 0) {
+	// nonblocking, so that a server with a full backlog doesn't hold us up
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sock < 0) {
 		return -1;
 	}
-	event.events = EPOLLIN;
-	event.data.fd = s->listener;
-	if (epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->listener, &event) < 0) {
-		close(s->listener);
+	res = connect(sock, (const struct sockaddr *)addr, len);
+	if (res < 0 && errno == ECONNREFUSED) {
+		close(sock);
+		return unlink(path) < 0 && errno != ENOENT ? -1 : 0;
+	}
+	close(sock);
+	if (res == 0 || errno == EAGAIN) {
+		errno = EADDRINUSE;
 		return -1;
 	}
-	hashmap_init(&s->clients_by_fd, &hashmap_ptr_equals, &hashmap_ptr_hash,
-			NULL, &client_free_);
-	hashmap_init(&s->fds_by_name, &hashmap_string_equals, &hashmap_string_hash,
-			&free, NULL);
-	s->waiting_client = -1;
-	s->game_width = game_width;
-	s->game_height = game_height;
 	return 0;
 }
 
-void server_finalize(struct server *s)
+/* Creates the Unix domain listener at the path, or at the name after
+ * the '@' in the abstract namespace, which needs no file and goes away
+ * with the socket.
+ */
+int make_local_listener(const char *path, int backlog)
 {
-	close(s->listener);
-	hashmap_finalize(&s->clients_by_fd);
-	hashmap_finalize(&s->fds_by_name);
+	int sock;
+	struct sockaddr_un addr;
+	socklen_t len;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+	if (path[0] == '@') {
+		// the name is the bytes after the leading zero, without a terminator
+		addr.sun_path[0] = '\0';
+	} else {
+		len++;
+		if (local_unlink_stale(path, &addr, len) < 0) {
+			return -1;
+		}
+	}
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		return -1;
+	}
+	if (bind(sock, (struct sockaddr *)&addr, len) < 0
+			|| listen(sock, backlog) < 0)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
 }
 
-int epoll_toggle_write(int epoll, int sock, int on)
+/* Finds the path the local listener is bound to, which may differ from
+ * LOCAL if the listener was handed over. *path is set to NULL if it's
+ * in the abstract namespace. Returns 0 on success and -1 on failure.
+ */
+static int local_bound_path(int sock, char **path)
 {
-	struct epoll_event event = {0};
-	if (on) {
-		event.events = EPOLLIN | EPOLLOUT;
-	} else {
-		event.events = EPOLLIN;
+	struct sockaddr_un addr;
+	socklen_t len = sizeof(addr);
+	*path = NULL;
+	if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0) {
+		return -1;
 	}
-	event.data.fd = sock;
-	return epoll_ctl(epoll, EPOLL_CTL_MOD, sock, &event);
+	if (len <= offsetof(struct sockaddr_un, sun_path) || addr.sun_path[0] == '\0') {
+		return 0;
+	}
+	*path = strndup(addr.sun_path, len - offsetof(struct sockaddr_un, sun_path));
+	return *path ? 0 : -1;
 }
 
-int respond(struct server *s, struct client *cli, struct message *msg)
+/* Makes accept on the listener return right away when nobody is waiting,
+ * so that server_accept can take the connections until there are none.
+ */
+static int listener_nonblocking(int sock)
 {
-	if (buffer_len(&cli->output) == 0) {
-		if (epoll_toggle_write(s->epoll, cli->sock, 1) < 0) {
-			return -1;
-		}
+	int flags = fcntl(sock, F_GETFL);
+	if (flags < 0) {
+		return -1;
 	}
-	return format_message(msg, &cli->output);
+	return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
 }
 
-int respond_nullary(struct server *s, struct client *cli, enum message_type type)
+int engine_init(struct engine *e, enum engine_type type,
+		const struct server_config *cfg, const struct server *s)
 {
-	struct message resp;
-	resp.type = type;
-	return respond(s, cli, &resp);
+	e->type = type;
+	e->book = s->book;
+	e->tablebase = s->tablebase;
+	if (type == ENGINE_ALPHABETA) {
+		return ai_init(&e->data.ai, &cfg->rules, BOT_TABLE_SIZE,
+				cfg->search_threads);
+	}
+	return mcts_init(&e->data.mcts, &cfg->rules, cfg->search_threads,
+			BOT_TREE_SIZE);
 }
 
-int respond_err(struct server *s, struct client *cli, enum message_type type, char *text)
+void engine_finalize(struct engine *e)
 {
-	struct message resp;
-	resp.type = type;
-	resp.data.err.text = text;
-	return respond(s, cli, &resp);
+	if (e->type == ENGINE_ALPHABETA) {
+		ai_finalize(&e->data.ai);
+	} else {
+		mcts_finalize(&e->data.mcts);
+	}
 }
 
-int server_accept(struct server *s)
+void tables_close(struct server *s)
 {
-	struct client *cli;
-	struct epoll_event event = {0};
-	int sock = accept(s->listener, NULL, NULL);
-	if (sock < 0) {
-		return -1;
+	if (s->book) {
+		book_close(s->book);
+		free(s->book);
+		s->book = NULL;
 	}
-	cli = client_new(sock);
-	if (!cli) {
-		close(sock);
-		return -1;
+	if (s->tablebase) {
+		tablebase_close(s->tablebase);
+		free(s->tablebase);
+		s->tablebase = NULL;
 	}
-	if (hashmap_insert(&s->clients_by_fd, (void *)(intptr_t)sock, (void *)cli) < 0) {
-		client_free(cli);
-		return -1;
+}
+
+/* Maps the opening book and the tablebase, if they are configured.
+ */
+int tables_open(struct server *s, const struct server_config *cfg)
+{
+	s->book = NULL;
+	s->tablebase = NULL;
+	if (cfg->book) {
+		s->book = malloc(sizeof(*s->book));
+		if (!s->book) {
+			return -1;
+		}
+		if (book_open(s->book, cfg->book) < 0) {
+			free(s->book);
+			s->book = NULL;
+			return -1;
+		}
+		if (!book_matches(s->book, &cfg->rules)) {
+			fprintf(stderr, "the book was generated for different rules\n");
+			goto invalid;
+		}
 	}
-	event.events = EPOLLIN;
-	event.data.fd = sock;
-	if (epoll_ctl(s->epoll, EPOLL_CTL_ADD, sock, &event) < 0) {
-		hashmap_remove(&s->clients_by_fd, (void *)(intptr_t)sock);
-		return -1;
+	if (cfg->tablebase) {
+		s->tablebase = malloc(sizeof(*s->tablebase));
+		if (!s->tablebase) {
+			tables_close(s);
+			return -1;
+		}
+		if (tablebase_open(s->tablebase, cfg->tablebase) < 0) {
+			free(s->tablebase);
+			s->tablebase = NULL;
+			tables_close(s);
+			return -1;
+		}
+		if (!tablebase_matches(s->tablebase, &cfg->rules)) {
+			fprintf(stderr, "the tablebase was generated for different rules\n");
+			goto invalid;
+		}
 	}
-	printf("accepted client %d\n", sock);
 	return 0;
+invalid:
+	tables_close(s);
+	errno = EINVAL;
+	return -1;
 }
 
-int server_disconnect(struct server *s, struct client *cli)
+int bots_init(struct server *s, const struct server_config *cfg)
 {
-	int sock = cli->sock;
-	if (cli->name) {
-		hashmap_remove(&s->fds_by_name, (void *)cli->name);
+	enum engine_type type = cfg->engine;
+	void **ctxs = NULL;
+	size_t i;
+	s->nbots = 0;
+	s->bot_time = cfg->bot_time;
+	if (type == ENGINE_AUTO) {
+		type = ai_supported(&cfg->rules) ? ENGINE_ALPHABETA : ENGINE_MCTS;
 	}
-	if (s->waiting_client == cli->sock) {
-		s->waiting_client = -1;
+	if (cfg->bot_threads == 0
+			|| (type == ENGINE_ALPHABETA && !ai_supported(&cfg->rules)))
+	{
+		return 0;
 	}
-	if (cli->pair) {
-		if (respond_nullary(s, client_other(cli), MSG_NOTIFY_QUIT) < 0) {
-			return -1;
+	if (tables_open(s, cfg) < 0) {
+		return -1;
+	}
+	if (cache_init(&s->cache, cfg->cache_size, CACHE_SHARDS) < 0) {
+		tables_close(s);
+		return -1;
+	}
+	s->analyses = 0;
+	s->analysis_time = s->analysis_max_time = 0;
+	s->engines = malloc(cfg->bot_threads * sizeof(*s->engines));
+	ctxs = malloc(cfg->bot_threads * sizeof(*ctxs));
+	if (!s->engines || !ctxs) {
+		goto error;
+	}
+	for (i = 0; i < cfg->bot_threads; ++i) {
+		if (engine_init(&s->engines[i], type, cfg, s) < 0) {
+			while (i > 0) {
+				engine_finalize(&s->engines[--i]);
+			}
+			goto error;
 		}
+		ctxs[i] = &s->engines[i];
 	}
-	hashmap_remove(&s->clients_by_fd, (void *)(intptr_t)sock);
-	printf("client %d disconnected\n", sock);
+	if (pool_init(&s->bots, cfg->bot_threads, ctxs) < 0) {
+		for (i = 0; i < cfg->bot_threads; ++i) {
+			engine_finalize(&s->engines[i]);
+		}
+		goto error;
+	}
+	s->nbots = cfg->bot_threads;
 	return 0;
+error:
+	free(s->engines);
+	free(ctxs);
+	cache_finalize(&s->cache);
+	tables_close(s);
+	return -1;
 }
 
-int handle_login(struct server *s, struct client *cli, char *name)
+static char *copy_name(const char *name, int len)
 {
-	char *name1, *name2;
-	if (cli->name) {
-		return respond_err(s, cli, MSG_LOGIN_ERR, "user already logged in");
+	char *copy = malloc(len + 1);
+	if (copy) {
+		memcpy(copy, name, len);
+		copy[len] = '\0';
 	}
-	if (hashmap_contains(&s->fds_by_name, (void *)name)) {
-		return respond_err(s, cli, MSG_LOGIN_ERR, "name already taken");
+	return copy;
+}
+
+/* Rates a game of the journal, the ratings are rebuilt on every start.
+ */
+static int rate_game(const struct journal_game *game, void *ctx)
+{
+	struct server *s = ctx;
+	char *red = copy_name(game->red, game->red_len);
+	char *blue = copy_name(game->blue, game->blue_len);
+	int res = -1;
+	if (red && blue) {
+		res = 0;
+		// games against the bot are not rated
+		if (strcmp(red, BOT_NAME) != 0 && strcmp(blue, BOT_NAME) != 0) {
+			res = ratings_update(&s->ratings, red, blue, game->winner);
+		}
+	}
+	free(red);
+	free(blue);
+	return res;
+}
+
+/* Keeps the seat of the player on the given side of a restored game,
+ * with their token if they have one and the seats of the dropped players
+ * are kept. Returns 0 on success, 1 if the seat can't be kept and -1
+ * on failure.
+ */
+static int seat_keep(struct server *s, struct pair *pair, enum side side,
+		const struct snapshot_game *game)
+{
+	char **seat = side == SIDE_RED ? &pair->red_name : &pair->blue_name;
+	char **token = side == SIDE_RED ? &pair->red_token : &pair->blue_token;
+	int len = side == SIDE_RED ? game->red_len : game->blue_len;
+	int token_len = side == SIDE_RED
+		? game->red_token_len : game->blue_token_len;
+	*seat = copy_name(side == SIDE_RED ? game->red : game->blue, len);
+	if (!*seat) {
+		return -1;
+	}
+	// players have names and can't have two seats
+	if (len == 0 || hashmap_contains(&s->seats, *seat)) {
+		return 1;
+	}
+	if (hashmap_insert(&s->seats, *seat, pair) < 0) {
+		return -1;
+	}
+	// without the tokens, the players take their seats by logging in
+	if (s->grace == 0 || token_len == 0) {
+		return 0;
 	}
-	name1 = strdup(name);
-	name2 = strdup(name);
-	if (!name1 || !name2) {
-		free(name1);
-		free(name2);
+	*token = copy_name(side == SIDE_RED ? game->red_token : game->blue_token,
+			token_len);
+	if (!*token) {
 		return -1;
 	}
-	if (hashmap_insert(&s->fds_by_name, (void *)name1, (void *)(intptr_t)cli->sock) < 0) {
-		free(name1);
-		free(name2);
+	// a token left out of the map is not the pair's to release
+	if (token_len != TOKEN_LEN || hashmap_contains(&s->tokens, *token)) {
+		free(*token);
+		*token = NULL;
+		return 1;
+	}
+	if (hashmap_insert(&s->tokens, *token, pair) < 0) {
+		free(*token);
+		*token = NULL;
 		return -1;
 	}
-	cli->name = name2;
-	return respond_nullary(s, cli, MSG_LOGIN_OK);
+	return 0;
 }
 
-int respond_start_ok(struct server *s, struct client *cli)
+/* Logs that a game of the snapshot is left out and why.
+ */
+static int restore_skip(const struct snapshot_game *game, const char *why)
 {
-	struct message resp;
-	resp.type = MSG_START_OK;
-	resp.data.start_ok.other = client_other(cli)->name;
-	resp.data.start_ok.side = client_side(cli);
-	resp.data.start_ok.width = cli->pair->game.width;
-	resp.data.start_ok.height = cli->pair->game.height;
-	resp.data.start_ok.red_undos = cli->pair->game.red_undos;
-	resp.data.start_ok.blue_undos = cli->pair->game.blue_undos;
-	return respond(s, cli, &resp);
+	printf("skipping the game of %.*s vs %.*s: %s\n",
+			game->red_len, game->red, game->blue_len, game->blue, why);
+	return 0;
 }
 
-int handle_start(struct server *s, struct client *cli)
+/* Recreates a game of the snapshot, the bad ones are left out. The seats
+ * of its players are kept until they log in or resume, the bot doesn't move
+ * before its opponent is back.
+ */
+static int restore_game(const struct snapshot_game *game, void *ctx)
 {
-	struct client *other;
+	struct server *s = ctx;
+	struct game_rules rules;
 	struct pair *pair;
-	if (!cli->name) {
-		return respond_err(s, cli, MSG_START_ERR, "not logged in");
-	} else if (cli->pair) {
-		return respond_err(s, cli, MSG_START_ERR, "already in a game");
-	} else if (s->waiting_client == cli->sock) {
-		return respond_err(s, cli, MSG_START_ERR, "already waiting for a game");
-	}
-	if (hashmap_get(&s->clients_by_fd,
-			(void *)(uintptr_t)s->waiting_client,
-			(void **)&other) < 0)
+	int i, res;
+	rules.width = game->width;
+	rules.height = game->height;
+	rules.line_length = game->line_length;
+	rules.undos = 0;
+	if (game->bot != SIDE_NONE && game->bot != SIDE_RED
+			&& game->bot != SIDE_BLUE)
 	{
-		s->waiting_client = cli->sock;
-		return 0;
+		return restore_skip(game, "invalid side of the bot");
+	}
+	if (game_rules_check(&rules) < 0) {
+		return restore_skip(game, "invalid rules");
 	}
-	pair = pair_new(cli, other, s->game_width, s->game_height);
+	if (game->bot != SIDE_NONE && s->nbots == 0) {
+		return restore_skip(game, "no bots to play it");
+	}
+	pair = pair_new(NULL, NULL, &rules);
 	if (!pair) {
 		return -1;
 	}
-	s->waiting_client = -1;
-	if (respond_start_ok(s, cli) < 0) {
-		return -1;
+	link_insert(&s->pairs, &pair->link);
+	pair->bot = game->bot;
+	pair->started = game->started;
+	pair->seats = &s->seats;
+	pair->tokens = &s->tokens;
+	for (i = 0; i < game->moves; ++i) {
+		if (game_drop(&pair->game, pair->game.turn, game->history[i]) < 0) {
+			pair_free(pair);
+			return restore_skip(game, "invalid moves");
+		}
 	}
-	if (respond_start_ok(s, other) < 0) {
-		return -1;
+	if (pair->game.over) {
+		pair_free(pair);
+		return restore_skip(game, "the game is over");
+	}
+	pair->game.red_undos = game->red_undos;
+	pair->game.blue_undos = game->blue_undos;
+	res = pair->bot == SIDE_RED ? 0 : seat_keep(s, pair, SIDE_RED, game);
+	if (res == 0 && pair->bot != SIDE_BLUE) {
+		res = seat_keep(s, pair, SIDE_BLUE, game);
+	}
+	if (res != 0) {
+		pair_free(pair);
+		return res < 0 ? -1 : restore_skip(game, "the seats can't be kept");
 	}
 	return 0;
 }
 
-int handle_drop(struct server *s, struct client *cli, int column)
+/* Restores the games of the last snapshot, if there is one, and starts
+ * the timer of the snapshots.
+ */
+int server_restore(struct server *s, const struct server_config *cfg)
 {
-	struct message resp;
-	struct game *game;
-	int row;
-	enum side side;
-	struct client *other;
-	if (!cli->pair) {
-		return respond_err(s, cli, MSG_DROP_ERR, "not in game right now");
+	struct itimerspec interval = {{0}};
+	struct epoll_event event = {0};
+	uint64_t started = wall_ms();
+	long games;
+	s->snapshot = malloc(sizeof(*s->snapshot));
+	if (!s->snapshot) {
+		return -1;
 	}
-	game = &cli->pair->game;
-	side = client_side(cli);
-	if ((row = game_drop(game, side, column)) < 0) {
-		return respond_err(s, cli, MSG_DROP_ERR, "can't drop here and now");
+	if (snapshot_init(s->snapshot, cfg->snapshot) < 0) {
+		free(s->snapshot);
+		s->snapshot = NULL;
+		return -1;
 	}
-	if (respond_nullary(s, cli, MSG_DROP_OK) < 0) {
+	// after a takeover, the games come from the old server
+	if (!s->takeover_data) {
+		games = snapshot_load(cfg->snapshot, &s->waiting_name, restore_game, s);
+		if (games < 0 && errno != ENOENT) {
+			return -1;
+		}
+		if (games >= 0) {
+			printf("restored %ld games in %lu ms\n", games,
+					(unsigned long)(wall_ms() - started));
+		}
+	}
+	s->snapshot_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (s->snapshot_timer < 0) {
 		return -1;
 	}
-	other = client_other(cli);
-	resp.type = MSG_NOTIFY_DROP;
-	resp.data.notify_drop.side = side;
-	resp.data.notify_drop.column = column;
-	resp.data.notify_drop.row = row;
-	if (respond(s, cli, &resp) < 0) {
+	interval.it_interval.tv_sec = cfg->snapshot_interval;
+	interval.it_value.tv_sec = cfg->snapshot_interval;
+	if (timerfd_settime(s->snapshot_timer, 0, &interval, NULL) < 0) {
+		return -1;
+	}
+	event.events = EPOLLIN;
+	event.data.fd = s->snapshot_timer;
+	return epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->snapshot_timer, &event);
+}
+
+/* Receives the listeners, the clients and the games from the server waiting
+ * on the handoff socket, if there is one. The old server has stopped once
+ * everything is received. Returns 0 on success and -1 on failure.
+ */
+static int takeover_receive(struct server *s, const char *path)
+{
+	uint32_t count;
+	int res = -1, i;
+	int sock = handoff_connect(path);
+	if (sock < 0) {
+		return errno == ENOENT || errno == ECONNREFUSED ? 0 : -1;
+	}
+	printf("taking over from the running server\n");
+	if (handoff_recv_fds(sock, &s->takeover_fds, &s->takeover_nfds) == 0) {
+		res = handoff_recv(sock, &s->takeover_data, &s->takeover_len);
+	}
+	close(sock);
+	// the listeners come first, the data starts with the number of clients
+	if (res == 0 && s->takeover_len >= 4) {
+		memcpy(&count, s->takeover_data, 4);
+		s->takeover_listeners = s->takeover_nfds - (int)count;
+	}
+	if (res == 0 && (s->takeover_listeners < 1 || s->takeover_listeners > 2)) {
+		for (i = 0; i < s->takeover_nfds; ++i) {
+			close(s->takeover_fds[i]);
+		}
+		errno = EINVAL;
+		res = -1;
+	}
+	return res;
+}
+
+/* Starts the I/O threads, if there should be any.
+ */
+int io_init(struct server *s, const struct server_config *cfg)
+{
+	struct epoll_event event = {0};
+	struct io_config io_cfg;
+	s->io = NULL;
+	s->nio = 0;
+	s->io_event = -1;
+	s->last_id = 0;
+	if (cfg->io_threads == 0) {
+		return 0;
+	}
+	s->io_event = eventfd(0, EFD_NONBLOCK);
+	if (s->io_event < 0) {
 		return -1;
 	}
-	if (respond(s, other, &resp) < 0) {
+	event.events = EPOLLIN;
+	event.data.fd = s->io_event;
+	if (epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->io_event, &event) < 0) {
 		return -1;
 	}
-	if (game->over) {
-		resp.type = MSG_NOTIFY_OVER;
-		resp.data.notify_over.winner = game->winner;
-		pair_free(cli->pair);
-		if (respond(s, cli, &resp) < 0) {
+	s->io = malloc(cfg->io_threads * sizeof(*s->io));
+	if (!s->io) {
+		return -1;
+	}
+	io_cfg.budget = cfg->budget;
+	io_cfg.high_water = cfg->high_water;
+	io_cfg.low_water = cfg->low_water;
+	io_cfg.spin = cfg->spin;
+	for (; s->nio < cfg->io_threads; s->nio++) {
+		// the first CPU is the loop's
+		io_cfg.cpu = cfg->ncpus > 0
+			? cfg->cpus[(s->nio + 1) % cfg->ncpus] : -1;
+		if (io_start(&s->io[s->nio], s->io_event, &io_cfg) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Pins the thread running the loop to its CPU, if it has one. Pinning
+ * only makes the loop faster, so a failure is reported and the loop
+ * goes on where it is.
+ */
+static void loop_pin(struct server *s)
+{
+	if (s->cpu >= 0 && cpu_pin(s->cpu) < 0) {
+		perror("failed to pin the loop");
+	}
+}
+
+/* Lets the loop's thread run on any CPU while it starts the threads that
+ * shouldn't share its CPU, loop_pin pins it back.
+ */
+static void loop_unpin(struct server *s)
+{
+	if (s->cpu >= 0 && cpu_unpin() < 0) {
+		perror("failed to unpin the loop");
+	}
+}
+
+int server_init(struct server *s, const struct server_config *cfg)
+{
+	struct epoll_event event = {0};
+	// the memory the loop allocates from here on is local to its CPU
+	s->cpu = cfg->ncpus > 0 ? cfg->cpus[0] : -1;
+	loop_pin(s);
+	s->epoll = epoll_create1(0);
+	if (s->epoll < 0) {
+		return -1;
+	}
+	s->handoff = -1;
+	s->handoff_path = cfg->handoff;
+	s->successor = -1;
+	s->takeover_fds = NULL;
+	s->takeover_data = NULL;
+	s->takeover_listeners = 0;
+	if (cfg->handoff && takeover_receive(s, cfg->handoff) < 0) {
+		return -1;
+	}
+	s->listener = s->takeover_fds ? s->takeover_fds[0]
+		: make_listener(cfg->port, cfg->backlog);
+	if (s->listener < 0) {
+		return -1;
+	}
+	if (listener_nonblocking(s->listener) < 0) {
+		close(s->listener);
+		return -1;
+	}
+	event.events = EPOLLIN;
+	event.data.fd = s->listener;
+	if (epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->listener, &event) < 0) {
+		close(s->listener);
+		return -1;
+	}
+	// the old server's local listener is kept if there should be one
+	s->local = -1;
+	s->local_path = NULL;
+	if (s->takeover_listeners == 2 && !cfg->local) {
+		close(s->takeover_fds[1]);
+	} else if (s->takeover_listeners == 2) {
+		s->local = s->takeover_fds[1];
+	} else if (cfg->local) {
+		s->local = make_local_listener(cfg->local, cfg->backlog);
+	}
+	if (cfg->local && s->local < 0) {
+		close(s->listener);
+		return -1;
+	}
+	event.data.fd = s->local;
+	if (s->local >= 0 && (listener_nonblocking(s->local) < 0
+			|| local_bound_path(s->local, &s->local_path) < 0
+			|| epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->local, &event) < 0))
+	{
+		free(s->local_path);
+		close(s->local);
+		close(s->listener);
+		return -1;
+	}
+	hashmap_init(&s->clients_by_fd, &hashmap_ptr_equals, &hashmap_ptr_hash,
+			NULL, &client_free_);
+	hashmap_init(&s->fds_by_name, &hashmap_string_equals, &hashmap_string_hash,
+			&free, NULL);
+	hashmap_init(&s->fds_by_token, &hashmap_string_equals, &hashmap_string_hash,
+			NULL, NULL);
+	s->waiting_client = -1;
+	s->waiting_name = NULL;
+	s->pairs.prev = s->pairs.next = &s->pairs;
+	// the names and the tokens are owned by the pairs
+	hashmap_init(&s->seats, &hashmap_string_equals, &hashmap_string_hash,
+			NULL, NULL);
+	hashmap_init(&s->tokens, &hashmap_string_equals, &hashmap_string_hash,
+			NULL, NULL);
+	s->random = open("/dev/urandom", O_RDONLY);
+	if (s->random < 0) {
+		return -1;
+	}
+	timer_wheel_init(&s->timers, now_ms());
+	s->grace = cfg->grace * 1000;
+	s->idle = cfg->idle * 1000;
+	s->move_time = cfg->move_time * 1000;
+	s->queue_time = cfg->queue_time * 1000;
+	timer_init(&s->queue_timer);
+	timer_init(&s->accept_timer);
+	s->high_water = cfg->high_water;
+	s->low_water = cfg->low_water;
+	s->policy = cfg->policy;
+	s->buffered = s->buffered_max = 0;
+	s->paused = s->dropped = 0;
+	s->reading = NULL;
+	s->budget = cfg->budget;
+	s->ready_head = s->ready_tail = NULL;
+	s->message_rate = cfg->message_rate;
+	s->message_burst = cfg->message_burst;
+	s->login_rate = cfg->login_rate;
+	if (s->login_rate > 0 && limiter_init(&s->logins, LIMITED_PEERS,
+				cfg->login_rate, cfg->login_burst) < 0)
+	{
+		return -1;
+	}
+	s->limit_action = cfg->limit_action;
+	s->limited = 0;
+	if (io_init(s, cfg) < 0) {
+		return -1;
+	}
+	cpu_spin_init(&s->spin, cfg->spin);
+	s->busy_poll = cfg->busy_poll;
+	s->snapshot = NULL;
+	s->snapshot_timer = -1;
+	s->snapshot_cursor.prev = s->snapshot_cursor.next = &s->snapshot_cursor;
+	s->snapshotting = 0;
+	s->rules = cfg->rules;
+	// the journal's writer, the archive's compaction and the bots get
+	// CPUs of their own
+	loop_unpin(s);
+	s->journal = NULL;
+	if (cfg->journal) {
+		s->journal = malloc(sizeof(*s->journal));
+		if (!s->journal) {
+			return -1;
+		}
+		if (journal_open(s->journal, cfg->journal) < 0) {
+			free(s->journal);
+			s->journal = NULL;
+			return -1;
+		}
+	}
+	loop_pin(s);
+	ratings_init(&s->ratings);
+	if (cfg->journal && journal_replay(cfg->journal, 0, rate_game, s) < 0) {
+		return -1;
+	}
+	s->archive = NULL;
+	s->archive_failing = 0;
+	loop_unpin(s);
+	if (cfg->archive) {
+		s->archive = malloc(sizeof(*s->archive));
+		if (!s->archive) {
+			return -1;
+		}
+		if (archive_open(s->archive, cfg->archive, cfg->journal) < 0) {
+			free(s->archive);
+			s->archive = NULL;
 			return -1;
 		}
-		if (respond(s, other, &resp) < 0) {
+	}
+	if (bots_init(s, cfg) < 0) {
+		return -1;
+	}
+	loop_pin(s);
+	if (s->nbots > 0) {
+		event.events = EPOLLIN;
+		event.data.fd = s->bots.event;
+		if (epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->bots.event, &event) < 0) {
 			return -1;
 		}
 	}
+	if (cfg->snapshot && server_restore(s, cfg) < 0) {
+		return -1;
+	}
 	return 0;
 }
 
-int handle_undo(struct server *s, struct client *cli)
+void server_finalize(struct server *s)
+{
+	size_t i;
+	close(s->listener);
+	if (s->local >= 0) {
+		close(s->local);
+		// the new server goes on listening at the path
+		if (s->local_path && s->successor < 0) {
+			unlink(s->local_path);
+		}
+		free(s->local_path);
+	}
+	if (s->handoff >= 0) {
+		close(s->handoff);
+		unlink(s->handoff_path);
+	}
+	if (s->snapshot_timer >= 0) {
+		close(s->snapshot_timer);
+	}
+	link_remove(&s->snapshot_cursor);
+	if (s->snapshot) {
+		snapshot_finalize(s->snapshot);
+		free(s->snapshot);
+	}
+	for (i = 0; i < (size_t)s->nio; ++i) {
+		io_stop(&s->io[i]);
+	}
+	free(s->io);
+	if (s->io_event >= 0) {
+		close(s->io_event);
+	}
+	hashmap_finalize(&s->clients_by_fd);
+	// the games whose players haven't come back
+	while (s->pairs.next != &s->pairs) {
+		pair_free((struct pair *)s->pairs.next);
+	}
+	hashmap_finalize(&s->seats);
+	hashmap_finalize(&s->tokens);
+	close(s->random);
+	if (s->login_rate > 0) {
+		limiter_finalize(&s->logins);
+	}
+	free(s->waiting_name);
+	free(s->takeover_fds);
+	free(s->takeover_data);
+	hashmap_finalize(&s->fds_by_name);
+	hashmap_finalize(&s->fds_by_token);
+	if (s->nbots > 0) {
+		pool_finalize(&s->bots);
+		for (i = 0; i < s->nbots; ++i) {
+			engine_finalize(&s->engines[i]);
+		}
+		free(s->engines);
+		cache_finalize(&s->cache);
+		tables_close(s);
+	}
+	if (s->archive) {
+		archive_close(s->archive);
+		free(s->archive);
+	}
+	ratings_finalize(&s->ratings);
+	if (s->journal) {
+		if (journal_close(s->journal) < 0) {
+			perror("failed to write the journal");
+		}
+		free(s->journal);
+	}
+	// the new server goes on once everything is closed
+	if (s->successor >= 0) {
+		close(s->successor);
+	}
+}
+
+/* Watches the client's socket for reading unless the client is paused,
+ * and for writing while there is some output.
+ */
+int client_poll(struct server *s, struct client *cli)
+{
+	struct epoll_event event = {0};
+	if (cli->io) {
+		return 0;
+	}
+	// the end of a closing connection is noticed by reading, the clients
+	// on the ready list have read enough for now
+	if ((!cli->paused && !cli->ready) || cli->closing) {
+		event.events |= EPOLLIN;
+	}
+	if (buffer_len(&cli->output) > 0) {
+		event.events |= EPOLLOUT;
+	}
+	event.data.fd = cli->sock;
+	return epoll_ctl(s->epoll, EPOLL_CTL_MOD, cli->sock, &event);
+}
+
+/* Takes the client off the ready list, if they are on it.
+ */
+void ready_remove(struct server *s, struct client *cli)
+{
+	if (!cli->ready) {
+		return;
+	}
+	if (cli->ready_prev) {
+		cli->ready_prev->ready_next = cli->ready_next;
+	} else {
+		s->ready_head = cli->ready_next;
+	}
+	if (cli->ready_next) {
+		cli->ready_next->ready_prev = cli->ready_prev;
+	} else {
+		s->ready_tail = cli->ready_prev;
+	}
+	cli->ready_prev = cli->ready_next = NULL;
+	cli->ready = 0;
+}
+
+/* Puts the client at the end of the ready list.
+ */
+void ready_append(struct server *s, struct client *cli)
+{
+	cli->ready = 1;
+	cli->ready_prev = s->ready_tail;
+	cli->ready_next = NULL;
+	if (s->ready_tail) {
+		s->ready_tail->ready_next = cli;
+	} else {
+		s->ready_head = cli;
+	}
+	s->ready_tail = cli;
+}
+
+/* Starts disconnecting the client, the read that sees the end of the
+ * connection finishes it. The messages the client has sent are ignored.
+ */
+static int client_close(struct server *s, struct client *cli)
+{
+	cli->closing = 1;
+	if (shutdown(cli->sock, SHUT_RDWR) < 0) {
+		return -1;
+	}
+	return client_poll(s, cli);
+}
+
+/* Decides about a message for a paused client according to the policy,
+ * the answers to the client's own messages are always sent since there
+ * are no more of them until the client is resumed. Returns 1 if the message
+ * should be sent anyway, 0 if it's left out and -1 on failure.
+ */
+static int output_admit(struct server *s, struct client *cli,
+		const struct message *msg)
+{
+	if (cli == s->reading) {
+		return 1;
+	}
+	switch (s->policy) {
+	case OUTPUT_DISCONNECT:
+		if (!cli->closing) {
+			printf("disconnecting client %d, it reads too slowly\n", cli->sock);
+			if (client_close(s, cli) < 0) {
+				return -1;
+			}
+		}
+		break;
+	case OUTPUT_COALESCE:
+		if (msg->type != MSG_NOTIFY_DROP && msg->type != MSG_NOTIFY_UNDO) {
+			return 1;
+		}
+		cli->stale = 1;
+		break;
+	default:
+		// nothing brings back the end of a game once it's gone, what
+		// else was left out of the game is replaced by resume_ok
+		if (msg->type == MSG_NOTIFY_OVER || msg->type == MSG_NOTIFY_QUIT) {
+			return 1;
+		}
+		cli->stale = 1;
+		break;
+	}
+	s->dropped++;
+	return 0;
+}
+
+/* Logs that a client whose output holds len bytes was paused, with the
+ * output of all the clients, the loop's and the I/O threads'.
+ */
+static void client_log_paused(struct server *s, struct client *cli,
+		size_t len)
+{
+	size_t buffered = s->buffered, max = s->buffered_max;
+	int i;
+	for (i = 0; i < s->nio; ++i) {
+		io_output(&s->io[i], &buffered, &max);
+	}
+	printf("paused client %d with %lu bytes of output"
+			" (%lu bytes for all clients, %lu paused, at most %lu)\n",
+			cli->sock, (unsigned long)len, (unsigned long)buffered,
+			s->paused, (unsigned long)max);
+}
+
+/* Hands a copy of the message to the I/O thread of the client, which
+ * formats and sends it.
+ */
+static int client_send(struct client *cli, struct message *msg)
+{
+	struct io_item item;
+	item.type = IO_SEND;
+	item.sock = cli->sock;
+	item.id = cli->id;
+	if (copy_message(msg, &item.msg) < 0) {
+		return -1;
+	}
+	io_send(cli->io, &item);
+	return 0;
+}
+
+int respond(struct server *s, struct client *cli, struct message *msg)
+{
+	size_t len = buffer_len(&cli->output);
+	int res;
+	cli->active = now_ms();
+	if (cli->paused && (res = output_admit(s, cli, msg)) <= 0) {
+		return res;
+	}
+	if (cli->io) {
+		return client_send(cli, msg);
+	}
+	if (format_message(msg, &cli->output) < 0) {
+		return -1;
+	}
+	s->buffered += buffer_len(&cli->output) - len;
+	if (buffer_len(&cli->output) > s->buffered_max) {
+		s->buffered_max = buffer_len(&cli->output);
+	}
+	if (!cli->paused && buffer_len(&cli->output) > s->high_water) {
+		cli->paused = 1;
+		s->paused++;
+		client_log_paused(s, cli, buffer_len(&cli->output));
+		return client_poll(s, cli);
+	}
+	return len == 0 ? client_poll(s, cli) : 0;
+}
+
+int respond_nullary(struct server *s, struct client *cli, enum message_type type)
 {
 	struct message resp;
-	int column, row;
-	enum side side;
-	struct client *other;
-	if (!cli->pair) {
-		return respond_err(s, cli, MSG_DROP_ERR, "not in game right now");
+	resp.type = type;
+	return respond(s, cli, &resp);
+}
+
+int respond_err(struct server *s, struct client *cli, enum message_type type, char *text)
+{
+	struct message resp;
+	resp.type = type;
+	resp.data.err.text = text;
+	return respond(s, cli, &resp);
+}
+
+/* Ends the wait of the client who has waited too long for an opponent.
+ */
+static int queue_expired(void *arg, void *ctx)
+{
+	struct server *s = ctx;
+	struct client *cli;
+	int sock = s->waiting_client;
+	s->waiting_client = -1;
+	if (hashmap_get(&s->clients_by_fd, (void *)(intptr_t)sock, (void **)&cli) < 0) {
+		return 0;
 	}
-	side = client_side(cli);
-	if (game_undo(&cli->pair->game, side, &column, &row) < 0) {
-		return respond_err(s, cli, MSG_DROP_ERR, "can't undo here and now");
+	printf("client %d found no opponent\n", sock);
+	return respond_err(s, cli, MSG_START_ERR, "no opponent found");
+}
+
+/* Makes the client the waiting one, or empties the queue if sock is -1.
+ */
+void queue_set(struct server *s, int sock)
+{
+	s->waiting_client = sock;
+	if (sock >= 0 && s->queue_time > 0) {
+		timer_arm(&s->timers, &s->queue_timer, now_ms() + s->queue_time,
+				queue_expired, NULL);
+	} else {
+		timer_cancel(&s->queue_timer);
 	}
-	if (respond_nullary(s, cli, MSG_UNDO_OK) < 0) {
+}
+
+/* Ends the game of the dropped player whose seat has expired, their
+ * opponent is told that they have quit.
+ */
+static int seat_expired(struct server *s, struct pair *pair, enum side side)
+{
+	struct client *other = pair->red ? pair->red : pair->blue;
+	printf("seat of %s expired\n", side == SIDE_RED
+			? pair->red_name : pair->blue_name);
+	pair_free(pair);
+	return other ? respond_nullary(s, other, MSG_NOTIFY_QUIT) : 0;
+}
+
+static int red_seat_expired(void *arg, void *ctx)
+{
+	return seat_expired(ctx, arg, SIDE_RED);
+}
+
+static int blue_seat_expired(void *arg, void *ctx)
+{
+	return seat_expired(ctx, arg, SIDE_BLUE);
+}
+
+/* Starts the grace of the seats of a restored game that are kept with
+ * tokens, their players resume as if their connections had just dropped.
+ */
+static void seat_restored(struct server *s, struct pair *pair)
+{
+	uint64_t expires = now_ms() + s->grace;
+	if (pair->red_token) {
+		timer_arm(&s->timers, &pair->red_grace, expires,
+				red_seat_expired, pair);
+	}
+	if (pair->blue_token) {
+		timer_arm(&s->timers, &pair->blue_grace, expires,
+				blue_seat_expired, pair);
+	}
+}
+
+/* Keeps the seat of the client whose connection has dropped during a game,
+ * the game waits for them until the seat expires. The client's name and
+ * token are moved to the pair.
+ */
+static int seat_drop(struct server *s, struct client *cli)
+{
+	struct pair *pair = cli->pair;
+	uint64_t expires = now_ms() + s->grace;
+	if (hashmap_insert(&s->seats, cli->name, pair) < 0) {
 		return -1;
 	}
-	other = client_other(cli);
-	resp.type = MSG_NOTIFY_UNDO;
-	resp.data.notify_undo.side = side;
-	resp.data.notify_undo.column = column;
-	resp.data.notify_undo.row = row;
-	if (respond(s, cli, &resp) < 0) {
+	if (hashmap_insert(&s->tokens, cli->token, pair) < 0) {
+		hashmap_remove(&s->seats, cli->name);
+		return -1;
+	}
+	if (cli == pair->red) {
+		pair->red = NULL;
+		pair->red_name = cli->name;
+		pair->red_token = cli->token;
+		timer_arm(&s->timers, &pair->red_grace, expires,
+				red_seat_expired, pair);
+	} else {
+		pair->blue = NULL;
+		pair->blue_name = cli->name;
+		pair->blue_token = cli->token;
+		timer_arm(&s->timers, &pair->blue_grace, expires,
+				blue_seat_expired, pair);
+	}
+	pair->seats = &s->seats;
+	pair->tokens = &s->tokens;
+	cli->name = NULL;
+	cli->token = NULL;
+	cli->pair = NULL;
+	return 0;
+}
+
+int server_disconnect(struct server *s, struct client *cli)
+{
+	int sock = cli->sock;
+	struct client *other;
+	struct io_item item;
+	ready_remove(s, cli);
+	s->buffered -= buffer_len(&cli->output);
+	if (cli->paused) {
+		s->paused--;
+	}
+	if (cli->name) {
+		hashmap_remove(&s->fds_by_name, (void *)cli->name);
+		hashmap_remove(&s->fds_by_token, (void *)cli->token);
+	}
+	if (s->waiting_client == cli->sock) {
+		queue_set(s, -1);
+	}
+	if (cli->pair && s->grace > 0) {
+		// the opponent waits for the client to resume
+		if (seat_drop(s, cli) < 0) {
+			return -1;
+		}
+		printf("keeping the seat of client %d\n", sock);
+	} else if ((other = client_other(cli))) {
+		if (respond_nullary(s, other, MSG_NOTIFY_QUIT) < 0) {
+			return -1;
+		}
+	}
+	if (cli->io) {
+		item.type = IO_CLOSE;
+		item.sock = sock;
+		item.id = cli->id;
+		item.msg.type = MSG_INVALID;
+		io_send(cli->io, &item);
+	}
+	hashmap_remove(&s->clients_by_fd, (void *)(intptr_t)sock);
+	printf("client %d disconnected\n", sock);
+	return 0;
+}
+
+/* Disconnects the client if they have been idle for too long.
+ */
+static int client_idle(void *arg, void *ctx)
+{
+	struct server *s = ctx;
+	struct client *cli = arg;
+	uint64_t now = now_ms();
+	// the waits in the games and in the queue are limited by their own timers
+	if (cli->pair || s->waiting_client == cli->sock) {
+		cli->active = now;
+	}
+	if (now - cli->active < (uint64_t)s->idle) {
+		timer_arm(&s->timers, &cli->idle, cli->active + s->idle,
+				client_idle, cli);
+		return 0;
+	}
+	printf("client %d was idle for too long\n", cli->sock);
+	return server_disconnect(s, cli);
+}
+
+/* Starts watching the client for being idle. The timer is only moved
+ * when it expires, the messages merely update the client's active time.
+ */
+void client_watch(struct server *s, struct client *cli)
+{
+	if (s->idle > 0) {
+		timer_arm(&s->timers, &cli->idle, cli->active + s->idle,
+				client_idle, cli);
+	}
+}
+
+/* Sets up a client for the accepted socket, tcp is nonzero if it came
+ * from the TCP listener. Returns 0 on success and -1 on failure.
+ */
+static int client_accept(struct server *s, int sock, int tcp)
+{
+	struct client *cli;
+	struct epoll_event event = {0};
+	struct io_item item;
+	int one = 1;
+	// The output is written a whole buffer at a time, so Nagle's algorithm
+	// only holds back a notification until the client acks the last
+	// answer, which it may delay for tens of milliseconds.
+	if (tcp && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+		perror("failed to set TCP_NODELAY");
+	}
+	if (tcp && s->busy_poll > 0 && setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL,
+				&s->busy_poll, sizeof(s->busy_poll)) < 0)
+	{
+		// raising it needs CAP_NET_ADMIN
+		perror("failed to set SO_BUSY_POLL");
+		s->busy_poll = 0;
+	}
+	cli = client_new(sock);
+	if (!cli) {
+		close(sock);
+		return -1;
+	}
+	if (hashmap_insert(&s->clients_by_fd, (void *)(intptr_t)sock, (void *)cli) < 0) {
+		client_free(cli);
+		return -1;
+	}
+	if (s->nio > 0) {
+		// a socket stays with its thread, so the items about it stay in order
+		cli->io = &s->io[sock % s->nio];
+		cli->id = ++s->last_id;
+		item.type = IO_ADOPT;
+		item.sock = sock;
+		item.id = cli->id;
+		item.msg.type = MSG_INVALID;
+		io_send(cli->io, &item);
+	} else {
+		event.events = EPOLLIN;
+		event.data.fd = sock;
+		if (epoll_ctl(s->epoll, EPOLL_CTL_ADD, sock, &event) < 0) {
+			hashmap_remove(&s->clients_by_fd, (void *)(intptr_t)sock);
+			return -1;
+		}
+	}
+	client_watch(s, cli);
+	token_bucket_init(&cli->messages, s->message_burst, cli->active);
+	printf("accepted %sclient %d\n", tcp ? "" : "local ", sock);
+	return 0;
+}
+
+/* Sets the events the listeners are watched for, 0 leaves them out.
+ */
+static int listeners_watch(struct server *s, uint32_t events)
+{
+	struct epoll_event event = {0};
+	event.events = events;
+	event.data.fd = s->listener;
+	if (epoll_ctl(s->epoll, EPOLL_CTL_MOD, s->listener, &event) < 0) {
+		return -1;
+	}
+	event.data.fd = s->local;
+	if (s->local >= 0 && epoll_ctl(s->epoll, EPOLL_CTL_MOD, s->local, &event) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int listeners_resume(void *arg, void *ctx)
+{
+	return listeners_watch(arg, EPOLLIN);
+}
+
+/* Accepts the connections waiting on the listener. At most ACCEPT_BATCH
+ * are taken at a time so that a burst of connections doesn't hold up
+ * the clients, the rest wait for the next round of events.
+ */
+int server_accept(struct server *s, int listener)
+{
+	int i, sock;
+	for (i = 0; i < ACCEPT_BATCH; ++i) {
+		sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+		if (sock < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			errno = 0;
+			return 0;
+		}
+		if (sock < 0 && errno == ECONNABORTED) {
+			// the client has given up while waiting
+			continue;
+		}
+		if (sock < 0 && errno != EMFILE && errno != ENFILE
+				&& errno != ENOBUFS && errno != ENOMEM)
+		{
+			return -1;
+		}
+		if (sock < 0 || client_accept(s, sock, listener == s->listener) < 0) {
+			// The connections wait in the backlog until there is room again.
+			// The listeners stay readable meanwhile, so they are left out
+			// of the events for a while instead of being retried in a loop.
+			perror("failed to accept a client");
+			errno = 0;
+			timer_arm(&s->timers, &s->accept_timer, now_ms() + ACCEPT_PAUSE,
+					listeners_resume, s);
+			return listeners_watch(s, 0);
+		}
+	}
+	return 0;
+}
+
+int respond_start_ok(struct server *s, struct client *cli)
+{
+	struct message resp;
+	enum side side = client_side(cli);
+	resp.type = MSG_START_OK;
+	resp.data.start_ok.other = (char *)pair_name(cli->pair,
+			side == SIDE_RED ? SIDE_BLUE : SIDE_RED);
+	resp.data.start_ok.side = side;
+	resp.data.start_ok.width = cli->pair->game.width;
+	resp.data.start_ok.height = cli->pair->game.height;
+	resp.data.start_ok.line_length = cli->pair->game.line_length;
+	resp.data.start_ok.red_undos = cli->pair->game.red_undos;
+	resp.data.start_ok.blue_undos = cli->pair->game.blue_undos;
+	return respond(s, cli, &resp);
+}
+
+/* Sends the message to both players of the pair.
+ */
+int respond_pair(struct server *s, struct pair *pair, struct message *msg)
+{
+	if (pair->red && respond(s, pair->red, msg) < 0) {
+		return -1;
+	}
+	if (pair->blue && respond(s, pair->blue, msg) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int job_column(struct bot_job *job)
+{
+	switch (job->engine) {
+	case ENGINE_BOOK:
+		return job->result.book.column;
+	case ENGINE_TABLEBASE:
+		return job->result.tablebase.column;
+	case ENGINE_ALPHABETA:
+		return job->result.ai.column;
+	default:
+		return job->result.mcts.column;
+	}
+}
+
+/* Returns the evaluation of the job's position on the scale
+ * of the alpha-beta engine, see MSG_ANALYZE_OK.
+ */
+static int job_score(struct bot_job *job)
+{
+	switch (job->engine) {
+	case ENGINE_BOOK:
+		return job->result.book.score;
+	case ENGINE_TABLEBASE:
+		switch (job->result.tablebase.outcome) {
+		case TABLEBASE_WIN:
+			return AI_SCORE_WIN - job->result.tablebase.distance;
+		case TABLEBASE_LOSS:
+			return -AI_SCORE_WIN + job->result.tablebase.distance;
+		default:
+			return 0;
+		}
+	case ENGINE_ALPHABETA:
+		return job->result.ai.score;
+	default:
+		// the chance of winning, mapped to -100..100
+		return (job->result.mcts.value - 0.5) * 200;
+	}
+}
+
+static void bot_search(struct bot_job *bj, struct engine *e)
+{
+	struct ai_limits limits;
+	struct mcts_limits mcts_limits;
+	// the tablebase is exact, so it goes first
+	if (e->tablebase && tablebase_probe(e->tablebase, bj->history, bj->moves,
+				&bj->result.tablebase) == 0)
+	{
+		bj->engine = ENGINE_TABLEBASE;
+		bj->status = bj->result.tablebase.column < 0 ? -1 : 0;
+		return;
+	}
+	if (e->book && book_probe(e->book, bj->key, bj->mirrored,
+				&bj->result.book) == 0)
+	{
+		bj->engine = ENGINE_BOOK;
+		bj->status = 0;
+		return;
+	}
+	bj->engine = e->type;
+	if (e->type == ENGINE_ALPHABETA) {
+		limits.time_ms = bj->time_ms;
+		limits.depth = 0;
+		limits.stop = &bj->cancelled;
+		bj->status = ai_search(&e->data.ai, bj->history, bj->moves,
+				&limits, &bj->result.ai);
+	} else {
+		mcts_limits.time_ms = bj->time_ms;
+		mcts_limits.stop = &bj->cancelled;
+		bj->status = mcts_search(&e->data.mcts, bj->history, bj->moves,
+				&mcts_limits, &bj->result.mcts);
+	}
+}
+
+static void bot_run(struct pool_job *job, void *ctx)
+{
+	struct bot_job *bj = (struct bot_job *)job;
+	struct cache_value value;
+	bot_search(bj, ctx);
+	// cancelled searches are cut short, their results are not cached
+	if (bj->cache && bj->status == 0
+			&& !__atomic_load_n(&bj->cancelled, __ATOMIC_RELAXED))
+	{
+		// the cache holds the moves of the canonical positions
+		value.column = job_column(bj);
+		if (bj->mirrored) {
+			value.column = bj->width - 1 - value.column;
+		}
+		value.score = job_score(bj);
+		cache_put(bj->cache, bj->key, &value);
+	}
+}
+
+/* Creates a search job for the position of the game.
+ */
+struct bot_job *job_new(struct server *s, struct game *game)
+{
+	struct bot_job *job = malloc(sizeof(*job));
+	if (!job) {
+		return NULL;
+	}
+	// + 1 so that the allocation is never empty
+	job->history = malloc(game->moves + 1);
+	if (!job->history) {
+		free(job);
+		return NULL;
+	}
+	memcpy(job->history, game_history(game), game->moves);
+	job->moves = game->moves;
+	job->key = game_canonical_hash(game, &job->mirrored);
+	job->width = game->width;
+	job->time_ms = s->bot_time;
+	job->cancelled = 0;
+	job->pair = NULL;
+	job->client = NULL;
+	job->cache = NULL;
+	return job;
+}
+
+int bot_start(struct server *s, struct pair *pair)
+{
+	struct bot_job *job = job_new(s, &pair->game);
+	if (!job) {
+		return -1;
+	}
+	job->pair = pair;
+	pair->job = job;
+	pool_submit(&s->bots, &job->base, bot_run);
+	return 0;
+}
+
+/* Appends the finished game to the journal, if there is one.
+ */
+void pair_record(struct server *s, struct pair *pair)
+{
+	struct journal_game game;
+	if (!s->journal) {
+		return;
+	}
+	game.started = pair->started;
+	game.finished = wall_ms();
+	game.width = pair->game.width;
+	game.height = pair->game.height;
+	game.line_length = pair->game.line_length;
+	game.winner = pair->game.winner;
+	game.red = pair_name(pair, SIDE_RED);
+	game.blue = pair_name(pair, SIDE_BLUE);
+	game.red_len = strlen(game.red);
+	game.blue_len = strlen(game.blue);
+	game.moves = pair->game.moves;
+	game.history = game_history(&pair->game);
+	if (journal_append(s->journal, &game) < 0) {
+		// the game is lost, but the server keeps going
+		printf("failed to journal the game\n");
+		return;
+	}
+	if (!s->archive) {
+		return;
+	}
+	if (archive_add(s->archive, &game) < 0) {
+		// the archive takes no more games, they are still journaled and
+		// the next start archives them
+		printf("failed to archive the game\n");
+	}
+	if (archive_failing(s->archive) != s->archive_failing) {
+		s->archive_failing = !s->archive_failing;
+		printf(s->archive_failing
+				? "the archive is failing, its new games wait in memory\n"
+				: "the archive works again\n");
+	}
+}
+
+/* Records the game that is over and tells the players who has won,
+ * the pair is freed.
+ */
+int pair_over(struct server *s, struct pair *pair)
+{
+	struct message resp;
+	struct client *red = pair->red;
+	struct client *blue = pair->blue;
+	resp.type = MSG_NOTIFY_OVER;
+	resp.data.notify_over.winner = pair->game.winner;
+	pair_log(pair);
+	pair_record(s, pair);
+	if (pair->bot == SIDE_NONE && ratings_update(&s->ratings,
+				pair_name(pair, SIDE_RED), pair_name(pair, SIDE_BLUE),
+				pair->game.winner) < 0)
+	{
+		// the ratings are off until the next start rebuilds them from the journal
+		printf("failed to rate the game\n");
+	}
+	pair_free(pair);
+	if (red && respond(s, red, &resp) < 0) {
+		return -1;
+	}
+	if (blue && respond(s, blue, &resp) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Ends the game with a loss for the player who has run out of time.
+ */
+static int pair_timeout(void *arg, void *ctx)
+{
+	struct pair *pair = arg;
+	printf("%s ran out of time\n", pair_name(pair, pair->game.turn));
+	game_resign(&pair->game, pair->game.turn);
+	return pair_over(ctx, pair);
+}
+
+/* Starts the clock of the player to move, if the moves are timed,
+ * the bot's moves are limited by the bot's time instead.
+ */
+void pair_clock(struct server *s, struct pair *pair)
+{
+	if (s->move_time > 0 && pair->game.turn != pair->bot) {
+		timer_arm(&s->timers, &pair->clock, now_ms() + s->move_time,
+				pair_timeout, pair);
+	} else {
+		timer_cancel(&pair->clock);
+	}
+}
+
+/* Notifies the players about a dropped disc. Ends the game if it's over,
+ * otherwise makes the bot think if it's the bot's turn.
+ */
+int pair_dropped(struct server *s, struct pair *pair, enum side side, int column, int row)
+{
+	struct message resp;
+	resp.type = MSG_NOTIFY_DROP;
+	resp.data.notify_drop.side = side;
+	resp.data.notify_drop.column = column;
+	resp.data.notify_drop.row = row;
+	if (respond_pair(s, pair, &resp) < 0) {
+		return -1;
+	}
+	if (pair->game.over) {
+		return pair_over(s, pair);
+	}
+	pair_clock(s, pair);
+	if (pair->game.turn == pair->bot) {
+		return bot_start(s, pair);
+	}
+	return 0;
+}
+
+int bot_move(struct server *s, struct pair *pair, struct bot_job *job)
+{
+	struct client *cli = pair->bot == SIDE_RED ? pair->blue : pair->red;
+	int column = job_column(job), row = -1;
+	if (job->status == 0) {
+		row = game_drop(&pair->game, pair->bot, column);
+	}
+	if (row < 0) {
+		// should not happen, the bot leaves the game
+		printf("bot failed to move\n");
+		pair_free(pair);
+		return cli ? respond_nullary(s, cli, MSG_NOTIFY_QUIT) : 0;
+	}
+	if (job->engine == ENGINE_TABLEBASE) {
+		printf("bot played %d from the tablebase (%s in %d)\n", column,
+				job->result.tablebase.outcome == TABLEBASE_WIN ? "win"
+				: job->result.tablebase.outcome == TABLEBASE_LOSS ? "loss"
+				: "draw", job->result.tablebase.distance);
+	} else if (job->engine == ENGINE_BOOK) {
+		printf("bot played %d from the book (score %d)\n",
+				column, job->result.book.score);
+	} else if (job->engine == ENGINE_ALPHABETA) {
+		printf("bot played %d (score %d, depth %d, %lu nodes)\n",
+				column, job->result.ai.score,
+				job->result.ai.depth, job->result.ai.nodes);
+	} else {
+		printf("bot played %d (value %.3f, %lu playouts, %.0f playouts/s)\n",
+				column, job->result.mcts.value, job->result.mcts.playouts,
+				job->result.mcts.playouts * 1000.0
+					/ (job->result.mcts.time_ms + 1));
+	}
+	return pair_dropped(s, pair, pair->bot, column, row);
+}
+
+int respond_analysis(struct server *s, struct client *cli,
+		const struct cache_value *value, int mirrored, int width, uint64_t started)
+{
+	struct message resp;
+	unsigned long hits, misses;
+	uint64_t elapsed = now_us() - started;
+	s->analyses++;
+	s->analysis_time += elapsed;
+	if (elapsed > s->analysis_max_time) {
+		s->analysis_max_time = elapsed;
+	}
+	cache_stats(&s->cache, &hits, &misses);
+	printf("analysis took %lu us (average %lu us, max %lu us, cache hit rate %.1f%%)\n",
+			(unsigned long)elapsed,
+			(unsigned long)(s->analysis_time / s->analyses),
+			(unsigned long)s->analysis_max_time,
+			100.0 * hits / (hits + misses));
+	resp.type = MSG_ANALYZE_OK;
+	resp.data.analyze_ok.column = mirrored ? width - 1 - value->column : value->column;
+	resp.data.analyze_ok.score = value->score;
+	return respond(s, cli, &resp);
+}
+
+int analysis_done(struct server *s, struct client *cli, struct bot_job *job)
+{
+	struct cache_value value;
+	if (job->status < 0) {
+		return respond_err(s, cli, MSG_ANALYZE_ERR, "analysis failed");
+	}
+	// respond_analysis expects the canonical column
+	value.column = job_column(job);
+	if (job->mirrored) {
+		value.column = job->width - 1 - value.column;
+	}
+	value.score = job_score(job);
+	return respond_analysis(s, cli, &value, job->mirrored, job->width,
+			job->started);
+}
+
+/* Applies the moves of the bots that have finished thinking
+ * and answers the finished analyses.
+ */
+int server_bots(struct server *s)
+{
+	struct pool_job *jobs, *next;
+	struct bot_job *job;
+	int res = 0;
+	for (jobs = pool_collect(&s->bots); jobs; jobs = next) {
+		next = jobs->next;
+		job = (struct bot_job *)jobs;
+		if (job->pair) {
+			job->pair->job = NULL;
+			if (res == 0) {
+				res = bot_move(s, job->pair, job);
+			}
+		} else if (job->client) {
+			job->client->analysis = NULL;
+			if (res == 0) {
+				res = analysis_done(s, job->client, job);
+			}
+		}
+		free(job->history);
+		free(job);
+	}
+	return res;
+}
+
+int handle_start(struct server *s, struct client *cli, int bot)
+{
+	struct client *other;
+	struct pair *pair;
+	if (!cli->name) {
+		return respond_err(s, cli, MSG_START_ERR, "not logged in");
+	} else if (cli->pair) {
+		return respond_err(s, cli, MSG_START_ERR, "already in a game");
+	} else if (s->waiting_client == cli->sock) {
+		return respond_err(s, cli, MSG_START_ERR, "already waiting for a game");
+	}
+	if (bot) {
+		if (s->nbots == 0) {
+			return respond_err(s, cli, MSG_START_ERR, "bot is not available");
+		}
+		pair = pair_new(cli, NULL, &s->rules);
+		if (!pair) {
+			return -1;
+		}
+		link_insert(&s->pairs, &pair->link);
+		pair_clock(s, pair);
+		return respond_start_ok(s, cli);
+	}
+	if (hashmap_get(&s->clients_by_fd,
+			(void *)(uintptr_t)s->waiting_client,
+			(void **)&other) < 0)
+	{
+		queue_set(s, cli->sock);
+		return 0;
+	}
+	pair = pair_new(cli, other, &s->rules);
+	if (!pair) {
+		return -1;
+	}
+	link_insert(&s->pairs, &pair->link);
+	queue_set(s, -1);
+	pair_clock(s, pair);
+	if (respond_start_ok(s, cli) < 0) {
+		return -1;
+	}
+	if (respond_start_ok(s, other) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Seats the client in the restored game where their seat is kept and sends
+ * them the moves played so far, or puts them back to waiting if they were
+ * waiting when the snapshot was taken.
+ */
+int client_resume(struct server *s, struct client *cli)
+{
+	struct message resp;
+	struct pair *pair;
+	const unsigned char *history;
+	int *heights, i;
+	if (s->waiting_name && strcmp(s->waiting_name, cli->name) == 0) {
+		free(s->waiting_name);
+		s->waiting_name = NULL;
+		return handle_start(s, cli, 0);
+	}
+	if (hashmap_get(&s->seats, cli->name, (void **)&pair) < 0) {
+		return 0;
+	}
+	seat_take(pair, cli);
+	if (respond_start_ok(s, cli) < 0) {
+		return -1;
+	}
+	heights = calloc(pair->game.width, sizeof(*heights));
+	if (!heights) {
+		return -1;
+	}
+	history = game_history(&pair->game);
+	resp.type = MSG_NOTIFY_DROP;
+	for (i = 0; i < pair->game.moves; ++i) {
+		// red moves first
+		resp.data.notify_drop.side = i % 2 == 0 ? SIDE_RED : SIDE_BLUE;
+		resp.data.notify_drop.column = history[i];
+		resp.data.notify_drop.row = heights[history[i]]++;
+		if (respond(s, cli, &resp) < 0) {
+			free(heights);
+			return -1;
+		}
+	}
+	free(heights);
+	if (pair->game.turn == pair->bot && !pair->job && s->nbots > 0) {
+		return bot_start(s, pair);
+	}
+	return 0;
+}
+
+/* Fills token with TOKEN_LEN random hexadecimal digits.
+ */
+static int token_new(struct server *s, char *token)
+{
+	unsigned char bytes[TOKEN_LEN / 2];
+	size_t i;
+	if (read(s->random, bytes, sizeof(bytes)) != sizeof(bytes)) {
+		return -1;
+	}
+	for (i = 0; i < sizeof(bytes); ++i) {
+		sprintf(token + 2 * i, "%02x", bytes[i]);
+	}
+	return 0;
+}
+
+/* Logs the client in with the given name and token.
+ */
+static int client_login(struct server *s, struct client *cli,
+		const char *name, const char *token)
+{
+	char *key = strdup(name);
+	cli->name = strdup(name);
+	cli->token = malloc(TOKEN_LEN + 1);
+	if (!key || !cli->name || !cli->token) {
+		free(key);
+		return -1;
+	}
+	if (token) {
+		strcpy(cli->token, token);
+	} else if (token_new(s, cli->token) < 0) {
+		free(key);
+		return -1;
+	}
+	if (hashmap_insert(&s->fds_by_name, (void *)key, (void *)(intptr_t)cli->sock) < 0) {
+		free(key);
+		return -1;
+	}
+	if (hashmap_insert(&s->fds_by_token, cli->token, (void *)(intptr_t)cli->sock) < 0) {
+		hashmap_remove(&s->fds_by_name, key);
+		return -1;
+	}
+	return 0;
+}
+
+int handle_login(struct server *s, struct client *cli, char *name)
+{
+	struct message resp;
+	struct pair *pair;
+	if (cli->name) {
+		return respond_err(s, cli, MSG_LOGIN_ERR, "user already logged in");
+	}
+	// the seats of the dropped players are only taken with their tokens
+	if (hashmap_contains(&s->fds_by_name, (void *)name)
+			|| strcmp(name, BOT_NAME) == 0
+			|| (hashmap_get(&s->seats, name, (void **)&pair) == 0
+				&& seat_token(pair, name)))
+	{
+		return respond_err(s, cli, MSG_LOGIN_ERR, "name already taken");
+	}
+	if (client_login(s, cli, name, NULL) < 0) {
+		return -1;
+	}
+	resp.type = MSG_LOGIN_OK;
+	resp.data.login_ok.token = cli->token;
+	if (respond(s, cli, &resp) < 0) {
+		return -1;
+	}
+	return client_resume(s, cli);
+}
+
+/* Sends the state of the game to the client who has resumed it.
+ */
+int respond_resume_ok(struct server *s, struct client *cli)
+{
+	struct message resp;
+	struct game *game = &cli->pair->game;
+	enum side side = client_side(cli), field;
+	int x, y, res;
+	char *board = malloc(game->width * game->height + 1);
+	if (!board) {
+		return -1;
+	}
+	for (x = 0; x < game->width; ++x) {
+		for (y = 0; y < game->height; ++y) {
+			field = game_get(game, x, y);
+			board[x * game->height + y] = field == SIDE_RED ? 'r'
+				: field == SIDE_BLUE ? 'b' : '.';
+		}
+	}
+	board[game->width * game->height] = '\0';
+	resp.type = MSG_RESUME_OK;
+	resp.data.resume_ok.name = cli->name;
+	resp.data.resume_ok.other = (char *)pair_name(cli->pair,
+			side == SIDE_RED ? SIDE_BLUE : SIDE_RED);
+	resp.data.resume_ok.side = side;
+	resp.data.resume_ok.width = game->width;
+	resp.data.resume_ok.height = game->height;
+	resp.data.resume_ok.line_length = game->line_length;
+	resp.data.resume_ok.red_undos = game->red_undos;
+	resp.data.resume_ok.blue_undos = game->blue_undos;
+	resp.data.resume_ok.turn = game->turn;
+	resp.data.resume_ok.board = board;
+	res = respond(s, cli, &resp);
+	free(board);
+	return res;
+}
+
+/* Disconnects the client in a game who holds the token, if there is one,
+ * and keeps their seat for whoever resumes with the token, so that a player
+ * whose old connection isn't dead yet can resume on a new one.
+ */
+static int token_takeover(struct server *s, char *token)
+{
+	struct client *old;
+	void *fd;
+	if (hashmap_get(&s->fds_by_token, token, &fd) < 0
+			|| hashmap_get(&s->clients_by_fd, fd, (void **)&old) < 0
+			|| !old->pair)
+	{
+		return 0;
+	}
+	printf("client %d resumed on a new connection\n", old->sock);
+	hashmap_remove(&s->fds_by_name, (void *)old->name);
+	hashmap_remove(&s->fds_by_token, (void *)old->token);
+	// the seat is taken right away, so the grace doesn't matter
+	if (seat_drop(s, old) < 0) {
+		return -1;
+	}
+	return server_disconnect(s, old);
+}
+
+int handle_resume(struct server *s, struct client *cli, char *token)
+{
+	struct pair *pair;
+	const char *name;
+	if (cli->name) {
+		return respond_err(s, cli, MSG_RESUME_ERR, "user already logged in");
+	}
+	if (token_takeover(s, token) < 0) {
+		return -1;
+	}
+	if (hashmap_get(&s->tokens, token, (void **)&pair) < 0) {
+		return respond_err(s, cli, MSG_RESUME_ERR, "no game to resume");
+	}
+	name = pair->red_token && strcmp(pair->red_token, token) == 0
+		? pair->red_name : pair->blue_name;
+	if (client_login(s, cli, name, token) < 0) {
+		return -1;
+	}
+	seat_take(pair, cli);
+	printf("client %d resumed the game as %s\n", cli->sock, cli->name);
+	if (respond_resume_ok(s, cli) < 0) {
+		return -1;
+	}
+	if (pair->game.turn == pair->bot && !pair->job && s->nbots > 0) {
+		return bot_start(s, pair);
+	}
+	return 0;
+}
+
+int handle_drop(struct server *s, struct client *cli, int column)
+{
+	int row;
+	enum side side;
+	if (!cli->pair) {
+		return respond_err(s, cli, MSG_DROP_ERR, "not in game right now");
+	}
+	side = client_side(cli);
+	if ((row = game_drop(&cli->pair->game, side, column)) < 0) {
+		return respond_err(s, cli, MSG_DROP_ERR, "can't drop here and now");
+	}
+	if (respond_nullary(s, cli, MSG_DROP_OK) < 0) {
+		return -1;
+	}
+	return pair_dropped(s, cli->pair, side, column, row);
+}
+
+int handle_undo(struct server *s, struct client *cli)
+{
+	struct message resp;
+	struct pair *pair;
+	struct game *game;
+	int column, row, bot_column, bot_row, undos;
+	enum side side;
+	int with_bot = 0;
+	if (!cli->pair) {
+		return respond_err(s, cli, MSG_DROP_ERR, "not in game right now");
+	}
+	pair = cli->pair;
+	game = &pair->game;
+	side = client_side(cli);
+	if (pair->bot != SIDE_NONE && game->turn == side) {
+		// against the bot, undo takes back the bot's reply as well
+		undos = side == SIDE_RED ? game->red_undos : game->blue_undos;
+		if (undos == 0 || game->moves < 2
+				|| game_undo(game, pair->bot, &bot_column, &bot_row) < 0)
+		{
+			return respond_err(s, cli, MSG_DROP_ERR, "can't undo here and now");
+		}
+		with_bot = 1;
+	}
+	if (game_undo(game, side, &column, &row) < 0) {
+		return respond_err(s, cli, MSG_DROP_ERR, "can't undo here and now");
+	}
+	// the bot might be thinking about the move that was taken back
+	bot_cancel(pair);
+	pair_clock(s, pair);
+	if (respond_nullary(s, cli, MSG_UNDO_OK) < 0) {
+		return -1;
+	}
+	resp.type = MSG_NOTIFY_UNDO;
+	if (with_bot) {
+		resp.data.notify_undo.side = pair->bot;
+		resp.data.notify_undo.column = bot_column;
+		resp.data.notify_undo.row = bot_row;
+		if (respond_pair(s, pair, &resp) < 0) {
+			return -1;
+		}
+	}
+	resp.data.notify_undo.side = side;
+	resp.data.notify_undo.column = column;
+	resp.data.notify_undo.row = row;
+	return respond_pair(s, pair, &resp);
+}
+
+int handle_quit(struct server *s, struct client *cli)
+{
+	struct client *other;
+	if (cli->pair) {
+		other = client_other(cli);
+		pair_free(cli->pair);
+		if (other && respond_nullary(s, other, MSG_NOTIFY_QUIT) < 0) {
+			return -1;
+		}
+	} else if (s->waiting_client == cli->sock) {
+		queue_set(s, -1);
+	} else {
+		return respond_err(s, cli, MSG_QUIT_ERR, "not in game or queue now");
+	}
+	if (respond_nullary(s, cli, MSG_QUIT_OK) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int handle_analyze(struct server *s, struct client *cli, int *moves, int nmoves)
+{
+	struct game_rules rules = s->rules;
+	struct game game;
+	struct cache_value value;
+	struct bot_job *job;
+	uint64_t key, started = now_us();
+	int i, mirrored;
+	if (!cli->name) {
+		return respond_err(s, cli, MSG_ANALYZE_ERR, "not logged in");
+	} else if (s->nbots == 0) {
+		return respond_err(s, cli, MSG_ANALYZE_ERR, "analysis is not available");
+	} else if (cli->analysis) {
+		return respond_err(s, cli, MSG_ANALYZE_ERR, "analysis in progress");
+	}
+	rules.undos = 0;
+	if (game_init(&game, &rules) < 0) {
+		return -1;
+	}
+	for (i = 0; i < nmoves; ++i) {
+		if (game_drop(&game, game.turn, moves[i]) < 0) {
+			game_finalize(&game);
+			return respond_err(s, cli, MSG_ANALYZE_ERR, "invalid moves");
+		}
+	}
+	if (game.over) {
+		game_finalize(&game);
+		return respond_err(s, cli, MSG_ANALYZE_ERR, "game is over");
+	}
+	key = game_canonical_hash(&game, &mirrored);
+	if (cache_get(&s->cache, key, &value) == 0) {
+		game_finalize(&game);
+		return respond_analysis(s, cli, &value, mirrored, rules.width, started);
+	}
+	job = job_new(s, &game);
+	game_finalize(&game);
+	if (!job) {
+		return -1;
+	}
+	job->client = cli;
+	job->cache = &s->cache;
+	job->started = started;
+	cli->analysis = job;
+	pool_submit(&s->bots, &job->base, bot_run);
+	return 0;
+}
+
+/* The client that gets a list, one message per item.
+ */
+struct listing {
+	struct server *s;
+	struct client *cli;
+};
+
+static int respond_history_game(const struct journal_game *game, void *ctx)
+{
+	struct listing *req = ctx;
+	struct message resp;
+	int i, res = -1;
+	resp.type = MSG_HISTORY_GAME;
+	resp.data.history_game.red = copy_name(game->red, game->red_len);
+	resp.data.history_game.blue = copy_name(game->blue, game->blue_len);
+	resp.data.history_game.winner = game->winner;
+	resp.data.history_game.nmoves = game->moves;
+	// + 1 so that the allocation is never empty
+	resp.data.history_game.moves = malloc((game->moves + 1) * sizeof(int));
+	if (resp.data.history_game.red && resp.data.history_game.blue
+			&& resp.data.history_game.moves)
+	{
+		for (i = 0; i < game->moves; ++i) {
+			resp.data.history_game.moves[i] = game->history[i];
+		}
+		res = respond(req->s, req->cli, &resp);
+	}
+	close_message(&resp);
+	return res;
+}
+
+int handle_history(struct server *s, struct client *cli, char *name, int count)
+{
+	struct listing req;
+	struct message resp;
+	int found;
+	if (!s->archive) {
+		return respond_err(s, cli, MSG_HISTORY_ERR, "history is not available");
+	}
+	if (count <= 0 || count > MAX_HISTORY) {
+		return respond_err(s, cli, MSG_HISTORY_ERR, "invalid number of games");
+	}
+	req.s = s;
+	req.cli = cli;
+	found = archive_history(s->archive, name, count, respond_history_game, &req);
+	if (found < 0) {
+		return -1;
+	}
+	resp.type = MSG_HISTORY_OK;
+	resp.data.history_ok.count = found;
+	return respond(s, cli, &resp);
+}
+
+int handle_rank(struct server *s, struct client *cli, char *name)
+{
+	struct message resp;
+	if (ratings_rank(&s->ratings, name, &resp.data.rank_ok.rating,
+				&resp.data.rank_ok.rank) < 0)
+	{
+		return respond_err(s, cli, MSG_RANK_ERR, "player is not rated");
+	}
+	resp.type = MSG_RANK_OK;
+	resp.data.rank_ok.players = ratings_count(&s->ratings);
+	return respond(s, cli, &resp);
+}
+
+static int respond_leaderboard_entry(const char *name, int rating, int rank,
+		void *ctx)
+{
+	struct listing *req = ctx;
+	struct message resp;
+	resp.type = MSG_LEADERBOARD_ENTRY;
+	resp.data.leaderboard_entry.rank = rank;
+	resp.data.leaderboard_entry.name = (char *)name;
+	resp.data.leaderboard_entry.rating = rating;
+	return respond(req->s, req->cli, &resp);
+}
+
+int handle_leaderboard(struct server *s, struct client *cli, int count)
+{
+	struct listing req;
+	struct message resp;
+	int found;
+	if (count <= 0 || count > MAX_LEADERBOARD) {
+		return respond_err(s, cli, MSG_LEADERBOARD_ERR,
+				"invalid number of players");
+	}
+	req.s = s;
+	req.cli = cli;
+	found = ratings_top(&s->ratings, count, respond_leaderboard_entry, &req);
+	if (found < 0) {
+		return -1;
+	}
+	resp.type = MSG_LEADERBOARD_OK;
+	resp.data.leaderboard_ok.count = found;
+	return respond(s, cli, &resp);
+}
+
+/* Returns the type of the error answering a message of the given type,
+ * MSG_INVALID if it has none.
+ */
+static enum message_type error_type(enum message_type type)
+{
+	switch (type) {
+	case MSG_LOGIN:
+		return MSG_LOGIN_ERR;
+	case MSG_RESUME:
+		return MSG_RESUME_ERR;
+	case MSG_START:
+		return MSG_START_ERR;
+	case MSG_DROP:
+		return MSG_DROP_ERR;
+	case MSG_UNDO:
+		return MSG_UNDO_ERR;
+	case MSG_QUIT:
+		return MSG_QUIT_ERR;
+	case MSG_ANALYZE:
+		return MSG_ANALYZE_ERR;
+	case MSG_HISTORY:
+		return MSG_HISTORY_ERR;
+	case MSG_RANK:
+		return MSG_RANK_ERR;
+	case MSG_LEADERBOARD:
+		return MSG_LEADERBOARD_ERR;
+	default:
+		return MSG_INVALID;
+	}
+}
+
+/* Takes a token for a login or a resume from the bucket of the client's
+ * address. Returns 0 if there was one and -1 otherwise, the addresses
+ * other than IPv4 ones are not limited.
+ */
+static int peer_take(struct server *s, struct client *cli, uint64_t now)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getpeername(cli->sock, (struct sockaddr *)&addr, &len) < 0
+			|| addr.sin_family != AF_INET)
+	{
+		return 0;
+	}
+	return limiter_take(&s->logins, ntohl(addr.sin_addr.s_addr), now);
+}
+
+/* Answers a message of a client who is over their rate according to
+ * the limit action.
+ */
+static int client_limited(struct server *s, struct client *cli,
+		enum message_type type, const char *what)
+{
+	if (s->limited++ % 1000 == 0) {
+		printf("client %d is over the %s rate (%lu messages refused)\n",
+				cli->sock, what, s->limited);
+	}
+	if (s->limit_action == LIMIT_DISCONNECT) {
+		return client_close(s, cli);
+	}
+	if (type == MSG_INVALID) {
+		return respond_nullary(s, cli, MSG_INVALID);
+	}
+	return respond_err(s, cli, type, "too many requests");
+}
+
+int handle_message(struct server *s, struct client *cli, struct message *msg)
+{
+	struct message resp;
+	uint64_t now = 0;
+	if (s->message_rate > 0 || s->login_rate > 0) {
+		now = now_ms();
+	}
+	if (s->message_rate > 0 && token_bucket_take(&cli->messages,
+				s->message_rate, s->message_burst, now) < 0)
+	{
+		return client_limited(s, cli, error_type(msg->type), "message");
+	}
+	if (s->login_rate > 0 && (msg->type == MSG_LOGIN || msg->type == MSG_RESUME)
+			&& peer_take(s, cli, now) < 0)
+	{
+		return client_limited(s, cli, error_type(msg->type), "login");
+	}
+	switch (msg->type) {
+	case MSG_LOGIN:
+		return handle_login(s, cli, msg->data.login.name);
+	case MSG_RESUME:
+		return handle_resume(s, cli, msg->data.resume.token);
+	case MSG_START:
+		return handle_start(s, cli, msg->data.start.bot);
+	case MSG_DROP:
+		return handle_drop(s, cli, msg->data.drop.column);
+	case MSG_UNDO:
+		return handle_undo(s, cli);
+	case MSG_QUIT:
+		return handle_quit(s, cli);
+	case MSG_ANALYZE:
+		return handle_analyze(s, cli, msg->data.analyze.moves,
+				msg->data.analyze.nmoves);
+	case MSG_HISTORY:
+		return handle_history(s, cli, msg->data.history.name,
+				msg->data.history.count);
+	case MSG_RANK:
+		return handle_rank(s, cli, msg->data.rank.name);
+	case MSG_LEADERBOARD:
+		return handle_leaderboard(s, cli, msg->data.leaderboard.count);
+	default:
+		resp.type = MSG_INVALID;
+		return respond(s, cli, &resp);
+	}
+}
+
+/* Handles at most s->budget of the messages the client has sent. If they
+ * are used up, the client goes to the end of the ready list and isn't read
+ * from until the rest is handled, so nobody can keep the loop to themselves.
+ */
+int client_serve(struct server *s, struct client *cli)
+{
+	struct message msg;
+	int i, n, handled;
+	int was_ready = cli->ready;
+	ready_remove(s, cli);
+	s->reading = cli;
+	for (handled = 0; handled < s->budget && !cli->closing
+			&& (n = parse_message(&cli->input, &msg)) != 0; ++handled)
+	{
+		if (n < 0) {
+			n = -n;
+			printf("invalid message: ");
+			for (i = 0; i < n; ++i) {
+				printf("%c", buffer_get(&cli->input, i));
+			}
+			msg.type = MSG_INVALID;
+			if (respond(s, cli, &msg) < 0) {
+				return -1;
+			}
+		} else {
+			printf("message: ");
+			for (i = 0; i < n; ++i) {
+				printf("%c", buffer_get(&cli->input, i));
+			}
+			if (handle_message(s, cli, &msg) < 0) {
+				close_message(&msg);
+				return -1;
+			}
+		}
+		close_message(&msg);
+		buffer_pop(&cli->input, NULL, n);
+	}
+	s->reading = NULL;
+	// there may be more, the next turn finds out
+	if (handled == s->budget && !cli->closing) {
+		ready_append(s, cli);
+	}
+	return cli->ready != was_ready ? client_poll(s, cli) : 0;
+}
+
+int server_read(struct server *s, struct client *cli)
+{
+	char buf[MAX_READ];
+	int n;
+	n = read(cli->sock, buf, sizeof(buf));
+	if (n < 0 && errno == ECONNRESET) {
+		errno = 0;
+		return server_disconnect(s, cli);
+	}
+	if (n < 0) {
+		return -1;
+	}
+	if (n == 0) {
+		return server_disconnect(s, cli);
+	}
+	cli->active = now_ms();
+	if (buffer_push(&cli->input, buf, n) < 0) {
+		return -1;
+	}
+	return client_serve(s, cli);
+}
+
+/* Gives a turn to every client that was on the ready list when it started.
+ * The round is counted rather than ended at the tail, which a message
+ * may disconnect, see token_takeover.
+ */
+int server_serve(struct server *s)
+{
+	struct client *cli;
+	size_t turns = 0;
+	for (cli = s->ready_head; cli; cli = cli->ready_next) {
+		turns++;
+	}
+	while (turns-- > 0 && s->ready_head) {
+		if (client_serve(s, s->ready_head) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Reads from the client again, their output has drained to the low
+ * watermark.
+ */
+int client_unpause(struct server *s, struct client *cli)
+{
+	cli->paused = 0;
+	s->paused--;
+	printf("resumed client %d (%lu messages left out so far)\n",
+			cli->sock, s->dropped);
+	// the state of the game replaces the moves that were left out
+	if (cli->stale && cli->pair && respond_resume_ok(s, cli) < 0) {
+		return -1;
+	}
+	cli->stale = 0;
+	return client_poll(s, cli);
+}
+
+/* Handles an item about the client from their I/O thread.
+ */
+int client_item(struct server *s, struct client *cli, struct io_item *item)
+{
+	int res;
+	switch (item->type) {
+	case IO_MESSAGE:
+		if (cli->closing) {
+			return 0;
+		}
+		cli->active = now_ms();
+		s->reading = cli;
+		res = handle_message(s, cli, &item->msg);
+		s->reading = NULL;
+		return res;
+	case IO_PAUSED:
+		cli->paused = 1;
+		s->paused++;
+		client_log_paused(s, cli, item->len);
+		return 0;
+	case IO_RESUMED:
+		return client_unpause(s, cli);
+	case IO_CLOSED:
+		return server_disconnect(s, cli);
+	default:
+		return 0;
+	}
+}
+
+/* Handles what the I/O threads have sent, the items of a client whose
+ * connection is already gone are dropped.
+ */
+int server_collect(struct server *s)
+{
+	struct io_item item;
+	struct client *cli;
+	uint64_t value;
+	int i, res;
+	if (read(s->io_event, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		return -1;
+	}
+	for (i = 0; i < s->nio; ++i) {
+		while (io_receive(&s->io[i], &item) == 0) {
+			res = 0;
+			if (hashmap_get(&s->clients_by_fd, (void *)(intptr_t)item.sock,
+						(void **)&cli) == 0 && cli->id == item.id)
+			{
+				res = client_item(s, cli, &item);
+			}
+			close_message(&item.msg);
+			if (res < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int server_write(struct server *s, struct client *cli)
+{
+	char buf[MAX_WRITE];
+	size_t len;
+	int n;
+	len = sizeof(buf) < buffer_len(&cli->output)
+		? sizeof(buf)
+		: buffer_len(&cli->output);
+	buffer_peek(&cli->output, buf, len);
+	n = write(cli->sock, buf, len);
+	if (n < 0 && errno == EPIPE) {
+		errno = 0;
+		return server_disconnect(s, cli);
+	}
+	if (n < 0) {
+		return -1;
+	}
+	buffer_pop(&cli->output, NULL, n);
+	s->buffered -= n;
+	if (cli->paused && buffer_len(&cli->output) <= s->low_water) {
+		return client_unpause(s, cli);
+	}
+	if (buffer_len(&cli->output) == 0) {
+		return client_poll(s, cli);
+	}
+	return 0;
+}
+
+/* Starts a snapshot of the live games, unless the last one is still
+ * being taken or written. The games are added by server_snapshot_step.
+ */
+int server_snapshot(struct server *s)
+{
+	struct client *waiting;
+	const char *name = s->waiting_name;
+	uint64_t expirations;
+	if (read(s->snapshot_timer, &expirations, sizeof(expirations)) < 0
+			&& errno != EAGAIN)
+	{
+		return -1;
+	}
+	if (s->snapshotting || snapshot_busy(s->snapshot)) {
+		printf("skipped a snapshot, the last one is not written yet\n");
+		return 0;
+	}
+	if (snapshot_wait(s->snapshot) < 0) {
+		printf("failed to write the snapshot\n");
+	}
+	if (hashmap_get(&s->clients_by_fd, (void *)(intptr_t)s->waiting_client,
+				(void **)&waiting) == 0)
+	{
+		name = waiting->name;
+	}
+	if (snapshot_begin(s->snapshot, name, name ? strlen(name) : 0) < 0) {
+		return -1;
+	}
+	// the games started from now on are left for the next snapshot
+	link_insert(&s->pairs, &s->snapshot_cursor);
+	s->snapshotting = 1;
+	s->snapshot_games = 0;
+	s->snapshot_started = now_us();
+	return 0;
+}
+
+static int snapshot_pair(struct snapshot *sn, struct pair *pair)
+{
+	struct snapshot_game game;
+	game.started = pair->started;
+	game.width = pair->game.width;
+	game.height = pair->game.height;
+	game.line_length = pair->game.line_length;
+	game.bot = pair->bot;
+	game.red_undos = pair->game.red_undos;
+	game.blue_undos = pair->game.blue_undos;
+	game.red = pair->bot == SIDE_RED ? "" : pair_name(pair, SIDE_RED);
+	game.blue = pair->bot == SIDE_BLUE ? "" : pair_name(pair, SIDE_BLUE);
+	game.red_len = strlen(game.red);
+	game.blue_len = strlen(game.blue);
+	game.red_token = pair_token(pair, SIDE_RED);
+	game.blue_token = pair_token(pair, SIDE_BLUE);
+	game.red_token_len = strlen(game.red_token);
+	game.blue_token_len = strlen(game.blue_token);
+	game.moves = pair->game.moves;
+	game.history = game_history(&pair->game);
+	return snapshot_add(sn, &game);
+}
+
+/* Adds the games after the cursor to the snapshot for at most
+ * SNAPSHOT_STEP_US, and hands the snapshot to its writer once the cursor
+ * reaches the end of the list. Each game is added as it is at the time,
+ * the games that end before the cursor gets to them are left out.
+ */
+void server_snapshot_step(struct server *s)
+{
+	struct pair_link *link;
+	uint64_t started = now_us();
+	int n = 0, res;
+	while ((link = s->snapshot_cursor.next) != &s->pairs) {
+		if (snapshot_pair(s->snapshot, (struct pair *)link) < 0) {
+			printf("failed to take the snapshot\n");
+			snapshot_abort(s->snapshot);
+			link_remove(&s->snapshot_cursor);
+			s->snapshotting = 0;
+			return;
+		}
+		s->snapshot_games++;
+		link_remove(&s->snapshot_cursor);
+		link_insert(link, &s->snapshot_cursor);
+		// reading the clock for every game would cost more than the game
+		if (++n % 64 == 0 && now_us() - started >= SNAPSHOT_STEP_US) {
+			return;
+		}
+	}
+	link_remove(&s->snapshot_cursor);
+	s->snapshotting = 0;
+	loop_unpin(s);
+	res = snapshot_commit(s->snapshot);
+	loop_pin(s);
+	if (res < 0) {
+		printf("failed to write the snapshot\n");
+		return;
+	}
+	printf("snapshot of %lu games taken in %lu us\n", s->snapshot_games,
+			(unsigned long)(now_us() - s->snapshot_started));
+}
+
+/* What is sent to the new server: the listener, the local listener if
+ * there is one and the sockets of the clients, and the clients encoded
+ * in the same order.
+ */
+struct handoff_state {
+	struct server *s;
+	int *fds;
+	int nfds;
+	int fds_cap;
+	struct buffer clients;
+};
+
+/* Encodes a client for the new server: the length of the name as a 32-bit
+ * number, -1 if the client is not logged in, the name and the token,
+ * 1 if the client is waiting for a game and 0 otherwise as a byte, and what
+ * is left in the input and the output buffer, each after its length
+ * as a 32-bit number.
+ */
+static int handoff_client(void *key, void *value, void *ctx)
+{
+	struct handoff_state *st = ctx;
+	struct client *cli = value;
+	int32_t name_len = cli->name ? (int32_t)strlen(cli->name) : -1;
+	char waiting = st->s->waiting_client == cli->sock;
+	uint32_t len;
+	int *fds;
+	// the analysis can't be handed over
+	if (cli->analysis) {
+		analysis_cancel(cli);
+		if (respond_err(st->s, cli, MSG_ANALYZE_ERR, "server is restarting") < 0) {
+			return -1;
+		}
+	}
+	if (st->nfds == st->fds_cap) {
+		fds = realloc(st->fds, 2 * st->fds_cap * sizeof(*fds));
+		if (!fds) {
+			return -1;
+		}
+		st->fds = fds;
+		st->fds_cap *= 2;
+	}
+	st->fds[st->nfds++] = cli->sock;
+	if (buffer_push(&st->clients, (char *)&name_len, 4) < 0
+			|| (cli->name && buffer_push(&st->clients, cli->name, name_len) < 0)
+			|| (cli->name && buffer_push(&st->clients, cli->token, TOKEN_LEN) < 0)
+			|| buffer_push(&st->clients, &waiting, 1) < 0)
+	{
+		return -1;
+	}
+	len = buffer_len(&cli->input);
+	if (buffer_push(&st->clients, (char *)&len, 4) < 0
+			|| buffer_append(&st->clients, &cli->input, len) < 0)
+	{
+		return -1;
+	}
+	len = buffer_len(&cli->output);
+	if (buffer_push(&st->clients, (char *)&len, 4) < 0
+			|| buffer_append(&st->clients, &cli->output, len) < 0)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Hands the listeners, the clients and the games over to the new server
+ * that has connected to the handoff socket: sends the sockets, the number
+ * of clients as a 32-bit number, the clients (see handoff_client) and
+ * a snapshot image of the games. The server stops afterwards, unless
+ * the handoff fails: then it goes on with its clients and its snapshot.
+ */
+int server_handoff(struct server *s)
+{
+	struct handoff_state st;
+	struct snapshot image;
+	struct pair_link *link;
+	char *clients = NULL;
+	size_t len;
+	uint32_t count;
+	uint64_t started = now_us();
+	int res = -1;
+	int sock = accept(s->handoff, NULL, NULL);
+	if (sock < 0) {
+		return -1;
+	}
+	printf("handing over to the new server\n");
+	st.s = s;
+	st.nfds = s->local >= 0 ? 2 : 1;
+	st.fds_cap = 64;
+	st.fds = malloc(st.fds_cap * sizeof(*st.fds));
+	buffer_init(&st.clients);
+	if (snapshot_init(&image, NULL) < 0) {
+		free(st.fds);
+		close(sock);
+		return -1;
+	}
+	if (!st.fds || hashmap_foreach(&s->clients_by_fd, handoff_client, &st) < 0) {
+		goto done;
+	}
+	st.fds[0] = s->listener;
+	if (s->local >= 0) {
+		st.fds[1] = s->local;
+	}
+	count = st.nfds - (s->local >= 0 ? 2 : 1);
+	len = buffer_len(&st.clients);
+	// + 1 so that the allocation is never empty
+	clients = malloc(len + 1);
+	if (!clients || buffer_peek(&st.clients, clients, len) < 0
+			|| handoff_send_fds(sock, st.fds, st.nfds) < 0
+			|| handoff_send(sock, (char *)&count, 4) < 0
+			|| handoff_send(sock, clients, len) < 0
+			|| snapshot_begin(&image, s->waiting_name,
+				s->waiting_name ? strlen(s->waiting_name) : 0) < 0)
+	{
+		goto done;
+	}
+	for (link = s->pairs.next; link != &s->pairs; link = link->next) {
+		// the cursor of the snapshot being taken is not a game
+		if (link != &s->snapshot_cursor
+				&& snapshot_pair(&image, (struct pair *)link) < 0)
+		{
+			goto done;
+		}
+	}
+	if (snapshot_write(&image, sock) < 0) {
+		goto done;
+	}
+	// the new server takes the snapshots from now on
+	if (s->snapshotting) {
+		snapshot_abort(s->snapshot);
+		link_remove(&s->snapshot_cursor);
+		s->snapshotting = 0;
+	}
+	printf("handed over %lu clients in %lu us\n", (unsigned long)count,
+			(unsigned long)(now_us() - started));
+	s->successor = sock;
+	res = 0;
+done:
+	if (res < 0) {
+		close(sock);
+	}
+	snapshot_finalize(&image);
+	buffer_finalize(&st.clients);
+	free(st.fds);
+	free(clients);
+	return res;
+}
+
+static const char *take(const char **data, const char *end, size_t len)
+{
+	const char *start = *data;
+	if ((size_t)(end - start) < len) {
+		return NULL;
+	}
+	*data += len;
+	return start;
+}
+
+/* Adopts a client received from the old server, see handoff_client.
+ * Returns 0 on success and -1 on failure.
+ */
+static int takeover_client(struct server *s, int sock, const char **data,
+		const char *end)
+{
+	struct epoll_event event = {0};
+	struct client *cli;
+	const char *name, *token, *p;
+	char *key;
+	int32_t name_len;
+	uint32_t len;
+	int i;
+	cli = client_new(sock);
+	if (!cli) {
+		close(sock);
 		return -1;
 	}
-	if (respond(s, other, &resp) < 0) {
+	if (hashmap_insert(&s->clients_by_fd, (void *)(intptr_t)sock, cli) < 0) {
+		client_free(cli);
 		return -1;
 	}
-	return 0;
-}
-
-int handle_quit(struct server *s, struct client *cli)
-{
-	struct client *other;
-	if (cli->pair) {
-		other = client_other(cli);
-		pair_free(cli->pair);
-		if (respond_nullary(s, other, MSG_NOTIFY_QUIT) < 0) {
+	if (!(p = take(data, end, 4))) {
+		goto invalid;
+	}
+	memcpy(&name_len, p, 4);
+	if (name_len >= 0) {
+		if (!(name = take(data, end, name_len))
+				|| !(token = take(data, end, TOKEN_LEN)))
+		{
+			goto invalid;
+		}
+		cli->name = copy_name(name, name_len);
+		cli->token = copy_name(token, TOKEN_LEN);
+		key = copy_name(name, name_len);
+		if (!cli->name || !cli->token || !key) {
+			free(key);
+			return -1;
+		}
+		if (hashmap_insert(&s->fds_by_name, key, (void *)(intptr_t)sock) < 0) {
+			free(key);
+			return -1;
+		}
+		if (hashmap_insert(&s->fds_by_token, cli->token, (void *)(intptr_t)sock) < 0) {
+			hashmap_remove(&s->fds_by_name, key);
 			return -1;
 		}
-	} else if (s->waiting_client == cli->sock) {
-		s->waiting_client = -1;
-	} else {
-		return respond_err(s, cli, MSG_QUIT_ERR, "not in game or queue now");
 	}
-	if (respond_nullary(s, cli, MSG_QUIT_OK) < 0) {
+	if (!(p = take(data, end, 1))) {
+		goto invalid;
+	}
+	if (*p) {
+		queue_set(s, sock);
+	}
+	for (i = 0; i < 2; ++i) {
+		if (!(p = take(data, end, 4))) {
+			goto invalid;
+		}
+		memcpy(&len, p, 4);
+		if (!(p = take(data, end, len))) {
+			goto invalid;
+		}
+		if (buffer_push(i == 0 ? &cli->input : &cli->output, (char *)p, len) < 0) {
+			return -1;
+		}
+	}
+	s->buffered += buffer_len(&cli->output);
+	event.events = EPOLLIN;
+	if (buffer_len(&cli->output) > 0) {
+		event.events |= EPOLLOUT;
+	}
+	event.data.fd = sock;
+	client_watch(s, cli);
+	token_bucket_init(&cli->messages, s->message_burst, cli->active);
+	if (epoll_ctl(s->epoll, EPOLL_CTL_ADD, sock, &event) < 0) {
 		return -1;
 	}
+	// the messages that the old server hasn't handled get their turn
+	if (buffer_len(&cli->input) > 0) {
+		ready_append(s, cli);
+		return client_poll(s, cli);
+	}
 	return 0;
+invalid:
+	errno = EINVAL;
+	return -1;
 }
 
-int handle_message(struct server *s, struct client *cli, struct message *msg)
+static int takeover_seat(void *key, void *value, void *ctx)
 {
-	struct message resp;
-	switch (msg->type) {
-	case MSG_LOGIN:
-		return handle_login(s, cli, msg->data.login.name);
-	case MSG_START:
-		return handle_start(s, cli);
-	case MSG_DROP:
-		return handle_drop(s, cli, msg->data.drop.column);
-	case MSG_UNDO:
-		return handle_undo(s, cli);
-	case MSG_QUIT:
-		return handle_quit(s, cli);
-	default:
-		resp.type = MSG_INVALID;
-		return respond(s, cli, &resp);
+	struct server *s = ctx;
+	struct client *cli = value;
+	struct pair *pair;
+	if (cli->name && hashmap_get(&s->seats, cli->name, (void **)&pair) == 0) {
+		seat_take(pair, cli);
 	}
+	return 0;
 }
 
-int server_read(struct server *s, struct client *cli)
+/* Adopts the clients and the games received from the old server,
+ * they are seated in the games where their seats are kept.
+ */
+static int takeover_adopt(struct server *s)
 {
-	char buf[MAX_READ];
-	int i, n;
-	struct message msg;
-	n = read(cli->sock, buf, sizeof(buf));
-	if (n < 0) {
-		return -1;
+	const char *data = s->takeover_data, *end = data + s->takeover_len, *p;
+	struct pair_link *link;
+	struct pair *pair;
+	uint32_t count;
+	long games;
+	int i;
+	if (!(p = take(&data, end, 4))) {
+		goto invalid;
 	}
-	if (n == 0) {
-		return server_disconnect(s, cli);
+	memcpy(&count, p, 4);
+	for (i = s->takeover_listeners; i < s->takeover_nfds; ++i) {
+		if (takeover_client(s, s->takeover_fds[i], &data, end) < 0) {
+			// the sockets not adopted yet are closed
+			while (++i < s->takeover_nfds) {
+				close(s->takeover_fds[i]);
+			}
+			return -1;
+		}
 	}
-	if (buffer_push(&cli->input, buf, n) < 0) {
+	games = snapshot_parse(data, end - data, &s->waiting_name, restore_game, s);
+	if (games < 0) {
 		return -1;
 	}
-	while ((n = parse_message(&cli->input, &msg)) != 0) {
-		if (n < 0) {
-			n = -n;
-			printf("invalid message: ");
-			for (i = 0; i < n; ++i) {
-				printf("%c", buffer_get(&cli->input, i));
-			}
-			msg.type = MSG_INVALID;
-			if (respond(s, cli, &msg) < 0) {
-				return -1;
-			}
-		} else {
-			printf("message: ");
-			for (i = 0; i < n; ++i) {
-				printf("%c", buffer_get(&cli->input, i));
-			}
-			if (handle_message(s, cli, &msg) < 0) {
-				close_message(&msg);
-				return -1;
-			}
+	hashmap_foreach(&s->clients_by_fd, takeover_seat, s);
+	// the bots that were thinking start over
+	for (link = s->pairs.next; link != &s->pairs; link = link->next) {
+		pair = (struct pair *)link;
+		if (s->nbots > 0 && pair->game.turn == pair->bot
+				&& (pair->bot == SIDE_RED ? pair->blue : pair->red)
+				&& bot_start(s, pair) < 0)
+		{
+			return -1;
 		}
-		close_message(&msg);
-		buffer_pop(&cli->input, NULL, n);
 	}
+	printf("took over %lu clients and %ld games\n", (unsigned long)count, games);
 	return 0;
+invalid:
+	for (i = s->takeover_listeners; i < s->takeover_nfds; ++i) {
+		close(s->takeover_fds[i]);
+	}
+	errno = EINVAL;
+	return -1;
 }
 
-int server_write(struct server *s, struct client *cli)
+/* Adopts what was received from the old server, if anything, and waits
+ * on the handoff socket for the next server, if there is one.
+ * Returns 0 on success and -1 on failure.
+ */
+int server_takeover(struct server *s)
 {
-	char buf[MAX_WRITE];
-	size_t len;
-	int n;
-	len = sizeof(buf) < buffer_len(&cli->output)
-		? sizeof(buf)
-		: buffer_len(&cli->output);
-	buffer_peek(&cli->output, buf, len);
-	n = write(cli->sock, buf, len);
-	if (n < 0 && errno == EPIPE) {
-		errno = 0;
-		return server_disconnect(s, cli);
-	}
-	if (n < 0) {
-		return -1;
-	}
-	buffer_pop(&cli->output, NULL, n);
-	if (buffer_len(&cli->output) == 0) {
-		if (epoll_toggle_write(s->epoll, cli->sock, 0) < 0) {
+	struct epoll_event event = {0};
+	struct pair_link *link;
+	if (s->takeover_data) {
+		if (takeover_adopt(s) < 0) {
 			return -1;
 		}
+		free(s->takeover_fds);
+		free(s->takeover_data);
+		s->takeover_fds = NULL;
+		s->takeover_data = NULL;
 	}
-	return 0;
+	// the clocks and the graces of the restored games start over
+	for (link = s->pairs.next; link != &s->pairs; link = link->next) {
+		pair_clock(s, (struct pair *)link);
+		seat_restored(s, (struct pair *)link);
+	}
+	if (!s->handoff_path) {
+		return 0;
+	}
+	s->handoff = handoff_listen(s->handoff_path);
+	if (s->handoff < 0) {
+		return -1;
+	}
+	event.events = EPOLLIN;
+	event.data.fd = s->handoff;
+	return epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->handoff, &event);
 }
 
 #define MAX_EVENTS 32
@@ -526,13 +3557,45 @@ int server_run(struct server *s)
 	int nfds;
 	int i;
 	while (1) {
-		nfds = epoll_wait(s->epoll, events, MAX_EVENTS, -1);
+		// a snapshot being taken goes on as soon as the events are handled
+		nfds = epoll_wait(s->epoll, events, MAX_EVENTS,
+				s->snapshotting || s->ready_head ? 0 : cpu_spin_timeout(
+					&s->spin, timer_timeout(&s->timers, now_ms())));
 		if (nfds < 0) {
 			return -1;
 		}
+		cpu_spin_events(&s->spin, nfds);
 		for (i = 0; i < nfds; ++i) {
-			if (events[i].data.fd == s->listener) {
-				if (server_accept(s) < 0) {
+			if (events[i].data.fd == s->listener || events[i].data.fd == s->local) {
+				if (server_accept(s, events[i].data.fd) < 0) {
+					return -1;
+				}
+				continue;
+			}
+			if (events[i].data.fd == s->handoff) {
+				if (server_handoff(s) < 0) {
+					perror("failed to hand over");
+				}
+				// the new server takes over from here
+				if (s->successor >= 0) {
+					return 0;
+				}
+				continue;
+			}
+			if (events[i].data.fd == s->snapshot_timer) {
+				if (server_snapshot(s) < 0) {
+					return -1;
+				}
+				continue;
+			}
+			if (s->nbots > 0 && events[i].data.fd == s->bots.event) {
+				if (server_bots(s) < 0) {
+					return -1;
+				}
+				continue;
+			}
+			if (s->nio > 0 && events[i].data.fd == s->io_event) {
+				if (server_collect(s) < 0) {
 					return -1;
 				}
 				continue;
@@ -548,15 +3611,58 @@ int server_run(struct server *s)
 				}
 			}
 		}
+		if (server_serve(s) < 0) {
+			return -1;
+		}
+		if (timer_expire(&s->timers, now_ms(), s) < 0) {
+			return -1;
+		}
+		if (s->snapshotting) {
+			server_snapshot_step(s);
+		}
+		// what was sent to the clients goes out at once
+		for (i = 0; i < s->nio; ++i) {
+			io_flush(&s->io[i]);
+		}
 	}
 	return 0;
 }
 
 const int DEFAULT_PORT = 8051;
+const int DEFAULT_BACKLOG = 128;
 const int DEFAULT_WIDTH = 7;
 const int DEFAULT_HEIGHT = 6;
+const int DEFAULT_LINE_LENGTH = 4;
+const int DEFAULT_UNDOS = 3;
+const int DEFAULT_BOT_THREADS = 1;
+const int DEFAULT_SEARCH_THREADS = 1;
+const int DEFAULT_BOT_TIME = 1000;
+const int DEFAULT_CACHE_SIZE = 65536;
+const int DEFAULT_SNAPSHOT_INTERVAL = 10;
+const int DEFAULT_GRACE = 30;
+const int DEFAULT_IDLE = 300;
+const int DEFAULT_MOVE_TIME = 300;
+const int DEFAULT_QUEUE_TIME = 120;
+const int DEFAULT_HIGH_WATER = 65536;
+const int DEFAULT_LOW_WATER = 16384;
+const int DEFAULT_BUDGET = 16;
+const int DEFAULT_MESSAGE_RATE = 100;
+const int DEFAULT_MESSAGE_BURST = 200;
+const int DEFAULT_LOGIN_RATE = 0;
+const int DEFAULT_LOGIN_BURST = 20;
+const int DEFAULT_IO_THREADS = 0;
+const int DEFAULT_SPIN = 0;
+const int DEFAULT_BUSY_POLL = 0;
 
-const char *USAGE = "server [-p PORT] [-c COLUMNS] [-r ROWS]";
+const char *USAGE = "server [-p PORT] [-U LOCAL] [-A BACKLOG]"
+	" [-w WIDTH] [-h HEIGHT] [-l LINE] [-u UNDOS]"
+	" [-b BOT_THREADS] [-s SEARCH_THREADS] [-t BOT_TIME] [-e ENGINE]"
+	" [-o BOOK] [-T TABLEBASE] [-c CACHE_SIZE] [-j JOURNAL] [-a ARCHIVE]"
+	" [-S SNAPSHOT] [-i SNAPSHOT_INTERVAL] [-H HANDOFF] [-g GRACE]"
+	" [-I IDLE] [-m MOVE_TIME] [-q QUEUE_TIME] [-W HIGH_WATER] [-L LOW_WATER]"
+	" [-P POLICY] [-B BUDGET] [-r MESSAGE_RATE] [-k MESSAGE_BURST]"
+	" [-R LOGIN_RATE] [-K LOGIN_BURST] [-x LIMIT_ACTION] [-N IO_THREADS]"
+	" [-C CPUS] [-y SPIN] [-Y BUSY_POLL]";
 
 int parse_natural(char *str)
 {
@@ -568,26 +3674,269 @@ int parse_natural(char *str)
 	return n;
 }
 
-int parse_args(int argc, char **argv, int *port, int *width, int *height)
+/* Parses a list of CPUs such as 0,2-3 to cfg->cpus. Returns 0 on success
+ * and -1 on failure.
+ */
+int parse_cpus(char *str, struct server_config *cfg)
+{
+	long count = sysconf(_SC_NPROCESSORS_CONF);
+	long from, to;
+	char *end;
+	cfg->ncpus = 0;
+	while (1) {
+		from = to = strtol(str, &end, 10);
+		if (end == str) {
+			return -1;
+		}
+		if (*end == '-') {
+			str = end + 1;
+			to = strtol(str, &end, 10);
+			if (end == str) {
+				return -1;
+			}
+		}
+		if (from < 0 || from > to || to >= count) {
+			return -1;
+		}
+		for (; from <= to; ++from) {
+			if (cfg->ncpus == MAX_CPUS) {
+				return -1;
+			}
+			cfg->cpus[cfg->ncpus++] = from;
+		}
+		if (*end == '\0') {
+			return 0;
+		}
+		if (*end != ',') {
+			return -1;
+		}
+		str = end + 1;
+	}
+}
+
+int parse_args(int argc, char **argv, struct server_config *cfg)
 {
 	int c;
-	*port = DEFAULT_PORT;
-	*width = DEFAULT_WIDTH;
-	*height = DEFAULT_HEIGHT;
-	while ((c = getopt(argc, argv, "p:w:h:")) != -1) {
+	cfg->port = DEFAULT_PORT;
+	cfg->local = NULL;
+	cfg->backlog = DEFAULT_BACKLOG;
+	cfg->rules.width = DEFAULT_WIDTH;
+	cfg->rules.height = DEFAULT_HEIGHT;
+	cfg->rules.line_length = DEFAULT_LINE_LENGTH;
+	cfg->rules.undos = DEFAULT_UNDOS;
+	cfg->bot_threads = DEFAULT_BOT_THREADS;
+	cfg->search_threads = DEFAULT_SEARCH_THREADS;
+	cfg->bot_time = DEFAULT_BOT_TIME;
+	cfg->engine = ENGINE_AUTO;
+	cfg->book = NULL;
+	cfg->tablebase = NULL;
+	cfg->cache_size = DEFAULT_CACHE_SIZE;
+	cfg->journal = NULL;
+	cfg->archive = NULL;
+	cfg->snapshot = NULL;
+	cfg->snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+	cfg->handoff = NULL;
+	cfg->grace = DEFAULT_GRACE;
+	cfg->idle = DEFAULT_IDLE;
+	cfg->move_time = DEFAULT_MOVE_TIME;
+	cfg->queue_time = DEFAULT_QUEUE_TIME;
+	cfg->high_water = DEFAULT_HIGH_WATER;
+	cfg->low_water = DEFAULT_LOW_WATER;
+	cfg->policy = OUTPUT_COALESCE;
+	cfg->budget = DEFAULT_BUDGET;
+	cfg->message_rate = DEFAULT_MESSAGE_RATE;
+	cfg->message_burst = DEFAULT_MESSAGE_BURST;
+	cfg->login_rate = DEFAULT_LOGIN_RATE;
+	cfg->login_burst = DEFAULT_LOGIN_BURST;
+	cfg->limit_action = LIMIT_ERROR;
+	cfg->io_threads = DEFAULT_IO_THREADS;
+	cfg->ncpus = 0;
+	cfg->spin = DEFAULT_SPIN;
+	cfg->busy_poll = DEFAULT_BUSY_POLL;
+	while ((c = getopt(argc, argv,
+			"p:U:A:w:h:l:u:b:s:t:e:o:T:c:j:a:S:i:H:g:I:m:q:W:L:P:B:r:k:R:K:x:N:C:y:Y:")) != -1)
+	{
 		switch (c) {
 		case 'p':
-			if ((*port = parse_natural(optarg)) < 0) {
+			if ((cfg->port = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'U':
+			if (optarg[0] == '\0' || strcmp(optarg, "@") == 0) {
+				return -1;
+			}
+			cfg->local = optarg;
+			break;
+		case 'A':
+			if ((cfg->backlog = parse_natural(optarg)) <= 0) {
 				return -1;
 			}
 			break;
 		case 'w':
-			if ((*width = parse_natural(optarg)) < 0) {
+			if ((cfg->rules.width = parse_natural(optarg)) < 0) {
 				return -1;
 			}
 			break;
 		case 'h':
-			if ((*height = parse_natural(optarg)) < 0) {
+			if ((cfg->rules.height = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'l':
+			if ((cfg->rules.line_length = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'u':
+			if ((cfg->rules.undos = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'b':
+			if ((cfg->bot_threads = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 's':
+			if ((cfg->search_threads = parse_natural(optarg)) <= 0) {
+				return -1;
+			}
+			break;
+		case 't':
+			if ((cfg->bot_time = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'e':
+			if (strcmp(optarg, "alphabeta") == 0) {
+				cfg->engine = ENGINE_ALPHABETA;
+			} else if (strcmp(optarg, "mcts") == 0) {
+				cfg->engine = ENGINE_MCTS;
+			} else {
+				return -1;
+			}
+			break;
+		case 'o':
+			cfg->book = optarg;
+			break;
+		case 'T':
+			cfg->tablebase = optarg;
+			break;
+		case 'j':
+			cfg->journal = optarg;
+			break;
+		case 'a':
+			cfg->archive = optarg;
+			break;
+		case 'S':
+			cfg->snapshot = optarg;
+			break;
+		case 'i':
+			if ((cfg->snapshot_interval = parse_natural(optarg)) <= 0) {
+				return -1;
+			}
+			break;
+		case 'H':
+			cfg->handoff = optarg;
+			break;
+		case 'g':
+			if ((cfg->grace = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'I':
+			if ((cfg->idle = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'm':
+			if ((cfg->move_time = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'q':
+			if ((cfg->queue_time = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'W':
+			if ((cfg->high_water = parse_natural(optarg)) <= 0) {
+				return -1;
+			}
+			break;
+		case 'L':
+			if ((cfg->low_water = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'B':
+			if ((cfg->budget = parse_natural(optarg)) <= 0) {
+				return -1;
+			}
+			break;
+		case 'r':
+			if ((cfg->message_rate = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'k':
+			if ((cfg->message_burst = parse_natural(optarg)) <= 0) {
+				return -1;
+			}
+			break;
+		case 'R':
+			if ((cfg->login_rate = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'K':
+			if ((cfg->login_burst = parse_natural(optarg)) <= 0) {
+				return -1;
+			}
+			break;
+		case 'N':
+			if ((cfg->io_threads = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'C':
+			if (parse_cpus(optarg, cfg) < 0) {
+				return -1;
+			}
+			break;
+		case 'y':
+			if ((cfg->spin = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'Y':
+			if ((cfg->busy_poll = parse_natural(optarg)) < 0) {
+				return -1;
+			}
+			break;
+		case 'x':
+			if (strcmp(optarg, "error") == 0) {
+				cfg->limit_action = LIMIT_ERROR;
+			} else if (strcmp(optarg, "disconnect") == 0) {
+				cfg->limit_action = LIMIT_DISCONNECT;
+			} else {
+				return -1;
+			}
+			break;
+		case 'P':
+			if (strcmp(optarg, "drop") == 0) {
+				cfg->policy = OUTPUT_DROP;
+			} else if (strcmp(optarg, "disconnect") == 0) {
+				cfg->policy = OUTPUT_DISCONNECT;
+			} else if (strcmp(optarg, "coalesce") == 0) {
+				cfg->policy = OUTPUT_COALESCE;
+			} else {
+				return -1;
+			}
+			break;
+		case 'c':
+			if ((cfg->cache_size = parse_natural(optarg)) < CACHE_SHARDS) {
 				return -1;
 			}
 			break;
@@ -595,22 +3944,39 @@ int parse_args(int argc, char **argv, int *port, int *width, int *height)
 			return -1;
 		}
 	}
-	return 0;
+	if (cfg->archive && !cfg->journal) {
+		return -1;
+	}
+	if (cfg->low_water >= cfg->high_water) {
+		return -1;
+	}
+	// the buffers of the clients handed over live in the loop
+	if (cfg->io_threads > 0 && cfg->handoff) {
+		return -1;
+	}
+	return game_rules_check(&cfg->rules);
 }
 
 int main(int argc, char **argv)
 {
-	int port, width, height;
+	struct server_config cfg;
 	struct server srv;
-	if (parse_args(argc, argv, &port, &width, &height) < 0) {
+	if (parse_args(argc, argv, &cfg) < 0) {
 		fprintf(stderr, "invalid arguments\n");
 		fprintf(stderr, "%s\n", USAGE);
 		return 1;
 	}
-	if (server_init(&srv, port, width, height) < 0) {
+	// dropped connections are noticed by the writes failing with EPIPE
+	signal(SIGPIPE, SIG_IGN);
+	if (server_init(&srv, &cfg) < 0) {
 		perror("failed to initialize server");
 		return 1;
 	}
+	if (server_takeover(&srv) < 0) {
+		perror("failed to take over");
+		server_finalize(&srv);
+		return 1;
+	}
 	if (server_run(&srv) < 0) {
 		perror("server error");
 		server_finalize(&srv);
@@ -0,0 +1,393 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "snapshot.h"
+
+// the length of a record without the names, the tokens and the moves
+#define RECORD_FIXED (4 + 8 + 7 * 2 + 2 + 2 + 2 + 2)
+// the same for the snapshots without the tokens
+#define RECORD_FIXED_V1 (RECORD_FIXED - 2 - 2)
+#define MAX_NAME 0xffff
+// the largest of the numbers stored in 16 bits
+#define MAX_NUMBER 0xffff
+// the longest record fits into a block
+#define BLOCK_SIZE (1 << 20)
+
+struct snapshot_block {
+	struct snapshot_block *next;
+	size_t len;
+	char data[BLOCK_SIZE];
+};
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Returns where the next len bytes of the image go, moving on to the next
+ * block if they don't fit into the current one, or NULL on failure.
+ */
+static char *reserve(struct snapshot *sn, size_t len)
+{
+	struct snapshot_block *block = sn->current;
+	if (block && block->len + len <= BLOCK_SIZE) {
+		return block->data + block->len;
+	}
+	block = block ? block->next : sn->blocks;
+	if (!block) {
+		block = malloc(sizeof(*block));
+		if (!block) {
+			return NULL;
+		}
+		block->next = NULL;
+		if (sn->current) {
+			sn->current->next = block;
+		} else {
+			sn->blocks = block;
+		}
+	}
+	block->len = 0;
+	sn->current = block;
+	return block->data;
+}
+
+static char *put(char *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+	return dst + len;
+}
+
+static char *put_name(char *dst, const char *name, int len)
+{
+	uint16_t n = len;
+	dst = put(dst, &n, 2);
+	return put(dst, name, len);
+}
+
+int snapshot_init(struct snapshot *sn, const char *path)
+{
+	sn->path = NULL;
+	sn->tmp = NULL;
+	if (path) {
+		sn->path = malloc(strlen(path) + 1);
+		sn->tmp = malloc(strlen(path) + sizeof(".tmp"));
+		if (!sn->path || !sn->tmp) {
+			free(sn->path);
+			free(sn->tmp);
+			return -1;
+		}
+		strcpy(sn->path, path);
+		sprintf(sn->tmp, "%s.tmp", path);
+	}
+	sn->blocks = NULL;
+	sn->current = NULL;
+	sn->writing = 0;
+	sn->done = 0;
+	sn->failed = 0;
+	return 0;
+}
+
+void snapshot_finalize(struct snapshot *sn)
+{
+	struct snapshot_block *block, *next;
+	snapshot_wait(sn);
+	for (block = sn->blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	free(sn->path);
+	free(sn->tmp);
+}
+
+int snapshot_busy(struct snapshot *sn)
+{
+	return sn->writing && !__atomic_load_n(&sn->done, __ATOMIC_ACQUIRE);
+}
+
+int snapshot_wait(struct snapshot *sn)
+{
+	if (!sn->writing) {
+		return 0;
+	}
+	pthread_join(sn->thread, NULL);
+	sn->writing = 0;
+	return sn->failed ? -1 : 0;
+}
+
+int snapshot_begin(struct snapshot *sn, const char *waiting, int waiting_len)
+{
+	char *dst;
+	if (!waiting) {
+		waiting_len = 0;
+	}
+	if (waiting_len > MAX_NAME) {
+		errno = EINVAL;
+		return -1;
+	}
+	snapshot_wait(sn);
+	snapshot_abort(sn);
+	dst = reserve(sn, 8 + 2 + waiting_len);
+	if (!dst) {
+		return -1;
+	}
+	put_name(put(dst, SNAPSHOT_MAGIC, 8), waiting, waiting_len);
+	sn->current->len += 8 + 2 + waiting_len;
+	return 0;
+}
+
+int snapshot_add(struct snapshot *sn, const struct snapshot_game *game)
+{
+	uint32_t len;
+	uint16_t numbers[7];
+	char *dst;
+	if (game->red_len > MAX_NAME || game->blue_len > MAX_NAME
+			|| game->red_token_len > MAX_NAME
+			|| game->blue_token_len > MAX_NAME
+			|| game->width > MAX_NUMBER || game->height > MAX_NUMBER
+			|| game->line_length > MAX_NUMBER || game->moves > MAX_NUMBER
+			|| game->red_undos > MAX_NUMBER || game->blue_undos > MAX_NUMBER)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	len = RECORD_FIXED - 4 + game->red_len + game->blue_len
+		+ game->red_token_len + game->blue_token_len + game->moves;
+	dst = reserve(sn, len + 4);
+	if (!dst) {
+		return -1;
+	}
+	numbers[0] = game->width;
+	numbers[1] = game->height;
+	numbers[2] = game->line_length;
+	numbers[3] = (int16_t)game->bot;
+	numbers[4] = game->red_undos;
+	numbers[5] = game->blue_undos;
+	numbers[6] = game->moves;
+	dst = put(dst, &len, 4);
+	dst = put(dst, &game->started, 8);
+	dst = put(dst, numbers, sizeof(numbers));
+	dst = put_name(dst, game->red, game->red_len);
+	dst = put_name(dst, game->blue, game->blue_len);
+	dst = put_name(dst, game->red_token, game->red_token_len);
+	dst = put_name(dst, game->blue_token, game->blue_token_len);
+	put(dst, game->history, game->moves);
+	sn->current->len += len + 4;
+	return 0;
+}
+
+int snapshot_write(struct snapshot *sn, int fd)
+{
+	struct snapshot_block *block;
+	// the blocks after the current one are left from larger images
+	for (block = sn->blocks; sn->current; block = block->next) {
+		if (write_all(fd, block->data, block->len) < 0) {
+			return -1;
+		}
+		if (block == sn->current) {
+			break;
+		}
+	}
+	return 0;
+}
+
+static void *writer(void *arg)
+{
+	struct snapshot *sn = arg;
+	int fd = open(sn->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int failed = fd < 0;
+	if (!failed) {
+		failed = snapshot_write(sn, fd) < 0 || fsync(fd) < 0;
+		if (close(fd) < 0) {
+			failed = 1;
+		}
+		// the old snapshot stays until the new one is complete
+		if (failed || rename(sn->tmp, sn->path) < 0) {
+			unlink(sn->tmp);
+			failed = 1;
+		}
+	}
+	sn->failed = failed;
+	__atomic_store_n(&sn->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+int snapshot_commit(struct snapshot *sn)
+{
+	sn->done = 0;
+	sn->failed = 0;
+	if (pthread_create(&sn->thread, NULL, writer, sn) != 0) {
+		snapshot_abort(sn);
+		return -1;
+	}
+	sn->writing = 1;
+	return 0;
+}
+
+void snapshot_abort(struct snapshot *sn)
+{
+	// the blocks are kept for the next image
+	sn->current = NULL;
+}
+
+/* Reads the name at data + *pos, which must end by end, and moves *pos
+ * past it. Returns 0 on success and -1 if the name doesn't fit.
+ */
+static int parse_name(const char *data, size_t *pos, size_t end,
+		const char **name, int *len)
+{
+	uint16_t n;
+	if (*pos + 2 > end) {
+		return -1;
+	}
+	memcpy(&n, data + *pos, 2);
+	*name = data + *pos + 2;
+	*len = n;
+	*pos += 2 + n;
+	return 0;
+}
+
+/* Parses the record at the start of data, with the tokens unless it's
+ * from a snapshot that has none. Returns its length, or 0 if it is not
+ * a valid record.
+ */
+static size_t parse(const char *data, size_t len, int tokens,
+		struct snapshot_game *game)
+{
+	uint32_t record_len;
+	uint16_t numbers[7];
+	size_t pos = 4 + 8 + sizeof(numbers), end;
+	size_t fixed = tokens ? RECORD_FIXED : RECORD_FIXED_V1;
+	if (len < fixed) {
+		return 0;
+	}
+	memcpy(&record_len, data, 4);
+	if (record_len < fixed - 4 || record_len > len - 4) {
+		return 0;
+	}
+	end = record_len + 4;
+	memcpy(&game->started, data + 4, 8);
+	memcpy(numbers, data + 12, sizeof(numbers));
+	game->width = numbers[0];
+	game->height = numbers[1];
+	game->line_length = numbers[2];
+	game->bot = (int16_t)numbers[3];
+	game->red_undos = numbers[4];
+	game->blue_undos = numbers[5];
+	game->moves = numbers[6];
+	game->red_token = game->blue_token = "";
+	game->red_token_len = game->blue_token_len = 0;
+	if (parse_name(data, &pos, end, &game->red, &game->red_len) < 0
+			|| parse_name(data, &pos, end, &game->blue, &game->blue_len) < 0
+			|| (tokens && (parse_name(data, &pos, end, &game->red_token,
+						&game->red_token_len) < 0
+					|| parse_name(data, &pos, end, &game->blue_token,
+						&game->blue_token_len) < 0)))
+	{
+		return 0;
+	}
+	game->history = (const unsigned char *)data + pos;
+	if (pos + game->moves != end) {
+		return 0;
+	}
+	return end;
+}
+
+long snapshot_parse(const char *data, size_t size, char **waiting,
+		int (*fn)(const struct snapshot_game *game, void *ctx), void *ctx)
+{
+	struct snapshot_game game;
+	size_t pos, len;
+	uint16_t n;
+	long count = 0;
+	int tokens;
+	*waiting = NULL;
+	if (size < 8 + 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	tokens = memcmp(data, SNAPSHOT_MAGIC, 8) == 0;
+	if (!tokens && memcmp(data, SNAPSHOT_MAGIC_V1, 8) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&n, data + 8, 2);
+	pos = 8 + 2 + n;
+	if (pos > size) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (n > 0) {
+		*waiting = malloc(n + 1);
+		if (!*waiting) {
+			return -1;
+		}
+		memcpy(*waiting, data + 10, n);
+		(*waiting)[n] = '\0';
+	}
+	while (pos < size) {
+		len = parse(data + pos, size - pos, tokens, &game);
+		if (len == 0) {
+			// images are only read once they are complete,
+			// so this is not a record cut short by a crash
+			free(*waiting);
+			*waiting = NULL;
+			errno = EINVAL;
+			return -1;
+		}
+		if (fn(&game, ctx) < 0) {
+			return -1;
+		}
+		pos += len;
+		count++;
+	}
+	return count;
+}
+
+long snapshot_load(const char *path, char **waiting,
+		int (*fn)(const struct snapshot_game *game, void *ctx), void *ctx)
+{
+	struct stat st;
+	long count;
+	void *addr;
+	int fd = open(path, O_RDONLY);
+	*waiting = NULL;
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return -1;
+	}
+	count = snapshot_parse(addr, st.st_size, waiting, fn, ctx);
+	munmap(addr, st.st_size);
+	return count;
+}
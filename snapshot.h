@@ -0,0 +1,135 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* This module reads and writes snapshots: images of the games in progress
+ * and of the player waiting for a game, from which a restarted server picks
+ * up where the last one stopped.
+ *
+ * The image is built in memory, a game at a time, so its user can spread
+ * the work over many short steps. Once it's complete, a thread writes it
+ * to a temporary file, syncs it and renames it over the last snapshot,
+ * so a crash leaves either the old snapshot or the new one.
+ *
+ * The file starts with the magic "FOURSNP2" and the name of the waiting
+ * player as a 16-bit length followed by the characters, the length is 0
+ * if nobody is waiting. The games follow until the end of the file, each
+ * starts with its length as a 32-bit number, not counting the length itself,
+ * followed by:
+ * - the start of the game in milliseconds since the epoch as a 64-bit number,
+ * - the width, the height and the line length as 16-bit numbers,
+ * - the side of the bot as a signed 16-bit number (see side.h),
+ * - the undos left to the red and the blue player and the number of moves
+ *   as 16-bit numbers,
+ * - the names of the red and the blue player, each as a 16-bit length
+ *   followed by the characters, the bot's name is empty,
+ * - the tokens with which the red and the blue player resume the game,
+ *   stored like the names, empty if the player has none,
+ * - the columns of the moves as bytes.
+ * Numbers are stored in the byte order of the machine. The snapshots with
+ * the magic "FOURSNAP" have no tokens, they are read as if all the tokens
+ * were empty.
+ */
+
+#define SNAPSHOT_MAGIC "FOURSNP2"
+#define SNAPSHOT_MAGIC_V1 "FOURSNAP"
+
+struct snapshot_game {
+	uint64_t started;
+	int width;
+	int height;
+	int line_length;
+	int bot;
+	int red_undos;
+	int blue_undos;
+	// names of the players, they need not be terminated
+	const char *red;
+	const char *blue;
+	int red_len;
+	int blue_len;
+	// tokens of the players, they need not be terminated either
+	const char *red_token;
+	const char *blue_token;
+	int red_token_len;
+	int blue_token_len;
+	int moves;
+	const unsigned char *history;
+};
+
+struct snapshot_block;
+
+struct snapshot {
+	// these should be treated as private
+	char *path;
+	char *tmp;
+	// the image being built or written, the blocks are kept for the next one
+	struct snapshot_block *blocks;
+	// the block being filled, NULL if the image is empty
+	struct snapshot_block *current;
+	pthread_t thread;
+	// set while there is a thread to join
+	int writing;
+	// set by the thread once it's done
+	int done;
+	int failed;
+};
+
+/* Prepares writing snapshots to path. The path may be NULL if the images
+ * are only written with snapshot_write. Returns 0 on success and -1
+ * on failure.
+ */
+int snapshot_init(struct snapshot *sn, const char *path);
+
+/* Waits for the last snapshot to be written and releases the memory.
+ */
+void snapshot_finalize(struct snapshot *sn);
+
+/* Returns 1 if the last snapshot is still being written and 0 otherwise.
+ */
+int snapshot_busy(struct snapshot *sn);
+
+/* Waits for the last snapshot to be written. Returns 0 if it was written
+ * or if there was none and -1 if it failed.
+ */
+int snapshot_wait(struct snapshot *sn);
+
+/* Starts a new image, waiting is the name of the waiting player or NULL.
+ * Waits for the last snapshot if it's still being written.
+ * Returns 0 on success and -1 on failure.
+ */
+int snapshot_begin(struct snapshot *sn, const char *waiting, int waiting_len);
+
+/* Adds a game to the image. Returns 0 on success and -1 on failure,
+ * then the image must be aborted.
+ */
+int snapshot_add(struct snapshot *sn, const struct snapshot_game *game);
+
+/* Starts the thread that writes the image. Returns 0 on success and -1
+ * on failure, then the image is dropped.
+ */
+int snapshot_commit(struct snapshot *sn);
+
+/* Drops the image.
+ */
+void snapshot_abort(struct snapshot *sn);
+
+/* Writes the image to fd right away, without committing it.
+ * Returns 0 on success and -1 on failure.
+ */
+int snapshot_write(struct snapshot *sn, int fd);
+
+/* Like snapshot_load, for an image held in memory.
+ */
+long snapshot_parse(const char *data, size_t size, char **waiting,
+		int (*fn)(const struct snapshot_game *game, void *ctx), void *ctx);
+
+/* Reads the snapshot at path. Sets *waiting to a copy of the name of
+ * the waiting player, or NULL, and calls fn for every game until fn returns
+ * -1. The game passed to fn is only valid during the call. Returns
+ * the number of games, or -1 on failure or if fn has stopped. A missing
+ * snapshot is a failure with errno set to ENOENT.
+ */
+long snapshot_load(const char *path, char **waiting,
+		int (*fn)(const struct snapshot_game *game, void *ctx), void *ctx);
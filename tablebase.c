@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tablebase.h"
+
+/* The tables are generated backwards, from the full boards to the empty
+ * one. Positions with the same number of discs don't depend on each other,
+ * so every layer is split between the threads, and each position is solved
+ * from the positions one disc further, which were solved in the layer
+ * before.
+ *
+ * Boards that can't appear in a game (with the wrong number of discs
+ * of a side, or a line of the side to move) are marked invalid.
+ * A few boards that are never reached, such as two separate lines of the
+ * side that just moved, are solved anyway, they are never probed.
+ */
+
+// A value packs the outcome in the two high bits and the distance
+// in the six low bits.
+#define VALUE(outcome, distance) ((outcome) << 6 | (distance))
+#define OUTCOME(value) ((value) >> 6)
+#define DISTANCE(value) ((value) & 0x3f)
+
+struct geometry {
+	int width;
+	int height;
+	int line_length;
+	// number of codes of a column, the base of the index
+	uint64_t radix;
+	// radix^x for every column x
+	uint64_t powers[64];
+	uint64_t count;
+};
+
+struct generator {
+	struct geometry geo;
+	unsigned char *values;
+	// number of discs in the layer being solved
+	int layer;
+};
+
+struct worker {
+	struct generator *gen;
+	pthread_t thread;
+	uint64_t begin;
+	uint64_t end;
+};
+
+static int geometry_init(struct geometry *geo, const struct game_rules *rules)
+{
+	int x;
+	if (game_rules_check(rules) < 0 || rules->width * (rules->height + 1) > 64
+			|| rules->width * rules->height > 63)
+	{
+		return -1;
+	}
+	geo->width = rules->width;
+	geo->height = rules->height;
+	geo->line_length = rules->line_length;
+	geo->radix = (UINT64_C(1) << (rules->height + 1)) - 1;
+	geo->powers[0] = 1;
+	for (x = 1; x <= rules->width; ++x) {
+		if (geo->powers[x - 1] > TABLEBASE_MAX_SIZE / geo->radix) {
+			return -1;
+		}
+		if (x < rules->width) {
+			geo->powers[x] = geo->powers[x - 1] * geo->radix;
+		} else {
+			geo->count = geo->powers[x - 1] * geo->radix;
+		}
+	}
+	return 0;
+}
+
+int tablebase_supported(const struct game_rules *rules)
+{
+	struct geometry geo;
+	return geometry_init(&geo, rules) == 0;
+}
+
+// number of discs in a column with the given code
+static int code_discs(uint64_t code)
+{
+	return 63 - __builtin_clzll(code);
+}
+
+static int code_reds(uint64_t code)
+{
+	return __builtin_popcountll(code) - 1;
+}
+
+static int has_line(const struct geometry *geo, uint64_t discs)
+{
+	int shifts[4] = {1, geo->height, geo->height + 1, geo->height + 2};
+	uint64_t m;
+	int d, k;
+	for (d = 0; d < 4; ++d) {
+		m = discs;
+		for (k = 1; k < geo->line_length && m; ++k) {
+			m = k * shifts[d] < 64 ? m & (discs >> (k * shifts[d])) : 0;
+		}
+		if (m) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Solves the position with the given column codes,
+ * all positions with one more disc must be solved already.
+ */
+static unsigned char solve(const struct generator *gen, uint64_t index,
+		const uint64_t *codes)
+{
+	const struct geometry *geo = &gen->geo;
+	uint64_t red = 0, blue = 0, column;
+	int x, k, red_turn = gen->layer % 2 == 0;
+	unsigned char value, best = 0;
+	int wins = 0, draws = 0;
+	for (x = 0; x < geo->width; ++x) {
+		k = code_discs(codes[x]);
+		column = codes[x] - (UINT64_C(1) << k);
+		red |= column << (x * (geo->height + 1));
+		blue |= (~column & ((UINT64_C(1) << k) - 1)) << (x * (geo->height + 1));
+	}
+	if (has_line(geo, red_turn ? red : blue)) {
+		return TABLEBASE_INVALID;
+	}
+	if (has_line(geo, red_turn ? blue : red)) {
+		// the last move won the game
+		return VALUE(TABLEBASE_LOSS, 0);
+	}
+	for (x = 0; x < geo->width; ++x) {
+		k = code_discs(codes[x]);
+		if (k == geo->height) {
+			continue;
+		}
+		// the new disc adds 2^k to the code, and another 2^k if it's red
+		value = gen->values[index
+			+ ((uint64_t)(1 + red_turn) << k) * geo->powers[x]];
+		switch (OUTCOME(value)) {
+		case TABLEBASE_LOSS:
+			// win as fast as possible
+			if (!wins || DISTANCE(value) + 1 < DISTANCE(best)) {
+				best = VALUE(TABLEBASE_WIN, DISTANCE(value) + 1);
+			}
+			wins = 1;
+			break;
+		case TABLEBASE_DRAW:
+			draws = 1;
+			break;
+		case TABLEBASE_WIN:
+			// lose as slowly as possible
+			if (!wins && !draws && DISTANCE(value) + 1 > DISTANCE(best)) {
+				best = VALUE(TABLEBASE_LOSS, DISTANCE(value) + 1);
+			}
+			break;
+		}
+	}
+	if (wins) {
+		return best;
+	}
+	if (draws || OUTCOME(best) != TABLEBASE_LOSS) {
+		// a full board is a draw as well
+		return VALUE(TABLEBASE_DRAW, 0);
+	}
+	return best;
+}
+
+static void *solve_range(void *arg)
+{
+	struct worker *w = arg;
+	const struct geometry *geo = &w->gen->geo;
+	uint64_t codes[64], rest = w->begin, index;
+	int x, discs = 0, reds = 0;
+	for (x = 0; x < geo->width; ++x) {
+		codes[x] = rest % geo->radix + 1;
+		rest /= geo->radix;
+		discs += code_discs(codes[x]);
+		reds += code_reds(codes[x]);
+	}
+	for (index = w->begin; index < w->end; ++index) {
+		if (discs == w->gen->layer) {
+			// red moves first
+			w->gen->values[index] = reds == (discs + 1) / 2
+				? solve(w->gen, index, codes) : TABLEBASE_INVALID;
+		}
+		// advance to the next index like an odometer
+		for (x = 0; x < geo->width; ++x) {
+			discs -= code_discs(codes[x]);
+			reds -= code_reds(codes[x]);
+			codes[x] = codes[x] == geo->radix ? 1 : codes[x] + 1;
+			discs += code_discs(codes[x]);
+			reds += code_reds(codes[x]);
+			if (codes[x] != 1) {
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+static int write_table(const char *path, const struct geometry *geo,
+		const unsigned char *values)
+{
+	struct tablebase_header header = {{0}};
+	FILE *file;
+	memcpy(header.magic, TABLEBASE_MAGIC, sizeof(header.magic));
+	header.width = geo->width;
+	header.height = geo->height;
+	header.line_length = geo->line_length;
+	header.count = geo->count;
+	file = fopen(path, "wb");
+	if (!file) {
+		return -1;
+	}
+	if (fwrite(&header, sizeof(header), 1, file) != 1
+			|| fwrite(values, 1, geo->count, file) != geo->count)
+	{
+		fclose(file);
+		return -1;
+	}
+	return fclose(file) == 0 ? 0 : -1;
+}
+
+int tablebase_generate(const struct game_rules *rules, size_t nthreads,
+		const char *path)
+{
+	struct generator gen;
+	struct worker *workers;
+	size_t i, started;
+	int status = 0;
+	if (geometry_init(&gen.geo, rules) < 0 || nthreads == 0) {
+		return -1;
+	}
+	gen.values = malloc(gen.geo.count);
+	workers = malloc(nthreads * sizeof(*workers));
+	if (!gen.values || !workers) {
+		free(gen.values);
+		free(workers);
+		return -1;
+	}
+	for (i = 0; i < nthreads; ++i) {
+		workers[i].gen = &gen;
+		workers[i].begin = gen.geo.count / nthreads * i;
+		workers[i].end = i + 1 < nthreads
+			? gen.geo.count / nthreads * (i + 1) : gen.geo.count;
+	}
+	for (gen.layer = gen.geo.width * gen.geo.height; gen.layer >= 0; --gen.layer) {
+		// the calling thread takes the first range
+		for (started = 1; started < nthreads; ++started) {
+			if (pthread_create(&workers[started].thread, NULL,
+						solve_range, &workers[started]) != 0)
+			{
+				status = -1;
+				break;
+			}
+		}
+		solve_range(&workers[0]);
+		for (i = 1; i < started; ++i) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		if (status < 0) {
+			break;
+		}
+	}
+	if (status == 0) {
+		status = write_table(path, &gen.geo, gen.values);
+	}
+	free(gen.values);
+	free(workers);
+	return status;
+}
+
+int tablebase_open(struct tablebase *tb, const char *path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*tb->header)) {
+		close(fd);
+		return -1;
+	}
+	tb->size = st.st_size;
+	tb->data = mmap(NULL, tb->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (tb->data == MAP_FAILED) {
+		return -1;
+	}
+	tb->header = tb->data;
+	tb->values = (const unsigned char *)(tb->header + 1);
+	if (memcmp(tb->header->magic, TABLEBASE_MAGIC, sizeof(tb->header->magic)) != 0
+			|| tb->size - sizeof(*tb->header) != tb->header->count)
+	{
+		munmap(tb->data, tb->size);
+		return -1;
+	}
+	return 0;
+}
+
+void tablebase_close(struct tablebase *tb)
+{
+	munmap(tb->data, tb->size);
+}
+
+int tablebase_matches(const struct tablebase *tb, const struct game_rules *rules)
+{
+	struct geometry geo;
+	return geometry_init(&geo, rules) == 0
+		&& tb->header->width == rules->width
+		&& tb->header->height == rules->height
+		&& tb->header->line_length == rules->line_length
+		&& tb->header->count == geo.count;
+}
+
+int tablebase_probe(const struct tablebase *tb, const unsigned char *history,
+		int moves, struct tablebase_result *res)
+{
+	const struct tablebase_header *h = tb->header;
+	uint64_t power, index = 0, child;
+	int discs[64] = {0};
+	unsigned char value, next;
+	int i, x, red_turn;
+	for (i = 0; i < moves; ++i) {
+		x = history[i];
+		if (x >= h->width || discs[x] == h->height) {
+			return -1;
+		}
+		// the digits are the codes minus one, so the empty board is 0
+		for (power = 1; x > 0; --x) {
+			power *= (UINT64_C(1) << (h->height + 1)) - 1;
+		}
+		index += ((uint64_t)(1 + (i % 2 == 0)) << discs[history[i]]) * power;
+		discs[history[i]]++;
+	}
+	value = tb->values[index];
+	if (OUTCOME(value) == TABLEBASE_INVALID) {
+		return -1;
+	}
+	res->outcome = OUTCOME(value);
+	res->distance = DISTANCE(value);
+	res->column = -1;
+	if (res->outcome == TABLEBASE_LOSS && res->distance == 0) {
+		return 0;
+	}
+	// find a move that leads to a position with the same value
+	red_turn = moves % 2 == 0;
+	power = 1;
+	for (x = 0; x < h->width; ++x) {
+		if (discs[x] < h->height) {
+			child = index + ((uint64_t)(1 + red_turn) << discs[x]) * power;
+			next = tb->values[child];
+			if ((res->outcome == TABLEBASE_WIN
+						&& next == VALUE(TABLEBASE_LOSS, res->distance - 1))
+					|| (res->outcome == TABLEBASE_LOSS
+						&& next == VALUE(TABLEBASE_WIN, res->distance - 1))
+					|| (res->outcome == TABLEBASE_DRAW
+						&& OUTCOME(next) == TABLEBASE_DRAW))
+			{
+				res->column = x;
+				return 0;
+			}
+		}
+		power *= (UINT64_C(1) << (h->height + 1)) - 1;
+	}
+	// only a full board has no moves
+	return 0;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+/* This module implements endgame tablebases: files with the exact outcome
+ * of every position of a small board, generated offline by tbgen.
+ *
+ * A position is indexed by the contents of its columns. A column with k
+ * discs is encoded as the number 2^k + bits, where bit i is set if the
+ * ith disc from the bottom is red, and the codes of all columns are
+ * the digits of the index. Every board has a unique index, so the table
+ * holds one byte per index with the outcome and the distance to the end.
+ *
+ * The tables grow as (2^(height + 1) - 1)^width, so only small boards
+ * are supported.
+ */
+
+#define TABLEBASE_MAGIC "FOURTBAS"
+
+// the biggest table that tbgen agrees to generate, in bytes
+#define TABLEBASE_MAX_SIZE (UINT64_C(1) << 32)
+
+enum tablebase_outcome {
+	// the position can't be reached in a game
+	TABLEBASE_INVALID = 0,
+	TABLEBASE_WIN = 1,
+	TABLEBASE_LOSS = 2,
+	TABLEBASE_DRAW = 3,
+};
+
+struct tablebase_header {
+	char magic[8];
+	uint32_t width;
+	uint32_t height;
+	uint32_t line_length;
+	uint32_t reserved;
+	uint64_t count;
+};
+
+struct tablebase {
+	// these should be treated as private
+	void *data;
+	size_t size;
+	const struct tablebase_header *header;
+	const unsigned char *values;
+};
+
+struct tablebase_result {
+	// from the point of view of the side to move
+	enum tablebase_outcome outcome;
+	// number of plies until the game is won or lost with the best play
+	// of both sides, 0 for draws
+	int distance;
+	// best move, -1 if the game is already over
+	int column;
+};
+
+/* Returns 1 if a tablebase can be generated for the given rules
+ * and 0 otherwise.
+ */
+int tablebase_supported(const struct game_rules *rules);
+
+/* Solves all positions with the given rules on nthreads threads
+ * and writes them to a new tablebase file.
+ * Returns 0 on success and -1 on failure.
+ */
+int tablebase_generate(const struct game_rules *rules, size_t nthreads,
+		const char *path);
+
+/* Maps the tablebase from the given file. Returns 0 on success and -1
+ * if the file can't be mapped or isn't a valid tablebase.
+ */
+int tablebase_open(struct tablebase *tb, const char *path);
+
+void tablebase_close(struct tablebase *tb);
+
+/* Returns 1 if the tablebase was generated for the given rules
+ * and 0 otherwise.
+ */
+int tablebase_matches(const struct tablebase *tb, const struct game_rules *rules);
+
+/* Looks up the position reached by playing the given columns from
+ * the empty board and finds its best move.
+ * Returns 0 on success and -1 if the moves don't lead to a valid position.
+ */
+int tablebase_probe(const struct tablebase *tb, const unsigned char *history,
+		int moves, struct tablebase_result *res);
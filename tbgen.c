@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "tablebase.h"
+
+/* Generates the endgame tablebase of a small board for the server.
+ */
+
+const int DEFAULT_WIDTH = 5;
+const int DEFAULT_HEIGHT = 4;
+const int DEFAULT_LINE_LENGTH = 4;
+const int DEFAULT_THREADS = 1;
+
+const char *USAGE = "tbgen [-w WIDTH] [-h HEIGHT] [-l LINE] [-j THREADS] FILE";
+
+int main(int argc, char **argv)
+{
+	struct game_rules rules;
+	int threads = DEFAULT_THREADS;
+	int c;
+	rules.width = DEFAULT_WIDTH;
+	rules.height = DEFAULT_HEIGHT;
+	rules.line_length = DEFAULT_LINE_LENGTH;
+	rules.undos = 0;
+	while ((c = getopt(argc, argv, "w:h:l:j:")) != -1) {
+		switch (c) {
+		case 'w':
+			rules.width = atoi(optarg);
+			break;
+		case 'h':
+			rules.height = atoi(optarg);
+			break;
+		case 'l':
+			rules.line_length = atoi(optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s\n", USAGE);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || threads <= 0) {
+		fprintf(stderr, "%s\n", USAGE);
+		return 1;
+	}
+	if (!tablebase_supported(&rules)) {
+		fprintf(stderr, "the board is too big for a tablebase\n");
+		return 1;
+	}
+	if (tablebase_generate(&rules, threads, argv[optind]) < 0) {
+		perror("failed to generate the tablebase");
+		return 1;
+	}
+	return 0;
+}
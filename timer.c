@@ -0,0 +1,191 @@
+#include <limits.h>
+
+#include "timer.h"
+
+// log2 of TIMER_SLOTS
+#define SLOT_BITS 6
+// the furthest a timer may be from the time of the wheel
+#define MAX_DELAY (((uint64_t)1 << (SLOT_BITS * TIMER_LEVELS)) - 1)
+
+/* Adds the timer to the slot it belongs to at the time of the wheel.
+ * Timers that are due go to the current slot of the first level.
+ */
+static void place(struct timer_wheel *w, struct timer *t)
+{
+	struct timer *head;
+	uint64_t delta = t->expires - w->now;
+	int level = 0, index;
+	while (level < TIMER_LEVELS - 1
+			&& delta >> (SLOT_BITS * (level + 1)) != 0)
+	{
+		level++;
+	}
+	index = (t->expires >> (SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+	head = &w->slots[level * TIMER_SLOTS + index];
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+	w->occupied[level] |= (uint64_t)1 << index;
+}
+
+/* Takes the timer out of its slot, leaving it marked as armed.
+ */
+static void unlink_timer(struct timer *t)
+{
+	struct timer_wheel *w = t->wheel;
+	int slot;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	if (t->prev == t->next) {
+		// the slot is empty, only its head is left
+		slot = t->prev - w->slots;
+		w->occupied[slot / TIMER_SLOTS] &=
+			~((uint64_t)1 << (slot % TIMER_SLOTS));
+	}
+}
+
+/* Returns the first millisecond after the time of the wheel at which
+ * some slot has to be handled: the timers of a slot of the first level
+ * expire, those of the other levels move down. Returns UINT64_MAX
+ * if the wheel is empty.
+ */
+static uint64_t next_tick(const struct timer_wheel *w)
+{
+	uint64_t best = UINT64_MAX, occupied, tick;
+	int level, shift, from, steps;
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		if (!(occupied = w->occupied[level])) {
+			continue;
+		}
+		shift = SLOT_BITS * level;
+		// rotate the bits so that the slot after the current one is first,
+		// the current slot itself comes a whole turn later
+		from = ((w->now >> shift) + 1) & (TIMER_SLOTS - 1);
+		if (from) {
+			occupied = occupied >> from | occupied << (TIMER_SLOTS - from);
+		}
+		steps = __builtin_ctzll(occupied) + 1;
+		tick = ((w->now >> shift) + steps) << shift;
+		if (tick < best) {
+			best = tick;
+		}
+	}
+	return best;
+}
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now)
+{
+	int i;
+	for (i = 0; i < TIMER_LEVELS * TIMER_SLOTS; i++) {
+		w->slots[i].prev = w->slots[i].next = &w->slots[i];
+	}
+	for (i = 0; i < TIMER_LEVELS; i++) {
+		w->occupied[i] = 0;
+	}
+	w->now = now;
+	w->count = 0;
+}
+
+void timer_init(struct timer *t)
+{
+	t->prev = t->next = NULL;
+	t->wheel = NULL;
+	t->fn = NULL;
+	t->arg = NULL;
+}
+
+void timer_arm(struct timer_wheel *w, struct timer *t, uint64_t expires,
+		int (*fn)(void *arg, void *ctx), void *arg)
+{
+	timer_cancel(t);
+	t->fn = fn;
+	t->arg = arg;
+	if (expires <= w->now) {
+		expires = w->now + 1;
+	} else if (expires - w->now > MAX_DELAY) {
+		expires = w->now + MAX_DELAY;
+	}
+	t->expires = expires;
+	t->wheel = w;
+	place(w, t);
+	w->count++;
+}
+
+void timer_cancel(struct timer *t)
+{
+	if (!t->wheel) {
+		return;
+	}
+	unlink_timer(t);
+	t->wheel->count--;
+	t->wheel = NULL;
+}
+
+int timer_armed(const struct timer *t)
+{
+	return t->wheel != NULL;
+}
+
+int timer_timeout(const struct timer_wheel *w, uint64_t now)
+{
+	uint64_t tick;
+	if (w->count == 0) {
+		return -1;
+	}
+	if (w->occupied[0] & (uint64_t)1 << (w->now & (TIMER_SLOTS - 1))) {
+		// left by a function that has failed
+		return 0;
+	}
+	tick = next_tick(w);
+	if (tick <= now) {
+		return 0;
+	}
+	return tick - now > INT_MAX ? INT_MAX : (int)(tick - now);
+}
+
+int timer_expire(struct timer_wheel *w, uint64_t now, void *ctx)
+{
+	struct timer *head, *t;
+	uint64_t tick;
+	int level, shift, index;
+	while (w->now < now || w->occupied[0] & (uint64_t)1
+			<< (w->now & (TIMER_SLOTS - 1)))
+	{
+		head = &w->slots[w->now & (TIMER_SLOTS - 1)];
+		if (head->next == head) {
+			// nothing happens in between, so skip right to the next tick
+			tick = next_tick(w);
+			if (tick > now) {
+				w->now = now;
+				return 0;
+			}
+			w->now = tick;
+			// move the timers down from the coarsest level, the ones
+			// that are due end up in the current slot of the first one
+			for (level = TIMER_LEVELS - 1; level > 0; level--) {
+				shift = SLOT_BITS * level;
+				if (tick & (((uint64_t)1 << shift) - 1)) {
+					continue;
+				}
+				index = (tick >> shift) & (TIMER_SLOTS - 1);
+				head = &w->slots[level * TIMER_SLOTS + index];
+				while ((t = head->next) != head) {
+					unlink_timer(t);
+					place(w, t);
+				}
+			}
+			head = &w->slots[tick & (TIMER_SLOTS - 1)];
+		}
+		// the functions may change the slot, so take a timer at a time
+		while ((t = head->next) != head) {
+			unlink_timer(t);
+			w->count--;
+			t->wheel = NULL;
+			if (t->fn(t->arg, ctx) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
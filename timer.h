@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* This module implements a hierarchical timer wheel: timers are kept
+ * in TIMER_LEVELS wheels of TIMER_SLOTS slots, the slots of the first wheel
+ * are a millisecond apart, those of every next wheel TIMER_SLOTS times
+ * further. A timer goes to the wheel whose slots are as long as the time
+ * left to it, and moves down to the finer wheels as its time approaches.
+ * Arming and cancelling a timer is O(1), and so is finding the next slot
+ * holding timers, which lets the loop sleep until then.
+ *
+ * Timers are meant to be embedded in the structs they belong to, the wheel
+ * doesn't allocate anything. Times are in milliseconds from any fixed point,
+ * the wheel covers TIMER_SLOTS^TIMER_LEVELS milliseconds (over two years)
+ * ahead of its time, later timers are cut to that.
+ */
+
+#define TIMER_LEVELS 6
+#define TIMER_SLOTS 64
+
+struct timer_wheel;
+
+struct timer {
+	// these should be treated as private
+	struct timer *prev;
+	struct timer *next;
+	uint64_t expires;
+	// the wheel holding the timer, NULL if it's not armed
+	struct timer_wheel *wheel;
+	int (*fn)(void *arg, void *ctx);
+	void *arg;
+};
+
+struct timer_wheel {
+	// these should be treated as private
+	// heads of the lists of timers, TIMER_SLOTS for each level
+	struct timer slots[TIMER_LEVELS * TIMER_SLOTS];
+	// the slots holding some timers, a bit for each
+	uint64_t occupied[TIMER_LEVELS];
+	// the last millisecond whose timers have expired
+	uint64_t now;
+	size_t count;
+};
+
+/* Initializes an empty wheel whose time is now.
+ */
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+
+/* Initializes a timer that isn't armed.
+ */
+void timer_init(struct timer *t);
+
+/* Arms the timer to expire at the millisecond expires, or at the next one
+ * if that's already past. A timer that is already armed is moved. When
+ * it expires, it calls fn with arg and the ctx passed to timer_expire,
+ * fn returns 0 on success and -1 on a failure that should stop the caller.
+ */
+void timer_arm(struct timer_wheel *w, struct timer *t, uint64_t expires,
+		int (*fn)(void *arg, void *ctx), void *arg);
+
+/* Disarms the timer, it's fine if it isn't armed.
+ */
+void timer_cancel(struct timer *t);
+
+/* Returns 1 if the timer is armed and 0 otherwise.
+ */
+int timer_armed(const struct timer *t);
+
+/* Returns the number of milliseconds from now until the wheel needs
+ * timer_expire to be called, to be used as the timeout of epoll_wait:
+ * -1 if there are no timers and 0 if it's needed right away.
+ */
+int timer_timeout(const struct timer_wheel *w, uint64_t now);
+
+/* Calls the functions of the timers that have expired by now, in the order
+ * of their times. The functions may arm and cancel any timers. Returns 0
+ * on success and -1 as soon as a function fails, the timers that haven't
+ * been called yet stay for the next call.
+ */
+int timer_expire(struct timer_wheel *w, uint64_t now, void *ctx);